@@ -0,0 +1,62 @@
+// Checks how pinatrace matches allocator exits to entries (allocator_call in alloc_index.h) on a
+// simulated stack: nested calls, tail calls, and a call whose exit was missed followed by the next
+// call from the same frame, as in a loop whose malloc once left through a tail-jumping slow path.
+// That next call must replace the stale one, so its exit inserts its own size and erases nothing.
+//
+// g++ -O2 -o alloc_call_test alloc_call_test.cpp && ./alloc_call_test
+
+#include <stdint.h>
+#include <stdio.h>
+#include "pin/source/tools/ManualExamples/alloc_index.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "mismatch: %s\n", what);
+    failures++;
+  }
+}
+
+int main()
+{
+  // the stack grows down; a call's stack pointer at entry points at its return address
+  uint64_t stack[64] = { 0 };
+  const uint64_t LOOP_RETURN = 0x401234, INNER_RETURN = 0x7f0000001000;
+  uint64_t loop_sp = (uint64_t)&stack[48], inner_sp = (uint64_t)&stack[40];
+
+  // realloc(p, 100) from the loop, whose exit is missed
+  allocator_call call;
+  stack[48] = LOOP_RETURN;
+  check(call.enter(loop_sp, LOOP_RETURN, 100), "a first call is noted");
+  call.old_ptr = 0x10000;
+
+  // the next iteration's malloc(200) enters at the same stack pointer, with the same return address
+  check(call.enter(loop_sp, LOOP_RETURN, 200), "the next call from the same frame is noted");
+  check(call.size == 200 && call.old_ptr == 0, "the next call replaces the stale one");
+
+  // malloc calls an internal allocator routine that is hooked too: nested, its exit is ignored
+  stack[40] = INNER_RETURN;
+  check(!call.enter(inner_sp, INNER_RETURN, 4096), "a call deeper in the stack is nested");
+  check(!call.leave(inner_sp), "the exit of a nested call is not the outer call's");
+  check(call.leave(loop_sp) && call.size == 200, "the outer call's exit matches it");
+  check(!call.leave(loop_sp), "a call ends at its exit");
+
+  // calloc(4, 25) tail-calls malloc(100): the same stack pointer, and one exit for both
+  check(call.enter(loop_sp, LOOP_RETURN, 100), "calloc is noted");
+  check(call.enter(loop_sp, LOOP_RETURN, 100), "its tail call replaces it");
+  check(call.leave(loop_sp) && call.size == 100, "the tail call's exit matches it");
+
+  // a missed exit, then a call from a deeper frame that has overwritten the stale return address
+  check(call.enter(loop_sp, LOOP_RETURN, 300), "a call is noted");
+  stack[48] = 0;
+  check(call.enter(inner_sp, INNER_RETURN, 400), "a deeper call after a missed exit is noted");
+  check(call.leave(inner_sp) && call.size == 400, "its exit matches it");
+
+  if (failures != 0) {
+    return 1;
+  }
+  printf("allocator call matching: all checks passed\n");
+  return 0;
+}
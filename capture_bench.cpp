@@ -0,0 +1,200 @@
+// Measures the -capture path of pinatrace (address_trace.h) on a synthetic access stream: bursts of
+// strided loops over arrays, pointer chasing over a heap and stack traffic, staged the way the
+// analysis routine stages it (timestamp records included). Prints the cost of encoding and
+// compressing a chunk, the bytes per access on disk and the reader's decoding rate, and checks that
+// every access reads back unchanged, by streaming the whole file and after seeks by record number
+// and by timestamp, with and without the index.
+//
+// g++ -O2 -o capture_bench capture_bench.cpp && ./capture_bench [num_accesses] [chunk_records] [file]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+#include "pin/source/tools/ManualExamples/address_trace.h"
+
+static double now_sec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *state >> 17;
+}
+
+static bool same(const trace_access &a, const trace_access &b)
+{
+  return a.ip == b.ip && a.addr == b.addr && a.size == b.size && a.is_write == b.is_write && a.timestamp_us == b.timestamp_us;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t num_accesses = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000000;
+  size_t chunk_records = argc > 2 ? strtoull(argv[2], NULL, 10) : 65536;
+  const char *filename = argc > 3 ? argv[3] : "capture_bench.atrace";
+  const size_t TIMESTAMP_PERIOD = 4096;
+
+  // the expected accesses, and the staged records with a timestamp every TIMESTAMP_PERIOD records
+  std::vector<trace_access> expected(num_accesses);
+  uint64_t state = 42, timestamp = 0, array = 0x7f3a10000000ULL, element = 0;
+  uint64_t node = 0x55d0c0000000ULL, stack = 0x7ffc9a000000ULL, r = 0;
+  size_t burst = 0;
+  for (size_t i = 0; i < num_accesses; i++) {
+    trace_access &a = expected[i];
+    if (burst == 0) {
+      r = next_random(&state) % 100;
+      burst = 1 + next_random(&state) % (r < 60 ? 100 : 50);
+    }
+    burst--;
+    if (r < 60) {
+      // loop body: load a[i], load b[i], store c[i]
+      uint32_t op = element % 3;
+      a.ip = 0x401000 + op * 4;
+      a.addr = array + op * 0x100000 + (element / 3) * 8;
+      a.size = 8;
+      a.is_write = op == 2;
+      element++;
+    } else if (r < 85) {
+      node = 0x55d0c0000000ULL + (next_random(&state) % (1 << 24)) * 64;
+      a.ip = 0x402340;
+      a.addr = node;
+      a.size = 8;
+      a.is_write = false;
+    } else {
+      a.ip = 0x403000 + (next_random(&state) % 16) * 3;
+      a.addr = stack - (next_random(&state) % 64) * 8;
+      a.size = r < 98 ? 8 : 32;
+      a.is_write = i & 1;
+    }
+    a.timestamp_us = timestamp;
+    if (i % (TIMESTAMP_PERIOD / 4) == 0) {
+      timestamp += 1 + next_random(&state) % 3;
+    }
+  }
+
+  // staging, as in pinatrace's CaptureAccess()
+  std::vector<raw_access> staged;
+  std::vector<size_t> chunk_starts(1, 0);
+  std::vector<uint64_t> chunk_timestamps(1, 0), chunk_first_records(1, 0);
+  size_t in_chunk = 0;
+  uint64_t last_timestamp = 0;
+  for (size_t i = 0; i < num_accesses; i++) {
+    const trace_access &a = expected[i];
+    if (in_chunk == 0) {
+      chunk_timestamps.back() = a.timestamp_us;
+      last_timestamp = a.timestamp_us;
+    } else if (in_chunk % TIMESTAMP_PERIOD == 0 && a.timestamp_us != last_timestamp) {
+      raw_access t = { a.timestamp_us, raw_access::RAW_TIMESTAMP };
+      staged.push_back(t);
+      last_timestamp = a.timestamp_us;
+      in_chunk++;
+    }
+    raw_access r = { a.addr, a.ip << 16 | (uint64_t)a.size << 1 | (a.is_write ? 1 : 0) };
+    staged.push_back(r);
+    in_chunk++;
+    if (in_chunk >= chunk_records && i + 1 < num_accesses) {
+      chunk_starts.push_back(staged.size());
+      chunk_timestamps.push_back(0);
+      chunk_first_records.push_back(i + 1);
+      in_chunk = 0;
+    }
+  }
+  chunk_starts.push_back(staged.size());
+
+  // timestamps only change at timestamp records, so the expected ones follow the staging
+  {
+    size_t a = 0;
+    for (size_t c = 0; c + 1 < chunk_starts.size(); c++) {
+      uint64_t t = chunk_timestamps[c];
+      for (size_t i = chunk_starts[c]; i < chunk_starts[c + 1]; i++) {
+        if (staged[i].info == raw_access::RAW_TIMESTAMP) {
+          t = staged[i].addr;
+        } else {
+          expected[a++].timestamp_us = t;
+        }
+      }
+    }
+  }
+
+  address_trace_writer writer;
+  if (!writer.open(filename, 7)) {
+    fprintf(stderr, "could not open %s\n", filename);
+    return 1;
+  }
+  address_chunk chunk;
+  std::vector<uint8_t> scratch;
+  uint64_t encoded_bytes = 0;
+  size_t lz_chunks = 0;
+  double compress_sec = 0, write_sec = 0;
+  for (size_t c = 0; c + 1 < chunk_starts.size(); c++) {
+    double start = now_sec();
+    compress_chunk(&staged[chunk_starts[c]], chunk_starts[c + 1] - chunk_starts[c], chunk_first_records[c], chunk_timestamps[c], &chunk, scratch);
+    compress_sec += now_sec() - start;
+    encoded_bytes += chunk.header.encoded_bytes;
+    lz_chunks += chunk.header.codec == ADDRESS_CODEC_LZ;
+    start = now_sec();
+    writer.append(chunk);
+    write_sec += now_sec() - start;
+  }
+  uint64_t file_bytes = writer.bytes();
+  double start = now_sec();
+  if (!writer.close()) {
+    fprintf(stderr, "could not write %s\n", filename);
+    return 1;
+  }
+  write_sec += now_sec() - start;
+
+  size_t mismatches = 0;
+  start = now_sec();
+  address_trace_reader reader;
+  if (!reader.open(filename)) {
+    fprintf(stderr, "could not read %s\n", filename);
+    return 1;
+  }
+  trace_access a;
+  size_t n = 0;
+  while (reader.next(&a)) {
+    mismatches += n >= num_accesses || !same(a, expected[n]);
+    n++;
+  }
+  double read_sec = now_sec() - start;
+  mismatches += n != num_accesses || reader.failed() || reader.num_records() != num_accesses || reader.thread() != 7;
+
+  // seeks, to records and times spread over the run
+  for (size_t k = 1; k <= 16; k++) {
+    size_t record = num_accesses * k / 17;
+    mismatches += !reader.seek_record(record) || !reader.next(&a) || !same(a, expected[record]);
+    uint64_t t = expected[record].timestamp_us;
+    mismatches += !reader.seek_time(t) || !reader.next(&a) || a.timestamp_us > t;
+  }
+
+  // a file whose writer died before close() has no index; truncate the footer and the index away
+  size_t num_chunks = reader.num_chunks();
+  if (truncate(filename, file_bytes) != 0) {
+    fprintf(stderr, "could not truncate %s\n", filename);
+    return 1;
+  }
+  address_trace_reader unindexed;
+  mismatches += !unindexed.open(filename) || unindexed.num_chunks() != num_chunks || !unindexed.seek_record(num_accesses / 2) ||
+                !unindexed.next(&a) || !same(a, expected[num_accesses / 2]);
+  unlink(filename);
+
+  printf("%zu accesses in %zu chunks of %zu records (%zu compressed)\n", num_accesses, num_chunks, chunk_records, lz_chunks);
+  printf("compress:  %6.2f ns/access (%.0f M accesses/s per background thread)\n", compress_sec * 1e9 / num_accesses, num_accesses / compress_sec / 1e6);
+  printf("write:     %6.2f ns/access\n", write_sec * 1e9 / num_accesses);
+  printf("size:      %6.2f bytes/access encoded, %.2f on disk (raw records: %zu)\n", (double)encoded_bytes / num_accesses,
+         (double)file_bytes / num_accesses, sizeof(raw_access));
+  printf("read:      %6.2f ns/access\n", read_sec * 1e9 / num_accesses);
+
+  if (mismatches != 0) {
+    fprintf(stderr, "mismatch: %zu accesses or seeks did not read back\n", mismatches);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,114 @@
+// Checks the miss-ratio curves of pinatrace -mrc (reuse_distance.h) against fully associative LRU
+// caches simulated directly, on a synthetic line stream: a hot set, loops over arrays of several
+// sizes, and uniform accesses over a large footprint. With every line sampled, the curve from the
+// reuse histogram (reuse_histogram::at_least) must be within 1e-3 of the simulated miss ratio at
+// every size; the curves at the given sampling rate are printed for comparison, not checked.
+//
+// g++ -O2 -o mrc_bench mrc_bench.cpp && ./mrc_bench [num_accesses] [sample]
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <list>
+#include <map>
+#include <vector>
+#include "pin/source/tools/ManualExamples/reuse_distance.h"
+
+static uint64_t next_random(uint64_t *state)
+{
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *state >> 17;
+}
+
+// Misses of a fully associative LRU cache of capacity lines
+static uint64_t lru_misses(const std::vector<uint64_t> &lines, size_t capacity)
+{
+  std::list<uint64_t> stack;  // most recent first
+  std::map<uint64_t, std::list<uint64_t>::iterator> positions;
+  uint64_t misses = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::map<uint64_t, std::list<uint64_t>::iterator>::iterator it = positions.find(lines[i]);
+    if (it != positions.end()) {
+      stack.splice(stack.begin(), stack, it->second);
+      continue;
+    }
+    misses++;
+    stack.push_front(lines[i]);
+    positions[lines[i]] = stack.begin();
+    if (stack.size() > capacity) {
+      positions.erase(stack.back());
+      stack.pop_back();
+    }
+  }
+  return misses;
+}
+
+static void histogram_of(const std::vector<uint64_t> &lines, double rate, size_t max_lines, reuse_histogram *histogram)
+{
+  reuse_distance_engine engine(rate, max_lines);
+  for (size_t i = 0; i < lines.size(); i++) {
+    double weight = 1 / engine.rate();
+    double distance = engine.access(lines[i]);
+    if (distance == reuse_distance_engine::NOT_SAMPLED) {
+      continue;
+    }
+    if (distance < 0) {
+      histogram->add_cold(weight);
+    } else {
+      histogram->add(distance, weight);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  size_t num_accesses = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  uint32_t sample = argc > 2 ? atoi(argv[2]) : 100;
+
+  std::vector<uint64_t> lines(num_accesses);
+  uint64_t state = 42, r = 0, position = 0;
+  size_t burst = 0;
+  for (size_t i = 0; i < num_accesses; i++) {
+    if (burst == 0) {
+      r = next_random(&state) % 100;
+      burst = 1 + next_random(&state) % 200;
+    }
+    burst--;
+    if (r < 30) {
+      lines[i] = next_random(&state) % 512;  // hot set
+    } else if (r < 50) {
+      lines[i] = 0x10000 + position++ % 6000;  // loop over 6000 lines
+    } else if (r < 70) {
+      lines[i] = 0x20000 + position++ % 60000;  // loop over 60000 lines
+    } else {
+      lines[i] = 0x100000 + next_random(&state) % 400000;  // uniform over a large footprint
+    }
+  }
+
+  reuse_histogram exact_histogram, sampled_histogram;
+  // every line fits in the first engine; the second has pinatrace's default -reuse_lines
+  histogram_of(lines, 1.0, 1 << 20, &exact_histogram);
+  histogram_of(lines, 1.0 / sample, 65536, &sampled_histogram);
+
+  printf("%zu accesses; miss ratios of fully associative LRU caches\n", num_accesses);
+  printf("%10s %10s %10s %10s\n", "lines", "simulated", "mrc", "1/sample");
+  double worst = 0;
+  for (size_t capacity = 256; capacity <= (1 << 19); capacity *= 2) {
+    for (int step = 0; step < 2; step++) {
+      size_t c = (size_t)(capacity * pow(2.0, step / 2.0) + 0.5);
+      double simulated = (double)lru_misses(lines, c) / num_accesses;
+      double exact = exact_histogram.at_least(c) / exact_histogram.total();
+      double sampled = sampled_histogram.at_least(c) / sampled_histogram.total();
+      printf("%10zu %10.6f %10.6f %10.6f\n", c, simulated, exact, sampled);
+      worst = std::max(worst, fabs(exact - simulated));
+    }
+  }
+  printf("largest difference with every line sampled: %.6f\n", worst);
+
+  if (worst > 1e-3) {
+    fprintf(stderr, "mismatch: the curve is more than 1e-3 away from the simulated miss ratio\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Compares the per-access cost of the old four std::map page counters against page_table.
+//
+// g++ -O2 -o page_table_bench page_table_bench.cpp && ./page_table_bench [num_pages] [num_accesses]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <map>
+#include <vector>
+#include "pin/source/tools/ManualExamples/page_table.h"
+
+static double now_sec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+struct map_counters
+{
+  std::map<uint64_t, uint64_t> page_count_read_with_cache;
+  std::map<uint64_t, uint64_t> page_count_read_without_cache;
+  std::map<uint64_t, uint64_t> page_count_write_with_cache;
+  std::map<uint64_t, uint64_t> page_count_write_without_cache;
+
+  // same find() + operator[] sequence the tool used to run per access
+  void record(std::map<uint64_t, uint64_t> &m, uint64_t pageno) {
+    if (m.find(pageno) == m.end()) {
+      m[pageno] = 0;
+    }
+    m[pageno]++;
+  }
+};
+
+int main(int argc, char *argv[])
+{
+  size_t num_pages = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  size_t num_accesses = argc > 2 ? strtoull(argv[2], NULL, 10) : 50000000;
+
+  // Skewed synthetic stream: 90% of accesses go to 10% of the pages, like a hot working set in a
+  // large heap. Pages start at a heap-like base so page numbers look realistic.
+  std::vector<uint64_t> pagenos(num_accesses);
+  std::vector<uint8_t> flags(num_accesses);
+  srand(42);
+  for (size_t i = 0; i < num_accesses; i++) {
+    uint64_t r = ((uint64_t)rand() << 31) ^ rand();
+    uint64_t page = (rand() % 10 == 0) ? r % num_pages : r % (num_pages / 10 + 1);
+    pagenos[i] = 0x7f0000000ULL + page;
+    flags[i] = rand() & 3;  // bit 0: write, bit 1: cache hit
+  }
+
+  double start = now_sec();
+  map_counters maps;
+  for (size_t i = 0; i < num_accesses; i++) {
+    bool write = flags[i] & 1, hit = flags[i] & 2;
+    if (write) {
+      maps.record(maps.page_count_write_without_cache, pagenos[i]);
+      if (!hit) maps.record(maps.page_count_write_with_cache, pagenos[i]);
+    } else {
+      maps.record(maps.page_count_read_without_cache, pagenos[i]);
+      if (!hit) maps.record(maps.page_count_read_with_cache, pagenos[i]);
+    }
+  }
+  double map_sec = now_sec() - start;
+
+  start = now_sec();
+  page_table table;
+  for (size_t i = 0; i < num_accesses; i++) {
+    bool write = flags[i] & 1, hit = flags[i] & 2;
+    page_counts *counts = table.lookup(pagenos[i]);
+    if (write) {
+      counts->write_without_cache++;
+      if (!hit) counts->write_with_cache++;
+    } else {
+      counts->read_without_cache++;
+      if (!hit) counts->read_with_cache++;
+    }
+  }
+  double table_sec = now_sec() - start;
+
+  // sanity check: both structures must agree
+  uint64_t map_total = 0, table_total = 0;
+  for (std::map<uint64_t, uint64_t>::iterator it = maps.page_count_read_without_cache.begin(); it != maps.page_count_read_without_cache.end(); ++it) {
+    map_total += it->second;
+  }
+  for (size_t i = 0; i < table.capacity(); i++) {
+    if (table.used(i)) table_total += table.counts_at(i).read_without_cache;
+  }
+  if (map_total != table_total) {
+    fprintf(stderr, "mismatch: std::map counted %llu reads, page_table %llu\n", (unsigned long long)map_total, (unsigned long long)table_total);
+    return 1;
+  }
+
+  printf("%zu accesses over %zu distinct pages\n", num_accesses, table.size());
+  printf("std::map x4: %6.2f ns/access\n", map_sec * 1e9 / num_accesses);
+  printf("page_table:  %6.2f ns/access (%.1fx)\n", table_sec * 1e9 / num_accesses, map_sec / table_sec);
+
+  return 0;
+}
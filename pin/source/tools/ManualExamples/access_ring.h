@@ -0,0 +1,312 @@
+#ifndef ACCESS_RING_H
+#define ACCESS_RING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Shared-memory segment through which pinatrace -stream hands the memory accesses of the application
+// to a separate consumer process (stream_consumer.cpp), which does the counting and cache simulation
+// on its own cores. The segment is a file (normally in /dev/shm) mapped by both processes:
+//
+//   access_stream_header                 at offset 0
+//   access_ring_control[num_rings]       one per ring, each on its own cache lines
+//   access_record[num_rings][capacity]   the rings
+//
+// Every ring has a single producer, the application thread that claimed it, and a single consumer,
+// so head and tail need no locks: the producer writes records and then publishes them with a
+// release store of head, the consumer reads them and then frees their slots with a release store of
+// tail. Both only ever grow; the slot of record i is i & (capacity - 1).
+//
+// A full ring either stalls its producer until the consumer frees slots (blocking, lossless) or
+// drops the records that do not fit (never slows the application down); both are counted in the
+// ring's control block, and so are the records of threads that found every ring owned.
+
+const uint32_t ACCESS_STREAM_VERSION = 1;
+const char ACCESS_STREAM_MAGIC[8] = { 'P', 'A', 'T', 'S', 'T', 'R', 'M', 0 };
+
+// One access, or a run of count accesses to the same cache line by one instruction
+struct access_record
+{
+  // A record with info == THREAD_START starts the records of the thread numbered addr
+  static const uint64_t THREAD_START = ~(uint64_t)0;
+
+  uint64_t addr;
+  uint64_t info;  // ip << 16 | count << 1 | is_write (user-space instruction addresses fit in 48 bits)
+
+  uint64_t ip() const { return info >> 16; }
+  uint32_t count() const { return (uint32_t)(info >> 1) & 0x7FFF; }
+  bool is_write() const { return info & 1; }
+
+  static access_record make(uint64_t addr, uint64_t ip, uint32_t count, bool is_write) {
+    access_record r;
+    r.addr = addr;
+    r.info = ip << 16 | (uint64_t)count << 1 | (is_write ? 1 : 0);
+    return r;
+  }
+};
+
+struct access_stream_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t num_rings;
+  uint64_t ring_capacity;           // records per ring, a power of two
+  volatile uint32_t ready;          // set last by the creator
+  volatile uint32_t done;           // set by the producer process once every record is published
+  volatile int32_t consumer_pid;    // 0 until a consumer attaches, -1 once it detached
+  uint32_t reserved;
+  volatile uint64_t unassigned_dropped;  // records of threads that found every ring owned
+  volatile uint64_t threads;             // threads that claimed a ring
+  char pad[8];
+};
+
+struct access_ring_control
+{
+  volatile uint64_t head;     // records published, written by the producer
+  char pad0[56];
+  volatile uint64_t tail;     // records consumed, written by the consumer
+  char pad1[56];
+  volatile uint64_t dropped;  // records discarded because the ring was full
+  volatile uint64_t stalls;   // flushes that waited for the consumer
+  volatile uint32_t owned;    // 1 while an application thread owns the ring
+  char pad2[44];
+};
+
+class access_stream
+{
+public:
+  access_stream() : base(NULL), mapped_bytes(0) {}
+  ~access_stream() { unmap(); }
+
+  static size_t segment_bytes(uint32_t num_rings, uint64_t ring_capacity) {
+    return sizeof(access_stream_header) + num_rings * (sizeof(access_ring_control) + ring_capacity * sizeof(access_record));
+  }
+
+  // Creates the segment file at path, replacing any old one (a consumer still attached to it keeps
+  // its own copy); ring_capacity must be a power of two. Returns false with errno set on failure.
+  bool create(const char *path, uint32_t num_rings, uint64_t ring_capacity) {
+    unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+      return false;
+    }
+    size_t bytes = segment_bytes(num_rings, ring_capacity);
+    if (ftruncate(fd, bytes) != 0 || !map(fd, bytes)) {
+      close(fd);
+      return false;
+    }
+    close(fd);
+
+    access_stream_header *h = header();
+    memcpy(h->magic, ACCESS_STREAM_MAGIC, sizeof(h->magic));
+    h->version = ACCESS_STREAM_VERSION;
+    h->num_rings = num_rings;
+    h->ring_capacity = ring_capacity;
+    __atomic_store_n(&h->ready, 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Maps the segment at path; false if it does not exist or is not initialized yet (try again), or
+  // is not a segment of this version
+  bool attach(const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(access_stream_header) || !map(fd, st.st_size)) {
+      close(fd);
+      return false;
+    }
+    close(fd);
+
+    const access_stream_header *h = header();
+    if (!__atomic_load_n(&h->ready, __ATOMIC_ACQUIRE) || memcmp(h->magic, ACCESS_STREAM_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != ACCESS_STREAM_VERSION || segment_bytes(h->num_rings, h->ring_capacity) != mapped_bytes) {
+      unmap();
+      return false;
+    }
+    return true;
+  }
+
+  // Registers the calling process as the consumer; false if another live consumer is attached
+  bool attach_consumer() {
+    int32_t pid = header()->consumer_pid;
+    if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM)) {
+      return false;
+    }
+    return __atomic_compare_exchange_n(&header()->consumer_pid, &pid, (int32_t)getpid(), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+
+  void detach_consumer() { __atomic_store_n(&header()->consumer_pid, -1, __ATOMIC_RELEASE); }
+
+  // Whether a blocked producer may still expect its ring to be drained: a consumer is attached and
+  // alive, or none has attached yet
+  bool consumer_expected() const {
+    int32_t pid = __atomic_load_n(&header()->consumer_pid, __ATOMIC_ACQUIRE);
+    return pid == 0 || (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM));
+  }
+
+  void unmap() {
+    if (base != NULL) {
+      munmap(base, mapped_bytes);
+      base = NULL;
+    }
+  }
+
+  access_stream_header *header() const { return (access_stream_header *)base; }
+  uint32_t num_rings() const { return header()->num_rings; }
+  uint64_t ring_capacity() const { return header()->ring_capacity; }
+
+  access_ring_control *control(uint32_t ring) const {
+    return (access_ring_control *)(base + sizeof(access_stream_header)) + ring;
+  }
+
+  access_record *records(uint32_t ring) const {
+    access_record *first = (access_record *)(base + sizeof(access_stream_header) + num_rings() * sizeof(access_ring_control));
+    return first + ring * ring_capacity();
+  }
+
+  // Consumer side: copies up to max of the oldest records of ring to out and frees their slots
+  size_t drain(uint32_t ring, access_record *out, size_t max) {
+    access_ring_control *c = control(ring);
+    uint64_t tail = c->tail;
+    uint64_t available = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE) - tail;
+    size_t n = available < max ? (size_t)available : max;
+    const access_record *recs = records(ring);
+    uint64_t mask = ring_capacity() - 1;
+    for (size_t i = 0; i < n; i++) {
+      out[i] = recs[(tail + i) & mask];
+    }
+    __atomic_store_n(&c->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+  }
+
+private:
+  char *base;
+  size_t mapped_bytes;
+
+  bool map(int fd, size_t bytes) {
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    base = (char *)p;
+    mapped_bytes = bytes;
+    return true;
+  }
+
+  access_stream(const access_stream &);
+  access_stream &operator=(const access_stream &);
+};
+
+// An application thread's end of a ring. Records are staged locally and published BATCH at a time,
+// so head's cache line moves to the consumer once per batch rather than once per access.
+class ring_producer
+{
+public:
+  static const uint32_t BATCH = 64;
+  static const uint32_t NO_RING = ~(uint32_t)0;
+
+  ring_producer(access_stream *stream, bool block) : stream(stream), block(block), ring(NO_RING), num_staged(0) {}
+
+  // Claims a free ring for the thread numbered thread; false if every ring is owned, in which case
+  // the thread's records are only counted, in unassigned_dropped. A ring the consumer has drained is
+  // preferred, and the THREAD_START marker is never dropped (see flush): the consumer attributes
+  // every record after it to thread, so losing it would charge them to the ring's previous owner.
+  bool claim(uint32_t thread) {
+    for (int pass = 0; pass < 2; pass++) {
+      for (uint32_t r = 0; r < stream->num_rings(); r++) {
+        access_ring_control *c = stream->control(r);
+        if (pass == 0 && __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&c->head, __ATOMIC_ACQUIRE)) {
+          continue;
+        }
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&c->owned, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+          ring = r;
+          __atomic_add_fetch(&stream->header()->threads, 1, __ATOMIC_RELAXED);
+          staged[num_staged].addr = thread;
+          staged[num_staged].info = access_record::THREAD_START;
+          num_staged++;
+          flush(true);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  void push(uint64_t addr, uint64_t ip, uint32_t count, bool is_write) {
+    staged[num_staged++] = access_record::make(addr, ip, count, is_write);
+    if (num_staged == BATCH) {
+      flush();
+    }
+  }
+
+  // Publishes the staged records, waiting for free slots or dropping the records that do not fit;
+  // with wait set it waits even in drop mode, as long as a consumer is expected to free them
+  void flush(bool wait = false) {
+    if (ring == NO_RING) {
+      if (num_staged != 0) {
+        __atomic_add_fetch(&stream->header()->unassigned_dropped, num_staged, __ATOMIC_RELAXED);
+      }
+      num_staged = 0;
+      return;
+    }
+
+    access_ring_control *c = stream->control(ring);
+    access_record *recs = stream->records(ring);
+    uint64_t capacity = stream->ring_capacity();
+    uint64_t head = c->head;
+    uint32_t published = 0;
+    bool stalled = false;
+    while (published < num_staged) {
+      uint64_t free = capacity - (head - __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE));
+      if (free == 0) {
+        if ((block || wait) && stream->consumer_expected()) {
+          stalled = true;
+          sched_yield();
+          continue;
+        }
+        c->dropped += num_staged - published;
+        break;
+      }
+      uint32_t n = free < num_staged - published ? (uint32_t)free : num_staged - published;
+      for (uint32_t i = 0; i < n; i++) {
+        recs[(head + i) & (capacity - 1)] = staged[published + i];
+      }
+      head += n;
+      published += n;
+      __atomic_store_n(&c->head, head, __ATOMIC_RELEASE);
+    }
+    if (stalled) {
+      c->stalls++;
+    }
+    num_staged = 0;
+  }
+
+  // Publishes the staged records and gives the ring back for another thread to claim
+  void release() {
+    flush();
+    if (ring != NO_RING) {
+      __atomic_store_n(&stream->control(ring)->owned, 0, __ATOMIC_RELEASE);
+      ring = NO_RING;
+    }
+  }
+
+private:
+  access_stream *stream;
+  bool block;
+  uint32_t ring;
+  uint32_t num_staged;
+  access_record staged[BATCH];
+};
+
+#endif
@@ -0,0 +1,746 @@
+#ifndef ADDRESS_TRACE_H
+#define ADDRESS_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <vector>
+
+// Raw address traces (pinatrace -capture)
+// =======================================
+//
+// Every application thread writes one file of its memory accesses, in the order it made them:
+// instruction address, data address, size, read or write, and a coarse timestamp (microseconds since
+// the tool started, updated every few thousand accesses). All integers are little-endian.
+//
+//   address_trace_header               at offset 0
+//   chunks                             address_chunk_header followed by stored_bytes of payload
+//   address_chunk_index_entry[]        at index_offset, one per chunk (written by close())
+//   address_trace_footer               the last 32 bytes of the file
+//
+// Chunks are independent: the delta encoding starts over in every chunk, so a reader can start
+// decoding at any chunk found through the index (by record number or by timestamp). A file whose
+// writer died has no index, but its chunks can still be found by walking the chunk headers.
+//
+// The payload of a chunk is its records encoded as below, then compressed with lz_compress() (codec
+// ADDRESS_CODEC_LZ) or stored as is if that does not make it smaller (ADDRESS_CODEC_NONE). The
+// encoding is four streams, one after the other, each preceded by its length in bytes as a uint32:
+//
+//   flags    one byte per record:
+//              bit 0       write
+//              bits 1-3    length of the address delta in bytes (0: the same delta as the previous
+//                          record, 1 to 6, or 7 for 8 bytes)
+//              bits 4-5    length of the instruction delta (0: the same instruction, 1: 2 bytes,
+//                          2: 4 bytes, 3: 8 bytes)
+//              bit 6       the size changed: it follows in extras
+//              bit 7       the timestamp changed: its delta follows in extras
+//   ips      zigzag-encoded instruction deltas of the lengths the flags give
+//   addrs    zigzag-encoded address deltas, likewise
+//   extras   for each record with bit 6, log2(size) as one byte, or 255 and the size as a varint;
+//            then, with bit 7, the timestamp delta as a varint
+//
+// Deltas are from the previous record of the chunk, or from 0 for the first one (whose size is given
+// unless it is 0); timestamp deltas start from the chunk's first_timestamp_us. Splitting the fields
+// keeps the encoding free of branches on the data, and lets the compressor find the loops of the
+// program as repeats in the flags and instruction streams.
+
+const char ADDRESS_TRACE_MAGIC[8] = { 'P', 'I', 'N', 'A', 'D', 'D', 'R', 0 };
+const uint32_t ADDRESS_TRACE_VERSION = 1;
+const uint32_t ADDRESS_CHUNK_MAGIC = 0x4B4E4843;  // "CHNK"
+
+enum address_codec
+{
+  ADDRESS_CODEC_NONE = 0,
+  ADDRESS_CODEC_LZ = 1,
+};
+
+struct address_trace_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t thread;  // the thread's number in pinatrace's other outputs
+  uint64_t reserved[2];
+};
+
+struct address_chunk_header
+{
+  uint32_t magic;
+  uint32_t codec;
+  uint32_t stored_bytes;   // payload size in the file
+  uint32_t encoded_bytes;  // payload size once decompressed
+  uint64_t first_record;   // number of the chunk's first record in the file
+  uint64_t first_timestamp_us;
+  uint32_t records;
+  uint32_t reserved;
+};
+
+struct address_chunk_index_entry
+{
+  uint64_t offset;  // of the chunk's header
+  uint64_t first_record;
+  uint64_t first_timestamp_us;
+  uint32_t records;
+  uint32_t reserved;
+};
+
+struct address_trace_footer
+{
+  uint64_t index_offset;
+  uint64_t num_chunks;
+  uint64_t num_records;
+  char magic[8];
+};
+
+// One access as staged by an application thread, before encoding. A record with
+// info == RAW_TIMESTAMP sets the timestamp (addr, in microseconds) of the records after it.
+struct raw_access
+{
+  static const uint64_t RAW_TIMESTAMP = ~(uint64_t)0;
+
+  uint64_t addr;
+  uint64_t info;  // ip << 16 | size << 1 | is_write (user-space instruction addresses fit in 48 bits)
+};
+
+// One access as read back
+struct trace_access
+{
+  uint64_t ip;
+  uint64_t addr;
+  uint32_t size;
+  bool is_write;
+  uint64_t timestamp_us;
+};
+
+// LZ block codec
+// ==============
+//
+// Greedy LZ77 with a 64 KB window and 4-byte minimum matches, in the LZ4 block format: sequences of
+// a token (literal length << 4 | match length - 4, 15 meaning more length bytes follow), the
+// literals, and a 2-byte match offset. Fast rather than tight: one probe per position into a 16 KB
+// hash table, which stays in the L1 cache.
+
+inline size_t lz_bound(size_t n)
+{
+  return n + n / 255 + 16;
+}
+
+inline uint8_t *lz_put_length(uint8_t *op, size_t length)
+{
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (uint8_t)length;
+  return op;
+}
+
+inline uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *literals, size_t num_literals, size_t offset, size_t match_length)
+{
+  uint8_t *token = op++;
+  *token = (uint8_t)((num_literals < 15 ? num_literals : 15) << 4);
+  if (num_literals >= 15) {
+    op = lz_put_length(op, num_literals - 15);
+  }
+  memcpy(op, literals, num_literals);
+  op += num_literals;
+  if (match_length == 0) {
+    return op;
+  }
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+  size_t extra = match_length - 4;
+  *token |= (uint8_t)(extra < 15 ? extra : 15);
+  if (extra >= 15) {
+    op = lz_put_length(op, extra - 15);
+  }
+  return op;
+}
+
+// Compresses n bytes of in into out, which must hold lz_bound(n) bytes; returns the compressed size
+inline size_t lz_compress(const uint8_t *in, size_t n, uint8_t *out)
+{
+  const uint32_t HASH_BITS = 12;
+  std::vector<uint32_t> table(1 << HASH_BITS, 0);  // position + 1 of the last occurrence, 0 if none
+
+  uint8_t *op = out;
+  size_t ip = 0, anchor = 0;
+  // the format ends in at least 5 literals, and no match starts in the last 12 bytes
+  size_t match_start_limit = n < 12 ? 0 : n - 12;
+  size_t match_end_limit = n < 5 ? 0 : n - 5;
+  while (ip < match_start_limit) {
+    uint32_t sequence;
+    memcpy(&sequence, in + ip, 4);
+    uint32_t h = (sequence * 2654435761U) >> (32 - HASH_BITS);
+    size_t candidate = table[h];
+    table[h] = ip + 1;
+    uint32_t at_candidate = 0;
+    if (candidate != 0) {
+      memcpy(&at_candidate, in + candidate - 1, 4);
+    }
+    if (candidate == 0 || ip - (candidate - 1) > 65535 || at_candidate != sequence) {
+      // skip faster through data that does not compress
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    size_t ref = candidate - 1;
+    size_t length = 4;
+    while (ip + length + 8 <= match_end_limit) {
+      uint64_t a, b;
+      memcpy(&a, in + ref + length, 8);
+      memcpy(&b, in + ip + length, 8);
+      if (a != b) {
+        length += __builtin_ctzll(a ^ b) / 8;
+        break;
+      }
+      length += 8;
+    }
+    while (ip + length < match_end_limit && in[ref + length] == in[ip + length]) {
+      length++;
+    }
+    op = lz_put_sequence(op, in + anchor, ip - anchor, ip - ref, length);
+    ip += length;
+    anchor = ip;
+  }
+  op = lz_put_sequence(op, in + anchor, n - anchor, 0, 0);
+  return op - out;
+}
+
+// Decompresses n bytes of in into exactly out_n bytes of out; false if in is malformed
+inline bool lz_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t out_n)
+{
+  const uint8_t *ip = in, *end = in + n;
+  size_t o = 0;
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t num_literals = token >> 4;
+    if (num_literals == 15) {
+      uint8_t b;
+      do {
+        if (ip >= end) {
+          return false;
+        }
+        b = *ip++;
+        num_literals += b;
+      } while (b == 255);
+    }
+    if ((size_t)(end - ip) < num_literals || out_n - o < num_literals) {
+      return false;
+    }
+    memcpy(out + o, ip, num_literals);
+    ip += num_literals;
+    o += num_literals;
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    size_t length = (token & 15) + 4;
+    if ((token & 15) == 15) {
+      uint8_t b;
+      do {
+        if (ip >= end) {
+          return false;
+        }
+        b = *ip++;
+        length += b;
+      } while (b == 255);
+    }
+    if (offset == 0 || offset > o || out_n - o < length) {
+      return false;
+    }
+    // byte by byte: the match may overlap the bytes it produces
+    for (size_t i = 0; i < length; i++, o++) {
+      out[o] = out[o - offset];
+    }
+  }
+  return o == out_n;
+}
+
+// Record encoding
+// ===============
+
+enum
+{
+  ADDRESS_WRITE = 1,
+  ADDRESS_ADDR_SHIFT = 1,
+  ADDRESS_IP_SHIFT = 4,
+  ADDRESS_SIZE_CHANGED = 1 << 6,
+  ADDRESS_TIMESTAMP_CHANGED = 1 << 7,
+};
+
+const uint8_t ADDRESS_SIZE_ESCAPE = 255;
+
+// Bytes of an instruction delta by length code, and the code of a zigzag-encoded delta
+const uint32_t ADDRESS_IP_BYTES[4] = { 0, 2, 4, 8 };
+
+inline uint32_t address_ip_code(uint64_t v)
+{
+  return v == 0 ? 0 : v < (1ULL << 16) ? 1 : v < (1ULL << 32) ? 2 : 3;
+}
+
+// Bytes needed for v (at least 1), and the address length code for them
+inline uint32_t address_bytes(uint64_t v)
+{
+  return (71 - __builtin_clzll(v | 1)) / 8;
+}
+
+inline uint32_t address_addr_code(uint32_t bytes)
+{
+  return bytes > 6 ? 7 : bytes;
+}
+
+// Fields are stored as the low bytes of a little-endian 8-byte store (or load), so every stream is
+// followed by at least 8 bytes of slack
+inline uint8_t *put_fixed(uint8_t *p, uint64_t v, uint32_t bytes)
+{
+  memcpy(p, &v, sizeof(v));
+  return p + bytes;
+}
+
+inline uint64_t get_fixed(const uint8_t *p, uint32_t bytes)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return bytes == 8 ? v : v & ((1ULL << (8 * bytes)) - 1);
+}
+
+inline uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+inline bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+  uint64_t result = 0;
+  for (uint32_t shift = 0; shift < 64 && *p < end; shift += 7) {
+    uint8_t b = *(*p)++;
+    result |= (uint64_t)(b & 0x7F) << shift;
+    if (b < 0x80) {
+      *v = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline uint64_t zigzag(uint64_t delta)
+{
+  return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+inline uint64_t unzigzag(uint64_t v)
+{
+  return (v >> 1) ^ (0 - (v & 1));
+}
+
+struct address_chunk
+{
+  address_chunk_header header;
+  std::vector<uint8_t> payload;
+};
+
+// Encodes and compresses n staged records (timestamp records included) into chunk; scratch is
+// reused from call to call
+inline void compress_chunk(const raw_access *in, size_t n, uint64_t first_record, uint64_t first_timestamp_us,
+                           address_chunk *chunk, std::vector<uint8_t> &scratch)
+{
+  // the streams' worst cases, then the assembled encoding
+  const size_t SLACK = 8;
+  size_t flags_room = n + SLACK, ips_room = 8 * n + SLACK, addrs_room = 8 * n + SLACK, extras_room = 16 * n + SLACK;
+  size_t streams_room = flags_room + ips_room + addrs_room + extras_room;
+  scratch.resize(2 * streams_room + 16);
+  uint8_t *flags_start = &scratch[0], *ips_start = flags_start + flags_room;
+  uint8_t *addrs_start = ips_start + ips_room, *extras_start = addrs_start + addrs_room;
+  uint8_t *f = flags_start, *ips = ips_start, *addrs = addrs_start, *extras = extras_start;
+
+  uint64_t prev_ip = 0, prev_addr = 0, prev_stride = 0, timestamp = first_timestamp_us, written_timestamp = first_timestamp_us;
+  uint32_t prev_size = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (in[i].info == raw_access::RAW_TIMESTAMP) {
+      timestamp = in[i].addr;
+      continue;
+    }
+    uint64_t ip = in[i].info >> 16;
+    uint32_t size = (uint32_t)(in[i].info >> 1) & 0x7FFF;
+    uint64_t stride = in[i].addr - prev_addr;
+
+    uint64_t ip_delta = zigzag(ip - prev_ip);
+    uint32_t ip_code = address_ip_code(ip_delta);
+    ips = put_fixed(ips, ip_delta, ADDRESS_IP_BYTES[ip_code]);
+
+    uint64_t addr_delta = zigzag(stride);
+    uint32_t addr_bytes = stride == prev_stride ? 0 : address_bytes(addr_delta);
+    uint32_t addr_code = address_addr_code(addr_bytes);
+    addrs = put_fixed(addrs, addr_delta, addr_code == 7 ? 8 : addr_code);
+
+    uint8_t flags = (uint8_t)((in[i].info & 1) | addr_code << ADDRESS_ADDR_SHIFT | ip_code << ADDRESS_IP_SHIFT);
+    if (size != prev_size) {
+      flags |= ADDRESS_SIZE_CHANGED;
+      if (size != 0 && size <= 64 && (size & (size - 1)) == 0) {
+        *extras++ = (uint8_t)__builtin_ctz(size);
+      } else {
+        *extras++ = ADDRESS_SIZE_ESCAPE;
+        extras = put_varint(extras, size);
+      }
+    }
+    if (timestamp != written_timestamp) {
+      flags |= ADDRESS_TIMESTAMP_CHANGED;
+      extras = put_varint(extras, timestamp - written_timestamp);
+      written_timestamp = timestamp;
+    }
+    *f++ = flags;
+
+    prev_ip = ip;
+    prev_addr = in[i].addr;
+    prev_stride = stride;
+    prev_size = size;
+  }
+
+  uint8_t *encoded = flags_start + streams_room, *e = encoded;
+  const uint8_t *starts[] = { flags_start, ips_start, addrs_start, extras_start };
+  const uint8_t *ends[] = { f, ips, addrs, extras };
+  for (size_t k = 0; k < 4; k++) {
+    uint32_t length = ends[k] - starts[k];
+    memcpy(e, &length, sizeof(length));
+    memcpy(e + sizeof(length), starts[k], length);
+    e += sizeof(length) + length;
+  }
+  size_t encoded_bytes = e - encoded;
+
+  chunk->payload.resize(lz_bound(encoded_bytes));
+  size_t compressed = lz_compress(encoded, encoded_bytes, &chunk->payload[0]);
+  memset(&chunk->header, 0, sizeof(chunk->header));
+  if (compressed < encoded_bytes) {
+    chunk->header.codec = ADDRESS_CODEC_LZ;
+    chunk->payload.resize(compressed);
+  } else {
+    chunk->header.codec = ADDRESS_CODEC_NONE;
+    chunk->payload.assign(encoded, encoded + encoded_bytes);
+  }
+  chunk->header.magic = ADDRESS_CHUNK_MAGIC;
+  chunk->header.stored_bytes = chunk->payload.size();
+  chunk->header.encoded_bytes = encoded_bytes;
+  chunk->header.first_record = first_record;
+  chunk->header.first_timestamp_us = first_timestamp_us;
+  chunk->header.records = f - flags_start;
+}
+
+// Writes the chunks of one thread, in order
+class address_trace_writer
+{
+public:
+  address_trace_writer() : file(NULL), offset(0), num_records(0) {}
+
+  ~address_trace_writer() {
+    if (file != NULL) {
+      close();
+    }
+  }
+
+  bool open(const char *filename, uint32_t thread) {
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+      return false;
+    }
+    index.clear();
+    offset = 0;
+    num_records = 0;
+    address_trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ADDRESS_TRACE_MAGIC, sizeof(header.magic));
+    header.version = ADDRESS_TRACE_VERSION;
+    header.thread = thread;
+    write(&header, sizeof(header));
+    return true;
+  }
+
+  void append(const address_chunk &chunk) {
+    address_chunk_index_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.offset = offset;
+    entry.first_record = chunk.header.first_record;
+    entry.first_timestamp_us = chunk.header.first_timestamp_us;
+    entry.records = chunk.header.records;
+    index.push_back(entry);
+    num_records += chunk.header.records;
+
+    write(&chunk.header, sizeof(chunk.header));
+    write(chunk.payload.empty() ? NULL : &chunk.payload[0], chunk.payload.size());
+  }
+
+  // Writes the index and the footer; false if any write failed. A writer whose open() failed
+  // ignores chunks and fails close().
+  bool close() {
+    if (file == NULL) {
+      return false;
+    }
+    address_trace_footer footer;
+    memset(&footer, 0, sizeof(footer));
+    footer.index_offset = offset;
+    footer.num_chunks = index.size();
+    footer.num_records = num_records;
+    memcpy(footer.magic, ADDRESS_TRACE_MAGIC, sizeof(footer.magic));
+    write(index.empty() ? NULL : &index[0], index.size() * sizeof(address_chunk_index_entry));
+    write(&footer, sizeof(footer));
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    return ok;
+  }
+
+  uint64_t bytes() const { return offset; }
+  uint64_t records() const { return num_records; }
+
+private:
+  FILE *file;
+  uint64_t offset;
+  uint64_t num_records;
+  std::vector<address_chunk_index_entry> index;
+
+  void write(const void *data, size_t size) {
+    if (size != 0 && file != NULL) {
+      fwrite(data, 1, size, file);
+      offset += size;
+    }
+  }
+};
+
+// Streams the records of one file, one decompressed chunk in memory at a time
+class address_trace_reader
+{
+public:
+  address_trace_reader() : file(NULL), current_chunk(0), bad(false), flags(NULL), flags_end(NULL) {}
+
+  ~address_trace_reader() {
+    if (file != NULL) {
+      fclose(file);
+    }
+  }
+
+  // Reads the index from the footer, or rebuilds it from the chunk headers if the file has none
+  bool open(const char *filename) {
+    file = fopen(filename, "rb");
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, ADDRESS_TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != ADDRESS_TRACE_VERSION) {
+      return false;
+    }
+
+    address_trace_footer footer;
+    if (fseeko(file, -(off_t)sizeof(footer), SEEK_END) == 0 && fread(&footer, sizeof(footer), 1, file) == 1 &&
+        memcmp(footer.magic, ADDRESS_TRACE_MAGIC, sizeof(footer.magic)) == 0) {
+      index.resize(footer.num_chunks);
+      if (fseeko(file, footer.index_offset, SEEK_SET) != 0 ||
+          (!index.empty() && fread(&index[0], sizeof(address_chunk_index_entry), index.size(), file) != index.size())) {
+        return false;
+      }
+    } else {
+      uint64_t offset = sizeof(header);
+      address_chunk_header chunk;
+      while (fseeko(file, offset, SEEK_SET) == 0 && fread(&chunk, sizeof(chunk), 1, file) == 1 && chunk.magic == ADDRESS_CHUNK_MAGIC) {
+        address_chunk_index_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.offset = offset;
+        entry.first_record = chunk.first_record;
+        entry.first_timestamp_us = chunk.first_timestamp_us;
+        entry.records = chunk.records;
+        index.push_back(entry);
+        offset += sizeof(chunk) + chunk.stored_bytes;
+      }
+    }
+    return seek_chunk(0);
+  }
+
+  uint32_t thread() const { return header.thread; }
+  size_t num_chunks() const { return index.size(); }
+  const address_chunk_index_entry &chunk(size_t i) const { return index[i]; }
+
+  uint64_t num_records() const {
+    return index.empty() ? 0 : index.back().first_record + index.back().records;
+  }
+
+  // Positions the reader at the first record of chunk i (i == num_chunks() means the end)
+  bool seek_chunk(size_t i) {
+    current_chunk = i;
+    flags = flags_end = NULL;
+    return i <= index.size() && (i == index.size() || load_chunk());
+  }
+
+  // Positions the reader at record number record
+  bool seek_record(uint64_t record) {
+    size_t i = 0;
+    while (i < index.size() && index[i].first_record + index[i].records <= record) {
+      i++;
+    }
+    if (!seek_chunk(i)) {
+      return false;
+    }
+    trace_access access;
+    for (uint64_t r = i < index.size() ? index[i].first_record : record; r < record; r++) {
+      if (!next(&access)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Positions the reader at the start of the last chunk that begins at or before timestamp_us, so
+  // that the records from timestamp_us on come next (after a few earlier ones)
+  bool seek_time(uint64_t timestamp_us) {
+    size_t i = 0;
+    while (i + 1 < index.size() && index[i + 1].first_timestamp_us <= timestamp_us) {
+      i++;
+    }
+    return seek_chunk(i);
+  }
+
+  // The next record; false at the end of the file or if it is corrupt (see failed())
+  bool next(trace_access *access) {
+    while (flags == flags_end) {
+      if (bad || current_chunk + 1 >= index.size()) {
+        return false;
+      }
+      current_chunk++;
+      if (!load_chunk()) {
+        return false;
+      }
+    }
+
+    uint8_t f = *flags++;
+    uint32_t ip_bytes = ADDRESS_IP_BYTES[(f >> ADDRESS_IP_SHIFT) & 3];
+    uint32_t addr_code = (f >> ADDRESS_ADDR_SHIFT) & 7;
+    uint32_t addr_bytes = addr_code == 7 ? 8 : addr_code;
+    if ((size_t)(ips_end - ips) < ip_bytes || (size_t)(addrs_end - addrs) < addr_bytes) {
+      return fail();
+    }
+    ip += unzigzag(get_fixed(ips, ip_bytes));
+    ips += ip_bytes;
+    if (addr_bytes != 0) {
+      stride = unzigzag(get_fixed(addrs, addr_bytes));
+      addrs += addr_bytes;
+    }
+    addr += stride;
+
+    if (f & ADDRESS_SIZE_CHANGED) {
+      if (extras == extras_end) {
+        return fail();
+      }
+      uint8_t code = *extras++;
+      uint64_t v;
+      if (code != ADDRESS_SIZE_ESCAPE) {
+        size = 1U << code;
+      } else if (get_varint(&extras, extras_end, &v)) {
+        size = (uint32_t)v;
+      } else {
+        return fail();
+      }
+    }
+    if (f & ADDRESS_TIMESTAMP_CHANGED) {
+      uint64_t v;
+      if (!get_varint(&extras, extras_end, &v)) {
+        return fail();
+      }
+      timestamp += v;
+    }
+
+    access->ip = ip;
+    access->addr = addr;
+    access->size = size;
+    access->is_write = f & ADDRESS_WRITE;
+    access->timestamp_us = timestamp;
+    return true;
+  }
+
+  bool failed() const { return bad; }
+
+private:
+  FILE *file;
+  address_trace_header header;
+  std::vector<address_chunk_index_entry> index;
+  size_t current_chunk;
+  std::vector<uint8_t> stored;
+  std::vector<uint8_t> decoded;
+  bool bad;
+
+  // the four streams of the current chunk, and the decoding state, reset at every chunk
+  const uint8_t *flags, *flags_end;
+  const uint8_t *ips, *ips_end;
+  const uint8_t *addrs, *addrs_end;
+  const uint8_t *extras, *extras_end;
+  uint64_t ip;
+  uint64_t addr;
+  uint64_t stride;
+  uint32_t size;
+  uint64_t timestamp;
+
+  bool fail() {
+    bad = true;
+    flags = flags_end = NULL;
+    return false;
+  }
+
+  bool load_chunk() {
+    address_chunk_header chunk;
+    if (fseeko(file, index[current_chunk].offset, SEEK_SET) != 0 || fread(&chunk, sizeof(chunk), 1, file) != 1 ||
+        chunk.magic != ADDRESS_CHUNK_MAGIC) {
+      return fail();
+    }
+    // 8 bytes of slack for get_fixed()
+    stored.resize(chunk.stored_bytes + 8);
+    if (chunk.stored_bytes != 0 && fread(&stored[0], 1, chunk.stored_bytes, file) != chunk.stored_bytes) {
+      return fail();
+    }
+    const uint8_t *p;
+    if (chunk.codec == ADDRESS_CODEC_LZ) {
+      decoded.resize(chunk.encoded_bytes + 8);
+      if (!lz_decompress(&stored[0], chunk.stored_bytes, &decoded[0], chunk.encoded_bytes)) {
+        return fail();
+      }
+      p = &decoded[0];
+    } else if (chunk.codec == ADDRESS_CODEC_NONE && chunk.encoded_bytes == chunk.stored_bytes) {
+      p = &stored[0];
+    } else {
+      return fail();
+    }
+
+    const uint8_t *end = p + chunk.encoded_bytes;
+    const uint8_t **starts[] = { &flags, &ips, &addrs, &extras };
+    const uint8_t **ends[] = { &flags_end, &ips_end, &addrs_end, &extras_end };
+    for (size_t k = 0; k < 4; k++) {
+      uint32_t length;
+      if ((size_t)(end - p) < sizeof(length)) {
+        return fail();
+      }
+      memcpy(&length, p, sizeof(length));
+      p += sizeof(length);
+      if ((size_t)(end - p) < length) {
+        return fail();
+      }
+      *starts[k] = p;
+      *ends[k] = p + length;
+      p += length;
+    }
+    if ((size_t)(flags_end - flags) != chunk.records) {
+      return fail();
+    }
+    ip = addr = stride = 0;
+    size = 0;
+    timestamp = chunk.first_timestamp_us;
+    return true;
+  }
+
+  address_trace_reader(const address_trace_reader &);
+  address_trace_reader &operator=(const address_trace_reader &);
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef ALLOC_INDEX_H
+#define ALLOC_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+// Live allocations of the application
+struct allocation
+{
+  uint64_t start;
+  uint64_t end;   // one past the last byte
+  uint32_t site;  // allocation site id
+  uint32_t object;  // object_table id, or NO_OBJECT
+};
+
+// Interval index of non-overlapping live allocations, keyed by start address.
+//
+// Not thread-safe; pinatrace.cpp guards it with a reader/writer lock and keeps a per-thread
+// alloc_index_cache in front of it so that most accesses never take the lock.
+class alloc_index
+{
+public:
+  static const uint32_t NO_SITE = ~(uint32_t)0;
+  static const uint32_t NO_OBJECT = ~(uint32_t)0;
+
+  alloc_index() : version(0) {}
+
+  void insert(uint64_t start, uint64_t size, uint32_t site, uint32_t object = NO_OBJECT) {
+    if (size == 0) {
+      size = 1;
+    }
+    allocation a;
+    a.start = start;
+    a.end = start + size;
+    a.site = site;
+    a.object = object;
+    by_start[start] = a;
+    version++;
+  }
+
+  // Removes the allocation starting at start and sets *object to its object; returns false if there is none
+  bool erase(uint64_t start, uint32_t *object = NULL) {
+    std::map<uint64_t, allocation>::iterator it = by_start.find(start);
+    if (it == by_start.end()) {
+      return false;
+    }
+    if (object != NULL) {
+      *object = it->second.object;
+    }
+    by_start.erase(it);
+    version++;
+    return true;
+  }
+
+  // Removes every allocation that starts in [start, start + size), e.g. for munmap, and appends
+  // their objects to *objects
+  void erase_range(uint64_t start, uint64_t size, std::vector<uint32_t> *objects = NULL) {
+    std::map<uint64_t, allocation>::iterator first = by_start.lower_bound(start);
+    std::map<uint64_t, allocation>::iterator last = by_start.lower_bound(start + size);
+    if (first != last) {
+      for (std::map<uint64_t, allocation>::iterator it = first; objects != NULL && it != last; ++it) {
+        if (it->second.object != NO_OBJECT) {
+          objects->push_back(it->second.object);
+        }
+      }
+      by_start.erase(first, last);
+      version++;
+    }
+  }
+
+  // Looks up addr. Returns the site of the allocation containing it, or NO_SITE, sets *object to its
+  // object (NO_OBJECT if none), and sets [*lo, *hi) to the extent of that allocation or of the gap
+  // between allocations that contains addr.
+  uint32_t find(uint64_t addr, uint64_t *lo, uint64_t *hi, uint32_t *object) const {
+    std::map<uint64_t, allocation>::const_iterator next = by_start.upper_bound(addr);
+    *hi = next == by_start.end() ? ~(uint64_t)0 : next->first;
+    *lo = 0;
+    *object = NO_OBJECT;
+    if (next != by_start.begin()) {
+      std::map<uint64_t, allocation>::const_iterator prev = next;
+      --prev;
+      if (addr < prev->second.end) {
+        *lo = prev->second.start;
+        *hi = prev->second.end;
+        *object = prev->second.object;
+        return prev->second.site;
+      }
+      *lo = prev->second.end;
+    }
+    return NO_SITE;
+  }
+
+  size_t size() const { return by_start.size(); }
+
+  // Incremented on every change, so that cached find() results can be validated
+  volatile uint64_t version;
+
+private:
+  std::map<uint64_t, allocation> by_start;
+};
+
+// A thread's most recent find() result. It stays valid until the index changes.
+struct alloc_index_cache
+{
+  uint64_t version;
+  uint64_t lo;
+  uint64_t hi;
+  uint32_t site;
+  uint32_t object;
+
+  alloc_index_cache() : version(~(uint64_t)0), lo(0), hi(0), site(alloc_index::NO_SITE), object(alloc_index::NO_OBJECT) {}
+
+  bool lookup(const alloc_index &index, uint64_t addr, uint32_t *result, uint32_t *result_object) const {
+    if (version != index.version || addr < lo || addr >= hi) {
+      return false;
+    }
+    *result = site;
+    *result_object = object;
+    return true;
+  }
+};
+
+// A thread's outermost allocator call in progress (malloc, calloc, realloc, mmap), matched to its
+// exit by the stack pointer at entry. Exits can be missed, e.g. when a slow path tail-jumps out of
+// the routine, so a new entry always replaces a stale call rather than being taken for a nested one.
+struct allocator_call
+{
+  uint64_t sp;         // stack pointer at entry, i.e. where the return address is; 0 if none
+  uint64_t return_ip;
+  uint64_t size;
+  uint32_t site;
+  uint64_t old_ptr;    // the block realloc was asked to resize, or 0
+
+  allocator_call() : sp(0), return_ip(0), size(0), site(alloc_index::NO_SITE), old_ptr(0) {}
+
+  // Whether a call entered with stack pointer sp runs inside the call in progress: that call's frame
+  // is further up the stack and still holds its return address. A call entering at exactly sp is not
+  // nested: it is either the next call from the same frame after a missed exit, or a tail call from
+  // the call in progress, whose result is the one returned anyway.
+  bool nested(uint64_t sp) const {
+    return this->sp > sp && *(const uint64_t *)this->sp == return_ip;
+  }
+
+  // Notes the call entered with stack pointer sp unless it is nested; returns whether it was noted.
+  // The caller sets site (and old_ptr for realloc) only then.
+  bool enter(uint64_t sp, uint64_t return_ip, uint64_t size) {
+    if (nested(sp)) {
+      return false;
+    }
+    this->sp = sp;
+    this->return_ip = return_ip;
+    this->size = size;
+    site = alloc_index::NO_SITE;
+    old_ptr = 0;
+    return true;
+  }
+
+  // Whether an exit seen with stack pointer sp is that of the call in progress, which then ends;
+  // exits of nested calls, or of calls in progress before the allocator was instrumented, are not
+  bool leave(uint64_t sp) {
+    if (this->sp != sp) {
+      return false;
+    }
+    this->sp = 0;
+    return true;
+  }
+};
+
+#endif
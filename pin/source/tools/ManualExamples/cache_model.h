@@ -0,0 +1,784 @@
+#ifndef CACHE_MODEL_H
+#define CACHE_MODEL_H
+
+// Multi-level cache hierarchy simulator
+// =====================================
+//
+// A cache_hierarchy is a list of cache levels ordered from the core outwards. Every level is a
+// set-associative cache of line numbers (address / line size) whose tags are packed per set in one
+// aligned array, so a lookup compares a whole set with a few SIMD instructions (32-bit tags of large
+// levels: 8 per AVX2 compare, 4 per SSE2 compare, so a 16-way set is one 64-byte line and two
+// compares). The replacement policy is a template parameter of the level, so the per-access path has
+// no policy dispatch beyond one virtual call per level.
+//
+// Accesses allocate on a miss in every level they miss in (loads and stores alike, like the
+// STORE_ALLOCATE caches of pin_cache.H this replaces). In an inclusive hierarchy a line evicted from
+// a level is also invalidated in all levels closer to the core.
+//
+// Levels are write-back: a store marks its line dirty in the first level, and a dirty line evicted
+// from a level is written into the next one (allocating it there, dirty). Dirty lines evicted from
+// the last level are write-backs to memory, which cache_hierarchy hands back to the caller; flush()
+// writes back everything still dirty, e.g. at the end of the run.
+//
+// Configuration comes from a config file, from the host's sysfs cache topology, or from
+// cache_config::default_config().
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+enum replacement_policy
+{
+  REPLACEMENT_LRU,
+  REPLACEMENT_PLRU,
+  REPLACEMENT_ROUND_ROBIN
+};
+
+struct cache_level_config
+{
+  std::string name;
+  uint64_t size;
+  uint32_t line_size;
+  uint32_t associativity;
+  replacement_policy policy;
+  bool shared;  // shared by all threads, or private to each thread
+
+  uint32_t num_sets() const { return size / ((uint64_t)line_size * associativity); }
+};
+
+// Replacement policies. Each set keeps its policy state right behind its tags (see
+// set_associative_cache), so a lookup and the policy update touch the same host cache lines.
+// touch() is called on every hit and fill, victim() on a miss in a set without invalid ways.
+
+// True LRU kept as a recency rank per way (0 = most recently used, ways - 1 = least recently used).
+// Ranks are bytes, so the ranks of a set of up to 16 ways fit in one SSE register and a touch is a
+// single compare-and-add instead of a scan over per-way timestamps.
+class lru_policy
+{
+public:
+  void init(uint32_t ways) { this->ways = ways; }
+  uint32_t state_size() const { return ways < 16 ? 16 : ways; }
+
+  void reset(uint8_t *ranks) const {
+    for (uint32_t w = 0; w < state_size(); w++) {
+      // padding ways get a rank that never ages and is never the victim
+      ranks[w] = w < ways ? w : 0x7f;
+    }
+  }
+
+  void touch(uint8_t *ranks, uint32_t way) const {
+    uint8_t rank = ranks[way];
+#if defined(__SSE2__)
+    if (ways <= 16) {
+      // every way more recent than way ages by one, and way itself becomes rank 0
+      static const uint8_t way_numbers[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+      __m128i r = _mm_loadu_si128((const __m128i *)ranks);
+      __m128i younger = _mm_cmplt_epi8(r, _mm_set1_epi8(rank));
+      __m128i self = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)way_numbers), _mm_set1_epi8(way));
+      _mm_storeu_si128((__m128i *)ranks, _mm_andnot_si128(self, _mm_sub_epi8(r, younger)));
+      return;
+    }
+#endif
+    for (uint32_t w = 0; w < ways; w++) {
+      if (ranks[w] < rank) {
+        ranks[w]++;
+      }
+    }
+    ranks[way] = 0;
+  }
+
+  uint32_t victim(uint8_t *ranks) const {
+#if defined(__SSE2__)
+    if (ways <= 16) {
+      __m128i oldest = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)ranks), _mm_set1_epi8(ways - 1));
+      return __builtin_ctz(_mm_movemask_epi8(oldest));
+    }
+#endif
+    for (uint32_t w = 0; w < ways; w++) {
+      if (ranks[w] == ways - 1) {
+        return w;
+      }
+    }
+    return 0;
+  }
+
+private:
+  uint32_t ways;
+};
+
+// Tree pseudo-LRU; the associativity must be a power of two (at most 32). Node i of the tree is bit i
+// of the state and points towards the half that holds the next victim.
+class plru_policy
+{
+public:
+  void init(uint32_t ways) {
+    depth = 0;
+    while ((1U << depth) < ways) {
+      depth++;
+    }
+    // touching a way makes every node on its path point away from it; precompute that per way
+    for (uint32_t way = 0; way < ways; way++) {
+      path_mask[way] = 0;
+      path_bits[way] = 0;
+      uint32_t node = 1;
+      for (uint32_t level = 0; level < depth; level++) {
+        uint32_t direction = (way >> (depth - 1 - level)) & 1;
+        path_mask[way] |= 1U << node;
+        path_bits[way] |= (direction ^ 1) << node;
+        node = 2 * node + direction;
+      }
+    }
+  }
+  uint32_t state_size() const { return sizeof(uint32_t); }
+  void reset(uint8_t *state) const { *(uint32_t *)state = 0; }
+
+  void touch(uint8_t *state, uint32_t way) const {
+    *(uint32_t *)state = (*(uint32_t *)state & ~path_mask[way]) | path_bits[way];
+  }
+
+  uint32_t victim(uint8_t *state) const {
+    uint32_t bits = *(uint32_t *)state;
+    uint32_t node = 1;
+    for (uint32_t level = 0; level < depth; level++) {
+      node = 2 * node + ((bits >> node) & 1);
+    }
+    return node - (1U << depth);
+  }
+
+private:
+  uint32_t depth;
+  uint32_t path_mask[32];
+  uint32_t path_bits[32];
+};
+
+class round_robin_policy
+{
+public:
+  void init(uint32_t ways) { this->ways = ways; }
+  uint32_t state_size() const { return sizeof(uint32_t); }
+  void reset(uint8_t *state) const { *(uint32_t *)state = 0; }
+  void touch(uint8_t *, uint32_t) const {}
+
+  uint32_t victim(uint8_t *state) const {
+    uint32_t way = *(uint32_t *)state;
+    *(uint32_t *)state = (way + 1) % ways;
+    return way;
+  }
+
+private:
+  uint32_t ways;
+};
+
+class cache_level
+{
+public:
+  static const uint64_t NO_LINE = ~(uint64_t)0;
+
+  cache_level(const cache_level_config &config) : config(config), num_sets(config.num_sets()), ways(config.associativity) {
+    set_bits = 0;
+    while ((1U << set_bits) < num_sets) {
+      set_bits++;
+    }
+    power_of_two = (1U << set_bits) == num_sets;
+  }
+  virtual ~cache_level() {}
+
+  // Looks up line and installs it on a miss; a write marks it dirty. Returns true on a hit; on a miss,
+  // *evicted is set to the line that was displaced, or NO_LINE if an invalid way was used, and
+  // *evicted_dirty to whether that line was dirty.
+  virtual bool access(uint64_t line, bool is_write, uint64_t *evicted, bool *evicted_dirty) = 0;
+
+  // Removes line if present; returns whether it was present and sets *dirty (if not NULL) to whether
+  // it was dirty
+  virtual bool invalidate(uint64_t line, bool *dirty) = 0;
+
+  // Appends every dirty line to *lines and marks it clean
+  virtual void flush(std::vector<uint64_t> *lines) = 0;
+
+  // Whether line is present and dirty
+  virtual bool is_dirty(uint64_t line) const = 0;
+
+  // Marks line clean if present; returns whether it was dirty
+  virtual bool clean(uint64_t line) = 0;
+
+  // Sliced last-level caches often have a set count that is not a power of two; those levels pay
+  // for a division per lookup
+  uint32_t set_of(uint64_t line) const { return power_of_two ? line & (num_sets - 1) : line % num_sets; }
+  uint64_t tag_of(uint64_t line) const { return power_of_two ? line >> set_bits : line / num_sets; }
+  uint64_t line_of(uint64_t tag, uint32_t set) const { return power_of_two ? (tag << set_bits) | set : tag * num_sets + set; }
+
+  const cache_level_config config;
+
+protected:
+  const uint32_t num_sets;
+  const uint32_t ways;
+  uint32_t set_bits;
+  bool power_of_two;
+};
+
+// Index of the first of n tags equal to tag, or -1. Tags are 64-byte aligned per set.
+inline int find_tag(const uint64_t *tags, uint32_t n, uint64_t tag)
+{
+  uint32_t w = 0;
+#if defined(__AVX2__)
+  __m256i needle = _mm256_set1_epi64x(tag);
+  for (; w + 4 <= n; w += 4) {
+    __m256i eq = _mm256_cmpeq_epi64(_mm256_load_si256((const __m256i *)(tags + w)), needle);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+    if (mask != 0) {
+      return w + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE4_1__)
+  __m128i needle = _mm_set1_epi64x(tag);
+  for (; w + 2 <= n; w += 2) {
+    __m128i eq = _mm_cmpeq_epi64(_mm_load_si128((const __m128i *)(tags + w)), needle);
+    int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+    if (mask != 0) {
+      return w + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; w < n; w++) {
+    if (tags[w] == tag) {
+      return w;
+    }
+  }
+  return -1;
+}
+
+inline int find_tag(const uint32_t *tags, uint32_t n, uint32_t tag)
+{
+  uint32_t w = 0;
+#if defined(__AVX2__)
+  __m256i needle = _mm256_set1_epi32(tag);
+  for (; w + 8 <= n; w += 8) {
+    __m256i eq = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i *)(tags + w)), needle);
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+    if (mask != 0) {
+      return w + __builtin_ctz(mask);
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i needle4 = _mm_set1_epi32(tag);
+  for (; w + 4 <= n; w += 4) {
+    __m128i eq = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)(tags + w)), needle4);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+    if (mask != 0) {
+      return w + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; w < n; w++) {
+    if (tags[w] == tag) {
+      return w;
+    }
+  }
+  return -1;
+}
+
+// A set stores the line numbers of its ways with the set index dropped (tag_of()).
+// TAG is uint64_t in general; make_cache_level() picks uint32_t when every user-space line number
+// fits, so a 16-way set is a single 64-byte host cache line.
+template <class POLICY, class TAG>
+class set_associative_cache : public cache_level
+{
+public:
+  set_associative_cache(const cache_level_config &config) : cache_level(config) {
+    policy.init(ways);
+    state_offset = (ways * sizeof(TAG) + 15) / 16 * 16;
+    dirty_offset = (state_offset + policy.state_size() + 7) / 8 * 8;
+    stride = (dirty_offset + sizeof(uint64_t) + 63) / 64 * 64;
+    void *p = NULL;
+    if (posix_memalign(&p, 64, (size_t)num_sets * stride) != 0) {
+      abort();
+    }
+    sets = (uint8_t *)p;
+    for (uint32_t set = 0; set < num_sets; set++) {
+      memset(sets + (size_t)set * stride, 0xff, state_offset);
+      policy.reset(sets + (size_t)set * stride + state_offset);
+      *(uint64_t *)(sets + (size_t)set * stride + dirty_offset) = 0;
+    }
+  }
+
+  ~set_associative_cache() {
+    free(sets);
+  }
+
+  bool access(uint64_t line, bool is_write, uint64_t *evicted, bool *evicted_dirty) {
+    uint32_t set = set_of(line);
+    TAG *t = (TAG *)(sets + (size_t)set * stride);
+    uint8_t *state = (uint8_t *)t + state_offset;
+    uint64_t *dirty = (uint64_t *)((uint8_t *)t + dirty_offset);
+    TAG tag = tag_of(line);
+    int way = find_tag(t, ways, tag);
+    if (way >= 0) {
+      policy.touch(state, way);
+      *dirty |= (uint64_t)is_write << way;
+      return true;
+    }
+
+    way = find_tag(t, ways, NO_TAG);
+    if (way < 0) {
+      way = policy.victim(state);
+      *evicted = line_of(t[way], set);
+      *evicted_dirty = (*dirty >> way) & 1;
+    } else {
+      *evicted = NO_LINE;
+      *evicted_dirty = false;
+    }
+    t[way] = tag;
+    *dirty = (*dirty & ~(1ULL << way)) | ((uint64_t)is_write << way);
+    policy.touch(state, way);
+    return false;
+  }
+
+  bool invalidate(uint64_t line, bool *was_dirty) {
+    uint32_t set = set_of(line);
+    TAG *t = (TAG *)(sets + (size_t)set * stride);
+    uint64_t *dirty = (uint64_t *)((uint8_t *)t + dirty_offset);
+    int way = find_tag(t, ways, (TAG)tag_of(line));
+    if (way < 0) {
+      return false;
+    }
+    if (was_dirty != NULL) {
+      *was_dirty = (*dirty >> way) & 1;
+    }
+    t[way] = NO_TAG;
+    *dirty &= ~(1ULL << way);
+    return true;
+  }
+
+  bool is_dirty(uint64_t line) const {
+    uint32_t set = set_of(line);
+    const TAG *t = (const TAG *)(sets + (size_t)set * stride);
+    int way = find_tag(t, ways, (TAG)tag_of(line));
+    return way >= 0 && ((*(const uint64_t *)((const uint8_t *)t + dirty_offset) >> way) & 1);
+  }
+
+  bool clean(uint64_t line) {
+    uint32_t set = set_of(line);
+    TAG *t = (TAG *)(sets + (size_t)set * stride);
+    uint64_t *dirty = (uint64_t *)((uint8_t *)t + dirty_offset);
+    int way = find_tag(t, ways, (TAG)tag_of(line));
+    if (way < 0 || ((*dirty >> way) & 1) == 0) {
+      return false;
+    }
+    *dirty &= ~(1ULL << way);
+    return true;
+  }
+
+  void flush(std::vector<uint64_t> *lines) {
+    for (uint32_t set = 0; set < num_sets; set++) {
+      TAG *t = (TAG *)(sets + (size_t)set * stride);
+      uint64_t *dirty = (uint64_t *)((uint8_t *)t + dirty_offset);
+      for (uint64_t d = *dirty; d != 0; d &= d - 1) {
+        lines->push_back(line_of(t[__builtin_ctzll(d)], set));
+      }
+      *dirty = 0;
+    }
+  }
+
+private:
+  static const TAG NO_TAG = (TAG)~(TAG)0;
+
+  // num_sets sets of stride bytes (a multiple of the host cache line): the tags of the set's ways
+  // (NO_TAG if invalid), then the policy state at state_offset, then a bit mask of the dirty ways at
+  // dirty_offset
+  uint8_t *sets;
+  uint32_t stride;
+  uint32_t state_offset;
+  uint32_t dirty_offset;
+  POLICY policy;
+};
+
+template <class POLICY>
+inline cache_level *make_cache_level(const cache_level_config &config)
+{
+  // Line numbers of user-space addresses (below 2^47) have at most 41 bits, so with at least 1024
+  // sets the remaining tag fits in 31 bits and never collides with the invalid tag
+  if (config.num_sets() >= 1024) {
+    return new set_associative_cache<POLICY, uint32_t>(config);
+  }
+  return new set_associative_cache<POLICY, uint64_t>(config);
+}
+
+inline cache_level *make_cache_level(const cache_level_config &config)
+{
+  switch (config.policy) {
+    case REPLACEMENT_PLRU:
+      return make_cache_level<plru_policy>(config);
+    case REPLACEMENT_ROUND_ROBIN:
+      return make_cache_level<round_robin_policy>(config);
+    case REPLACEMENT_LRU:
+    default:
+      return make_cache_level<lru_policy>(config);
+  }
+}
+
+class cache_hierarchy
+{
+public:
+  cache_hierarchy() : inclusive(false) {}
+
+  ~cache_hierarchy() {
+    for (size_t i = 0; i < levels.size(); i++) {
+      delete levels[i];
+    }
+  }
+
+  void add_level(const cache_level_config &config) { levels.push_back(make_cache_level(config)); }
+  void set_inclusive(bool inclusive) { this->inclusive = inclusive; }
+
+  size_t num_levels() const { return levels.size(); }
+  cache_level *level(size_t i) const { return levels[i]; }
+
+  // Returns the index of the level that hit, or -1 if every level missed. A write dirties the line
+  // in the first level. Lines written back out of the last level are appended to *written_back, and
+  // clean lines evicted from the last level to *dropped; either may be NULL if nobody cares.
+  int access(uint64_t line, bool is_write = false, std::vector<uint64_t> *written_back = NULL, std::vector<uint64_t> *dropped = NULL) {
+    for (size_t i = 0; i < levels.size(); i++) {
+      uint64_t evicted;
+      bool evicted_dirty;
+      if (levels[i]->access(line, is_write && i == 0, &evicted, &evicted_dirty)) {
+        return i;
+      }
+      evict(i, evicted, evicted_dirty, written_back, dropped);
+    }
+    return -1;
+  }
+
+  // Takes a dirty line written back by a cache in front of this hierarchy (e.g. the private levels
+  // in front of the shared ones)
+  void write_back(uint64_t line, std::vector<uint64_t> *written_back = NULL, std::vector<uint64_t> *dropped = NULL) {
+    write_back_into(0, line, written_back, dropped);
+  }
+
+  // Whether line is dirty in the first level, i.e. a store to it cannot change any other cache
+  bool dirty_in_first_level(uint64_t line) const {
+    return !levels.empty() && levels[0]->is_dirty(line);
+  }
+
+  // Removes line from every level (a coherence invalidation); returns whether any copy was dirty
+  bool invalidate(uint64_t line) {
+    bool dirty = false;
+    for (size_t i = 0; i < levels.size(); i++) {
+      bool level_dirty = false;
+      levels[i]->invalidate(line, &level_dirty);
+      dirty = dirty || level_dirty;
+    }
+    return dirty;
+  }
+
+  // Marks line clean in every level (a coherence downgrade); returns whether any copy was dirty
+  bool clean(uint64_t line) {
+    bool dirty = false;
+    for (size_t i = 0; i < levels.size(); i++) {
+      dirty = levels[i]->clean(line) || dirty;
+    }
+    return dirty;
+  }
+
+  // Writes every dirty line back through the remaining levels and appends the lines that leave the
+  // last level to *written_back; afterwards nothing is dirty
+  void flush(std::vector<uint64_t> *written_back) {
+    std::vector<uint64_t> dirty;
+    for (size_t i = 0; i < levels.size(); i++) {
+      dirty.clear();
+      levels[i]->flush(&dirty);
+      for (size_t j = 0; j < dirty.size(); j++) {
+        write_back_into(i + 1, dirty[j], written_back, NULL);
+      }
+    }
+  }
+
+private:
+  std::vector<cache_level *> levels;
+  bool inclusive;
+
+  // Handles the line evicted from level i: with an inclusive hierarchy the copies closer to the core
+  // go too, and if any copy was dirty the line is written into level i + 1
+  void evict(size_t i, uint64_t evicted, bool dirty, std::vector<uint64_t> *written_back, std::vector<uint64_t> *dropped) {
+    if (evicted == cache_level::NO_LINE) {
+      return;
+    }
+    if (inclusive) {
+      for (size_t j = 0; j < i; j++) {
+        bool closer_dirty = false;
+        levels[j]->invalidate(evicted, &closer_dirty);
+        dirty = dirty || closer_dirty;
+      }
+    }
+    if (dirty) {
+      write_back_into(i + 1, evicted, written_back, dropped);
+    } else if (i + 1 == levels.size() && dropped != NULL) {
+      dropped->push_back(evicted);
+    }
+  }
+
+  void write_back_into(size_t i, uint64_t line, std::vector<uint64_t> *written_back, std::vector<uint64_t> *dropped) {
+    if (i == levels.size()) {
+      if (written_back != NULL) {
+        written_back->push_back(line);
+      }
+      return;
+    }
+    uint64_t evicted;
+    bool evicted_dirty;
+    if (!levels[i]->access(line, true, &evicted, &evicted_dirty)) {
+      evict(i, evicted, evicted_dirty, written_back, dropped);
+    }
+  }
+
+  cache_hierarchy(const cache_hierarchy &);
+  cache_hierarchy &operator=(const cache_hierarchy &);
+};
+
+// Configuration of a whole hierarchy: private levels first, then shared levels
+struct cache_config
+{
+  std::vector<cache_level_config> levels;
+  bool inclusive;
+
+  cache_config() : inclusive(false) {}
+
+  // The geometry the tool always used: 64 KB direct-mapped private L1, 8 MB 16-way round-robin shared L3
+  static cache_config default_config() {
+    cache_config config;
+    config.levels.push_back(make_level("L1", 64 * 1024, 64, 1, REPLACEMENT_LRU, false));
+    config.levels.push_back(make_level("L3", 8192 * 1024, 64, 16, REPLACEMENT_ROUND_ROBIN, true));
+    return config;
+  }
+
+  static cache_level_config make_level(const std::string &name, uint64_t size, uint32_t line_size, uint32_t associativity,
+                                       replacement_policy policy, bool shared) {
+    cache_level_config level;
+    level.name = name;
+    level.size = size;
+    level.line_size = line_size;
+    level.associativity = associativity;
+    level.policy = policy;
+    level.shared = shared;
+    return level;
+  }
+
+  uint32_t line_size() const { return levels.empty() ? 64 : levels[0].line_size; }
+
+  // Reads a config file with one level per line, closest to the core first:
+  //
+  //   # name  private|shared  size  line_size  ways  lru|plru|round_robin
+  //   L1      private         32K   64         8     lru
+  //   L2      private         1M    64         16    plru
+  //   L3      shared          32M   64         16    lru
+  //   inclusive yes
+  bool read_file(const char *filename, std::string &error) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+      error = std::string("cannot open ") + filename;
+      return false;
+    }
+
+    levels.clear();
+    inclusive = false;
+
+    char line[512];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+      line[strcspn(line, "\n")] = '\0';
+      char *comment = strchr(line, '#');
+      if (comment != NULL) {
+        *comment = '\0';
+      }
+
+      char name[64], sharing[64], size[64], policy[64];
+      unsigned line_size, ways;
+      int fields = sscanf(line, "%63s %63s %63s %u %u %63s", name, sharing, size, &line_size, &ways, policy);
+      if (fields <= 0) {
+        continue;
+      }
+      if (fields == 2 && strcmp(name, "inclusive") == 0) {
+        inclusive = strcmp(sharing, "yes") == 0;
+        continue;
+      }
+
+      replacement_policy p;
+      if (fields != 6 || !parse_policy(policy, &p) || (strcmp(sharing, "private") != 0 && strcmp(sharing, "shared") != 0)) {
+        error = std::string("malformed line: ") + line;
+        ok = false;
+        break;
+      }
+      levels.push_back(make_level(name, parse_size(size), line_size, ways, p, strcmp(sharing, "shared") == 0));
+    }
+    fclose(f);
+
+    return ok && validate(error);
+  }
+
+  // Builds the data/unified cache levels of cpu0 from /sys/devices/system/cpu/cpu0/cache. The last
+  // level and levels shared by more than one core's worth of CPUs (more than two SMT siblings) are
+  // shared; sysfs does not expose the replacement policy, so every level uses LRU.
+  bool read_sysfs(std::string &error) {
+    const char *base = "/sys/devices/system/cpu/cpu0/cache";
+    DIR *dir = opendir(base);
+    if (dir == NULL) {
+      error = std::string("cannot open ") + base;
+      return false;
+    }
+
+    std::vector<std::pair<int, cache_level_config> > found;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, "index", 5) != 0) {
+        continue;
+      }
+      std::string path = std::string(base) + "/" + entry->d_name + "/";
+      std::string type = read_sysfs_string(path + "type");
+      if (type != "Data" && type != "Unified") {
+        continue;
+      }
+      int level = atoi(read_sysfs_string(path + "level").c_str());
+      cache_level_config config = make_level("L" + read_sysfs_string(path + "level"),
+                                             parse_size(read_sysfs_string(path + "size").c_str()),
+                                             atoi(read_sysfs_string(path + "coherency_line_size").c_str()),
+                                             atoi(read_sysfs_string(path + "ways_of_associativity").c_str()),
+                                             REPLACEMENT_LRU,
+                                             count_cpus(read_sysfs_string(path + "shared_cpu_list")) > 2);
+      found.push_back(std::make_pair(level, config));
+    }
+    closedir(dir);
+
+    std::sort(found.begin(), found.end(), compare_levels);
+    levels.clear();
+    for (size_t i = 0; i < found.size(); i++) {
+      levels.push_back(found[i].second);
+    }
+    // the last level is shared even where this process only sees one CPU of it
+    if (!levels.empty()) {
+      levels.back().shared = true;
+    }
+    inclusive = false;
+
+    return validate(error);
+  }
+
+  // Checks the constraints the simulator relies on
+  bool validate(std::string &error) const {
+    if (levels.empty()) {
+      error = "no cache levels";
+      return false;
+    }
+    bool seen_shared = false;
+    for (size_t i = 0; i < levels.size(); i++) {
+      const cache_level_config &l = levels[i];
+      uint32_t sets = l.associativity == 0 || l.line_size == 0 ? 0 : l.num_sets();
+      if (sets == 0 || (uint64_t)sets * l.line_size * l.associativity != l.size) {
+        error = l.name + ": size must be a multiple of line size * ways";
+        return false;
+      }
+      if ((l.line_size & (l.line_size - 1)) != 0) {
+        error = l.name + ": the line size must be a power of two";
+        return false;
+      }
+      if (l.line_size != levels[0].line_size) {
+        error = l.name + ": all levels must use the same line size";
+        return false;
+      }
+      if (l.associativity > 64) {
+        error = l.name + ": at most 64 ways are supported";
+        return false;
+      }
+      if (l.policy == REPLACEMENT_PLRU && ((l.associativity & (l.associativity - 1)) != 0 || l.associativity > 32)) {
+        error = l.name + ": plru needs a power-of-two associativity of at most 32";
+        return false;
+      }
+      if (seen_shared && !l.shared) {
+        error = l.name + ": private levels must come before shared levels";
+        return false;
+      }
+      seen_shared = seen_shared || l.shared;
+    }
+    return true;
+  }
+
+  static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t size = strtoull(s, &end, 10);
+    switch (*end) {
+      case 'K': case 'k': return size << 10;
+      case 'M': case 'm': return size << 20;
+      case 'G': case 'g': return size << 30;
+      default: return size;
+    }
+  }
+
+  static bool parse_policy(const char *s, replacement_policy *policy) {
+    if (strcmp(s, "lru") == 0) {
+      *policy = REPLACEMENT_LRU;
+    } else if (strcmp(s, "plru") == 0) {
+      *policy = REPLACEMENT_PLRU;
+    } else if (strcmp(s, "round_robin") == 0) {
+      *policy = REPLACEMENT_ROUND_ROBIN;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+private:
+  static std::string read_sysfs_string(const std::string &path) {
+    char buf[256] = "";
+    FILE *f = fopen(path.c_str(), "r");
+    if (f != NULL) {
+      if (fgets(buf, sizeof(buf), f) == NULL) {
+        buf[0] = '\0';
+      }
+      fclose(f);
+    }
+    std::string s(buf);
+    while (!s.empty() && (s[s.size() - 1] == '\n' || s[s.size() - 1] == ' ')) {
+      s.erase(s.size() - 1);
+    }
+    return s;
+  }
+
+  // Number of CPUs in a list like "0-3,8-11"
+  static int count_cpus(const std::string &list) {
+    int count = 0;
+    const char *p = list.c_str();
+    while (*p != '\0') {
+      char *end;
+      long first = strtol(p, &end, 10);
+      long last = first;
+      if (*end == '-') {
+        last = strtol(end + 1, &end, 10);
+      }
+      count += last - first + 1;
+      p = *end == ',' ? end + 1 : end;
+      if (end == p && *p != '\0') {
+        break;
+      }
+    }
+    return count;
+  }
+
+  static bool compare_levels(const std::pair<int, cache_level_config> &a, const std::pair<int, cache_level_config> &b) {
+    return a.first < b.first;
+  }
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef CACHE_SIMULATION_H
+#define CACHE_SIMULATION_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "cache_model.h"
+#include "page_table.h"
+#include "trace_format.h"
+
+// The simulation of a thread's accesses through its private levels and the shared levels, the
+// counting of the lines written back to memory, and the sections they are written as. pinatrace
+// runs it in the application's threads and stream_consumer on its workers (see access_ring.h); both
+// use this code so that the two counts stay the same.
+
+// Per-page counts of cache line events other than accesses
+struct line_event_counts
+{
+  uint64_t write_backs;       // dirty lines written back to memory
+  uint64_t invalidations;     // copies in other cores' private levels invalidated by a store (-cores)
+  uint64_t coherence_misses;  // private-level misses on lines lost to another core's store (-cores)
+
+  line_event_counts &operator+=(const line_event_counts &other) {
+    write_backs += other.write_backs;
+    invalidations += other.invalidations;
+    coherence_misses += other.coherence_misses;
+    return *this;
+  }
+};
+
+// The shared levels, protected by lock striping: line l is guarded by lock(stripe(l)), and the
+// number of stripes divides the number of sets of every shared level, so all lines of one set share
+// a stripe and two threads only contend when they touch sets in the same stripe.
+//
+// LOCKS names the lock type and its operations, so that the same code runs on Pin locks in the tool
+// and on pthread mutexes outside it:
+//
+//   struct LOCKS { typedef ... lock_type; static void init(lock_type *); static void acquire(lock_type *); static void release(lock_type *); };
+template <class LOCKS>
+class striped_shared_caches
+{
+public:
+  typedef typename LOCKS::lock_type lock_type;
+  static const uint32_t MAX_STRIPES = 256;
+
+  striped_shared_caches() : stripes(1) {}
+
+  // Adds the shared levels of config and initializes the locks
+  void configure(const cache_config &config) {
+    stripes = MAX_STRIPES;
+    for (size_t i = 0; i < config.levels.size(); i++) {
+      if (config.levels[i].shared) {
+        caches.add_level(config.levels[i]);
+        while (config.levels[i].num_sets() % stripes != 0) {
+          stripes /= 2;
+        }
+      }
+    }
+    caches.set_inclusive(config.inclusive);
+    for (uint32_t i = 0; i < stripes; i++) {
+      LOCKS::init(&locks[i]);
+    }
+  }
+
+  uint32_t num_stripes() const { return stripes; }
+  uint32_t stripe(uint64_t line) const { return line & (stripes - 1); }
+  lock_type *lock(uint32_t stripe) { return &locks[stripe]; }
+  uint32_t num_levels() const { return caches.num_levels(); }
+
+  // The levels themselves, for callers that hold the line's stripe lock (or run alone)
+  cache_hierarchy &levels() { return caches; }
+
+  // Lines written back to memory by the shared levels are appended to *written_back
+  bool access(uint64_t line, bool is_write, std::vector<uint64_t> *written_back) {
+    if (caches.num_levels() == 0) {
+      return false;
+    }
+    lock_type *set_lock = lock(stripe(line));
+    LOCKS::acquire(set_lock);
+    bool hit = caches.access(line, is_write, written_back) >= 0;
+    LOCKS::release(set_lock);
+    return hit;
+  }
+
+  // Takes a dirty line evicted from a thread's private levels; it goes straight to memory (i.e. into
+  // *written_back) if there are no shared levels
+  void write_back(uint64_t line, std::vector<uint64_t> *written_back) {
+    if (caches.num_levels() == 0) {
+      written_back->push_back(line);
+      return;
+    }
+    lock_type *set_lock = lock(stripe(line));
+    LOCKS::acquire(set_lock);
+    caches.write_back(line, written_back);
+    LOCKS::release(set_lock);
+  }
+
+private:
+  cache_hierarchy caches;
+  uint32_t stripes;
+  lock_type locks[MAX_STRIPES];
+};
+
+// Simulates an access to line through private_caches and, if they all miss, the shared levels.
+// Returns true if any level hit. A store dirties its line in the first level; the dirty lines this
+// pushes out of the private levels go on to the shared ones, and those out of the last level are
+// appended to *memory_write_backs. *private_write_backs is scratch space, empty between calls.
+template <class LOCKS>
+bool access_private_and_shared(cache_hierarchy &private_caches, striped_shared_caches<LOCKS> &shared, uint64_t line, bool is_write,
+                               std::vector<uint64_t> *private_write_backs, std::vector<uint64_t> *memory_write_backs)
+{
+  bool hit = private_caches.access(line, is_write, private_write_backs) >= 0 ||
+             shared.access(line, is_write && private_caches.num_levels() == 0, memory_write_backs);
+  for (size_t i = 0; i < private_write_backs->size(); i++) {
+    shared.write_back((*private_write_backs)[i], memory_write_backs);
+  }
+  private_write_backs->clear();
+  return hit;
+}
+
+// Writes the dirty lines of private_caches back at exit, through the shared levels; those that reach
+// memory are appended to *memory_write_backs
+template <class LOCKS>
+void flush_private_caches(cache_hierarchy &private_caches, striped_shared_caches<LOCKS> &shared, std::vector<uint64_t> *memory_write_backs)
+{
+  std::vector<uint64_t> lines;
+  private_caches.flush(&lines);
+  for (size_t i = 0; i < lines.size(); i++) {
+    shared.write_back(lines[i], memory_write_backs);
+  }
+}
+
+// Counts lines (of 2^line_shift bytes) written back to memory in events, whose pages are
+// 2^count_shift bytes, and empties lines
+inline void add_write_backs(page_table_of<line_event_counts> &events, std::vector<uint64_t> &lines, unsigned line_shift, unsigned count_shift)
+{
+  for (size_t i = 0; i < lines.size(); i++) {
+    events.lookup((lines[i] << line_shift) >> count_shift)->write_backs++;
+  }
+  lines.clear();
+}
+
+// Slots of the used pages of table, in page number order
+template <class TABLE>
+void sorted_slots(const TABLE &table, std::vector<std::pair<uint64_t, size_t> > *slots)
+{
+  slots->clear();
+  slots->reserve(table.size());
+  for (size_t i = 0; i < table.capacity(); i++) {
+    if (table.used(i)) {
+      slots->push_back(std::make_pair(table.pageno_at(i), i));
+    }
+  }
+  std::sort(slots->begin(), slots->end());
+}
+
+// Maps a counter to the count written, or to its standard error (pinatrace's sampling); a NULL
+// scale writes counters as they are, a NULL error writes no SECTION_ERROR sections
+typedef uint64_t (*count_transform)(uint64_t count);
+
+// Writes one counter of table's pages (of 2^shift bytes, slots as from sorted_slots) as a section of
+// kind, with SECTION_GRANULARITY added for pages other than 4 KB, leaving out pages where it is 0
+template <class TABLE, class COUNTS>
+void write_counter_section(trace_writer &writer, uint32_t kind, uint32_t thread, const TABLE &table,
+                           const std::vector<std::pair<uint64_t, size_t> > &slots, uint64_t COUNTS::*counter, uint32_t shift,
+                           uint32_t epoch, uint64_t timestamp_ms, uint32_t group, count_transform scale, count_transform error)
+{
+  if (shift != TRACE_PAGE_SHIFT) {
+    kind |= SECTION_GRANULARITY;
+  }
+  std::vector<uint64_t> pagenos, counts, errors;
+  for (size_t i = 0; i < slots.size(); i++) {
+    uint64_t count = table.counts_at(slots[i].second).*counter;
+    if (count != 0) {
+      pagenos.push_back(slots[i].first);
+      counts.push_back(scale != NULL ? scale(count) : count);
+      if (error != NULL) {
+        errors.push_back(error(count));
+      }
+    }
+  }
+  writer.add_section(kind, thread, pagenos.empty() ? NULL : &pagenos[0], counts.empty() ? NULL : &counts[0], pagenos.size(), epoch,
+                     timestamp_ms, shift, group);
+  if (error != NULL) {
+    writer.add_section(kind | SECTION_ERROR, thread, pagenos.empty() ? NULL : &pagenos[0], errors.empty() ? NULL : &errors[0], pagenos.size(),
+                       epoch, timestamp_ms, shift, group);
+  }
+}
+
+// Writes the four counters of one thread's pages of 2^shift bytes as four sections sorted by page number
+inline void write_page_counts_sections(trace_writer &writer, uint32_t thread, const page_table &pages, uint32_t shift, uint32_t kind_flags,
+                                       uint32_t epoch, uint64_t timestamp_ms, uint32_t group, count_transform scale, count_transform error)
+{
+  std::vector<std::pair<uint64_t, size_t> > slots;
+  sorted_slots(pages, &slots);
+
+  const uint32_t kinds[] = { SECTION_READ_WITH_CACHE, SECTION_READ_WITHOUT_CACHE, SECTION_WRITE_WITH_CACHE, SECTION_WRITE_WITHOUT_CACHE };
+  uint64_t page_counts::*counters[] = { &page_counts::read_with_cache, &page_counts::read_without_cache, &page_counts::write_with_cache, &page_counts::write_without_cache };
+  for (size_t k = 0; k < 4; k++) {
+    write_counter_section(writer, kinds[k] | kind_flags, thread, pages, slots, counters[k], shift, epoch, timestamp_ms, group, scale, error);
+  }
+}
+
+// Writes the write-backs and, if coherence, the coherence events of one thread's pages of 2^shift
+// bytes as sections sorted by page number
+inline void write_line_events_sections(trace_writer &writer, uint32_t thread, const page_table_of<line_event_counts> &events, uint32_t shift,
+                                       bool coherence, count_transform scale, count_transform error)
+{
+  std::vector<std::pair<uint64_t, size_t> > slots;
+  sorted_slots(events, &slots);
+
+  const uint32_t kinds[] = { SECTION_WRITE_BACK, SECTION_INVALIDATION, SECTION_COHERENCE_MISS };
+  uint64_t line_event_counts::*counters[] = { &line_event_counts::write_backs, &line_event_counts::invalidations, &line_event_counts::coherence_misses };
+  for (size_t k = 0; k < (coherence ? 3 : 1); k++) {
+    write_counter_section(writer, kinds[k], thread, events, slots, counters[k], shift, 0, 0, 0, scale, error);
+  }
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef COHERENCE_H
+#define COHERENCE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// What a core's request requires of the other cores' private caches
+struct coherence_actions
+{
+  uint64_t invalidate;  // cores whose copy of the line must be invalidated
+  int32_t downgrade;    // core whose exclusive (E or M) copy becomes shared, or coherence_directory::NO_CORE
+  bool coherence_miss;  // the requesting core lost the line to an invalidation and has not fetched it since
+};
+
+// MESI-style directory over the private caches of up to 64 simulated cores.
+//
+// For every line in some core's private caches the directory records the cores holding it
+// (sharers) and the core holding it exclusively, if any (owner: E, or M once written). It also
+// remembers the cores whose copy was invalidated by another core's store and that have not fetched
+// the line again, so that their next miss on it can be told apart from a cold or capacity miss.
+// Entries go away once no core holds the line and none has lost it to an invalidation.
+//
+// The directory only decides; the caller applies the actions to the cores' caches. Not thread-safe;
+// pinatrace.cpp keeps one directory per shared-cache lock stripe.
+class coherence_directory
+{
+public:
+  static const int32_t NO_CORE = -1;
+
+  coherence_directory() : entries(NULL), mask(0), num_used(0) {
+    allocate(INITIAL_CAPACITY);
+  }
+
+  ~coherence_directory() { free(entries); }
+
+  // core missed on line and reads it (GetS)
+  void read(uint64_t line, uint32_t core, coherence_actions *actions) {
+    entry *e = lookup(line);
+    uint64_t bit = 1ULL << core;
+    actions->invalidate = 0;
+    actions->downgrade = NO_CORE;
+    actions->coherence_miss = (e->invalidated & bit) != 0;
+    e->invalidated &= ~bit;
+
+    if (e->owner != NO_CORE && e->owner != (int32_t)core) {
+      actions->downgrade = e->owner;
+    }
+    e->sharers |= bit;
+    e->owner = e->sharers == bit ? (int32_t)core : NO_CORE;
+  }
+
+  // core writes line, either after a miss or to a copy it does not know to be exclusive (GetM or
+  // upgrade); every other copy is invalidated
+  void write(uint64_t line, uint32_t core, coherence_actions *actions) {
+    entry *e = lookup(line);
+    uint64_t bit = 1ULL << core;
+    actions->invalidate = e->sharers & ~bit;
+    actions->downgrade = NO_CORE;
+    actions->coherence_miss = (e->invalidated & bit) != 0;
+
+    e->invalidated = (e->invalidated & ~bit) | actions->invalidate;
+    e->sharers = bit;
+    e->owner = core;
+  }
+
+  // line was evicted from core's private caches
+  void drop(uint64_t line, uint32_t core) {
+    size_t i = find(line);
+    if (entries[i].line == EMPTY) {
+      return;
+    }
+    entries[i].sharers &= ~(1ULL << core);
+    if (entries[i].owner == (int32_t)core) {
+      entries[i].owner = NO_CORE;
+    }
+    if (entries[i].sharers == 0 && entries[i].invalidated == 0) {
+      erase_slot(i);
+    }
+  }
+
+  size_t size() const { return num_used; }
+
+private:
+  static const uint64_t EMPTY = ~(uint64_t)0;
+  static const size_t INITIAL_CAPACITY = 1024;
+
+  struct entry
+  {
+    uint64_t line;
+    uint64_t sharers;
+    uint64_t invalidated;
+    int32_t owner;
+  };
+
+  // open addressing with linear probing, like page_table
+  entry *entries;
+  size_t mask;
+  size_t num_used;
+
+  coherence_directory(const coherence_directory &);
+  coherence_directory &operator=(const coherence_directory &);
+
+  static size_t hash(uint64_t line) {
+    return (size_t)((line * 0x9E3779B97F4A7C15ULL) >> 32);
+  }
+
+  size_t find(uint64_t line) const {
+    size_t i = hash(line) & mask;
+    while (entries[i].line != EMPTY && entries[i].line != line) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  entry *lookup(uint64_t line) {
+    size_t i = find(line);
+    if (entries[i].line == line) {
+      return &entries[i];
+    }
+    if (2 * (num_used + 1) > mask + 1) {
+      grow();
+      i = find(line);
+    }
+    entries[i].line = line;
+    entries[i].sharers = 0;
+    entries[i].invalidated = 0;
+    entries[i].owner = NO_CORE;
+    num_used++;
+    return &entries[i];
+  }
+
+  // Backward-shift deletion, as in reuse_distance_engine
+  void erase_slot(size_t i) {
+    size_t j = i;
+    while (true) {
+      j = (j + 1) & mask;
+      if (entries[j].line == EMPTY) {
+        break;
+      }
+      size_t home = hash(entries[j].line) & mask;
+      if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+        entries[i] = entries[j];
+        i = j;
+      }
+    }
+    entries[i].line = EMPTY;
+    num_used--;
+  }
+
+  void allocate(size_t capacity) {
+    entries = (entry *)malloc(capacity * sizeof(entry));
+    memset(entries, 0xff, capacity * sizeof(entry));
+    mask = capacity - 1;
+    num_used = 0;
+  }
+
+  void grow() {
+    entry *old_entries = entries;
+    size_t old_capacity = mask + 1;
+
+    allocate(2 * old_capacity);
+
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_entries[i].line != EMPTY) {
+        entries[find(old_entries[i].line)] = old_entries[i];
+        num_used++;
+      }
+    }
+    free(old_entries);
+  }
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "page_table.h"
+
+// Fixed-size page counters for runs whose footprint is too large to count every page exactly:
+// a Count-Min sketch estimates the counters of any page, and a Space-Saving table keeps the
+// candidates for the hottest ones. Memory depends only on the parameters, not on the footprint.
+//
+// The top pages are ranked by their estimates, so how many of the truly hottest pages are found
+// depends mostly on the sketch's width. On sketch_bench's Zipf streams (s = 0.9, 4 threads, 20M
+// accesses over 1.6M pages), the top 4096 pages reported contain 63% of the true top 4096 at width
+// 16384, 86% at 32768, 95% at 65536 and 98% at 131072 (depth 4). Flatter streams do worse: 87% at
+// width 65536 for s = 0.7. The number of pages reported needs a matching width: at 65536, the top
+// 16384 contain 73% of the true top 16384.
+
+// Count-Min sketch (Cormode and Muthukrishnan, J. Algorithms 2005) of page_counts: depth rows of
+// width cells, a page adds to one cell per row and is estimated by the smallest of its cells, field
+// by field. An estimate is never below the true count. For any one page, with probability at least
+// 1 - exp(-depth), it exceeds the true count by at most e / width times the total of that field
+// over all pages (error_bound()). This bound holds per page and is not a maximum: of the thousands
+// of pages reported, about exp(-depth) of them may exceed it (sketch_bench: 1 to 3 of 4096 at depth
+// 4). Sketches with the same width and depth merge by adding up their cells.
+class count_min_sketch
+{
+public:
+  // width must be a power of two
+  count_min_sketch(uint32_t width, uint32_t depth)
+      : width(width), depth(depth), cells(new page_counts[(size_t)width * depth]) {
+    clear();
+  }
+
+  ~count_min_sketch() { delete[] cells; }
+
+  void add(uint64_t pageno, const page_counts &delta) {
+    for (uint32_t row = 0; row < depth; row++) {
+      cells[cell(row, pageno)] += delta;
+    }
+    totals += delta;
+  }
+
+  page_counts estimate(uint64_t pageno) const {
+    page_counts result = cells[cell(0, pageno)];
+    for (uint32_t row = 1; row < depth; row++) {
+      const page_counts &c = cells[cell(row, pageno)];
+      result.read_with_cache = std::min(result.read_with_cache, c.read_with_cache);
+      result.read_without_cache = std::min(result.read_without_cache, c.read_without_cache);
+      result.write_with_cache = std::min(result.write_with_cache, c.write_with_cache);
+      result.write_without_cache = std::min(result.write_without_cache, c.write_without_cache);
+    }
+    return result;
+  }
+
+  void merge(const count_min_sketch &other) {
+    for (size_t i = 0; i < (size_t)width * depth; i++) {
+      cells[i] += other.cells[i];
+    }
+    totals += other.totals;
+  }
+
+  void clear() {
+    memset(cells, 0, (size_t)width * depth * sizeof(page_counts));
+    memset(&totals, 0, sizeof(totals));
+  }
+
+  // Sum of every field over all pages
+  const page_counts &total() const { return totals; }
+
+  // Largest overestimate, with probability 1 - failure_probability(), of a field whose total is total
+  double error_bound(uint64_t total) const { return M_E / width * total; }
+  double failure_probability() const { return exp(-(double)depth); }
+
+  size_t bytes() const { return (size_t)width * depth * sizeof(page_counts); }
+
+  static uint64_t mix(uint64_t pageno) {
+    uint64_t h = pageno;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+  }
+
+private:
+  uint32_t width;
+  uint32_t depth;
+  page_counts *cells;
+  page_counts totals;
+
+  // Rows hash independently; deriving them from one hash (h1 + row * h2) would let two pages share
+  // all their cells with probability 1 / width^2, and a cold page would then inherit a hot page's count
+  size_t cell(uint32_t row, uint64_t pageno) const {
+    return (size_t)row * width + (mix(pageno + row * 0x9E3779B97F4A7C15ULL) & (width - 1));
+  }
+
+  count_min_sketch(const count_min_sketch &);
+  count_min_sketch &operator=(const count_min_sketch &);
+};
+
+// Space-Saving (Metwally et al., ICDT 2005) over capacity pages, with admission guided by a
+// count_min_sketch of the same stream. In plain Space-Saving every access to an unmonitored page
+// replaces the lightest monitored page, which sinks through the whole heap; on a large footprint
+// that costs more than the rest of the tool. Here an unmonitored page only replaces the lightest
+// page if its estimated count is above that page's weight, and starts at its estimate.
+//
+// Weights are never below the true counts. Every page whose true count is above the smallest weight
+// at the end is monitored. The smallest weight is at most total / capacity plus the sketch's
+// error_bound(total), with the sketch's per-page probability rather than always. All of this holds
+// for the union of the tables of several streams against the sums of their totals, which is how
+// per-thread tables merge.
+class space_saving
+{
+public:
+  struct entry
+  {
+    uint64_t pageno;
+    uint64_t weight;
+    size_t slot;  // in slots_of_pages
+  };
+
+  explicit space_saving(size_t capacity) : capacity(capacity), total_weight(0) {
+    size_t slots = 1;
+    while (slots < 2 * capacity) {
+      slots *= 2;
+    }
+    slots_of_pages.assign(slots, (size_t)EMPTY);
+    mask = slots - 1;
+    heap.reserve(capacity);
+  }
+
+  // weight more accesses to pageno, whose sketch estimate (accesses included) is estimate
+  void add(uint64_t pageno, uint64_t weight, uint64_t estimate) {
+    total_weight += weight;
+    size_t slot = find(pageno);
+    if (slots_of_pages[slot] != EMPTY) {
+      size_t i = slots_of_pages[slot];
+      heap[i].weight += weight;
+      sift_down(i);
+      return;
+    }
+
+    entry e;
+    e.pageno = pageno;
+    e.weight = estimate;
+    if (heap.size() < capacity) {
+      e.slot = slot;
+      heap.push_back(e);
+      slots_of_pages[slot] = heap.size() - 1;
+      sift_up(heap.size() - 1);
+      return;
+    }
+    if (estimate <= heap[0].weight) {
+      return;
+    }
+
+    // replace the lightest page, at the root
+    erase_slot(heap[0].slot);
+    e.slot = find(pageno);
+    heap[0] = e;
+    slots_of_pages[e.slot] = 0;
+    sift_down(0);
+  }
+
+  uint64_t min_weight() const { return heap.size() < capacity ? 0 : heap[0].weight; }
+
+  size_t size() const { return heap.size(); }
+  const entry &at(size_t i) const { return heap[i]; }
+  uint64_t total() const { return total_weight; }
+
+  void clear() {
+    heap.clear();
+    slots_of_pages.assign(slots_of_pages.size(), (size_t)EMPTY);
+    total_weight = 0;
+  }
+
+  size_t bytes() const { return capacity * sizeof(entry) + slots_of_pages.size() * sizeof(size_t); }
+
+private:
+  static const size_t EMPTY = ~(size_t)0;
+
+  size_t capacity;
+  uint64_t total_weight;
+
+  // min-heap by weight, and page number -> heap index (open addressing, linear probing)
+  std::vector<entry> heap;
+  std::vector<size_t> slots_of_pages;
+  size_t mask;
+
+  size_t find(uint64_t pageno) const {
+    size_t i = (size_t)count_min_sketch::mix(pageno) & mask;
+    while (slots_of_pages[i] != EMPTY && heap[slots_of_pages[i]].pageno != pageno) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  // Backward-shift deletion, as in coherence_directory
+  void erase_slot(size_t i) {
+    size_t j = i;
+    while (true) {
+      j = (j + 1) & mask;
+      if (slots_of_pages[j] == EMPTY) {
+        break;
+      }
+      size_t home = (size_t)count_min_sketch::mix(heap[slots_of_pages[j]].pageno) & mask;
+      if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+        slots_of_pages[i] = slots_of_pages[j];
+        heap[slots_of_pages[i]].slot = i;
+        i = j;
+      }
+    }
+    slots_of_pages[i] = EMPTY;
+  }
+
+  void swap_entries(size_t i, size_t j) {
+    std::swap(heap[i], heap[j]);
+    slots_of_pages[heap[i].slot] = i;
+    slots_of_pages[heap[j].slot] = j;
+  }
+
+  void sift_up(size_t i) {
+    while (i > 0 && heap[(i - 1) / 2].weight > heap[i].weight) {
+      swap_entries(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  }
+
+  void sift_down(size_t i) {
+    while (true) {
+      size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+      if (left < heap.size() && heap[left].weight < heap[smallest].weight) {
+        smallest = left;
+      }
+      if (right < heap.size() && heap[right].weight < heap[smallest].weight) {
+        smallest = right;
+      }
+      if (smallest == i) {
+        return;
+      }
+      swap_entries(i, smallest);
+      i = smallest;
+    }
+  }
+};
+
+#endif
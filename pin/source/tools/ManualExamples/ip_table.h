@@ -0,0 +1,177 @@
+#ifndef IP_TABLE_H
+#define IP_TABLE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Memory traffic generated by one instruction
+struct ip_counts
+{
+  uint64_t accesses;
+  uint64_t misses;  // accesses that missed every simulated cache level
+
+  // Dominant page: a Boyer-Moore majority vote over the pages the instruction touched. If one page
+  // received more than half of the accesses it is dominant_pageno; otherwise it is just a recent hot one.
+  uint64_t dominant_pageno;
+  uint64_t dominant_votes;
+
+  // Linear-counting sketch of the distinct pages touched (see distinct_pages())
+  uint64_t page_bits[4];
+
+  void add_page(uint64_t pageno, uint64_t count) {
+    if (pageno == dominant_pageno) {
+      dominant_votes += count;
+    } else if (dominant_votes <= count) {
+      dominant_pageno = pageno;
+      dominant_votes = count - dominant_votes;
+    } else {
+      dominant_votes -= count;
+    }
+
+    // splitmix64 finalizer; neighbouring pages must land on unrelated bits
+    uint64_t h = pageno;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    uint32_t bit = (uint32_t)(h >> 56);
+    page_bits[bit >> 6] |= 1ULL << (bit & 63);
+  }
+
+  // Estimated number of distinct pages; exact for a handful of pages, within a few percent up to a
+  // few hundred, and saturating at about 1400
+  double distinct_pages() const {
+    uint32_t zero_bits = 0;
+    for (int i = 0; i < 4; i++) {
+      zero_bits += 64 - __builtin_popcountll(page_bits[i]);
+    }
+    if (zero_bits == 0) {
+      zero_bits = 1;
+    }
+    return -256.0 * log(zero_bits / 256.0);
+  }
+
+  void merge(const ip_counts &other) {
+    accesses += other.accesses;
+    misses += other.misses;
+    for (int i = 0; i < 4; i++) {
+      page_bits[i] |= other.page_bits[i];
+    }
+    if (other.dominant_pageno == dominant_pageno) {
+      dominant_votes += other.dominant_votes;
+    } else if (other.dominant_votes > dominant_votes) {
+      dominant_pageno = other.dominant_pageno;
+      dominant_votes = other.dominant_votes - dominant_votes;
+    } else {
+      dominant_votes -= other.dominant_votes;
+    }
+  }
+};
+
+// Open-addressing hash table (linear probing) from instruction address to ip_counts, laid out like
+// page_table. Not thread-safe; every application thread owns its own table.
+class ip_table
+{
+public:
+  static const uint64_t EMPTY_IP = 0;
+
+  ip_table() : keys(NULL), counts(NULL), mask(0), num_used(0) {
+    allocate(INITIAL_CAPACITY);
+  }
+
+  ~ip_table() {
+    free(keys);
+    free(counts);
+  }
+
+  // Returns the counters for ip, inserting zeroed counters if it has not been seen yet
+  ip_counts *lookup(uint64_t ip) {
+    size_t i = hash(ip) & mask;
+    while (true) {
+      if (keys[i] == ip) {
+        return &counts[i];
+      }
+      if (keys[i] == EMPTY_IP) {
+        break;
+      }
+      i = (i + 1) & mask;
+    }
+
+    if (2 * (num_used + 1) > capacity()) {
+      grow();
+      return lookup(ip);
+    }
+
+    keys[i] = ip;
+    num_used++;
+    return &counts[i];
+  }
+
+  void merge(const ip_table &other) {
+    for (size_t i = 0; i < other.capacity(); i++) {
+      if (other.used(i)) {
+        lookup(other.keys[i])->merge(other.counts[i]);
+      }
+    }
+  }
+
+  void clear() {
+    free(keys);
+    free(counts);
+    allocate(INITIAL_CAPACITY);
+  }
+
+  size_t size() const { return num_used; }
+  size_t capacity() const { return mask + 1; }
+
+  bool used(size_t i) const { return keys[i] != EMPTY_IP; }
+  uint64_t ip_at(size_t i) const { return keys[i]; }
+  const ip_counts &counts_at(size_t i) const { return counts[i]; }
+
+private:
+  static const size_t INITIAL_CAPACITY = 1024;
+
+  uint64_t *keys;
+  ip_counts *counts;
+  size_t mask;
+  size_t num_used;
+
+  ip_table(const ip_table &);
+  ip_table &operator=(const ip_table &);
+
+  static size_t hash(uint64_t ip) {
+    return (size_t)((ip * 0x9E3779B97F4A7C15ULL) >> 32);
+  }
+
+  void allocate(size_t capacity) {
+    keys = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+    counts = (ip_counts *)calloc(capacity, sizeof(ip_counts));
+    mask = capacity - 1;
+    num_used = 0;
+  }
+
+  void grow() {
+    uint64_t *old_keys = keys;
+    ip_counts *old_counts = counts;
+    size_t old_capacity = capacity();
+
+    allocate(2 * old_capacity);
+
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_keys[i] == EMPTY_IP) {
+        continue;
+      }
+      size_t j = hash(old_keys[i]) & mask;
+      while (keys[j] != EMPTY_IP) {
+        j = (j + 1) & mask;
+      }
+      keys[j] = old_keys[i];
+      counts[j] = old_counts[i];
+      num_used++;
+    }
+
+    free(old_keys);
+    free(old_counts);
+  }
+};
+
+#endif
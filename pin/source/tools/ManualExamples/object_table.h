@@ -0,0 +1,252 @@
+#ifndef OBJECT_TABLE_H
+#define OBJECT_TABLE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// Access counters of one allocated object
+struct object_counts
+{
+  static const uint32_t NEVER = ~(uint32_t)0;
+  static const uint32_t CUSTOM = 1;  // flags: site is a custom allocation class, not an allocation site
+
+  uint64_t size;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t misses;     // accesses that missed every simulated cache level
+  uint32_t first_ms;   // time of the first and last access, in ms since the start of the run; NEVER if untouched
+  uint32_t last_ms;
+  uint32_t site;
+  uint32_t flags;
+
+  uint64_t accesses() const { return reads + writes; }
+
+  void record(bool is_write, bool miss, uint64_t count, uint32_t now_ms) {
+    if (is_write) {
+      writes += count;
+    } else {
+      reads += count;
+    }
+    misses += miss;
+    if (first_ms == NEVER) {
+      first_ms = now_ms;
+    }
+    last_ms = now_ms;
+  }
+};
+
+// Objects by size class (log2 of the size, rounded up) and heat class (log2 of the number of
+// accesses, rounded up; class 0 holds the objects that were never accessed)
+struct object_histogram
+{
+  static const int CLASSES = 49;
+
+  // Objects by access density (accesses per byte) in quarter-octave steps, for the coverage curve
+  static const int DENSITY_STEPS = 4;
+  static const int DENSITY_BUCKETS = 512;
+
+  struct cell
+  {
+    uint64_t objects;
+    uint64_t bytes;
+    uint64_t accesses;
+    uint64_t misses;
+
+    void add(const object_counts &o) {
+      objects++;
+      bytes += o.size;
+      accesses += o.accesses();
+      misses += o.misses;
+    }
+  };
+
+  cell cells[CLASSES][CLASSES];
+  cell densities[DENSITY_BUCKETS];
+
+  // Smallest n with value <= 2^(n-1), i.e. 0 for 0, 1 for 1, 2 for 2, 3 for 3..4, 4 for 5..8...
+  static int log2_class(uint64_t value) {
+    if (value <= 1) {
+      return (int)value;
+    }
+    int c = 65 - __builtin_clzll(value - 1);
+    return c < CLASSES ? c : CLASSES - 1;
+  }
+
+  // Lower and upper bound of the values in class c
+  static uint64_t class_min(int c) { return c <= 1 ? c : (1ULL << (c - 2)) + 1; }
+  static uint64_t class_max(int c) { return c == 0 ? 0 : 1ULL << (c - 1); }
+
+  // Density bucket i holds densities in [2^((i - DENSITY_BUCKETS / 2) / DENSITY_STEPS), ...)
+  static int density_bucket(const object_counts &o) {
+    double d = (double)o.accesses() / (o.size ? o.size : 1);
+    int i = (int)floor(log2(d) * DENSITY_STEPS) + DENSITY_BUCKETS / 2;
+    return std::max(1, std::min(i, DENSITY_BUCKETS - 1));
+  }
+
+  void add(const object_counts &o) {
+    cells[log2_class(o.size)][log2_class(o.accesses())].add(o);
+    // bucket 0 is reserved for untouched objects
+    densities[o.accesses() == 0 ? 0 : density_bucket(o)].add(o);
+  }
+};
+
+// Counters of every allocated object, live or freed.
+//
+// Live objects own a record, addressed by a 32-bit id that pinatrace.cpp stores in the alloc_index
+// next to the allocation, so that finding an access's object costs nothing beyond the allocation
+// lookup. Records are 48 bytes and live in fixed chunks that never move, so that they can be
+// updated without a lock while other threads insert. When an object is freed its record is folded
+// into the size/heat histogram (and into the list of the hottest objects, if it is one) and its id
+// is reused, so memory grows with the number of live objects, not with the number of allocations.
+//
+// insert() and retire() must be serialized by the caller; counter updates through at() are not
+// atomic, so two threads hitting one object at the same instant can lose a count.
+class object_table
+{
+public:
+  static const uint32_t NO_OBJECT = ~(uint32_t)0;
+
+  explicit object_table(size_t max_hottest = 50)
+      : num_ids(0), num_live(0), num_objects(0), max_hottest(max_hottest) {
+    chunks = (object_counts **)calloc(MAX_CHUNKS, sizeof(object_counts *));
+    histogram = (object_histogram *)calloc(1, sizeof(object_histogram));
+  }
+
+  ~object_table() {
+    for (size_t i = 0; i < MAX_CHUNKS && chunks[i] != NULL; i++) {
+      free(chunks[i]);
+    }
+    free(chunks);
+    free(histogram);
+  }
+
+  // Returns the id of a new object, or NO_OBJECT if the table is full
+  uint32_t insert(uint64_t size, uint32_t site, uint32_t flags) {
+    uint32_t id;
+    if (!free_ids.empty()) {
+      id = free_ids.back();
+      free_ids.pop_back();
+    } else {
+      if (num_ids == (uint64_t)MAX_CHUNKS * CHUNK_SIZE) {
+        return NO_OBJECT;
+      }
+      id = num_ids++;
+      if (chunks[id / CHUNK_SIZE] == NULL) {
+        chunks[id / CHUNK_SIZE] = (object_counts *)malloc(CHUNK_SIZE * sizeof(object_counts));
+      }
+    }
+
+    object_counts &o = at(id);
+    o.size = size;
+    o.site = site;
+    o.flags = flags;
+    clear_counts(o);
+    num_live++;
+    num_objects++;
+    return id;
+  }
+
+  object_counts &at(uint32_t id) { return chunks[id / CHUNK_SIZE][id % CHUNK_SIZE]; }
+
+  // Folds a freed object into the statistics and frees its id
+  void retire(uint32_t id) {
+    retire_counts(at(id));
+    free_ids.push_back(id);
+    num_live--;
+  }
+
+  // Folds every live object into the statistics, once, at exit
+  void retire_live() {
+    std::vector<bool> is_free = free_id_map();
+    for (uint32_t id = 0; id < num_ids; id++) {
+      if (!is_free[id]) {
+        retire_counts(at(id));
+      }
+    }
+  }
+
+  // Forgets all counts so far: the statistics of retired objects and the accesses of live ones
+  void reset() {
+    memset(histogram, 0, sizeof(object_histogram));
+    hottest.clear();
+    std::vector<bool> is_free = free_id_map();
+    for (uint32_t id = 0; id < num_ids; id++) {
+      if (!is_free[id]) {
+        clear_counts(at(id));
+      }
+    }
+    num_objects = num_live;
+  }
+
+  uint64_t live() const { return num_live; }
+  uint64_t objects() const { return num_objects; }
+  const object_histogram &stats() const { return *histogram; }
+
+  // The hottest retired objects, hottest first
+  std::vector<object_counts> hottest_objects() const {
+    std::vector<object_counts> result(hottest);
+    std::sort(result.begin(), result.end(), hotter);
+    return result;
+  }
+
+private:
+  static const uint32_t CHUNK_SIZE = 4096;
+  static const uint32_t MAX_CHUNKS = 1 << 18;  // a billion objects
+
+  object_counts **chunks;
+  uint32_t num_ids;
+  std::vector<uint32_t> free_ids;
+  uint64_t num_live;
+  uint64_t num_objects;
+
+  object_histogram *histogram;
+
+  // min-heap on accesses, so that the coldest of the hottest is the one to replace
+  size_t max_hottest;
+  std::vector<object_counts> hottest;
+
+  object_table(const object_table &);
+  object_table &operator=(const object_table &);
+
+  static void clear_counts(object_counts &o) {
+    o.reads = 0;
+    o.writes = 0;
+    o.misses = 0;
+    o.first_ms = object_counts::NEVER;
+    o.last_ms = object_counts::NEVER;
+  }
+
+  std::vector<bool> free_id_map() const {
+    std::vector<bool> is_free(num_ids);
+    for (size_t i = 0; i < free_ids.size(); i++) {
+      is_free[free_ids[i]] = true;
+    }
+    return is_free;
+  }
+
+  static bool hotter(const object_counts &a, const object_counts &b) {
+    return a.accesses() > b.accesses();
+  }
+
+  void retire_counts(const object_counts &o) {
+    histogram->add(o);
+
+    if (max_hottest == 0 || o.accesses() == 0) {
+      return;
+    }
+    if (hottest.size() < max_hottest) {
+      hottest.push_back(o);
+      std::push_heap(hottest.begin(), hottest.end(), hotter);
+    } else if (o.accesses() > hottest.front().accesses()) {
+      std::pop_heap(hottest.begin(), hottest.end(), hotter);
+      hottest.back() = o;
+      std::push_heap(hottest.begin(), hottest.end(), hotter);
+    }
+  }
+};
+
+#endif
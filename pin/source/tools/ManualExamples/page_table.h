@@ -0,0 +1,183 @@
+#ifndef PAGE_TABLE_H
+#define PAGE_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+// All four counters of a page live in one 32-byte slot, so a single access only touches one
+// (half) cache line no matter which counters it updates.
+struct page_counts
+{
+  uint64_t read_with_cache;
+  uint64_t read_without_cache;
+  uint64_t write_with_cache;
+  uint64_t write_without_cache;
+
+  page_counts &operator+=(const page_counts &other) {
+    read_with_cache += other.read_with_cache;
+    read_without_cache += other.read_without_cache;
+    write_with_cache += other.write_with_cache;
+    write_without_cache += other.write_without_cache;
+    return *this;
+  }
+};
+
+// Open-addressing hash table (linear probing) from page number to counters: page_counts, or any
+// other plain type with += (e.g. a single uint64_t for the write-backs of a page).
+//
+// Keys and counters are kept in two parallel arrays: probing walks the densely packed key array,
+// and only the matching slot of the counter array is touched. The table doubles whenever it becomes
+// half full, so the expected probe length stays close to one.
+//
+// Not thread-safe; every application thread owns its own table.
+template <class COUNTS>
+class page_table_of
+{
+public:
+  static const uint64_t EMPTY_PAGENO = ~(uint64_t)0;
+
+  page_table_of() : keys(NULL), counts(NULL), mask(0), num_used(0) {
+    allocate(INITIAL_CAPACITY);
+  }
+
+  ~page_table_of() {
+    free(keys);
+    free(counts);
+  }
+
+  // Returns the counters for pageno, inserting zeroed counters if the page has not been seen yet
+  COUNTS *lookup(uint64_t pageno) {
+    size_t i = hash(pageno) & mask;
+    while (true) {
+      if (keys[i] == pageno) {
+        return &counts[i];
+      }
+      if (keys[i] == EMPTY_PAGENO) {
+        break;
+      }
+      i = (i + 1) & mask;
+    }
+
+    if (2 * (num_used + 1) > capacity()) {
+      grow();
+      return lookup(pageno);
+    }
+
+    keys[i] = pageno;
+    num_used++;
+    return &counts[i];
+  }
+
+  // Returns the counters for pageno, or NULL if the page has not been seen
+  const COUNTS *find(uint64_t pageno) const {
+    size_t i = hash(pageno) & mask;
+    while (keys[i] != EMPTY_PAGENO) {
+      if (keys[i] == pageno) {
+        return &counts[i];
+      }
+      i = (i + 1) & mask;
+    }
+    return NULL;
+  }
+
+  // Adds every counter of other into this table
+  void merge(const page_table_of &other) {
+    merge_coarsened(other, 0);
+  }
+
+  // Adds every counter of other into this table under page number other_pageno >> shift, i.e. derives
+  // counts for pages 2^shift times larger
+  void merge_coarsened(const page_table_of &other, unsigned shift) {
+    for (size_t i = 0; i < other.capacity(); i++) {
+      if (!other.used(i)) {
+        continue;
+      }
+      *lookup(other.keys[i] >> shift) += other.counts[i];
+    }
+  }
+
+  // Exchanges the contents of two tables in O(1)
+  void swap(page_table_of &other) {
+    std::swap(keys, other.keys);
+    std::swap(counts, other.counts);
+    std::swap(mask, other.mask);
+    std::swap(num_used, other.num_used);
+  }
+
+  void clear() {
+    free(keys);
+    free(counts);
+    allocate(INITIAL_CAPACITY);
+  }
+
+  size_t size() const { return num_used; }
+  size_t capacity() const { return mask + 1; }
+
+  // Slot-level iteration: for (i = 0; i < capacity(); i++) if (used(i)) ...
+  bool used(size_t i) const { return keys[i] != EMPTY_PAGENO; }
+  uint64_t pageno_at(size_t i) const { return keys[i]; }
+  const COUNTS &counts_at(size_t i) const { return counts[i]; }
+
+private:
+  static const size_t INITIAL_CAPACITY = 1024;
+
+  uint64_t *keys;
+  COUNTS *counts;
+  size_t mask;
+  size_t num_used;
+
+  // page_table_of owns its arrays and is never copied
+  page_table_of(const page_table_of &);
+  page_table_of &operator=(const page_table_of &);
+
+  static size_t hash(uint64_t pageno) {
+    // Fibonacci hashing; the high bits are well mixed even for runs of consecutive page numbers
+    return (size_t)((pageno * 0x9E3779B97F4A7C15ULL) >> 32);
+  }
+
+  void allocate(size_t capacity) {
+    keys = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    memset(keys, 0xff, capacity * sizeof(uint64_t));
+    // align slots to their size where that is a power of two (32 bytes for page_counts), so that no
+    // slot straddles two cache lines
+    size_t alignment = std::max(sizeof(COUNTS) & -sizeof(COUNTS), sizeof(void *));
+    void *p = NULL;
+    if (posix_memalign(&p, alignment, capacity * sizeof(COUNTS)) != 0) {
+      abort();
+    }
+    counts = (COUNTS *)p;
+    memset(counts, 0, capacity * sizeof(COUNTS));
+    mask = capacity - 1;
+    num_used = 0;
+  }
+
+  void grow() {
+    uint64_t *old_keys = keys;
+    COUNTS *old_counts = counts;
+    size_t old_capacity = capacity();
+
+    allocate(2 * old_capacity);
+
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_keys[i] == EMPTY_PAGENO) {
+        continue;
+      }
+      size_t j = hash(old_keys[i]) & mask;
+      while (keys[j] != EMPTY_PAGENO) {
+        j = (j + 1) & mask;
+      }
+      keys[j] = old_keys[i];
+      counts[j] = old_counts[i];
+      num_used++;
+    }
+
+    free(old_keys);
+    free(old_counts);
+  }
+};
+
+typedef page_table_of<page_counts> page_table;
+
+#endif
@@ -5,227 +5,3509 @@
 #include <streambuf>
 #include <stdio.h>
 #include <syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "pin.H"
 #include <iostream>
 #include <inttypes.h>
 #include <map>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <cmath>
 #include "json.h"
+#include "page_table.h"
+#include "trace_format.h"
+#include "ip_table.h"
+#include "alloc_index.h"
+#include "object_table.h"
+#include "reuse_distance.h"
 
-// for some reason, the type CACHE_STATS is used in pin_cache.H even though it isn't typedef'd in that file, so we just typedef it here
-typedef UINT64 CACHE_STATS;
-#include "pin_cache.H"
+#include "cache_model.h"
+#include "cache_simulation.h"
+#include "coherence.h"
+#include "tiered_memory.h"
+#include "region_table.h"
+#include "heavy_hitters.h"
+#include "access_ring.h"
+#include "address_trace.h"
 
 FILE * trace;
 
+KNOB<string> KnobCounts(KNOB_MODE_WRITEONCE, "pintool", "counts", "both",
+    "which page counts to collect: 'cache' (after the simulated caches), 'no_cache' (every access) or 'both'");
+KNOB<string> KnobAccesses(KNOB_MODE_WRITEONCE, "pintool", "accesses", "all",
+    "which memory accesses to instrument: 'reads', 'writes' or 'all'");
+KNOB<string> KnobInstrument(KNOB_MODE_WRITEONCE, "pintool", "instrument", "ins",
+    "instrumentation granularity: 'ins' (one call per memory operand) or 'bbl' (coalesce consecutive same-line operands of a basic block)");
+KNOB<string> KnobFormat(KNOB_MODE_WRITEONCE, "pintool", "format", "binary",
+    "output format: 'binary' (see trace_format.h) or 'json'");
+KNOB<UINT32> KnobEpochMs(KNOB_MODE_WRITEONCE, "pintool", "epoch_ms", "0",
+    "start a new epoch every this many milliseconds and record per-epoch page counts (0 = off)");
+KNOB<UINT64> KnobEpochAccesses(KNOB_MODE_WRITEONCE, "pintool", "epoch_accesses", "0",
+    "start a new epoch in a thread after it made this many counted accesses (0 = off)");
+KNOB<BOOL> KnobStartTracing(KNOB_MODE_WRITEONCE, "pintool", "start_tracing", "1",
+    "instrument from the start; with 0, wait for a 'start' command on PINATRACE_PIPE");
+KNOB<UINT64> KnobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool", "sample_period", "0",
+    "periodic sampling: count only every Nth access of each thread and scale counts by N (needs -counts no_cache; 0 = off)");
+KNOB<UINT64> KnobSampleBurst(KNOB_MODE_WRITEONCE, "pintool", "sample_burst", "0",
+    "bursty sampling: run this many traces fully instrumented, then -sample_gap traces uninstrumented (0 = off)");
+KNOB<UINT64> KnobSampleGap(KNOB_MODE_WRITEONCE, "pintool", "sample_gap", "0",
+    "bursty sampling: number of uninstrumented traces between bursts");
+KNOB<UINT32> KnobSampleTopK(KNOB_MODE_WRITEONCE, "pintool", "sample_topk", "100",
+    "size of the hot set whose sampling error is reported at exit");
+KNOB<BOOL> KnobBuffer(KNOB_MODE_WRITEONCE, "pintool", "buffer", "0",
+    "batch memory references through a per-thread trace buffer instead of one analysis call per operand");
+KNOB<string> KnobGranularities(KNOB_MODE_WRITEONCE, "pintool", "granularities", "4K",
+    "comma-separated page sizes to count at: 'line', or a power of two of at least a cache line such as 4K, 2M, 1G (4 KB pages are always written)");
+KNOB<string> KnobIpReport(KNOB_MODE_WRITEONCE, "pintool", "ip_report", "",
+    "attribute memory traffic to the instructions that generate it and write a ranked, symbolized report to this file");
+KNOB<UINT32> KnobIpTopK(KNOB_MODE_WRITEONCE, "pintool", "ip_topk", "50",
+    "number of instructions and functions listed in the -ip_report report");
+KNOB<string> KnobAllocReport(KNOB_MODE_WRITEONCE, "pintool", "alloc_report", "",
+    "intercept malloc/calloc/realloc/free/mmap/munmap, attribute accesses to allocation sites and write per-site totals to this file");
+KNOB<string> KnobAllocHook(KNOB_MODE_APPEND, "pintool", "alloc_hook", "",
+    "custom allocator to intercept (needs -alloc_report): FUNCTION[,size=ARG][,ptr=ARG|ret][,class=ARG][,free=FUNCTION][,free_ptr=ARG], "
+    "e.g. slabs_alloc,size=0,class=1,free=slabs_free; ARGs are 0-based argument numbers");
+KNOB<string> KnobObjectReport(KNOB_MODE_WRITEONCE, "pintool", "object_report", "",
+    "count accesses per allocated object (needs -alloc_report) and write object size vs hotness distributions to this file");
+KNOB<UINT32> KnobObjectTopK(KNOB_MODE_WRITEONCE, "pintool", "object_topk", "50",
+    "number of hottest objects listed in the -object_report report");
+KNOB<string> KnobReuseReport(KNOB_MODE_WRITEONCE, "pintool", "reuse_report", "",
+    "compute sampled reuse distances of the cache lines accessed and write the global histogram to this file "
+    "(per-page histograms go to the binary trace)");
+KNOB<UINT32> KnobReuseSample(KNOB_MODE_WRITEONCE, "pintool", "reuse_sample", "100",
+    "initially compute the reuse distances of one in this many cache lines (1 = all)");
+KNOB<UINT64> KnobReuseLines(KNOB_MODE_WRITEONCE, "pintool", "reuse_lines", "65536",
+    "maximum number of sampled lines tracked at once; the sampling rate drops when more are sampled");
+KNOB<UINT64> KnobReusePages(KNOB_MODE_WRITEONCE, "pintool", "reuse_pages", "32768",
+    "maximum number of pages with a reuse histogram in the binary trace; a uniform sample of the pages is kept when more are accessed");
+KNOB<string> KnobMrc(KNOB_MODE_WRITEONCE, "pintool", "mrc", "",
+    "write miss-ratio curves of cache and page-tier sizes from -mrc_min to -mrc_max, derived from sampled reuse distances "
+    "(see -reuse_sample, -reuse_lines), to this file and to the binary trace");
+KNOB<string> KnobMrcMin(KNOB_MODE_WRITEONCE, "pintool", "mrc_min", "1M",
+    "smallest size on the miss-ratio curves");
+KNOB<string> KnobMrcMax(KNOB_MODE_WRITEONCE, "pintool", "mrc_max", "64G",
+    "largest size on the miss-ratio curves");
+KNOB<UINT32> KnobMrcSteps(KNOB_MODE_WRITEONCE, "pintool", "mrc_steps", "4",
+    "sizes per doubling on the miss-ratio curves");
+KNOB<string> KnobCacheConfig(KNOB_MODE_WRITEONCE, "pintool", "cache_config", "default",
+    "simulated cache hierarchy: 'default' (64 KB direct-mapped L1, 8 MB 16-way L3), 'sysfs' (this host's caches) or a config file (see cache_model.h)");
+KNOB<string> KnobTierReport(KNOB_MODE_WRITEONCE, "pintool", "tier_report", "",
+    "simulate a hybrid DRAM/NVM memory fed by the traffic past the simulated caches and write the stall time, migration traffic "
+    "and energy of each placement policy to this file (see tiered_memory.h)");
+KNOB<string> KnobDramSize(KNOB_MODE_WRITEONCE, "pintool", "dram_size", "1G",
+    "DRAM capacity of the hybrid memory; NVM holds the rest");
+KNOB<UINT64> KnobTierEpoch(KNOB_MODE_WRITEONCE, "pintool", "tier_epoch", "1000000",
+    "number of memory accesses between the migration decisions of the epoch_migration policy");
+KNOB<string> KnobTierParams(KNOB_MODE_WRITEONCE, "pintool", "tier_params", "",
+    "latencies (ns) and energies (pJ) of a cache-line access to each tier, over the defaults, "
+    "e.g. nvm_read_ns=300,nvm_write_ns=1000,nvm_read_pj=1265,nvm_write_pj=8612 (also dram_read_ns, dram_write_ns, dram_read_pj, dram_write_pj)");
+KNOB<UINT32> KnobCores(KNOB_MODE_WRITEONCE, "pintool", "cores", "0",
+    "simulate this many cores (at most 64), each with its own copy of the private cache levels, kept coherent by a MESI directory "
+    "(0 = every thread has its own private levels and there is no coherence)");
+KNOB<string> KnobCoreMap(KNOB_MODE_WRITEONCE, "pintool", "core_map", "round_robin",
+    "with -cores: 'round_robin' (thread i runs on core i % cores) or 'affinity' (round robin until a thread is pinned with sched_setaffinity)");
+KNOB<string> KnobRegions(KNOB_MODE_WRITEONCE, "pintool", "regions", "",
+    "track the application's memory regions (images, brk heap, mmap'ed memory), write them to this file, "
+    "and map every page of the trace to (region, offset in region) so that runs can be compared despite ASLR");
+KNOB<string> KnobCounters(KNOB_MODE_WRITEONCE, "pintool", "counters", "exact",
+    "'exact' (count every page) or 'sketch' (fixed-size Count-Min sketch and top-k table per thread; "
+    "the trace only holds the -sketch_topk hottest pages, with estimated counts)");
+KNOB<UINT32> KnobSketchWidth(KNOB_MODE_WRITEONCE, "pintool", "sketch_width", "65536",
+    "with -counters sketch: cells per sketch row (a power of two, 8 MB per thread at the default); each page's count "
+    "overestimates by at most e / width of the total, and a wider sketch finds more of the truly hottest pages (see heavy_hitters.h)");
+KNOB<UINT32> KnobSketchDepth(KNOB_MODE_WRITEONCE, "pintool", "sketch_depth", "4",
+    "with -counters sketch: sketch rows; each page's count exceeds its bound with probability exp(-depth)");
+KNOB<UINT32> KnobSketchTopK(KNOB_MODE_WRITEONCE, "pintool", "sketch_topk", "4096",
+    "with -counters sketch: pages in the top-k table of every thread, and in the trace");
+KNOB<string> KnobStream(KNOB_MODE_WRITEONCE, "pintool", "stream", "",
+    "stream every access through this shared-memory segment (e.g. /dev/shm/pinatrace) to stream_consumer, "
+    "which does the counting and writes the trace, instead of analyzing it in the application's threads");
+KNOB<UINT32> KnobStreamRings(KNOB_MODE_WRITEONCE, "pintool", "stream_rings", "64",
+    "with -stream: rings in the segment, one per live thread; the accesses of threads beyond that are dropped");
+KNOB<UINT32> KnobStreamCapacity(KNOB_MODE_WRITEONCE, "pintool", "stream_capacity", "65536",
+    "with -stream: 16-byte records per ring (a power of two)");
+KNOB<string> KnobStreamFull(KNOB_MODE_WRITEONCE, "pintool", "stream_full", "block",
+    "with -stream: when a ring is full, 'block' (wait for the consumer) or 'drop' (discard and count the records)");
+KNOB<string> KnobCapture(KNOB_MODE_WRITEONCE, "pintool", "capture", "",
+    "write every access of every thread (instruction, address, size, read/write, time) compressed to "
+    "PREFIX.<thread>.atrace (see address_trace.h) for offline replay, instead of analyzing it");
+KNOB<UINT32> KnobCaptureChunk(KNOB_MODE_WRITEONCE, "pintool", "capture_chunk", "65536",
+    "with -capture: accesses per chunk, the unit of compression and of seeking (a multiple of 4096)");
+KNOB<UINT32> KnobCaptureThreads(KNOB_MODE_WRITEONCE, "pintool", "capture_threads", "2",
+    "with -capture: internal threads that compress and write the chunks");
+KNOB<UINT32> KnobCaptureQueue(KNOB_MODE_WRITEONCE, "pintool", "capture_queue", "64",
+    "with -capture: full chunks waiting for compression before the application's threads wait too");
+
 PIN_LOCK lock;
 
-// cat /sys/devices/system/cpu/cpu0/cache to get cache stats
-typedef CACHE_DIRECT_MAPPED(KILO, CACHE_ALLOC::STORE_ALLOCATE) L1Cache;
-typedef CACHE_ROUND_ROBIN(8192, 16, CACHE_ALLOC::STORE_ALLOCATE) L3Cache;
+// The simulated hierarchy (see cache_model.h): every application thread simulates its own copy of
+// the private levels, so those lookups need no locking; the shared levels exist once. With an inclusive
+// config, inclusion is kept among the private levels and among the shared levels, but a shared-level
+// eviction does not reach into other threads' private levels. With -cores, the private levels belong
+// to simulated cores instead (see "Simulated cores" below).
+cache_config caches;
+UINT32 cache_line_size = 64;
+UINT32 cache_line_shift = 6;
+
+// Reuse distances
+// ===============
+//
+// With -reuse_report or -mrc, the line accesses of all threads go through one reuse_distance_engine
+// (see reuse_distance.h), before any cache. Threads check without a lock whether a line is sampled
+// and stage the sampled ones; reuse_lock is only taken to feed a full staging buffer to the engine,
+// so the threads' accesses are interleaved REUSE_STAGING accesses at a time. Distances are kept in a
+// global histogram and, in whole octaves, per 4 KB page for at most -reuse_pages pages.
+//
+// With -mrc, the accesses also go through a second engine that computes distances between 4 KB
+// pages, in pages, for the miss-ratio curves of page-granularity tiers (see WriteMissRatioCurves()).
+// Its sampled accesses are staged per thread in the same way, and fed to it under page_stream_lock.
+bool reuse_tracking = false;
+PIN_LOCK reuse_lock;
+reuse_distance_engine *reuse_engine;
+reuse_histogram reuse_distances;
+page_reuse_table *page_reuses;
+
+// A thread's sampled accesses waiting for the engine
+const UINT32 REUSE_STAGING = 256;
+
+struct reuse_staging
+{
+  reuse_staging() : num(0) {}
+
+  UINT64 keys[REUSE_STAGING];  // lines or pages
+  UINT64 counts[REUSE_STAGING];
+  UINT32 num;
+};
+
+PIN_LOCK page_stream_lock;
+reuse_distance_engine *page_stream_engine;
+reuse_histogram page_stream_distances;
+
+// Cache sizes of the miss-ratio curves, in bytes
+std::vector<UINT64> mrc_sizes;
+
+// Adds an access at distance (-1 for a first access) and count - 1 accesses at distance 0
+void add_reuse(reuse_histogram &histogram, double distance, double weight, UINT64 count)
+{
+    if (distance < 0) {
+      histogram.add_cold(weight);
+    } else {
+      histogram.add(distance, weight);
+    }
+    if (count > 1) {
+      histogram.add(0, (count - 1) * weight);
+    }
+}
+
+VOID FlushReuse(reuse_staging &staged)
+{
+    PIN_GetLock(&reuse_lock, 0);
+    for (UINT32 i = 0; i < staged.num; i++) {
+      UINT64 line = staged.keys[i], count = staged.counts[i];
+      double weight = 1 / reuse_engine->rate();
+      double distance = reuse_engine->access(line);
+      if (distance == reuse_distance_engine::NOT_SAMPLED) {
+        continue;
+      }
+      add_reuse(reuse_distances, distance, weight, count);
+      page_reuse *page = page_reuses->lookup(line >> (TRACE_PAGE_SHIFT - cache_line_shift));
+      if (page != NULL) {
+        page->weights[page_reuse::bucket(distance)] += weight;
+        page->weights[page_reuse::bucket(0)] += (count - 1) * weight;
+      }
+    }
+    PIN_ReleaseLock(&reuse_lock);
+    staged.num = 0;
+}
+
+// count > 1 is a coalesced group of accesses to one line, which reuses it at distance 0 after the first
+VOID RecordReuse(reuse_staging &staged, VOID *addr, UINT64 count)
+{
+    UINT64 line = ((UINT64)addr) >> cache_line_shift;
+    if (!reuse_engine->sampled(line)) {
+      return;
+    }
+
+    staged.keys[staged.num] = line;
+    staged.counts[staged.num] = count;
+    if (++staged.num == REUSE_STAGING) {
+      FlushReuse(staged);
+    }
+}
+
+VOID FlushPageReuse(reuse_staging &staged)
+{
+    PIN_GetLock(&page_stream_lock, 0);
+    for (UINT32 i = 0; i < staged.num; i++) {
+      double weight = 1 / page_stream_engine->rate();
+      double distance = page_stream_engine->access(staged.keys[i]);
+      if (distance != reuse_distance_engine::NOT_SAMPLED) {
+        add_reuse(page_stream_distances, distance, weight, staged.counts[i]);
+      }
+    }
+    PIN_ReleaseLock(&page_stream_lock);
+    staged.num = 0;
+}
+
+VOID RecordPageReuse(reuse_staging &staged, VOID *addr, UINT64 count)
+{
+    UINT64 pageno = ((UINT64)addr) >> TRACE_PAGE_SHIFT;
+    if (!page_stream_engine->sampled(pageno)) {
+      return;
+    }
+
+    staged.keys[staged.num] = pageno;
+    staged.counts[staged.num] = count;
+    if (++staged.num == REUSE_STAGING) {
+      FlushPageReuse(staged);
+    }
+}
+
+// The shared levels, striped over Pin locks (cache_simulation.h)
+struct pin_locks
+{
+    typedef PIN_LOCK lock_type;
+    static void init(PIN_LOCK *lock) { PIN_InitLock(lock); }
+    static void acquire(PIN_LOCK *lock) { PIN_GetLock(lock, 0); }
+    static void release(PIN_LOCK *lock) { PIN_ReleaseLock(lock); }
+};
+
+striped_shared_caches<pin_locks> shared_caches;
+
+// Simulated cores
+// ===============
+//
+// With -cores, threads are mapped to simulated cores and the private levels belong to the cores.
+// The threads of one core serialize on its lock, which is uncontended as long as there are no more
+// threads than cores. A MESI-style directory (coherence.h) tracks the lines in each core's private
+// levels; it is striped like the shared levels, and a line's entry is guarded by the same stripe
+// lock, so coherence adds no global lock either.
+//
+// A core's request never touches another core's caches directly (that would need its lock while
+// holding a stripe lock, the reverse of the access path's order). The directory's invalidations and
+// downgrades are posted to the other cores' inboxes instead and applied at their next access, which
+// is when they could first observe them.
+//
+// The directory learns about lines leaving a core from evictions out of the core's last private
+// level, so it is exact for single-level or inclusive private hierarchies.
+
+struct simulated_core
+{
+    PIN_LOCK lock;
+    cache_hierarchy caches;
+
+    // messages from other cores: line << 1 to invalidate the line, line << 1 | 1 to downgrade it
+    PIN_LOCK inbox_lock;
+    std::vector<UINT64> inbox;
+    volatile UINT32 inbox_size;
+};
+
+std::vector<simulated_core *> cores;
+coherence_directory *directories;  // one per stripe of shared_caches
+
+VOID PostCoherenceMessage(UINT32 core, UINT64 message)
+{
+    simulated_core *c = cores[core];
+    PIN_GetLock(&c->inbox_lock, 0);
+    c->inbox.push_back(message);
+    c->inbox_size = c->inbox.size();
+    PIN_ReleaseLock(&c->inbox_lock);
+}
+
+// Line moved out of core's private levels: the directory forgets the copy, and a dirty line goes on
+// to the shared levels (lines written back to memory are appended to *written_back)
+VOID LeaveCore(UINT32 core, UINT64 line, bool dirty, std::vector<uint64_t> *written_back)
+{
+    UINT32 stripe = shared_caches.stripe(line);
+    PIN_GetLock(shared_caches.lock(stripe), 0);
+    directories[stripe].drop(line, core);
+    if (dirty) {
+      if (shared_caches.num_levels() == 0) {
+        written_back->push_back(line);
+      } else {
+        shared_caches.levels().write_back(line, written_back);
+      }
+    }
+    PIN_ReleaseLock(shared_caches.lock(stripe));
+}
+
+// Hybrid memory
+// =============
+//
+// With -tier_report, the line fills and write-backs that get past the simulated caches also drive a
+// DRAM/NVM placement simulator (tiered_memory.h). It sees the traffic of all threads, so each thread
+// queues its share and hands it over under tier_lock MEMORY_ACCESS_BATCH accesses at a time.
+//
+// The simulator therefore sees the threads interleaved in runs of up to MEMORY_ACCESS_BATCH accesses,
+// not in the order the accesses happened. With several threads this skews the time-dependent
+// policies: first_touch gives DRAM to the pages of whichever thread's batch arrives first rather
+// than to the pages touched first, and an epoch_migration epoch shorter than a few batches per
+// thread sees the hot pages of only some threads. Single-threaded runs are unaffected; -tier_epoch
+// should be large compared to MEMORY_ACCESS_BATCH times the number of threads.
+
+const size_t MEMORY_ACCESS_BATCH = 4096;
+tier_simulator *tiers = NULL;
+tier_params tier_config;
+UINT64 dram_bytes;
+PIN_LOCK tier_lock;
+
+// Feeds accesses (line << 1 | is_write) to the simulator and empties accesses
+VOID SimulateMemoryAccesses(std::vector<UINT64> &accesses)
+{
+    PIN_GetLock(&tier_lock, 0);
+    for (size_t i = 0; i < accesses.size(); i++) {
+      tiers->access((accesses[i] >> 1) >> (TRACE_PAGE_SHIFT - cache_line_shift), accesses[i] & 1);
+    }
+    PIN_ReleaseLock(&tier_lock);
+    accesses.clear();
+}
+
+// Regions
+// =======
+//
+// With -regions, mmap, mremap and brk calls and image loads build a region_table (region_table.h).
+// Region syscalls are recorded at entry and applied at exit under region_lock, once their result
+// is known. munmap needs no handling: the table keeps unmapped memory until something else is
+// mapped there. At exit, every page of the trace is mapped to its region and offset.
+
+bool region_tracking = false;
+PIN_LOCK region_lock;
+region_table regions;
+
+// Granularities
+// =============
+//
+// Accesses are counted at the finest granularity requested (count_shift: page number = address >>
+// count_shift). Every coarser granularity is derived at output time from the next finer one (see
+// write_page_table_sections()), so extra granularities cost nothing while the application runs.
+std::vector<UINT32> granularity_shifts;  // ascending, always including TRACE_PAGE_SHIFT
+UINT32 count_shift = TRACE_PAGE_SHIFT;
+
+// Sketched counts
+// ===============
+//
+// With -counters sketch, threads count pages in a count_min_sketch and keep the candidates for the
+// hottest pages in a space_saving table (heavy_hitters.h) instead of their page tables, so the
+// tool's memory does not grow with the footprint of the application. Pages are ranked by accesses,
+// or by cache misses with -counts cache. At exit the sketches are merged and the -sketch_topk pages
+// with the highest merged estimates become the counts of thread 0 (see HeavyHitters()).
+bool sketch_counting = false;
+
+// Streaming
+// =========
+//
+// With -stream, the analysis routines only copy every access into the thread's ring of a shared
+// segment (access_ring.h); the consumer process (stream_consumer.cpp) drains the rings and does the
+// counting and cache simulation, so the application's threads neither run the analysis nor contend
+// on its locks. Threads claim a ring when they start and give it back when they exit. The tool
+// itself keeps no counts and writes no trace; the consumer does.
+access_stream *stream = NULL;
+bool stream_blocking = true;
+
+// Capture
+// =======
+//
+// With -capture, every thread writes its accesses to its own file (address_trace.h) instead of
+// analyzing them. The analysis routine only appends a raw_access to the thread's chunk in progress;
+// full chunks are queued, and the -capture_threads internal threads encode, compress and write
+// them. A thread only waits for them when -capture_queue chunks are already queued. Chunks of one
+// thread may be compressed out of order; each file puts them back in order before writing.
+const UINT32 CAPTURE_TIMESTAMP_PERIOD = 4096;  // records between clock reads
+
+struct capture_file
+{
+  address_trace_writer writer;
+  PIN_LOCK lock;
+  UINT64 next_sequence;                          // of the next chunk to write
+  std::map<UINT64, address_chunk *> compressed;  // chunks compressed ahead of it
+};
+
+struct capture_chunk
+{
+  capture_file *file;
+  UINT64 sequence;
+  raw_access *records;
+  UINT32 count;
+  UINT64 first_record;
+  UINT64 first_timestamp_us;
+};
+
+// A thread's chunk in progress
+struct capture_thread
+{
+  capture_file *file;
+  raw_access *records;
+  UINT32 count;       // records, timestamp records included
+  UINT32 timestamps;  // timestamp records
+  UINT64 sequence;
+  UINT64 first_record;
+  UINT64 first_timestamp_us;
+  UINT64 timestamp_us;  // of the last timestamp record
+};
+
+bool capturing = false;
+UINT32 capture_chunk_records = 0;
+
+// Guards everything below
+PIN_LOCK capture_lock;
+std::deque<capture_chunk> capture_queue;
+std::vector<raw_access *> capture_free_chunks;
+std::vector<capture_file *> capture_files;
+UINT32 capture_threads_running = 0;
+UINT64 capture_stalls = 0;
+
+// With -ip_report, every thread also keeps an ip_table of the instructions it executed
+bool ip_attribution = false;
+
+// Allocation sites
+// ================
+//
+// With -alloc_report, the tool intercepts the allocator (see ImageLoad()) and keeps every live
+// allocation in an alloc_index, tagged with the id of its allocation site: the call stack that
+// allocated it, identified by a hash of its return addresses. Every counted access is attributed to
+// the site of the allocation it falls in. The index is shared and guarded by alloc_index_lock; each
+// thread caches its last lookup (an allocation, or the gap between two), so runs of accesses to one
+// object or to the stack take no lock until the next allocation or free anywhere.
+bool alloc_attribution = false;
+PIN_RWMUTEX alloc_index_lock;
+alloc_index allocations;
+
+const INT32 ALLOC_SITE_FRAMES = 8;
+
+struct alloc_site
+{
+    VOID *frames[ALLOC_SITE_FRAMES];
+    INT32 num_frames;
+    UINT64 allocations;
+    UINT64 bytes;
+};
+
+// With -object_report, every allocation (and custom allocation) also gets a record in an
+// object_table, whose id is kept next to it in the index. Accesses are counted per object, and per
+// 4 KB page for the accesses that fall in objects, so that the report can compare placing the hot
+// data per object with placing it per page. Insertions and retirements happen under the write lock
+// of alloc_index_lock.
+bool object_heat = false;
+object_table *objects;
+
+// Accesses to objects are timestamped with a per-thread clock that is read every
+// OBJECT_CLOCK_PERIOD object accesses
+const UINT32 OBJECT_CLOCK_PERIOD = 256;
+
+// Sites by id, and ids by stack hash
+PIN_LOCK alloc_sites_lock;
+std::vector<alloc_site> alloc_sites;
+std::map<UINT64, UINT32> alloc_site_ids;
+
+struct alloc_site_counts
+{
+    UINT64 reads;
+    UINT64 writes;
+    UINT64 misses;
+};
+
+// Custom allocators (-alloc_hook), such as memcached's slab allocator, hand out objects from memory
+// that malloc or mmap allocated, so their objects live in a second alloc_index layered on top of the
+// first (also guarded by alloc_index_lock). Each hook defines allocation classes: one, or one per value
+// of its class argument (e.g. the slab class id). Accesses to a class's objects are counted per class,
+// both in total and per page.
+struct alloc_hook
+{
+    std::string function;
+    INT32 size_arg;       // -1: objects have no known size and are recorded as one byte
+    INT32 ptr_arg;        // -1: the object is the return value
+    INT32 class_arg;      // -1: the hook is a single class
+    std::string free_function;
+    INT32 free_ptr_arg;
+};
+
+struct alloc_class
+{
+    std::string name;
+    UINT64 allocations;
+    UINT64 bytes;
+};
+
+std::vector<alloc_hook> alloc_hooks;
+alloc_index custom_allocations;
+
+// Classes by id, and ids by (hook, class argument); guarded by alloc_sites_lock
+std::vector<alloc_class> alloc_classes;
+std::map<std::pair<UINT32, UINT64>, UINT32> alloc_class_ids;
+
+// A hooked allocation whose result is not known yet
+struct pending_custom_alloc
+{
+    UINT64 size;
+    UINT32 class_id;
+    ADDRINT sp;  // stack pointer at entry, which the hook's exit must match
+};
+
+// Epoch mode
+// ==========
+//
+// With -epoch_ms, the epoch thread bumps current_epoch periodically. With -epoch_accesses, every
+// thread counts its own epochs. Either way an application thread notices on its next counted access
+// that its epoch is over, moves its page table onto its retired list (an O(1) swap) and continues
+// with an empty one. The epoch thread collects retired tables, appends them to the trace as epoch
+// sections and adds them into the thread's run totals. Application threads are never stopped.
+enum epoch_mode_t { EPOCHS_OFF, EPOCHS_BY_TIME, EPOCHS_BY_ACCESSES };
+
+epoch_mode_t epoch_mode = EPOCHS_OFF;
+volatile UINT32 current_epoch = 0;
+
+struct timespec start_time;
+
+UINT64 elapsed_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) * 1000 + (now.tv_nsec - start_time.tv_nsec) / 1000000;
+}
+
+UINT64 elapsed_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) * 1000000 + (now.tv_nsec - start_time.tv_nsec) / 1000;
+}
+
+struct retired_epoch
+{
+    UINT32 epoch;
+    UINT64 timestamp_ms;
+    page_table *pages;
+};
+
+struct thread_data
+{
+public:
+  thread_data(UINT32 index) : index(index), epoch(current_epoch), accesses_left_in_epoch(KnobEpochAccesses),
+      core(index % (cores.empty() ? 1 : cores.size())), next_core(core), syscall_number(~(ADDRINT)0),
+      object_clock_ms(0), object_clock_countdown(0) {
+    PIN_InitLock(&retired_lock);
+    for (size_t i = 0; i < caches.levels.size() && cores.empty(); i++) {
+      if (!caches.levels[i].shared) {
+        private_caches.add_level(caches.levels[i]);
+      }
+    }
+    private_caches.set_inclusive(caches.inclusive);
+    sketch = sketch_counting ? new count_min_sketch(KnobSketchWidth.Value(), KnobSketchDepth.Value()) : NULL;
+    hot_pages = sketch_counting ? new space_saving(KnobSketchTopK.Value()) : NULL;
+    producer = stream != NULL ? new ring_producer(stream, stream_blocking) : NULL;
+    capture = NULL;
+  }
+  cache_hierarchy private_caches;
+  page_table pages;
+  ip_table ips;
+
+  // With -counters sketch: the thread's counts, in place of pages
+  count_min_sketch *sketch;
+  space_saving *hot_pages;
+
+  // With -stream: the thread's ring, in place of all of the above
+  ring_producer *producer;
+
+  // With -capture: the thread's chunk in progress, likewise
+  capture_thread *capture;
+
+  // Write-backs and coherence events per page (at count_shift), attributed to the thread whose access
+  // caused them; and the lines the current access evicted from the private and the shared levels
+  page_table_of<line_event_counts> line_events;
+  std::vector<uint64_t> private_write_backs;
+  std::vector<uint64_t> private_drops;
+  std::vector<uint64_t> memory_write_backs;
+
+  // Memory accesses not yet handed to the hybrid memory simulator
+  std::vector<UINT64> memory_accesses;
+
+  // position in all_thread_data, used as the thread number in the output
+  UINT32 index;
+
+  // Epoch mode: epoch that pages belongs to, finished epochs waiting for the epoch thread, and the
+  // sum of all collected epochs (only touched by the epoch thread and Fini())
+  UINT32 epoch;
+  UINT64 accesses_left_in_epoch;
+  PIN_LOCK retired_lock;
+  std::vector<retired_epoch> retired;
+  page_table totals;
+
+  // With -cores: the simulated core the thread runs on, the one it moves to at its next access
+  // (set by other threads' sched_setaffinity calls), and its OS thread id
+  UINT32 core;
+  volatile UINT32 next_core;
+  OS_THREAD_ID os_tid;
+
+  // With -regions: the number and arguments of the thread's system call in progress
+  ADDRINT syscall_number;
+  ADDRINT syscall_args[6];
+
+  // Allocation sites: accesses per site id, the last alloc_index lookup, and the outermost allocator
+  // call in progress
+  std::vector<alloc_site_counts> sites;
+  alloc_index_cache alloc_cache;
+  allocator_call alloc_call;
+
+  // Custom allocation classes: accesses per class id, in total and per page, the last lookup in
+  // custom_allocations, and the hooked calls in progress, innermost last (hooks may nest, e.g. an
+  // item allocator calling a slab allocator)
+  std::vector<alloc_site_counts> classes;
+  std::vector<page_table *> class_pages;
+  alloc_index_cache custom_cache;
+  std::vector<pending_custom_alloc> custom_pending;
+
+  // With -reuse_report or -mrc: sampled line accesses not yet fed to reuse_engine, and with -mrc,
+  // sampled page accesses not yet fed to page_stream_engine
+  reuse_staging reuse_staged;
+  reuse_staging page_reuse_staged;
+
+  // Objects: accesses to objects per 4 KB page, and the clock for their timestamps
+  page_table object_pages;
+  UINT32 object_clock_ms;
+  UINT32 object_clock_countdown;
+
+  // Counts of the whole run so far; only valid once the application threads are done
+  const page_table &run_totals() const {
+    return epoch_mode == EPOCHS_OFF ? pages : totals;
+  }
+
+  void retire_epoch(UINT32 next_epoch) {
+    retired_epoch r;
+    r.epoch = epoch;
+    r.timestamp_ms = elapsed_ms();
+    r.pages = new page_table;
+    r.pages->swap(pages);
+
+    PIN_GetLock(&retired_lock, 0);
+    retired.push_back(r);
+    PIN_ReleaseLock(&retired_lock);
+
+    epoch = next_epoch;
+  }
+
+  // Page counters to update for one access, starting a new epoch first if the current one is over
+  page_counts *counts_for(uint64_t pageno) {
+    if (epoch_mode == EPOCHS_BY_TIME) {
+      if (epoch != current_epoch) {
+        retire_epoch(current_epoch);
+      }
+    } else if (epoch_mode == EPOCHS_BY_ACCESSES) {
+      if (--accesses_left_in_epoch == 0) {
+        retire_epoch(epoch + 1);
+        accesses_left_in_epoch = KnobEpochAccesses;
+      }
+    }
+    return pages.lookup(pageno);
+  }
+
+  // Simulates the access through the private levels and, if they all miss, the shared levels.
+  // Returns true if any level hit. A store dirties its line in the first level; the dirty lines this
+  // pushes out of the private levels go on to the shared ones, and those out of the last level are
+  // counted as write-backs.
+  bool access_cache(ADDRINT addr, bool is_write) {
+    UINT64 line = addr >> cache_line_shift;
+    bool hit;
+    if (!cores.empty()) {
+      hit = access_core_caches(line, is_write);
+    } else {
+      hit = access_private_and_shared(private_caches, shared_caches, line, is_write, &private_write_backs, &memory_write_backs);
+      if (!memory_write_backs.empty()) {
+        count_write_backs(memory_write_backs);
+      }
+    }
+
+    if (tiers != NULL && !hit) {
+      record_memory_access(line, false);
+    }
+    return hit;
+  }
+
+  // Counts lines written back to memory and empties lines
+  void count_write_backs(std::vector<uint64_t> &lines) {
+    if (tiers != NULL) {
+      for (size_t i = 0; i < lines.size(); i++) {
+        record_memory_access(lines[i], true);
+      }
+    }
+    add_write_backs(line_events, lines, cache_line_shift, count_shift);
+  }
+
+  // Queues a line fill or write-back for the hybrid memory simulator, which takes them in batches
+  void record_memory_access(UINT64 line, bool is_write) {
+    memory_accesses.push_back(line << 1 | is_write);
+    if (memory_accesses.size() == MEMORY_ACCESS_BATCH) {
+      SimulateMemoryAccesses(memory_accesses);
+    }
+  }
+
+  line_event_counts *line_events_for(UINT64 line) {
+    return line_events.lookup((line << cache_line_shift) >> count_shift);
+  }
+
+  // access_cache() with -cores: the private levels of the thread's core, kept coherent with the
+  // other cores' through the directory, then the shared levels. A miss, or a store to a line that is
+  // not already dirty in the first level (and so maybe shared), goes to the directory.
+  bool access_core_caches(UINT64 line, bool is_write) {
+    core = next_core;
+    simulated_core *c = cores[core];
+    PIN_GetLock(&c->lock, 0);
+    if (c->inbox_size != 0) {
+      apply_coherence_messages(c);
+    }
+
+    bool exclusive = is_write && c->caches.dirty_in_first_level(line);
+    bool private_hit = c->caches.access(line, is_write, &private_write_backs, &private_drops) >= 0;
+    bool hit = private_hit;
+
+    if (!private_hit || (is_write && !exclusive)) {
+      UINT32 stripe = shared_caches.stripe(line);
+      coherence_actions actions;
+      PIN_GetLock(shared_caches.lock(stripe), 0);
+      if (is_write) {
+        directories[stripe].write(line, core, &actions);
+      } else {
+        directories[stripe].read(line, core, &actions);
+      }
+      for (uint64_t others = actions.invalidate; others != 0; others &= others - 1) {
+        PostCoherenceMessage(__builtin_ctzll(others), line << 1);
+      }
+      if (actions.downgrade != coherence_directory::NO_CORE) {
+        PostCoherenceMessage(actions.downgrade, line << 1 | 1);
+      }
+      if (!private_hit && shared_caches.num_levels() != 0) {
+        hit = shared_caches.levels().access(line, false, &memory_write_backs) >= 0;
+      }
+      PIN_ReleaseLock(shared_caches.lock(stripe));
+
+      if (actions.invalidate != 0) {
+        line_events_for(line)->invalidations += __builtin_popcountll(actions.invalidate);
+      }
+      if (!private_hit && actions.coherence_miss) {
+        line_events_for(line)->coherence_misses++;
+      }
+    }
+
+    for (size_t i = 0; i < private_write_backs.size(); i++) {
+      LeaveCore(core, private_write_backs[i], true, &memory_write_backs);
+    }
+    private_write_backs.clear();
+    for (size_t i = 0; i < private_drops.size(); i++) {
+      LeaveCore(core, private_drops[i], false, &memory_write_backs);
+    }
+    private_drops.clear();
+    PIN_ReleaseLock(&c->lock);
+
+    if (!memory_write_backs.empty()) {
+      count_write_backs(memory_write_backs);
+    }
+    return hit;
+  }
+
+  // Applies the invalidations and downgrades other cores posted to c, with c's lock held. The
+  // directory already accounts for them. An invalidated dirty copy is handed to the writer, so only
+  // a downgraded one is written back to the shared levels.
+  void apply_coherence_messages(simulated_core *c) {
+    std::vector<UINT64> messages;
+    PIN_GetLock(&c->inbox_lock, 0);
+    messages.swap(c->inbox);
+    c->inbox_size = 0;
+    PIN_ReleaseLock(&c->inbox_lock);
+
+    for (size_t i = 0; i < messages.size(); i++) {
+      UINT64 line = messages[i] >> 1;
+      if ((messages[i] & 1) == 0) {
+        c->caches.invalidate(line);
+      } else if (c->caches.clean(line)) {
+        shared_caches.write_back(line, &memory_write_backs);
+      }
+    }
+  }
+
+  // Attributes count accesses to ip (see ip_table.h)
+  void record_ip(void *ip, void *addr, bool cache_hit, uint64_t count) {
+    ip_counts *counts = ips.lookup((uint64_t)ip);
+    counts->accesses += count;
+    counts->misses += !cache_hit;
+    counts->add_page(((uint64_t)addr) >> TRACE_PAGE_SHIFT, count);
+  }
+
+  // Site (or class) of the allocation in index that addr falls in, or alloc_index::NO_SITE; sets
+  // *object to its object
+  static uint32_t find_allocation(const alloc_index &index, alloc_index_cache &cache, void *addr, uint32_t *object) {
+    uint32_t site;
+    if (!cache.lookup(index, (uint64_t)addr, &site, object)) {
+      PIN_RWMutexReadLock(&alloc_index_lock);
+      cache.version = index.version;
+      site = cache.site = index.find((uint64_t)addr, &cache.lo, &cache.hi, &cache.object);
+      *object = cache.object;
+      PIN_RWMutexUnlock(&alloc_index_lock);
+    }
+    return site;
+  }
+
+  static void count_access(std::vector<alloc_site_counts> &all_counts, uint32_t id, bool is_write, bool miss, uint64_t count) {
+    if (id >= all_counts.size()) {
+      all_counts.resize(id + 1);
+    }
+    alloc_site_counts &counts = all_counts[id];
+    if (is_write) {
+      counts.writes += count;
+    } else {
+      counts.reads += count;
+    }
+    counts.misses += miss;
+  }
+
+  // Attributes count accesses to the allocation site of the allocation addr falls in, to the custom
+  // allocation class of the object it falls in, and to the innermost of the two objects, if any.
+  // miss is true if the (first) access missed every simulated cache level.
+  void record_alloc_site(void *addr, bool is_write, bool miss, uint64_t count) {
+    uint32_t object;
+    uint32_t site = find_allocation(allocations, alloc_cache, addr, &object);
+    if (site != alloc_index::NO_SITE) {
+      count_access(sites, site, is_write, miss, count);
+    }
+
+    if (!alloc_hooks.empty()) {
+      record_alloc_class(addr, is_write, miss, count, &object);
+    }
+
+    if (object != alloc_index::NO_OBJECT) {
+      record_object(object, addr, is_write, miss, count);
+    }
+  }
+
+  void record_object(uint32_t object, void *addr, bool is_write, bool miss, uint64_t count) {
+    if (object_clock_countdown-- == 0) {
+      object_clock_ms = elapsed_ms();
+      object_clock_countdown = OBJECT_CLOCK_PERIOD - 1;
+    }
+    objects->at(object).record(is_write, miss, count, object_clock_ms);
+
+    page_counts *counts = object_pages.lookup(((uint64_t)addr) >> TRACE_PAGE_SHIFT);
+    if (is_write) {
+      counts->write_without_cache += count;
+      counts->write_with_cache += miss;
+    } else {
+      counts->read_without_cache += count;
+      counts->read_with_cache += miss;
+    }
+  }
+
+  // The custom allocation class part of record_alloc_site(); replaces *object with the custom object
+  // addr falls in, if any
+  void record_alloc_class(void *addr, bool is_write, bool miss, uint64_t count, uint32_t *object) {
+    uint32_t custom_object;
+    uint32_t class_id = find_allocation(custom_allocations, custom_cache, addr, &custom_object);
+    if (class_id == alloc_index::NO_SITE) {
+      return;
+    }
+    count_access(classes, class_id, is_write, miss, count);
+    if (custom_object != alloc_index::NO_OBJECT) {
+      *object = custom_object;
+    }
+
+    if (class_id >= class_pages.size()) {
+      class_pages.resize(class_id + 1, NULL);
+    }
+    if (class_pages[class_id] == NULL) {
+      class_pages[class_id] = new page_table;
+    }
+    page_counts *counts = class_pages[class_id]->lookup(((uint64_t)addr) >> count_shift);
+    if (is_write) {
+      counts->write_without_cache += count;
+      counts->write_with_cache += miss;
+    } else {
+      counts->read_without_cache += count;
+      counts->read_with_cache += miss;
+    }
+  }
+
+  // -counters sketch: the top-k table ranks pages by the unfiltered counts if they are kept
+  template <bool WITHOUT_CACHE>
+  void record_sketched(uint64_t pageno, bool is_write, uint64_t without_cache, uint64_t with_cache) {
+    page_counts delta = { 0, 0, 0, 0 };
+    if (is_write) {
+      delta.write_without_cache = without_cache;
+      delta.write_with_cache = with_cache;
+    } else {
+      delta.read_without_cache = without_cache;
+      delta.read_with_cache = with_cache;
+    }
+    sketch->add(pageno, delta);
+    page_counts estimate = sketch->estimate(pageno);
+    if (WITHOUT_CACHE) {
+      hot_pages->add(pageno, without_cache, estimate.read_without_cache + estimate.write_without_cache);
+    } else {
+      hot_pages->add(pageno, with_cache, estimate.read_with_cache + estimate.write_with_cache);
+    }
+  }
+
+  // WITH_CACHE / WITHOUT_CACHE select which of the cache-filtered and unfiltered counters are kept.
+  // With only WITH_CACHE the page table is not even touched on a cache hit.
+  //
+  // count > 1 records a coalesced group of accesses to one cache line (see mem_group), of which
+  // only the first can miss. ip is NULL if the caller attributes the accesses to instructions itself.
+  template <bool WITH_CACHE, bool WITHOUT_CACHE>
+  void record_mem_read(void *ip, void *addr, bool cache_hit, uint64_t count = 1) {
+    if (reuse_tracking) {
+      RecordReuse(reuse_staged, addr, count);
+      if (page_stream_engine != NULL) {
+        RecordPageReuse(page_reuse_staged, addr, count);
+      }
+    }
+    if (ip_attribution && ip != NULL) {
+      record_ip(ip, addr, cache_hit, count);
+    }
+    if (alloc_attribution) {
+      record_alloc_site(addr, false, WITH_CACHE && !cache_hit, count);
+    }
+    if (!WITHOUT_CACHE && cache_hit) {
+      return;
+    }
+    uint64_t pageno = ((uint64_t)(addr)) >> count_shift;
+    if (sketch_counting) {
+      record_sketched<WITHOUT_CACHE>(pageno, false, WITHOUT_CACHE ? count : 0, WITH_CACHE && !cache_hit);
+      return;
+    }
+    page_counts *counts = counts_for(pageno);
+    if (WITHOUT_CACHE) {
+      counts->read_without_cache += count;
+    }
+    if (WITH_CACHE && !cache_hit) {
+      counts->read_with_cache++;
+    }
+  }
+
+  template <bool WITH_CACHE, bool WITHOUT_CACHE>
+  void record_mem_write(void *ip, void *addr, bool cache_hit, uint64_t count = 1) {
+    if (reuse_tracking) {
+      RecordReuse(reuse_staged, addr, count);
+      if (page_stream_engine != NULL) {
+        RecordPageReuse(page_reuse_staged, addr, count);
+      }
+    }
+    if (ip_attribution && ip != NULL) {
+      record_ip(ip, addr, cache_hit, count);
+    }
+    if (alloc_attribution) {
+      record_alloc_site(addr, true, WITH_CACHE && !cache_hit, count);
+    }
+    if (!WITHOUT_CACHE && cache_hit) {
+      return;
+    }
+    uint64_t pageno = ((uint64_t)(addr)) >> count_shift;
+    if (sketch_counting) {
+      record_sketched<WITHOUT_CACHE>(pageno, true, WITHOUT_CACHE ? count : 0, WITH_CACHE && !cache_hit);
+      return;
+    }
+    page_counts *counts = counts_for(pageno);
+    if (WITHOUT_CACHE) {
+      counts->write_without_cache += count;
+    }
+    if (WITH_CACHE && !cache_hit) {
+      counts->write_with_cache++;
+    }
+  }
+};
+
+TLS_KEY tls_key;
+
+std::vector<thread_data *> all_thread_data;
+
+thread_data *get_tls(THREADID threadid)
+{
+    return static_cast<thread_data *>(PIN_GetThreadData(tls_key, threadid));
+}
+
+// The analysis routines below are instantiated once per counts configuration; main() picks the
+// instantiation matching -counts, so a run never executes cache simulation or counter updates
+// whose results it does not keep.
+
+template <bool WITH_CACHE, bool WITHOUT_CACHE>
+inline VOID AccessMemory(thread_data *td, VOID *ip, ADDRINT addr, BOOL is_write)
+{
+    if (is_write) {
+      bool cache_hit = WITH_CACHE && td->access_cache(addr, true);
+      td->record_mem_write<WITH_CACHE, WITHOUT_CACHE>(ip, (VOID *)addr, cache_hit);
+    } else {
+      bool cache_hit = WITH_CACHE && td->access_cache(addr, false);
+      td->record_mem_read<WITH_CACHE, WITHOUT_CACHE>(ip, (VOID *)addr, cache_hit);
+    }
+}
+
+const UINT32 MAX_GROUP_SIZE = 16;
+
+// Consecutive memory operands of one basic block that were coalesced at instrumentation time because
+// they share a base register (not modified in between) and all fall within cache_line_size bytes of
+// each other.
+// Offsets are relative to the effective address of the first operand, which is the only one
+// computed at run time.
+struct mem_group
+{
+    BOOL is_write;
+    UINT32 count;
+    INT32 min_offset;  // lowest byte touched by any operand
+    INT32 max_offset;  // one past the highest byte touched by any operand
+    INT32 offsets[MAX_GROUP_SIZE];
+    ADDRINT ips[MAX_GROUP_SIZE];  // instruction of each operand, for -ip_report
+};
+
+template <bool WITH_CACHE, bool WITHOUT_CACHE>
+inline VOID AccessMemoryGroup(thread_data *td, VOID *ip, ADDRINT addr, const mem_group *group)
+{
+    ADDRINT first = addr + group->min_offset;
+    ADDRINT last = addr + group->max_offset - 1;
+
+    if (first / cache_line_size == last / cache_line_size) {
+      // Everything hits one line (and so one page): only the first access can miss in the cache
+      bool cache_hit = WITH_CACHE && td->access_cache(first, group->is_write);
+      if (group->is_write) {
+        td->record_mem_write<WITH_CACHE, WITHOUT_CACHE>(ip_attribution ? NULL : ip, (VOID *)first, cache_hit, group->count);
+      } else {
+        td->record_mem_read<WITH_CACHE, WITHOUT_CACHE>(ip_attribution ? NULL : ip, (VOID *)first, cache_hit, group->count);
+      }
+      // every operand is charged to its own instruction, as -instrument ins would; after the first,
+      // the line is in the cache
+      if (ip_attribution) {
+        for (UINT32 i = 0; i < group->count; i++) {
+          td->record_ip((VOID *)group->ips[i], (VOID *)(addr + group->offsets[i]), i == 0 ? cache_hit : WITH_CACHE, 1);
+        }
+      }
+      return;
+    }
+
+    // The base address made the group straddle a line boundary, so account for every operand
+    for (UINT32 i = 0; i < group->count; i++) {
+      AccessMemory<WITH_CACHE, WITHOUT_CACHE>(td, (VOID *)group->ips[i], addr + group->offsets[i], group->is_write);
+    }
+}
+
+// Print a memory read record
+template <bool WITH_CACHE, bool WITHOUT_CACHE>
+VOID RecordMemRead(VOID * ip, VOID * addr, THREADID threadid)
+{
+    AccessMemory<WITH_CACHE, WITHOUT_CACHE>(get_tls(threadid), ip, (ADDRINT)addr, FALSE);
+}
+
+// Print a memory write record
+template <bool WITH_CACHE, bool WITHOUT_CACHE>
+VOID RecordMemWrite(VOID * ip, VOID * addr, THREADID threadid)
+{
+    AccessMemory<WITH_CACHE, WITHOUT_CACHE>(get_tls(threadid), ip, (ADDRINT)addr, TRUE);
+}
+
+// Print the records of a coalesced group of memory operands
+template <bool WITH_CACHE, bool WITHOUT_CACHE>
+VOID RecordMemGroup(VOID * ip, VOID * addr, const mem_group *group, THREADID threadid)
+{
+    AccessMemoryGroup<WITH_CACHE, WITHOUT_CACHE>(get_tls(threadid), ip, (ADDRINT)addr, group);
+}
+
+// One memory reference as written into the per-thread trace buffer in buffered mode
+struct mem_ref
+{
+    ADDRINT ip;
+    ADDRINT ea;
+    const mem_group *group;  // NULL for a single operand
+    UINT32 size;
+    BOOL is_write;
+};
+
+// Number of 4 KB pages in each thread's trace buffer
+const UINT32 NUM_BUFFER_PAGES = 256;
+
+BUFFER_ID buffer_id;
+
+// Called by Pin when a thread's trace buffer is full (and when the thread exits) to consume
+// every buffered reference in one go
+template <bool WITH_CACHE, bool WITHOUT_CACHE>
+VOID *BufferFull(BUFFER_ID id, THREADID threadid, const CONTEXT *ctxt, VOID *buf, UINT64 numElements, VOID *v)
+{
+    thread_data *td = get_tls(threadid);
+    const mem_ref *refs = static_cast<const mem_ref *>(buf);
+
+    for (UINT64 i = 0; i < numElements; i++) {
+      if (refs[i].group != NULL) {
+        AccessMemoryGroup<WITH_CACHE, WITHOUT_CACHE>(td, (VOID *)refs[i].ip, refs[i].ea, refs[i].group);
+      } else {
+        AccessMemory<WITH_CACHE, WITHOUT_CACHE>(td, (VOID *)refs[i].ip, refs[i].ea, refs[i].is_write);
+      }
+    }
+
+    return buf;
+}
+
+// Analysis routines chosen in main() from the knobs
+AFUNPTR record_mem_read_routine = NULL;
+AFUNPTR record_mem_write_routine = NULL;
+AFUNPTR record_mem_group_routine = NULL;
+TRACE_BUFFER_CALLBACK buffer_full_routine = NULL;
+
+bool instrument_reads = true;
+bool instrument_writes = true;
+
+// Checked at instrumentation time; switched by the control channel (see ControlThread)
+volatile bool tracing_enabled = true;
+
+template <bool WITH_CACHE, bool WITHOUT_CACHE>
+VOID SelectAnalysisRoutines()
+{
+    record_mem_read_routine = (AFUNPTR)RecordMemRead<WITH_CACHE, WITHOUT_CACHE>;
+    record_mem_write_routine = (AFUNPTR)RecordMemWrite<WITH_CACHE, WITHOUT_CACHE>;
+    record_mem_group_routine = (AFUNPTR)RecordMemGroup<WITH_CACHE, WITHOUT_CACHE>;
+    buffer_full_routine = BufferFull<WITH_CACHE, WITHOUT_CACHE>;
+}
+
+// With -stream: pushes the records of one access, or of a coalesced group (a single record if the
+// group falls within one line, as AccessMemoryGroup() counts it)
+inline VOID StreamAccessGroup(ring_producer *producer, ADDRINT ip, ADDRINT addr, const mem_group *group)
+{
+    ADDRINT first = addr + group->min_offset;
+    ADDRINT last = addr + group->max_offset - 1;
+
+    if (first / cache_line_size == last / cache_line_size) {
+      producer->push(first, ip, group->count, group->is_write);
+      return;
+    }
+    for (UINT32 i = 0; i < group->count; i++) {
+      producer->push(addr + group->offsets[i], group->ips[i], 1, group->is_write);
+    }
+}
+
+VOID StreamMemRead(VOID * ip, VOID * addr, THREADID threadid)
+{
+    get_tls(threadid)->producer->push((ADDRINT)addr, (ADDRINT)ip, 1, false);
+}
+
+VOID StreamMemWrite(VOID * ip, VOID * addr, THREADID threadid)
+{
+    get_tls(threadid)->producer->push((ADDRINT)addr, (ADDRINT)ip, 1, true);
+}
+
+VOID StreamMemGroup(VOID * ip, VOID * addr, const mem_group *group, THREADID threadid)
+{
+    StreamAccessGroup(get_tls(threadid)->producer, (ADDRINT)ip, (ADDRINT)addr, group);
+}
+
+VOID *StreamBufferFull(BUFFER_ID id, THREADID threadid, const CONTEXT *ctxt, VOID *buf, UINT64 numElements, VOID *v)
+{
+    ring_producer *producer = get_tls(threadid)->producer;
+    const mem_ref *refs = static_cast<const mem_ref *>(buf);
+
+    for (UINT64 i = 0; i < numElements; i++) {
+      if (refs[i].group != NULL) {
+        StreamAccessGroup(producer, refs[i].ip, refs[i].ea, refs[i].group);
+      } else {
+        producer->push(refs[i].ea, refs[i].ip, 1, refs[i].is_write);
+      }
+    }
+
+    return buf;
+}
+
+VOID SelectStreamRoutines()
+{
+    record_mem_read_routine = (AFUNPTR)StreamMemRead;
+    record_mem_write_routine = (AFUNPTR)StreamMemWrite;
+    record_mem_group_routine = (AFUNPTR)StreamMemGroup;
+    buffer_full_routine = StreamBufferFull;
+}
+
+// With -capture: takes the next chunk for the thread and opens its file
+capture_thread *StartCapture(UINT32 thread)
+{
+    std::ostringstream filename;
+    filename << KnobCapture.Value() << "." << thread << ".atrace";
+    capture_file *file = new capture_file;
+    PIN_InitLock(&file->lock);
+    file->next_sequence = 0;
+    if (!file->writer.open(filename.str().c_str(), thread)) {
+      std::cerr << "Error: could not open " << filename.str() << std::endl;
+    }
+
+    capture_thread *c = new capture_thread;
+    PIN_GetLock(&capture_lock, 0);
+    capture_files.push_back(file);
+    if (capture_free_chunks.empty()) {
+      c->records = new raw_access[capture_chunk_records];
+    } else {
+      c->records = capture_free_chunks.back();
+      capture_free_chunks.pop_back();
+    }
+    PIN_ReleaseLock(&capture_lock);
+
+    c->file = file;
+    c->count = 0;
+    c->timestamps = 0;
+    c->sequence = 0;
+    c->first_record = 0;
+    c->first_timestamp_us = c->timestamp_us = elapsed_us();
+    return c;
+}
+
+// Queues the thread's chunk for the compression threads and starts the next one. Waits while the
+// queue is full, unless there are no compression threads left to empty it (at exit).
+VOID SubmitCaptureChunk(capture_thread *c)
+{
+    capture_chunk chunk = { c->file, c->sequence, c->records, c->count, c->first_record, c->first_timestamp_us };
+
+    PIN_GetLock(&capture_lock, 0);
+    while (capture_queue.size() >= KnobCaptureQueue.Value() && capture_threads_running != 0) {
+      capture_stalls++;
+      PIN_ReleaseLock(&capture_lock);
+      PIN_Sleep(1);
+      PIN_GetLock(&capture_lock, 0);
+    }
+    capture_queue.push_back(chunk);
+    if (capture_free_chunks.empty()) {
+      c->records = new raw_access[capture_chunk_records];
+    } else {
+      c->records = capture_free_chunks.back();
+      capture_free_chunks.pop_back();
+    }
+    PIN_ReleaseLock(&capture_lock);
+
+    c->sequence++;
+    c->first_record += c->count - c->timestamps;
+    c->count = 0;
+    c->timestamps = 0;
+    c->first_timestamp_us = c->timestamp_us = elapsed_us();
+}
+
+// size << 1 | is_write, as in raw_access::info
+inline UINT32 CaptureInfo(UINT32 size, BOOL is_write)
+{
+    return (size < 0x7FFF ? size : 0x7FFF) << 1 | (is_write ? 1 : 0);
+}
+
+// Appends an access to the thread's chunk, preceded every CAPTURE_TIMESTAMP_PERIOD records by a
+// timestamp record if the clock moved
+inline VOID CaptureAccess(capture_thread *c, ADDRINT ip, ADDRINT addr, UINT32 info)
+{
+    if ((c->count & (CAPTURE_TIMESTAMP_PERIOD - 1)) == 0 && c->count != 0) {
+      UINT64 now = elapsed_us();
+      if (now != c->timestamp_us) {
+        c->records[c->count].addr = now;
+        c->records[c->count].info = raw_access::RAW_TIMESTAMP;
+        c->count++;
+        c->timestamps++;
+        c->timestamp_us = now;
+      }
+    }
+    c->records[c->count].addr = addr;
+    c->records[c->count].info = (UINT64)ip << 16 | info;
+    if (++c->count == capture_chunk_records) {
+      SubmitCaptureChunk(c);
+    }
+}
+
+VOID CaptureMem(VOID * ip, VOID * addr, UINT32 info, THREADID threadid)
+{
+    CaptureAccess(get_tls(threadid)->capture, (ADDRINT)ip, (ADDRINT)addr, info);
+}
+
+// Capture only instruments single operands (see main()), so the buffer holds no groups
+VOID *CaptureBufferFull(BUFFER_ID id, THREADID threadid, const CONTEXT *ctxt, VOID *buf, UINT64 numElements, VOID *v)
+{
+    capture_thread *c = get_tls(threadid)->capture;
+    const mem_ref *refs = static_cast<const mem_ref *>(buf);
+
+    for (UINT64 i = 0; i < numElements; i++) {
+      CaptureAccess(c, refs[i].ip, refs[i].ea, CaptureInfo(refs[i].size, refs[i].is_write));
+    }
+
+    return buf;
+}
+
+// Sampling
+// ========
+//
+// Periodic sampling (-sample_period N) guards every analysis call with an inlined if-call that counts
+// down a per-thread counter, so only every Nth access of a thread pays for the page table update.
+// Cache simulation needs every access, so periodic sampling only supports -counts no_cache.
+//
+// Bursty sampling (-sample_burst B -sample_gap G) uses trace versioning: every trace exists in an
+// uninstrumented version (VERSION_BASE) and a fully instrumented one (VERSION_SAMPLE), and a call at
+// each trace head switches versions after B instrumented and G uninstrumented trace executions.
+// Bursts are long enough to warm up the simulated caches, so cache-filtered counts work too.
+//
+// The page tables hold raw sampled counts; the writers scale them by sample_scale and, in the binary
+// format, add SECTION_ERROR sections with a per-page standard error of scale * sqrt(samples). For
+// bursty sampling that estimate assumes the bursts behave like independent samples, which makes it
+// a lower bound when access patterns are strongly phased.
+enum sampling_mode_t { SAMPLING_OFF, SAMPLING_PERIODIC, SAMPLING_BURSTS };
+
+sampling_mode_t sampling_mode = SAMPLING_OFF;
+double sample_scale = 1.0;
+
+enum { VERSION_BASE = 0, VERSION_SAMPLE = 1 };
+
+REG sample_version_reg;
+
+// Per-thread sampling state, indexed by THREADID and padded to a cache line so that threads do not
+// share lines. Pin THREADIDs are small and reused, so the modulo practically never folds two live
+// threads together (and if it does, only the sampling phase is shared).
+const UINT32 MAX_SAMPLED_THREADS = 1024;
+
+struct sample_state
+{
+    UINT64 countdown;
+    UINT8 pad[64 - sizeof(UINT64)];
+};
+
+sample_state sample_states[MAX_SAMPLED_THREADS];
+
+sample_state &get_sample_state(THREADID threadid)
+{
+    return sample_states[threadid % MAX_SAMPLED_THREADS];
+}
+
+ADDRINT SampleCountdown(THREADID threadid)
+{
+    return --get_sample_state(threadid).countdown == 0;
+}
+
+template <BOOL IS_WRITE>
+VOID RecordSampledMem(VOID * ip, VOID * addr, THREADID threadid)
+{
+    get_sample_state(threadid).countdown = KnobSamplePeriod;
+    AccessMemory<false, true>(get_tls(threadid), ip, (ADDRINT)addr, IS_WRITE);
+}
+
+// Called at the head of every trace in bursty mode; returns the version the thread runs next
+ADDRINT NextSampleVersion(THREADID threadid, ADDRINT version)
+{
+    sample_state &state = get_sample_state(threadid);
+    if (--state.countdown != 0) {
+      return version;
+    }
+    if (version == VERSION_BASE) {
+      state.countdown = KnobSampleBurst;
+      return VERSION_SAMPLE;
+    }
+    state.countdown = KnobSampleGap;
+    return VERSION_BASE;
+}
+
+VOID InstrumentSampleVersions(TRACE trace)
+{
+    INS head = BBL_InsHead(TRACE_BblHead(trace));
+    ADDRINT version = TRACE_Version(trace);
+
+    INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)NextSampleVersion,
+        IARG_THREAD_ID,
+        IARG_ADDRINT, version,
+        IARG_RETURN_REGS, sample_version_reg,
+        IARG_END);
+
+    if (version == VERSION_BASE) {
+      INS_InsertVersionCase(head, sample_version_reg, VERSION_SAMPLE, VERSION_SAMPLE, IARG_END);
+    } else {
+      INS_InsertVersionCase(head, sample_version_reg, VERSION_BASE, VERSION_BASE, IARG_END);
+    }
+}
+
+// Instruments a single memory operand, either with an analysis call or, in buffered mode, by
+// appending a record to the trace buffer
+VOID InstrumentMemOp(INS ins, UINT32 memOp, BOOL is_write)
+{
+    if (sampling_mode == SAMPLING_PERIODIC)
+    {
+        INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleCountdown, IARG_THREAD_ID, IARG_END);
+        INS_InsertThenPredicatedCall(
+            ins, IPOINT_BEFORE, is_write ? (AFUNPTR)RecordSampledMem<TRUE> : (AFUNPTR)RecordSampledMem<FALSE>,
+            IARG_INST_PTR,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_THREAD_ID,
+            IARG_END);
+        return;
+    }
+
+    // Instruments memory accesses using a predicated call, i.e.
+    // the instrumentation is called iff the instruction will actually be executed.
+    //
+    // On the IA-32 and Intel(R) 64 architectures conditional moves and REP
+    // prefixed instructions appear as predicated instructions in Pin.
+    if (KnobBuffer)
+    {
+        INS_InsertFillBufferPredicated(
+            ins, IPOINT_BEFORE, buffer_id,
+            IARG_INST_PTR, offsetof(mem_ref, ip),
+            IARG_MEMORYOP_EA, memOp, offsetof(mem_ref, ea),
+            IARG_PTR, NULL, offsetof(mem_ref, group),
+            IARG_UINT32, INS_MemoryOperandSize(ins, memOp), offsetof(mem_ref, size),
+            IARG_BOOL, is_write, offsetof(mem_ref, is_write),
+            IARG_END);
+        return;
+    }
+
+    if (capturing)
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)CaptureMem,
+            IARG_INST_PTR,
+            IARG_MEMORYOP_EA, memOp,
+            IARG_UINT32, CaptureInfo(INS_MemoryOperandSize(ins, memOp), is_write),
+            IARG_THREAD_ID,
+            IARG_END);
+        return;
+    }
+
+    INS_InsertPredicatedCall(
+        ins, IPOINT_BEFORE, is_write ? record_mem_write_routine : record_mem_read_routine,
+        IARG_INST_PTR,
+        IARG_MEMORYOP_EA, memOp,
+        IARG_THREAD_ID,
+        IARG_END);
+}
+
+// Is called for every instruction and instruments reads and writes
+VOID Instruction(INS ins, VOID *v)
+{
+    if (!tracing_enabled) return;
+
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+    // Iterate over each memory operand of the instruction.
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+    {
+        if (instrument_reads && INS_MemoryOperandIsRead(ins, memOp))
+        {
+            InstrumentMemOp(ins, memOp, FALSE);
+        }
+        // Note that in some architectures a single memory operand can be
+        // both read and written (for instance incl (%eax) on IA-32)
+        // In that case we instrument it once for read and once for write.
+        if (instrument_writes && INS_MemoryOperandIsWritten(ins, memOp))
+        {
+            InstrumentMemOp(ins, memOp, TRUE);
+        }
+    }
+}
+
+// A group of memory operands being collected while scanning a basic block
+struct pending_group
+{
+    INS ins;       // instruction of the first operand, where the analysis call goes
+    UINT32 memOp;  // first operand
+    REG base;
+    BOOL is_write;
+    BOOL open;     // false once the base register has been overwritten, or another operand was instrumented
+    INT64 first_displacement;
+    INT64 min_displacement;
+    INT64 max_end;
+    std::vector<INT64> displacements;
+    std::vector<ADDRINT> ips;
+};
+
+// Whether an operand's address is base register + constant, so that its distance to other operands
+// off the same base is known statically
+bool IsCoalescable(INS ins, UINT32 memOp)
+{
+    REG base = INS_MemoryBaseReg(ins);
+    return !INS_IsPredicated(ins)
+        && INS_MemoryOperandCount(ins) == 1
+        && REG_valid(base)
+        && base != REG_INST_PTR
+        && !REG_valid(INS_MemoryIndexReg(ins))
+        && !REG_valid(INS_SegmentRegPrefix(ins))
+        // rules out push/pop/call/ret and pointer chasing through the base register
+        && !INS_RegWContain(ins, base)
+        && INS_MemoryOperandSize(ins, memOp) <= cache_line_size;
+}
+
+// A group is simulated at its first instruction, so no other instrumented operand may come between
+// its members: one could evict the group's line in between (e.g. a conflicting set in a direct-mapped
+// L1) and the counts would differ from -instrument ins. Every other operand closes the open groups.
+VOID CloseGroups(std::vector<pending_group> &groups)
+{
+    for (size_t i = 0; i < groups.size(); i++) {
+      groups[i].open = FALSE;
+    }
+}
+
+VOID AddToGroup(std::vector<pending_group> &groups, INS ins, UINT32 memOp, BOOL is_write)
+{
+    REG base = INS_MemoryBaseReg(ins);
+    INT64 displacement = INS_MemoryDisplacement(ins);
+    INT64 end = displacement + INS_MemoryOperandSize(ins, memOp);
+
+    for (size_t i = 0; i < groups.size(); i++) {
+      pending_group &g = groups[i];
+      if (!g.open || g.base != base || g.is_write != is_write || g.displacements.size() == MAX_GROUP_SIZE) {
+        continue;
+      }
+      INT64 min_displacement = std::min(g.min_displacement, displacement);
+      INT64 max_end = std::max(g.max_end, end);
+      if (max_end - min_displacement > cache_line_size) {
+        continue;
+      }
+      g.min_displacement = min_displacement;
+      g.max_end = max_end;
+      g.displacements.push_back(displacement);
+      g.ips.push_back(INS_Address(ins));
+      return;
+    }
+
+    CloseGroups(groups);
+    pending_group g;
+    g.ins = ins;
+    g.memOp = memOp;
+    g.base = base;
+    g.is_write = is_write;
+    g.open = TRUE;
+    g.first_displacement = displacement;
+    g.min_displacement = displacement;
+    g.max_end = end;
+    g.displacements.push_back(displacement);
+    g.ips.push_back(INS_Address(ins));
+    groups.push_back(g);
+}
+
+VOID InstrumentGroup(const pending_group &g)
+{
+    if (g.displacements.size() == 1) {
+      InstrumentMemOp(g.ins, g.memOp, g.is_write);
+      return;
+    }
+
+    // Lives as long as the instrumented code, i.e. until the tool exits
+    mem_group *group = new mem_group;
+    group->is_write = g.is_write;
+    group->count = g.displacements.size();
+    group->min_offset = g.min_displacement - g.first_displacement;
+    group->max_offset = g.max_end - g.first_displacement;
+    for (size_t i = 0; i < g.displacements.size(); i++) {
+      group->offsets[i] = g.displacements[i] - g.first_displacement;
+      group->ips[i] = g.ips[i];
+    }
+
+    // The first instruction of a group is never predicated, so a plain call is enough
+    if (KnobBuffer)
+    {
+        INS_InsertFillBuffer(
+            g.ins, IPOINT_BEFORE, buffer_id,
+            IARG_INST_PTR, offsetof(mem_ref, ip),
+            IARG_MEMORYOP_EA, g.memOp, offsetof(mem_ref, ea),
+            IARG_PTR, group, offsetof(mem_ref, group),
+            IARG_UINT32, 0, offsetof(mem_ref, size),
+            IARG_BOOL, g.is_write, offsetof(mem_ref, is_write),
+            IARG_END);
+        return;
+    }
+
+    INS_InsertCall(
+        g.ins, IPOINT_BEFORE, record_mem_group_routine,
+        IARG_INST_PTR,
+        IARG_MEMORYOP_EA, g.memOp,
+        IARG_PTR, group,
+        IARG_THREAD_ID,
+        IARG_END);
+}
+
+// Basic-block mode: scans each basic block once and coalesces consecutive memory operands that share
+// a base register and fall within one cache line into a single analysis call with a multiplicity
+VOID InstrumentBbl(BBL bbl)
+{
+    std::vector<pending_group> groups;
+
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+        for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+        {
+            bool coalescable = IsCoalescable(ins, memOp);
+
+            if (instrument_reads && INS_MemoryOperandIsRead(ins, memOp))
+            {
+                if (coalescable) {
+                    AddToGroup(groups, ins, memOp, FALSE);
+                } else {
+                    CloseGroups(groups);
+                    InstrumentMemOp(ins, memOp, FALSE);
+                }
+            }
+            if (instrument_writes && INS_MemoryOperandIsWritten(ins, memOp))
+            {
+                if (coalescable) {
+                    AddToGroup(groups, ins, memOp, TRUE);
+                } else {
+                    CloseGroups(groups);
+                    InstrumentMemOp(ins, memOp, TRUE);
+                }
+            }
+        }
+
+        // Later operands off a register this instruction writes use a different base address
+        for (size_t i = 0; i < groups.size(); i++) {
+          if (groups[i].open && INS_RegWContain(ins, groups[i].base)) {
+            groups[i].open = FALSE;
+          }
+        }
+    }
+
+    for (size_t i = 0; i < groups.size(); i++) {
+      InstrumentGroup(groups[i]);
+    }
+}
+
+VOID Trace(TRACE trace, VOID *v)
+{
+    if (!tracing_enabled) return;
+
+    if (sampling_mode == SAMPLING_BURSTS) {
+      InstrumentSampleVersions(trace);
+      if (TRACE_Version(trace) == VERSION_BASE) {
+        return;
+      }
+    }
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        if (KnobInstrument.Value() == "bbl") {
+          InstrumentBbl(bbl);
+        } else {
+          for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            Instruction(ins, 0);
+          }
+        }
+    }
+}
+
+// Allocator interception
+// ======================
+//
+// Only the outermost of nested allocator calls is recorded (calloc calling malloc, malloc calling
+// mmap); the *Before routines note the call, AllocatorAfter() records its result. IPOINT_AFTER misses
+// the exits of calls that leave through a tail jump or a longjmp, so a call's exit is matched to its
+// entry by the stack pointer, which is the same at entry and before the return, rather than by
+// counting entries and exits: a missed exit then only loses that one call. free and munmap need no
+// result, so they act at entry and have no exit to miss.
+
+// Returns the id of the allocation site that called the allocator, registering it on first use
+UINT32 AllocSiteId(const CONTEXT *ctxt, UINT64 size)
+{
+    VOID *frames[ALLOC_SITE_FRAMES];
+    INT32 num_frames = PIN_Backtrace(ctxt, frames, ALLOC_SITE_FRAMES);
+
+    // FNV-1a over the return addresses
+    UINT64 hash = 0xcbf29ce484222325ULL;
+    for (INT32 i = 0; i < num_frames; i++) {
+      hash = (hash ^ (UINT64)frames[i]) * 0x100000001b3ULL;
+    }
+
+    PIN_GetLock(&alloc_sites_lock, 0);
+    UINT32 id;
+    std::map<UINT64, UINT32>::iterator it = alloc_site_ids.find(hash);
+    if (it != alloc_site_ids.end()) {
+      id = it->second;
+    } else {
+      alloc_site site;
+      memcpy(site.frames, frames, num_frames * sizeof(VOID *));
+      site.num_frames = num_frames;
+      site.allocations = 0;
+      site.bytes = 0;
+      id = alloc_sites.size();
+      alloc_sites.push_back(site);
+      alloc_site_ids[hash] = id;
+    }
+    alloc_sites[id].allocations++;
+    alloc_sites[id].bytes += size;
+    PIN_ReleaseLock(&alloc_sites_lock);
+
+    return id;
+}
+
+// Notes an allocator call entered with stack pointer sp, unless it is nested in the call in
+// progress (see allocator_call). Returns whether the call was noted.
+bool AllocatorEntry(thread_data *td, const CONTEXT *ctxt, ADDRINT sp, ADDRINT return_ip, UINT64 size)
+{
+    if (!td->alloc_call.enter(sp, return_ip, size)) {
+      return false;
+    }
+    td->alloc_call.site = AllocSiteId(ctxt, size);
+    return true;
+}
+
+VOID MallocBefore(THREADID threadid, const CONTEXT *ctxt, ADDRINT sp, ADDRINT return_ip, ADDRINT size)
+{
+    AllocatorEntry(get_tls(threadid), ctxt, sp, return_ip, size);
+}
+
+VOID CallocBefore(THREADID threadid, const CONTEXT *ctxt, ADDRINT sp, ADDRINT return_ip, ADDRINT count, ADDRINT size)
+{
+    AllocatorEntry(get_tls(threadid), ctxt, sp, return_ip, count * size);
+}
+
+VOID ReallocBefore(THREADID threadid, const CONTEXT *ctxt, ADDRINT sp, ADDRINT return_ip, ADDRINT ptr, ADDRINT size)
+{
+    thread_data *td = get_tls(threadid);
+    if (AllocatorEntry(td, ctxt, sp, return_ip, size)) {
+      td->alloc_call.old_ptr = ptr;
+    }
+}
+
+// The next helpers must be called with alloc_index_lock held for writing
+
+// Returns the id of a new object of the given size, or alloc_index::NO_OBJECT without -object_report
+UINT32 InsertObject(UINT64 size, UINT32 site, UINT32 flags)
+{
+    return object_heat ? objects->insert(size, site, flags) : alloc_index::NO_OBJECT;
+}
+
+VOID RetireObject(UINT32 object)
+{
+    if (object != alloc_index::NO_OBJECT) {
+      objects->retire(object);
+    }
+}
+
+// Removes the allocation at ptr from index, if any
+VOID EraseAllocation(alloc_index &index, ADDRINT ptr)
+{
+    UINT32 object;
+    if (index.erase(ptr, &object)) {
+      RetireObject(object);
+    }
+}
+
+// A free nested in an allocator call (realloc freeing the old block) erases a block that is
+// already gone or about to be, which is harmless
+VOID FreeBefore(ADDRINT ptr)
+{
+    if (ptr != 0) {
+      PIN_RWMutexWriteLock(&alloc_index_lock);
+      EraseAllocation(allocations, ptr);
+      PIN_RWMutexUnlock(&alloc_index_lock);
+    }
+}
+
+VOID MunmapBefore(ADDRINT addr, ADDRINT length)
+{
+    std::vector<UINT32> freed;
+    PIN_RWMutexWriteLock(&alloc_index_lock);
+    allocations.erase_range(addr, length, &freed);
+    for (size_t i = 0; i < freed.size(); i++) {
+      RetireObject(freed[i]);
+    }
+    PIN_RWMutexUnlock(&alloc_index_lock);
+}
+
+VOID AllocatorAfter(THREADID threadid, ADDRINT sp, ADDRINT result)
+{
+    thread_data *td = get_tls(threadid);
+    // the exit of a nested call, or of a call that was in progress when the image was instrumented
+    if (!td->alloc_call.leave(sp)) {
+      return;
+    }
+    const allocator_call &call = td->alloc_call;
+
+    bool failed = result == 0 || result == (ADDRINT)MAP_FAILED;
+    PIN_RWMutexWriteLock(&alloc_index_lock);
+    // realloc frees the old block if it succeeds, or if it was asked for 0 bytes
+    if (call.old_ptr != 0 && (!failed || call.size == 0)) {
+      EraseAllocation(allocations, call.old_ptr);
+    }
+    if (!failed) {
+      // a block whose free was missed
+      EraseAllocation(allocations, result);
+      allocations.insert(result, call.size, call.site, InsertObject(call.size, call.site, 0));
+    }
+    PIN_RWMutexUnlock(&alloc_index_lock);
+}
+
+// Opens img's routine called name for instrumentation and, unless it only frees, inserts the
+// AllocatorAfter() call; returns an invalid RTN if img does not define name
+RTN OpenAllocator(IMG img, const char *name, bool frees = false)
+{
+    RTN rtn = RTN_FindByName(img, name);
+    if (RTN_Valid(rtn)) {
+      RTN_Open(rtn);
+      if (!frees) {
+        RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)AllocatorAfter, IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR,
+                       IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
+      }
+    }
+    return rtn;
+}
+
+// Returns the id of class_value's allocation class of hook, registering it on first use
+UINT32 AllocClassId(UINT32 hook, UINT64 class_value, UINT64 size)
+{
+    PIN_GetLock(&alloc_sites_lock, 0);
+    std::pair<UINT32, UINT64> key(hook, alloc_hooks[hook].class_arg >= 0 ? class_value : 0);
+    UINT32 id;
+    std::map<std::pair<UINT32, UINT64>, UINT32>::iterator it = alloc_class_ids.find(key);
+    if (it != alloc_class_ids.end()) {
+      id = it->second;
+    } else {
+      alloc_class c;
+      std::ostringstream name;
+      name << alloc_hooks[hook].function;
+      if (alloc_hooks[hook].class_arg >= 0) {
+        name << "[" << class_value << "]";
+      }
+      c.name = name.str();
+      c.allocations = 0;
+      c.bytes = 0;
+      id = alloc_classes.size();
+      alloc_classes.push_back(c);
+      alloc_class_ids[key] = id;
+    }
+    alloc_classes[id].allocations++;
+    alloc_classes[id].bytes += size;
+    PIN_ReleaseLock(&alloc_sites_lock);
+
+    return id;
+}
+
+VOID InsertCustomAllocation(ADDRINT ptr, UINT64 size, UINT32 class_id)
+{
+    PIN_RWMutexWriteLock(&alloc_index_lock);
+    EraseAllocation(custom_allocations, ptr);
+    custom_allocations.insert(ptr, size, class_id, InsertObject(size, class_id, object_counts::CUSTOM));
+    PIN_RWMutexUnlock(&alloc_index_lock);
+}
+
+// Pending calls of custom_pending that were entered at or below sp have returned (or, at sp, tail
+// jumped to a newer call); their exits were missed, and they are discarded so that no later result
+// is taken for theirs
+VOID DiscardReturnedCustomAllocs(std::vector<pending_custom_alloc> &pending, ADDRINT sp)
+{
+    while (!pending.empty() && pending.back().sp <= sp) {
+      pending.pop_back();
+    }
+}
+
+// size, class_value and ptr are 0 if the hook does not name those arguments
+VOID CustomAllocBefore(THREADID threadid, ADDRINT sp, UINT32 hook, ADDRINT size, ADDRINT class_value, ADDRINT ptr)
+{
+    UINT32 class_id = AllocClassId(hook, class_value, size);
+    if (alloc_hooks[hook].ptr_arg >= 0) {
+      if (ptr != 0) {
+        InsertCustomAllocation(ptr, size, class_id);
+      }
+      return;
+    }
+
+    thread_data *td = get_tls(threadid);
+    DiscardReturnedCustomAllocs(td->custom_pending, sp);
+    pending_custom_alloc pending;
+    pending.size = size;
+    pending.class_id = class_id;
+    pending.sp = sp;
+    td->custom_pending.push_back(pending);
+}
+
+// IPOINT_AFTER misses the exits of calls that leave through a tail jump or a longjmp, so an exit is
+// matched to the pending call entered at the same stack pointer rather than to the innermost one
+VOID CustomAllocAfter(THREADID threadid, ADDRINT sp, ADDRINT result)
+{
+    thread_data *td = get_tls(threadid);
+    DiscardReturnedCustomAllocs(td->custom_pending, sp - 1);
+    if (td->custom_pending.empty() || td->custom_pending.back().sp != sp) {
+      return;
+    }
+    pending_custom_alloc pending = td->custom_pending.back();
+    td->custom_pending.pop_back();
+    if (result != 0) {
+      InsertCustomAllocation(result, pending.size, pending.class_id);
+    }
+}
+
+VOID CustomFreeBefore(ADDRINT ptr)
+{
+    PIN_RWMutexWriteLock(&alloc_index_lock);
+    EraseAllocation(custom_allocations, ptr);
+    PIN_RWMutexUnlock(&alloc_index_lock);
+}
+
+// IARG_* pair passing argument arg of a routine to an analysis routine, or 0 if arg is -1
+#define CUSTOM_ARG(arg) ((arg) >= 0 ? IARG_FUNCARG_ENTRYPOINT_VALUE : IARG_ADDRINT), ((arg) >= 0 ? (arg) : 0)
+
+VOID InstrumentAllocHooks(IMG img)
+{
+    for (UINT32 i = 0; i < alloc_hooks.size(); i++) {
+      const alloc_hook &hook = alloc_hooks[i];
+
+      RTN rtn = RTN_FindByName(img, hook.function.c_str());
+      if (RTN_Valid(rtn)) {
+        RTN_Open(rtn);
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)CustomAllocBefore, IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR,
+                       IARG_UINT32, i, CUSTOM_ARG(hook.size_arg), CUSTOM_ARG(hook.class_arg), CUSTOM_ARG(hook.ptr_arg), IARG_END);
+        if (hook.ptr_arg < 0) {
+          RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)CustomAllocAfter, IARG_THREAD_ID, IARG_REG_VALUE, REG_STACK_PTR,
+                         IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
+        }
+        RTN_Close(rtn);
+      }
+
+      if (!hook.free_function.empty()) {
+        rtn = RTN_FindByName(img, hook.free_function.c_str());
+        if (RTN_Valid(rtn)) {
+          RTN_Open(rtn);
+          RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)CustomFreeBefore, IARG_FUNCARG_ENTRYPOINT_VALUE, hook.free_ptr_arg, IARG_END);
+          RTN_Close(rtn);
+        }
+      }
+    }
+}
+
+// Parses one -alloc_hook spec: FUNCTION[,size=ARG][,ptr=ARG|ret][,class=ARG][,free=FUNCTION][,free_ptr=ARG]
+bool ParseAllocHook(const std::string &spec, alloc_hook *hook)
+{
+    std::istringstream fields(spec);
+    std::string field;
+    if (!std::getline(fields, hook->function, ',') || hook->function.empty()) {
+      return false;
+    }
+    hook->size_arg = -1;
+    hook->ptr_arg = -1;
+    hook->class_arg = -1;
+    hook->free_ptr_arg = 0;
+
+    while (std::getline(fields, field, ',')) {
+      size_t eq = field.find('=');
+      if (eq == std::string::npos || eq + 1 == field.size()) {
+        return false;
+      }
+      std::string key = field.substr(0, eq), value = field.substr(eq + 1);
+      if (key == "free") {
+        hook->free_function = value;
+        continue;
+      }
+
+      INT32 arg = -1;
+      if (key == "ptr" && value == "ret") {
+        arg = -1;
+      } else if (value.find_first_not_of("0123456789") == std::string::npos) {
+        arg = atoi(value.c_str());
+      } else {
+        return false;
+      }
+
+      if (key == "size") {
+        hook->size_arg = arg;
+      } else if (key == "ptr") {
+        hook->ptr_arg = arg;
+      } else if (key == "class") {
+        hook->class_arg = arg;
+      } else if (key == "free_ptr") {
+        hook->free_ptr_arg = arg;
+      } else {
+        return false;
+      }
+    }
+    return true;
+}
+
+VOID ImageLoad(IMG img, VOID *v)
+{
+    InstrumentAllocHooks(img);
+
+    RTN rtn = OpenAllocator(img, "malloc");
+    if (RTN_Valid(rtn)) {
+      RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)MallocBefore, IARG_THREAD_ID, IARG_CONST_CONTEXT, IARG_REG_VALUE, REG_STACK_PTR, IARG_RETURN_IP,
+                     IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
+      RTN_Close(rtn);
+    }
+
+    rtn = OpenAllocator(img, "calloc");
+    if (RTN_Valid(rtn)) {
+      RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)CallocBefore, IARG_THREAD_ID, IARG_CONST_CONTEXT, IARG_REG_VALUE, REG_STACK_PTR, IARG_RETURN_IP,
+                     IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
+      RTN_Close(rtn);
+    }
+
+    rtn = OpenAllocator(img, "realloc");
+    if (RTN_Valid(rtn)) {
+      RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)ReallocBefore, IARG_THREAD_ID, IARG_CONST_CONTEXT, IARG_REG_VALUE, REG_STACK_PTR, IARG_RETURN_IP,
+                     IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
+      RTN_Close(rtn);
+    }
+
+    // mmap(addr, length, ...): only the length is needed, the address is the result
+    rtn = OpenAllocator(img, "mmap");
+    if (RTN_Valid(rtn)) {
+      RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)MallocBefore, IARG_THREAD_ID, IARG_CONST_CONTEXT, IARG_REG_VALUE, REG_STACK_PTR, IARG_RETURN_IP,
+                     IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
+      RTN_Close(rtn);
+    }
+
+    rtn = OpenAllocator(img, "free", true);
+    if (RTN_Valid(rtn)) {
+      RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)FreeBefore, IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
+      RTN_Close(rtn);
+    }
+
+    rtn = OpenAllocator(img, "munmap", true);
+    if (RTN_Valid(rtn)) {
+      RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)MunmapBefore,
+                     IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
+      RTN_Close(rtn);
+    }
+}
+
+// Writes back the lines still dirty at exit: every thread's (or core's) private levels into the
+// shared levels, then the shared levels to memory. Lines written back from the shared levels or from
+// cores are counted for thread 0, since they no longer belong to any one thread.
+VOID FlushCaches()
+{
+    if (all_thread_data.empty()) {
+      return;
+    }
+
+    for (size_t i = 0; i < cores.size(); i++) {
+      flush_private_caches(cores[i]->caches, shared_caches, &all_thread_data[0]->memory_write_backs);
+      all_thread_data[0]->count_write_backs(all_thread_data[0]->memory_write_backs);
+    }
+
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      thread_data *td = all_thread_data[i];
+      flush_private_caches(td->private_caches, shared_caches, &td->memory_write_backs);
+      td->count_write_backs(td->memory_write_backs);
+    }
+
+    std::vector<uint64_t> lines;
+    shared_caches.levels().flush(&lines);
+    all_thread_data[0]->count_write_backs(lines);
+}
+
+// Hands the accesses still queued to the hybrid memory simulator, decides the policies that need the
+// whole run and writes one row per policy
+VOID WriteTierReport(const char *filename)
+{
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      SimulateMemoryAccesses(all_thread_data[i]->memory_accesses);
+    }
+    tiers->finish();
+
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+      std::cerr << "Error: could not open " << filename << std::endl;
+      return;
+    }
+
+    fprintf(out, "# hybrid memory: %" PRIu64 " MB DRAM, NVM for the rest; %" PRIu64 " 4 KB pages reached memory; %" PRIu64 " epochs of %" PRIu64 " accesses\n",
+            dram_bytes >> 20, tiers->pages_seen(), tiers->epochs(), KnobTierEpoch.Value());
+    fprintf(out, "# per %u-byte line: DRAM read %g ns %g pJ, write %g ns %g pJ; NVM read %g ns %g pJ, write %g ns %g pJ\n", cache_line_size,
+            tier_config.dram_read_ns, tier_config.dram_read_pj, tier_config.dram_write_ns, tier_config.dram_write_pj,
+            tier_config.nvm_read_ns, tier_config.nvm_read_pj, tier_config.nvm_write_ns, tier_config.nvm_write_pj);
+    fprintf(out, "# memory and migration times add up the latencies without overlap; migration bytes count both directions\n");
+    fprintf(out, "#               policy     dram_reads      nvm_reads    dram_writes     nvm_writes promotions  demotions  migration_bytes"
+                 "   memory_ms migration_ms    total_ms   energy_mj\n");
+    for (int p = 0; p < tier_simulator::NUM_POLICIES; p++) {
+      const tier_costs &c = tiers->costs_of(p);
+      fprintf(out, "policy %15s %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %10" PRIu64 " %10" PRIu64 " %16" PRIu64
+                   " %11.3f %12.3f %11.3f %11.3f\n",
+              tier_simulator::policy_name(p), c.reads[0], c.reads[1], c.writes[0], c.writes[1], c.promotions, c.demotions,
+              (c.promotions + c.demotions) << TRACE_PAGE_SHIFT, c.memory_ns / 1e6, c.migration_ns / 1e6,
+              (c.memory_ns + c.migration_ns) / 1e6, c.energy_pj / 1e9);
+    }
+
+    fclose(out);
+}
+
+VOID ReportCoherence()
+{
+    line_event_counts total;
+    memset(&total, 0, sizeof(total));
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      const page_table_of<line_event_counts> &events = all_thread_data[i]->line_events;
+      for (size_t j = 0; j < events.capacity(); j++) {
+        if (events.used(j)) {
+          total += events.counts_at(j);
+        }
+      }
+    }
+
+    size_t directory_lines = 0;
+    for (UINT32 i = 0; i < shared_caches.num_stripes(); i++) {
+      directory_lines += directories[i].size();
+    }
+
+    std::cout << "Coherence: " << cores.size() << " cores, " << total.invalidations << " invalidations, " << total.coherence_misses
+              << " coherence misses, " << total.write_backs << " write-backs; " << directory_lines << " lines in the directory at exit" << std::endl;
+}
+
+void aggregate_thread_data(page_table &result)
+{
+  for (size_t i = 0; i < all_thread_data.size(); i++) {
+    result.merge(all_thread_data[i]->pages);
+  }
+}
+
+// -counters sketch: merges the threads' sketches and adds the -sketch_topk pages of the union of
+// their top-k tables with the highest merged estimates to result. The application threads must be
+// stopped or done.
+VOID HeavyHitters(page_table *result, bool report)
+{
+    count_min_sketch merged(KnobSketchWidth.Value(), KnobSketchDepth.Value());
+    std::vector<uint64_t> candidates;
+    uint64_t threshold = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      const thread_data *td = all_thread_data[i];
+      merged.merge(*td->sketch);
+      for (size_t j = 0; j < td->hot_pages->size(); j++) {
+        candidates.push_back(td->hot_pages->at(j).pageno);
+      }
+      threshold += td->hot_pages->min_weight();
+      bytes += td->sketch->bytes() + td->hot_pages->bytes();
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    bool by_accesses = KnobCounts.Value() != "cache";
+    std::vector<std::pair<uint64_t, uint64_t> > ranked;
+    for (size_t i = 0; i < candidates.size(); i++) {
+      page_counts c = merged.estimate(candidates[i]);
+      ranked.push_back(std::make_pair(by_accesses ? c.read_without_cache + c.write_without_cache : c.read_with_cache + c.write_with_cache,
+                                      candidates[i]));
+    }
+    size_t k = std::min(ranked.size(), (size_t)KnobSketchTopK.Value());
+    std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(), std::greater<std::pair<uint64_t, uint64_t> >());
+    for (size_t i = 0; i < k; i++) {
+      *result->lookup(ranked[i].second) = merged.estimate(ranked[i].second);
+    }
+
+    if (report) {
+      const page_counts &total = merged.total();
+      uint64_t ranked_total = by_accesses ? total.read_without_cache + total.write_without_cache : total.read_with_cache + total.write_with_cache;
+      std::cout << "Sketch: " << ranked_total << (by_accesses ? " accesses" : " cache misses") << ", top " << k << " of " << candidates.size()
+                << " candidate pages in the trace; each estimate exceeds its true count by at most " << (UINT64)merged.error_bound(ranked_total)
+                << " (each counter: e / " << KnobSketchWidth.Value() << " of its total) with probability " << 1 - merged.failure_probability()
+                << "; every page above " << threshold << " is a candidate; " << (bytes >> 10) << " KB in " << all_thread_data.size() << " threads"
+                << std::endl;
+    }
+}
+
+// Estimated number of accesses behind a sampled count
+uint64_t scale_sampled_count(uint64_t count)
+{
+    return sampling_mode == SAMPLING_OFF ? count : (uint64_t)(count * sample_scale + 0.5);
+}
+
+// Standard error of scale_sampled_count(count)
+uint64_t sampled_count_error(uint64_t count)
+{
+    return (uint64_t)(sqrt((double)count) * sample_scale + 0.5);
+}
+
+// Converts one of the counters of every page into a JSON object of page number => count. Pages whose
+// selected counter is zero are left out, matching what the old per-counter maps stored.
+template <class COUNTS>
+Json::Value convert_page_table_to_json_value(const page_table_of<COUNTS> &pages, uint64_t COUNTS::*counter)
+{
+    Json::Value result(Json::objectValue);
+
+    for (size_t i = 0; i < pages.capacity(); i++) {
+      if (!pages.used(i) || pages.counts_at(i).*counter == 0) {
+        continue;
+      }
+
+      // convert uint64_t to string
+      std::ostringstream o, o2;
+      o << pages.pageno_at(i);
+      o2 << scale_sampled_count(pages.counts_at(i).*counter);
+
+      result[o.str()] = o2.str();
+    }
+
+    return result;
+}
+
+trace_writer binary_writer;
+
+// Writes one thread's write-backs and, with -cores, coherence events (counted at count_shift) at
+// every granularity in granularity_shifts
+void write_line_event_sections(trace_writer &writer, uint32_t thread, const page_table_of<line_event_counts> &line_events)
+{
+    std::vector<page_table_of<line_event_counts> *> derived;
+    const page_table_of<line_event_counts> *finer = &line_events;
+    UINT32 finer_shift = count_shift;
+
+    for (size_t i = 0; i < granularity_shifts.size(); i++) {
+      UINT32 shift = granularity_shifts[i];
+      if (shift != finer_shift) {
+        page_table_of<line_event_counts> *coarse = new page_table_of<line_event_counts>;
+        coarse->merge_coarsened(*finer, shift - finer_shift);
+        derived.push_back(coarse);
+        finer = coarse;
+        finer_shift = shift;
+      }
+      write_line_events_sections(writer, thread, *finer, shift, !cores.empty(), scale_sampled_count,
+                                 sampling_mode != SAMPLING_OFF ? sampled_count_error : NULL);
+    }
+
+    for (size_t i = 0; i < derived.size(); i++) {
+      delete derived[i];
+    }
+}
+
+// Writes one thread's counts (counted at count_shift) at every granularity in granularity_shifts.
+// kind_flags is 0 for run totals, SECTION_EPOCH for the delta of one epoch, or SECTION_ALLOC_CLASS
+// for the accesses to the objects of custom allocation class group.
+void write_page_table_sections(trace_writer &writer, uint32_t thread, const page_table &pages,
+                               uint32_t kind_flags = 0, uint32_t epoch = 0, uint64_t timestamp_ms = 0, uint32_t group = 0)
+{
+    // each level is derived from the previous (finer) one, which is already smaller than pages
+    std::vector<page_table *> derived;
+    const page_table *finer = &pages;
+    UINT32 finer_shift = count_shift;
+
+    for (size_t i = 0; i < granularity_shifts.size(); i++) {
+      UINT32 shift = granularity_shifts[i];
+      if (shift != finer_shift) {
+        page_table *coarse = new page_table;
+        coarse->merge_coarsened(*finer, shift - finer_shift);
+        derived.push_back(coarse);
+        finer = coarse;
+        finer_shift = shift;
+      }
+      write_page_counts_sections(writer, thread, *finer, shift, kind_flags, epoch, timestamp_ms, group, scale_sampled_count,
+                                 sampling_mode != SAMPLING_OFF ? sampled_count_error : NULL);
+    }
+
+    for (size_t i = 0; i < derived.size(); i++) {
+      delete derived[i];
+    }
+}
+
+// Prints how reliably sampling identified the hottest pages of the run (all threads, reads and
+// writes without the cache filter): a page of the top k is certain if its 95% confidence interval
+// stays above the interval of the first page outside the top k.
+VOID ReportSamplingError()
+{
+    page_table pages;
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      pages.merge_coarsened(all_thread_data[i]->run_totals(), TRACE_PAGE_SHIFT - count_shift);
+    }
+
+    std::vector<uint64_t> samples;
+    for (size_t i = 0; i < pages.capacity(); i++) {
+      if (pages.used(i)) {
+        const page_counts &c = pages.counts_at(i);
+        samples.push_back(c.read_without_cache + c.write_without_cache);
+      }
+    }
+    std::sort(samples.rbegin(), samples.rend());
+
+    size_t k = std::min((size_t)KnobSampleTopK.Value(), samples.size());
+    if (k == 0) {
+      return;
+    }
+
+    double boundary_high = k < samples.size() ? samples[k] + 1.96 * sqrt((double)samples[k]) : 0;
+    size_t certain = 0;
+    double relative_error = 0;
+    for (size_t i = 0; i < k; i++) {
+      if (samples[i] - 1.96 * sqrt((double)samples[i]) > boundary_high) {
+        certain++;
+      }
+      relative_error += 1.0 / sqrt((double)samples[i]);
+    }
+
+    std::cout << "Sampling: scale " << sample_scale << ", " << samples.size() << " pages sampled" << std::endl;
+    std::cout << "Sampling: top-" << k << " pages have a mean relative standard error of " << relative_error / k
+              << "; " << certain << " of them are certain members of the top " << k << std::endl;
+}
+
+// IP attribution report
+// ======================
+//
+// With -ip_report, Fini() merges the per-thread ip_tables and writes the instructions and the
+// functions that made the most memory accesses, with their cache misses, the number of distinct 4 KB
+// pages they touched and their dominant page. Symbols are looked up at exit, so instructions of images
+// unloaded before then are reported as '?'.
+
+struct ip_report_entry
+{
+    UINT64 ip;
+    ip_counts counts;
+    std::string function;
+    std::string image;
+};
+
+bool compare_ip_report_entries(const ip_report_entry &a, const ip_report_entry &b)
+{
+    return a.counts.accesses > b.counts.accesses;
+}
+
+VOID WriteIpReportLine(FILE *out, size_t rank, const ip_counts &counts, UINT64 total_accesses, const std::string &what)
+{
+    char misses[32] = "-";
+    if (KnobCounts.Value() != "no_cache") {
+      snprintf(misses, sizeof(misses), "%" PRIu64, scale_sampled_count(counts.misses));
+    }
+    fprintf(out, "%5zu %14" PRIu64 " %6.2f%% %14s %8.0f  0x%012" PRIx64 "  %s\n", rank, scale_sampled_count(counts.accesses),
+            100.0 * counts.accesses / std::max(total_accesses, (UINT64)1), misses, counts.distinct_pages(),
+            counts.dominant_pageno << TRACE_PAGE_SHIFT, what.c_str());
+}
+
+VOID WriteIpReport(const char *filename)
+{
+    ip_table ips;
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      ips.merge(all_thread_data[i]->ips);
+    }
+
+    std::vector<ip_report_entry> entries;
+    entries.reserve(ips.size());
+    UINT64 total_accesses = 0;
+    for (size_t i = 0; i < ips.capacity(); i++) {
+      if (ips.used(i)) {
+        ip_report_entry entry;
+        entry.ip = ips.ip_at(i);
+        entry.counts = ips.counts_at(i);
+        entries.push_back(entry);
+        total_accesses += entry.counts.accesses;
+      }
+    }
+    std::sort(entries.begin(), entries.end(), compare_ip_report_entries);
+
+    // every instruction is symbolized so that functions include all of their instructions
+    std::map<std::string, ip_counts> functions;
+    PIN_LockClient();
+    for (size_t i = 0; i < entries.size(); i++) {
+      RTN rtn = RTN_FindByAddress(entries[i].ip);
+      IMG img = IMG_FindByAddress(entries[i].ip);
+      entries[i].function = RTN_Valid(rtn) ? RTN_Name(rtn) : "?";
+      entries[i].image = IMG_Valid(img) ? IMG_Name(img) : "?";
+      functions[entries[i].function + " (" + entries[i].image + ")"].merge(entries[i].counts);
+    }
+
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+      PIN_UnlockClient();
+      std::cerr << "Error: could not open " << filename << std::endl;
+      return;
+    }
+
+    size_t k = std::min((size_t)KnobIpTopK.Value(), entries.size());
+    fprintf(out, "# %zu instructions made %" PRIu64 " memory accesses\n\n", entries.size(), scale_sampled_count(total_accesses));
+    fprintf(out, "# top %zu instructions\n", k);
+    fprintf(out, "# rank       accesses   share         misses    pages  dominant_page   ip function (image) source\n");
+    for (size_t i = 0; i < k; i++) {
+      INT32 column = 0, line = 0;
+      std::string file;
+      PIN_GetSourceLocation(entries[i].ip, &column, &line, &file);
+
+      std::ostringstream what;
+      what << "0x" << std::hex << entries[i].ip << std::dec << " " << entries[i].function << " (" << entries[i].image << ")";
+      if (!file.empty()) {
+        what << " " << file << ":" << line;
+      }
+      WriteIpReportLine(out, i + 1, entries[i].counts, total_accesses, what.str());
+    }
+    PIN_UnlockClient();
+
+    std::vector<ip_report_entry> function_entries;
+    for (std::map<std::string, ip_counts>::iterator it = functions.begin(); it != functions.end(); ++it) {
+      ip_report_entry entry;
+      entry.function = it->first;
+      entry.counts = it->second;
+      function_entries.push_back(entry);
+    }
+    std::sort(function_entries.begin(), function_entries.end(), compare_ip_report_entries);
+
+    k = std::min((size_t)KnobIpTopK.Value(), function_entries.size());
+    fprintf(out, "\n# top %zu functions\n", k);
+    fprintf(out, "# rank       accesses   share         misses    pages  dominant_page   function (image)\n");
+    for (size_t i = 0; i < k; i++) {
+      WriteIpReportLine(out, i + 1, function_entries[i].counts, total_accesses, function_entries[i].function);
+    }
+
+    fclose(out);
+}
+
+// Writes the accesses made to the memory of every allocation site, hottest first, with the site's
+// call stack (innermost frame first). Return addresses are symbolized one byte back so that they
+// resolve to the line of the call.
+VOID WriteAllocReport(const char *filename)
+{
+    std::vector<alloc_site_counts> totals(alloc_sites.size());
+    UINT64 total_accesses = 0;
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      const std::vector<alloc_site_counts> &sites = all_thread_data[i]->sites;
+      for (size_t j = 0; j < sites.size(); j++) {
+        totals[j].reads += sites[j].reads;
+        totals[j].writes += sites[j].writes;
+        totals[j].misses += sites[j].misses;
+        total_accesses += sites[j].reads + sites[j].writes;
+      }
+    }
+
+    std::vector<std::pair<UINT64, UINT32> > order;
+    for (size_t i = 0; i < totals.size(); i++) {
+      order.push_back(std::make_pair(totals[i].reads + totals[i].writes, i));
+    }
+    std::sort(order.rbegin(), order.rend());
+
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+      std::cerr << "Error: could not open " << filename << std::endl;
+      return;
+    }
+
+    fprintf(out, "# %zu allocation sites, %" PRIu64 " accesses to allocated memory\n", alloc_sites.size(), scale_sampled_count(total_accesses));
+    fprintf(out, "# site          reads         writes         misses  allocations            bytes  stack\n");
+
+    PIN_LockClient();
+    for (size_t i = 0; i < order.size(); i++) {
+      UINT32 id = order[i].second;
+      const alloc_site &site = alloc_sites[id];
+      const alloc_site_counts &counts = totals[id];
+
+      char misses[32] = "-";
+      if (KnobCounts.Value() != "no_cache") {
+        snprintf(misses, sizeof(misses), "%" PRIu64, scale_sampled_count(counts.misses));
+      }
+      fprintf(out, "%6u %14" PRIu64 " %14" PRIu64 " %14s %12" PRIu64 " %16" PRIu64 " ", id, scale_sampled_count(counts.reads),
+              scale_sampled_count(counts.writes), misses, site.allocations, site.bytes);
+
+      for (INT32 f = 0; f < site.num_frames; f++) {
+        ADDRINT ip = (ADDRINT)site.frames[f] - 1;
+        INT32 column = 0, line = 0;
+        std::string file;
+        PIN_GetSourceLocation(ip, &column, &line, &file);
+        RTN rtn = RTN_FindByAddress(ip);
+        fprintf(out, "%s%s", f == 0 ? " " : " < ", RTN_Valid(rtn) ? RTN_Name(rtn).c_str() : "?");
+        if (!file.empty()) {
+          fprintf(out, " %s:%d", file.c_str(), line);
+        }
+      }
+      fprintf(out, "\n");
+    }
+    PIN_UnlockClient();
+
+    if (!alloc_hooks.empty()) {
+      std::vector<alloc_site_counts> class_totals(alloc_classes.size());
+      for (size_t i = 0; i < all_thread_data.size(); i++) {
+        const std::vector<alloc_site_counts> &classes = all_thread_data[i]->classes;
+        for (size_t j = 0; j < classes.size(); j++) {
+          class_totals[j].reads += classes[j].reads;
+          class_totals[j].writes += classes[j].writes;
+          class_totals[j].misses += classes[j].misses;
+        }
+      }
+
+      // page counts per class are in the binary trace, in SECTION_ALLOC_CLASS sections with group = id
+      fprintf(out, "\n# %zu custom allocation classes\n", alloc_classes.size());
+      fprintf(out, "#        id          reads         writes         misses  allocations            bytes  name\n");
+      for (size_t i = 0; i < alloc_classes.size(); i++) {
+        char misses[32] = "-";
+        if (KnobCounts.Value() != "no_cache") {
+          snprintf(misses, sizeof(misses), "%" PRIu64, scale_sampled_count(class_totals[i].misses));
+        }
+        fprintf(out, "class %4zu %14" PRIu64 " %14" PRIu64 " %14s %12" PRIu64 " %16" PRIu64 "  %s\n", i, scale_sampled_count(class_totals[i].reads),
+                scale_sampled_count(class_totals[i].writes), misses, alloc_classes[i].allocations, alloc_classes[i].bytes,
+                alloc_classes[i].name.c_str());
+      }
+    }
+
+    fclose(out);
+}
+
+// Footprint of the objects and of the 4 KB pages that receive share of the accesses to objects,
+// placing the densest objects (approximated to a quarter octave of accesses per byte) or the hottest
+// pages first
+struct object_coverage
+{
+    double share;
+    double object_bytes;
+    double objects;
+    UINT64 pages;
+};
+
+std::vector<object_coverage> ObjectCoverage(const object_histogram &stats, const page_table &pages)
+{
+    const double shares[] = { 0.5, 0.9, 0.99 };
+
+    UINT64 total = 0;
+    for (int b = 1; b < object_histogram::DENSITY_BUCKETS; b++) {
+      total += stats.densities[b].accesses;
+    }
+
+    std::vector<UINT64> page_accesses;
+    UINT64 page_total = 0;
+    for (size_t i = 0; i < pages.capacity(); i++) {
+      if (pages.used(i)) {
+        page_accesses.push_back(pages.counts_at(i).read_without_cache + pages.counts_at(i).write_without_cache);
+        page_total += page_accesses.back();
+      }
+    }
+    std::sort(page_accesses.rbegin(), page_accesses.rend());
+
+    std::vector<object_coverage> result;
+    for (size_t s = 0; s < sizeof(shares) / sizeof(shares[0]); s++) {
+      object_coverage c;
+      c.share = shares[s];
+      c.object_bytes = 0;
+      c.objects = 0;
+      c.pages = 0;
+
+      double target = shares[s] * total, covered = 0;
+      for (int b = object_histogram::DENSITY_BUCKETS - 1; b > 0 && covered < target; b--) {
+        const object_histogram::cell &bucket = stats.densities[b];
+        double fraction = std::min(1.0, (target - covered) / std::max(bucket.accesses, (UINT64)1));
+        covered += bucket.accesses;
+        c.object_bytes += fraction * bucket.bytes;
+        c.objects += fraction * bucket.objects;
+      }
+
+      double page_target = shares[s] * page_total, page_covered = 0;
+      while (c.pages < page_accesses.size() && page_covered < page_target) {
+        page_covered += page_accesses[c.pages++];
+      }
+      result.push_back(c);
+    }
+    return result;
+}
+
+VOID WriteObjectReport(const char *filename)
+{
+    objects->retire_live();
+    const object_histogram &stats = objects->stats();
+
+    page_table pages;
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      pages.merge(all_thread_data[i]->object_pages);
+    }
+
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+      std::cerr << "Error: could not open " << filename << std::endl;
+      return;
+    }
+
+    bool with_misses = KnobCounts.Value() != "no_cache";
+    char misses[32] = "-";
+
+    UINT64 total_bytes = 0, total_accesses = 0;
+    for (int s = 0; s < object_histogram::CLASSES; s++) {
+      for (int h = 0; h < object_histogram::CLASSES; h++) {
+        total_bytes += stats.cells[s][h].bytes;
+        total_accesses += stats.cells[s][h].accesses;
+      }
+    }
+    fprintf(out, "# %" PRIu64 " objects (%" PRIu64 " live at exit), %" PRIu64 " bytes, %" PRIu64 " accesses to objects\n",
+            objects->objects(), objects->live(), total_bytes, scale_sampled_count(total_accesses));
+
+    fprintf(out, "\n# footprint that receives a share of the accesses to objects, placing the densest objects or the hottest 4 KB pages first\n");
+    fprintf(out, "#        share    object_bytes        objects      page_bytes          pages\n");
+    std::vector<object_coverage> coverage = ObjectCoverage(stats, pages);
+    for (size_t i = 0; i < coverage.size(); i++) {
+      fprintf(out, "coverage %5.2f %15.0f %14.0f %15" PRIu64 " %14" PRIu64 "\n", coverage[i].share, coverage[i].object_bytes, coverage[i].objects,
+              coverage[i].pages << TRACE_PAGE_SHIFT, coverage[i].pages);
+    }
+
+    fprintf(out, "\n# objects by size, in bytes (min, max]\n");
+    fprintf(out, "#   size_min     size_max        objects            bytes      untouched         accesses           misses  accesses/byte\n");
+    for (int s = 0; s < object_histogram::CLASSES; s++) {
+      object_histogram::cell sum = object_histogram::cell();
+      for (int h = 0; h < object_histogram::CLASSES; h++) {
+        sum.objects += stats.cells[s][h].objects;
+        sum.bytes += stats.cells[s][h].bytes;
+        sum.accesses += stats.cells[s][h].accesses;
+        sum.misses += stats.cells[s][h].misses;
+      }
+      if (sum.objects == 0) {
+        continue;
+      }
+      if (with_misses) {
+        snprintf(misses, sizeof(misses), "%" PRIu64, scale_sampled_count(sum.misses));
+      }
+      fprintf(out, "size %8" PRIu64 " %12" PRIu64 " %14" PRIu64 " %16" PRIu64 " %14" PRIu64 " %16" PRIu64 " %16s %14.3f\n",
+              object_histogram::class_min(s), object_histogram::class_max(s), sum.objects, sum.bytes, stats.cells[s][0].objects,
+              scale_sampled_count(sum.accesses), misses, (double)scale_sampled_count(sum.accesses) / std::max(sum.bytes, (UINT64)1));
+    }
+
+    fprintf(out, "\n# objects by size, in bytes (min, max], and by accesses (min, max]\n");
+    fprintf(out, "#   size_min     size_max     accesses_min     accesses_max        objects            bytes         accesses           misses\n");
+    for (int s = 0; s < object_histogram::CLASSES; s++) {
+      for (int h = 0; h < object_histogram::CLASSES; h++) {
+        const object_histogram::cell &cell = stats.cells[s][h];
+        if (cell.objects == 0) {
+          continue;
+        }
+        if (with_misses) {
+          snprintf(misses, sizeof(misses), "%" PRIu64, scale_sampled_count(cell.misses));
+        }
+        fprintf(out, "cell %8" PRIu64 " %12" PRIu64 " %16" PRIu64 " %16" PRIu64 " %14" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16s\n",
+                object_histogram::class_min(s), object_histogram::class_max(s), scale_sampled_count(object_histogram::class_min(h)),
+                scale_sampled_count(object_histogram::class_max(h)), cell.objects, cell.bytes, scale_sampled_count(cell.accesses), misses);
+      }
+    }
+
+    std::vector<object_counts> hottest = objects->hottest_objects();
+    fprintf(out, "\n# the %zu hottest objects (site: see -alloc_report)\n", hottest.size());
+    fprintf(out, "#          size            reads           writes           misses   first_ms    last_ms  site\n");
+    for (size_t i = 0; i < hottest.size(); i++) {
+      const object_counts &o = hottest[i];
+      if (with_misses) {
+        snprintf(misses, sizeof(misses), "%" PRIu64, scale_sampled_count(o.misses));
+      }
+      fprintf(out, "object %12" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16s %10u %10u  ", o.size, scale_sampled_count(o.reads),
+              scale_sampled_count(o.writes), misses, o.first_ms, o.last_ms);
+      if (o.flags & object_counts::CUSTOM) {
+        fprintf(out, "class=%u %s\n", o.site, alloc_classes[o.site].name.c_str());
+      } else {
+        fprintf(out, "site=%u\n", o.site);
+      }
+    }
+
+    fclose(out);
+}
+
+VOID WriteReuseReport(const char *filename)
+{
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+      std::cerr << "Error: could not open " << filename << std::endl;
+      return;
+    }
+
+    double total = reuse_distances.total();
+    fprintf(out, "# reuse distances of %.0f accesses in %u-byte lines (sampling rate %g at exit, %zu lines tracked, %zu pages "
+            "with histograms, page sampling rate %g)\n",
+            total, cache_line_size, reuse_engine->rate(), reuse_engine->lines(), page_reuses->size(), page_reuses->rate());
+    fprintf(out, "# a fully associative LRU cache of C lines misses the accesses at distances >= C, and the cold ones\n");
+    fprintf(out, "#     distance_min     distance_max         accesses  share_at_least_min\n");
+    double at_least = total;
+    for (size_t b = 0; b < reuse_distances.size(); b++) {
+      if (reuse_distances.at(b) == 0) {
+        continue;
+      }
+      // everything below bucket b has been subtracted
+      fprintf(out, "reuse %16.1f %16.1f %16.0f %19.6f\n", reuse_distances.lower(b), reuse_distances.upper(b), reuse_distances.at(b),
+              total > 0 ? at_least / total : 0);
+      at_least -= reuse_distances.at(b);
+    }
+    fprintf(out, "cold %16.0f %19.6f\n", reuse_distances.cold(), total > 0 ? reuse_distances.cold() / total : 0);
+
+    fclose(out);
+}
+
+// Miss-ratio curves of fully associative LRU caches of every size in mrc_sizes, derived from the
+// reuse-distance histograms: one for caches of cache lines and one for tiers of 4 KB pages. They are
+// written to filename and to the trace as SECTION_MRC sections (group 0: lines, 1: pages) whose page
+// numbers are sizes in bytes and whose counts are estimated misses; size 0 counts every access.
+VOID WriteMissRatioCurves(const char *filename, trace_writer *writer)
+{
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+      std::cerr << "Error: could not open " << filename << std::endl;
+      return;
+    }
+
+    const reuse_histogram *histograms[] = { &reuse_distances, &page_stream_distances };
+    const UINT64 units[] = { cache_line_size, 1ULL << TRACE_PAGE_SHIFT };
+    const char *names[] = { "line", "page" };
+
+    fprintf(out, "# miss ratios of fully associative LRU caches of %u-byte lines and tiers of 4 KB pages (sampling rates %g and %g at exit)\n",
+            cache_line_size, reuse_engine->rate(), page_stream_engine->rate());
+    fprintf(out, "#        size_bytes           misses  miss_ratio\n");
+    for (UINT32 g = 0; g < 2; g++) {
+      double total = histograms[g]->total();
+      std::vector<uint64_t> sizes(1, 0), misses(1, (uint64_t)(total + 0.5));
+      for (size_t i = 0; i < mrc_sizes.size(); i++) {
+        double m = histograms[g]->at_least((double)mrc_sizes[i] / units[g]);
+        fprintf(out, "%s %16" PRIu64 " %16.0f %11.6f\n", names[g], mrc_sizes[i], m, total > 0 ? m / total : 0);
+        sizes.push_back(mrc_sizes[i]);
+        misses.push_back((uint64_t)(m + 0.5));
+      }
+      if (writer != NULL) {
+        writer->add_section(SECTION_MRC, 0, &sizes[0], &misses[0], sizes.size(), 0, 0, TRACE_PAGE_SHIFT, g);
+      }
+    }
+
+    fclose(out);
+}
+
+// Writes the per-page histograms as one SECTION_REUSE section per bucket, with group = bucket
+VOID WriteReuseSections(trace_writer &writer)
+{
+    std::vector<std::pair<uint64_t, size_t> > slots;
+    for (size_t i = 0; i < page_reuses->capacity(); i++) {
+      if (page_reuses->used(i)) {
+        slots.push_back(std::make_pair(page_reuses->pageno_at(i), i));
+      }
+    }
+    std::sort(slots.begin(), slots.end());
+
+    for (int b = 0; b < page_reuse::BUCKETS; b++) {
+      std::vector<uint64_t> pagenos, counts;
+      for (size_t i = 0; i < slots.size(); i++) {
+        uint64_t count = (uint64_t)(page_reuses->at(slots[i].second).weights[b] + 0.5);
+        if (count != 0) {
+          pagenos.push_back(slots[i].first);
+          counts.push_back(count);
+        }
+      }
+      if (!pagenos.empty()) {
+        writer.add_section(SECTION_REUSE, 0, &pagenos[0], &counts[0], pagenos.size(), 0, 0, TRACE_PAGE_SHIFT, b);
+      }
+    }
+}
+
+// The 4 KB pages that any thread accessed, in order
+std::vector<uint64_t> TracedPages()
+{
+    page_table pages;
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      pages.merge_coarsened(all_thread_data[i]->run_totals(), TRACE_PAGE_SHIFT - count_shift);
+    }
+
+    std::vector<uint64_t> pagenos;
+    for (size_t i = 0; i < pages.capacity(); i++) {
+      if (pages.used(i)) {
+        pagenos.push_back(pages.pageno_at(i));
+      }
+    }
+    std::sort(pagenos.begin(), pagenos.end());
+    return pagenos;
+}
+
+VOID WriteRegions(const char *filename)
+{
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+      std::cerr << "Error: could not open " << filename << std::endl;
+      return;
+    }
+
+    fprintf(out, "#      id   kind  ordinal              start         size  name\n");
+    for (UINT32 id = 0; id < regions.size(); id++) {
+      const region &r = regions.at(id);
+      fprintf(out, "region %4u %6s %8u 0x%016" PRIx64 " %12" PRIu64 "  %s\n", id, region_kind_name(r.kind), r.ordinal, r.start, r.size, r.name.c_str());
+    }
+
+    fclose(out);
+}
+
+// Writes the region of every traced page as SECTION_REGION sections (see trace_format.h)
+VOID WriteRegionSections(trace_writer &writer)
+{
+    std::vector<uint64_t> pagenos, ids, offsets;
+    std::vector<uint64_t> traced = TracedPages();
+    for (size_t i = 0; i < traced.size(); i++) {
+      UINT32 id;
+      uint64_t offset;
+      if (regions.find(traced[i] << TRACE_PAGE_SHIFT, &id, &offset)) {
+        pagenos.push_back(traced[i]);
+        ids.push_back(id);
+        offsets.push_back(offset >> TRACE_PAGE_SHIFT);
+      }
+    }
+
+    std::vector<uint64_t> region_ids, kinds, ordinals;
+    for (UINT32 id = 0; id < regions.size(); id++) {
+      region_ids.push_back(id);
+      kinds.push_back(regions.at(id).kind);
+      ordinals.push_back(regions.at(id).ordinal);
+    }
+
+    if (!pagenos.empty()) {
+      writer.add_section(SECTION_REGION, 0, &pagenos[0], &ids[0], pagenos.size(), 0, 0, TRACE_PAGE_SHIFT, 0);
+      writer.add_section(SECTION_REGION, 0, &pagenos[0], &offsets[0], pagenos.size(), 0, 0, TRACE_PAGE_SHIFT, 1);
+    }
+    if (!region_ids.empty()) {
+      writer.add_section(SECTION_REGION, 0, &region_ids[0], &kinds[0], region_ids.size(), 0, 0, TRACE_PAGE_SHIFT, 2);
+      writer.add_section(SECTION_REGION, 0, &region_ids[0], &ordinals[0], region_ids.size(), 0, 0, TRACE_PAGE_SHIFT, 3);
+    }
+}
+
+// Serializes everything that reads or writes thread_data::totals outside of Fini()
+PIN_LOCK collect_lock;
+
+// Moves every retired epoch into the trace and into its thread's run totals; collect_lock must be held
+VOID CollectEpochsLocked()
+{
+    PIN_GetLock(&lock, 0);
+    std::vector<thread_data *> threads = all_thread_data;
+    PIN_ReleaseLock(&lock);
+
+    for (size_t i = 0; i < threads.size(); i++) {
+      thread_data *td = threads[i];
+
+      std::vector<retired_epoch> batch;
+      PIN_GetLock(&td->retired_lock, 0);
+      batch.swap(td->retired);
+      PIN_ReleaseLock(&td->retired_lock);
+
+      for (size_t j = 0; j < batch.size(); j++) {
+        if (batch[j].pages->size() != 0) {
+          write_page_table_sections(binary_writer, td->index, *batch[j].pages, SECTION_EPOCH, batch[j].epoch, batch[j].timestamp_ms);
+          td->totals.merge(*batch[j].pages);
+        }
+        delete batch[j].pages;
+      }
+    }
+}
+
+VOID CollectEpochs()
+{
+    PIN_GetLock(&collect_lock, 0);
+    CollectEpochsLocked();
+    PIN_ReleaseLock(&collect_lock);
+}
+
+// Internal threads poll this and return once the application is exiting
+volatile bool internal_threads_exit = false;
+std::vector<PIN_THREAD_UID> internal_threads;
+
+// Pin internal thread that ends time-based epochs and writes out retired ones
+VOID EpochThread(VOID *arg)
+{
+    // with -epoch_accesses the threads end their own epochs; just collect them regularly
+    UINT32 sleep_ms = epoch_mode == EPOCHS_BY_TIME ? KnobEpochMs.Value() : 100;
+
+    while (!internal_threads_exit && !PIN_IsProcessExiting()) {
+      PIN_Sleep(sleep_ms);
+      if (epoch_mode == EPOCHS_BY_TIME) {
+        current_epoch++;
+      }
+      CollectEpochs();
+    }
+}
+
+// With -capture: takes the oldest queued chunk, if any
+bool NextCaptureChunk(capture_chunk *chunk)
+{
+    PIN_GetLock(&capture_lock, 0);
+    bool found = !capture_queue.empty();
+    if (found) {
+      *chunk = capture_queue.front();
+      capture_queue.pop_front();
+    }
+    PIN_ReleaseLock(&capture_lock);
+    return found;
+}
+
+// Compresses a chunk and writes it along with any of the file's later chunks that were waiting for it
+VOID WriteCaptureChunk(const capture_chunk &chunk, std::vector<uint8_t> &scratch)
+{
+    address_chunk *compressed = new address_chunk;
+    compress_chunk(chunk.records, chunk.count, chunk.first_record, chunk.first_timestamp_us, compressed, scratch);
+
+    PIN_GetLock(&capture_lock, 0);
+    capture_free_chunks.push_back(chunk.records);
+    PIN_ReleaseLock(&capture_lock);
+
+    capture_file *file = chunk.file;
+    PIN_GetLock(&file->lock, 0);
+    file->compressed[chunk.sequence] = compressed;
+    std::map<UINT64, address_chunk *>::iterator it;
+    while ((it = file->compressed.find(file->next_sequence)) != file->compressed.end()) {
+      file->writer.append(*it->second);
+      delete it->second;
+      file->compressed.erase(it);
+      file->next_sequence++;
+    }
+    PIN_ReleaseLock(&file->lock);
+}
+
+// Pin internal thread that compresses and writes queued chunks; returns once the application is
+// exiting and the queue is empty
+VOID CaptureThread(VOID *arg)
+{
+    std::vector<uint8_t> scratch;
+    capture_chunk chunk;
+    while (true) {
+      if (NextCaptureChunk(&chunk)) {
+        WriteCaptureChunk(chunk, scratch);
+      } else if (internal_threads_exit || PIN_IsProcessExiting()) {
+        break;
+      } else {
+        PIN_Sleep(1);
+      }
+    }
+
+    PIN_GetLock(&capture_lock, 0);
+    capture_threads_running--;
+    PIN_ReleaseLock(&capture_lock);
+}
+
+// Control channel
+// ===============
+//
+// If PINATRACE_PIPE names a FIFO, the control thread reads commands from it, one per line:
+//
+//   start            instrument memory accesses (also accepted: "A", as written by run.sh)
+//   stop             remove all instrumentation; the application runs at plain Pin speed
+//   reset            zero every page counter
+//   snapshot FILE    write the counts so far to FILE in the binary format
+//
+// Starting and stopping flush the code cache with PIN_RemoveInstrumentation(); the instrumentation
+// routines check tracing_enabled, so while tracing is off the re-translated code has no analysis
+// calls at all. reset and snapshot briefly stop the application threads so that they can read and
+// clear the thread-private counters safely.
+
+VOID SetTracing(bool enabled)
+{
+    if (tracing_enabled == enabled) {
+      return;
+    }
+    tracing_enabled = enabled;
+    PIN_RemoveInstrumentation();
+}
+
+VOID ResetCounters()
+{
+    PIN_GetLock(&collect_lock, 0);
+    CollectEpochsLocked();
+
+    if (PIN_StopApplicationThreads(PIN_ThreadId())) {
+      PIN_GetLock(&lock, 0);
+      for (size_t i = 0; i < all_thread_data.size(); i++) {
+        thread_data *td = all_thread_data[i];
+        td->pages.clear();
+        td->totals.clear();
+        if (sketch_counting) {
+          td->sketch->clear();
+          td->hot_pages->clear();
+        }
+        td->ips.clear();
+        td->line_events.clear();
+        td->sites.clear();
+        td->classes.clear();
+        for (size_t j = 0; j < td->class_pages.size(); j++) {
+          delete td->class_pages[j];
+        }
+        td->class_pages.clear();
+        td->object_pages.clear();
+        // epochs retired since CollectEpochsLocked() above only hold counts from before the reset
+        for (size_t j = 0; j < td->retired.size(); j++) {
+          td->retired[j].pages->clear();
+        }
+      }
+      PIN_ReleaseLock(&lock);
+
+      if (object_heat) {
+        PIN_RWMutexWriteLock(&alloc_index_lock);
+        objects->reset();
+        PIN_RWMutexUnlock(&alloc_index_lock);
+      }
+      if (tiers != NULL) {
+        PIN_GetLock(&tier_lock, 0);
+        tiers->reset();
+        PIN_ReleaseLock(&tier_lock);
+      }
+      if (reuse_tracking) {
+        PIN_GetLock(&reuse_lock, 0);
+        reuse_distances = reuse_histogram();
+        page_reuses->clear();
+        PIN_ReleaseLock(&reuse_lock);
+        PIN_GetLock(&page_stream_lock, 0);
+        page_stream_distances = reuse_histogram();
+        PIN_ReleaseLock(&page_stream_lock);
+      }
+      PIN_ResumeApplicationThreads(PIN_ThreadId());
+    }
+
+    PIN_ReleaseLock(&collect_lock);
+}
+
+VOID WriteSnapshot(const std::string &filename)
+{
+    std::vector<page_table *> snapshot;
+
+    PIN_GetLock(&collect_lock, 0);
+    CollectEpochsLocked();
+
+    // copy while the application is stopped, write after it has been resumed
+    if (PIN_StopApplicationThreads(PIN_ThreadId())) {
+      PIN_GetLock(&lock, 0);
+      for (size_t i = 0; i < all_thread_data.size(); i++) {
+        page_table *pages = new page_table;
+        pages->merge(all_thread_data[i]->totals);
+        pages->merge(all_thread_data[i]->pages);
+        if (sketch_counting && i == 0) {
+          HeavyHitters(pages, false);
+        }
+        snapshot.push_back(pages);
+      }
+      PIN_ReleaseLock(&lock);
+      PIN_ResumeApplicationThreads(PIN_ThreadId());
+    }
+
+    PIN_ReleaseLock(&collect_lock);
+
+    trace_writer writer;
+    if (!writer.open(filename.c_str())) {
+      std::cerr << "Error: could not open " << filename << std::endl;
+    } else {
+      for (size_t i = 0; i < snapshot.size(); i++) {
+        write_page_table_sections(writer, i, *snapshot[i]);
+      }
+      writer.close();
+    }
+
+    for (size_t i = 0; i < snapshot.size(); i++) {
+      delete snapshot[i];
+    }
+}
+
+VOID HandleCommand(const std::string &line)
+{
+    std::istringstream words(line);
+    std::string command, argument;
+    words >> command >> argument;
+
+    if (command.empty()) {
+      return;
+    }
+
+    std::cout << "Control command: " << line << std::endl;
+
+    if (command == "start" || command == "A") {
+      SetTracing(true);
+    } else if (command == "stop") {
+      SetTracing(false);
+    } else if (command == "reset") {
+      ResetCounters();
+    } else if (command == "snapshot" && !argument.empty()) {
+      WriteSnapshot(argument);
+    } else {
+      std::cerr << "Error: unknown control command '" << line << "'" << std::endl;
+    }
+}
+
+// Pin internal thread that services PINATRACE_PIPE
+VOID ControlThread(VOID *arg)
+{
+    const char *pipe_filename = static_cast<const char *>(arg);
+
+    // Opening the FIFO read-write keeps it from reporting end-of-file whenever a writer closes it,
+    // and non-blocking so that the thread can notice when the application exits.
+    int fd = open(pipe_filename, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+      std::cerr << "Error: could not open " << pipe_filename << std::endl;
+      return;
+    }
+
+    // Text after the last newline waits for the rest of its command, which may come in a later
+    // read. run.sh sends "A" without a newline, so a partial line that sees no more input for a
+    // whole poll interval is taken as complete.
+    std::string pending;
+    while (!internal_threads_exit && !PIN_IsProcessExiting()) {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 100) <= 0) {
+        if (!pending.empty()) {
+          HandleCommand(pending);
+          pending.clear();
+        }
+        continue;
+      }
+
+      char buf[4096];
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0) {
+        continue;
+      }
+      pending.append(buf, n);
+
+      size_t start = 0, end;
+      while ((end = pending.find('\n', start)) != std::string::npos) {
+        HandleCommand(pending.substr(start, end - start));
+        start = end + 1;
+      }
+      pending.erase(0, start);
+    }
 
-L1Cache *dl1cache = NULL;
-L3Cache *dl3cache = NULL;
+    close(fd);
+}
 
-struct thread_data
+VOID SpawnInternalThread(ROOT_THREAD_FUNC *function, VOID *arg)
 {
-public:
-  thread_data() {}
-  std::map<uint64_t, uint64_t> page_count_read_with_cache;
-  std::map<uint64_t, uint64_t> page_count_read_without_cache;
-  std::map<uint64_t, uint64_t> page_count_write_with_cache;
-  std::map<uint64_t, uint64_t> page_count_write_without_cache;
+    PIN_THREAD_UID uid;
+    if (PIN_SpawnInternalThread(function, arg, 0, &uid) == INVALID_THREADID) {
+      std::cerr << "Error: could not start an internal thread" << std::endl;
+      return;
+    }
+    internal_threads.push_back(uid);
+}
 
-  void record_mem_read(void *ip, void *addr, bool cache_hit) {
-    uint64_t pageno = ((uint64_t)(addr)) / 4096;
-    if (page_count_read_without_cache.find(pageno) == page_count_read_without_cache.end()) {
-      page_count_read_without_cache[pageno] = 0;
+VOID PrepareForFini(VOID *v)
+{
+    internal_threads_exit = true;
+    for (size_t i = 0; i < internal_threads.size(); i++) {
+      PIN_WaitForThreadTermination(internal_threads[i], PIN_INFINITE_TIMEOUT, NULL);
     }
-    page_count_read_without_cache[pageno]++;
+}
 
-    if (!cache_hit) {
-      if (page_count_read_with_cache.find(pageno) == page_count_read_with_cache.end()) {
-        page_count_read_with_cache[pageno] = 0;
+VOID WriteBinaryTrace()
+{
+    if (epoch_mode != EPOCHS_OFF) {
+      // the application threads are done, so their last (partial) epochs can be retired from here
+      for (size_t i = 0; i < all_thread_data.size(); i++) {
+        all_thread_data[i]->retire_epoch(all_thread_data[i]->epoch + 1);
       }
-      page_count_read_with_cache[pageno]++;
+      CollectEpochs();
     }
-  }
 
-  void record_mem_write(void *ip, void *addr, bool cache_hit) {
-    uint64_t pageno = ((uint64_t)(addr)) / 4096;
-    if (page_count_write_without_cache.find(pageno) == page_count_write_without_cache.end()) {
-      page_count_write_without_cache[pageno] = 0;
-    }
-    page_count_write_without_cache[pageno]++;
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      write_page_table_sections(binary_writer, i, all_thread_data[i]->run_totals());
+      if (KnobCounts.Value() != "no_cache") {
+        write_line_event_sections(binary_writer, i, all_thread_data[i]->line_events);
+      }
 
-    if (!cache_hit) {
-      if (page_count_write_with_cache.find(pageno) == page_count_write_with_cache.end()) {
-        page_count_write_with_cache[pageno] = 0;
+      const std::vector<page_table *> &class_pages = all_thread_data[i]->class_pages;
+      for (size_t c = 0; c < class_pages.size(); c++) {
+        if (class_pages[c] != NULL) {
+          write_page_table_sections(binary_writer, i, *class_pages[c], SECTION_ALLOC_CLASS, 0, 0, c);
+        }
       }
-      page_count_write_with_cache[pageno]++;
     }
-  }
-};
-
-TLS_KEY tls_key;
 
-std::vector<thread_data *> all_thread_data;
+    if (!KnobReuseReport.Value().empty()) {
+      WriteReuseSections(binary_writer);
+    }
+    if (region_tracking) {
+      WriteRegionSections(binary_writer);
+    }
+    if (page_stream_engine != NULL) {
+      WriteMissRatioCurves(KnobMrc.Value().c_str(), &binary_writer);
+    }
 
-thread_data *get_tls(THREADID threadid)
-{
-    return static_cast<thread_data *>(PIN_GetThreadData(tls_key, threadid));
+    if (!binary_writer.close()) {
+      std::cerr << "Error: could not write the trace" << std::endl;
+    }
 }
 
-// Print a memory read record
-VOID RecordMemRead(VOID * ip, VOID * addr, THREADID threadid)
+VOID WriteJsonTrace(const char *filename)
 {
-    PIN_GetLock(&lock, 0);
-    bool dl1hit = dl1cache->AccessSingleLine((ADDRINT)addr, CACHE_BASE::ACCESS_TYPE_LOAD);
-    bool dl3hit = dl3cache->AccessSingleLine((ADDRINT)addr, CACHE_BASE::ACCESS_TYPE_LOAD);
-    PIN_ReleaseLock(&lock);
+    Json::Value cache_data(Json::arrayValue);
+    Json::Value no_cache_data(Json::arrayValue);
 
-    thread_data *td = get_tls(threadid);
-    td->record_mem_read(ip, addr, dl1hit || dl3hit);
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      Json::Value threadData_Cache(Json::objectValue);
+      threadData_Cache["reads"] = convert_page_table_to_json_value(all_thread_data[i]->pages, &page_counts::read_with_cache);
+      threadData_Cache["writes"] = convert_page_table_to_json_value(all_thread_data[i]->pages, &page_counts::write_with_cache);
+      threadData_Cache["writebacks"] = convert_page_table_to_json_value(all_thread_data[i]->line_events, &line_event_counts::write_backs);
+      if (!cores.empty()) {
+        threadData_Cache["invalidations"] = convert_page_table_to_json_value(all_thread_data[i]->line_events, &line_event_counts::invalidations);
+        threadData_Cache["coherence_misses"] = convert_page_table_to_json_value(all_thread_data[i]->line_events, &line_event_counts::coherence_misses);
+      }
+      cache_data.append(threadData_Cache);
+
+      Json::Value threadData_noCache(Json::objectValue);
+      threadData_noCache["reads"] = convert_page_table_to_json_value(all_thread_data[i]->pages, &page_counts::read_without_cache);
+      threadData_noCache["writes"] = convert_page_table_to_json_value(all_thread_data[i]->pages, &page_counts::write_without_cache);
+      no_cache_data.append(threadData_noCache);
+    }
+
+    Json::Value root(Json::objectValue);
+    root["cache"] = cache_data;
+    root["no_cache"] = no_cache_data;
+
+    if (region_tracking) {
+      Json::Value page_regions(Json::objectValue);
+      std::vector<uint64_t> traced = TracedPages();
+      for (size_t i = 0; i < traced.size(); i++) {
+        UINT32 id;
+        uint64_t offset;
+        if (regions.find(traced[i] << TRACE_PAGE_SHIFT, &id, &offset)) {
+          std::ostringstream o, o2, o3;
+          o << traced[i];
+          o2 << id;
+          o3 << (offset >> TRACE_PAGE_SHIFT);
+          Json::Value entry(Json::arrayValue);
+          entry.append(o2.str());
+          entry.append(o3.str());
+          page_regions[o.str()] = entry;
+        }
+      }
+      root["regions"] = page_regions;
+    }
+
+    ofstream ofs(filename, ofstream::out);
+    ofs << root << endl;
+    ofs.close();
 }
 
-// Print a memory write record
-VOID RecordMemWrite(VOID * ip, VOID * addr, THREADID threadid)
+// Publishes what the threads still have staged and tells the consumer that the stream is complete
+VOID FinishStream()
 {
-    PIN_GetLock(&lock, 0);
-    bool dl1hit = dl1cache->AccessSingleLine((ADDRINT)addr, CACHE_BASE::ACCESS_TYPE_STORE);
-    bool dl3hit = dl3cache->AccessSingleLine((ADDRINT)addr, CACHE_BASE::ACCESS_TYPE_STORE);
-    PIN_ReleaseLock(&lock);
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      all_thread_data[i]->producer->release();
+    }
+    __atomic_store_n(&stream->header()->done, 1, __ATOMIC_RELEASE);
 
-    thread_data *td = get_tls(threadid);
-    td->record_mem_write(ip, addr, dl1hit || dl3hit);
+    UINT64 dropped = stream->header()->unassigned_dropped, stalls = 0;
+    for (UINT32 r = 0; r < stream->num_rings(); r++) {
+      dropped += stream->control(r)->dropped;
+      stalls += stream->control(r)->stalls;
+    }
+    std::cout << "Streamed " << all_thread_data.size() << " threads to " << KnobStream.Value() << ": " << dropped
+              << " records dropped, " << stalls << " stalls on a full ring" << std::endl;
 }
 
-// Is called for every instruction and instruments reads and writes
-VOID Instruction(INS ins, VOID *v)
+// Writes the chunks still in progress or queued from here, the compression threads being gone,
+// and closes the files
+VOID FinishCapture()
 {
-    // Instruments memory accesses using a predicated call, i.e.
-    // the instrumentation is called iff the instruction will actually be executed.
-    //
-    // On the IA-32 and Intel(R) 64 architectures conditional moves and REP
-    // prefixed instructions appear as predicated instructions in Pin.
-    UINT32 memOperands = INS_MemoryOperandCount(ins);
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      if (all_thread_data[i]->capture->count != 0) {
+        SubmitCaptureChunk(all_thread_data[i]->capture);
+      }
+    }
+    std::vector<uint8_t> scratch;
+    capture_chunk chunk;
+    while (NextCaptureChunk(&chunk)) {
+      WriteCaptureChunk(chunk, scratch);
+    }
 
-    // Iterate over each memory operand of the instruction.
-    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
-    {
-        if (INS_MemoryOperandIsRead(ins, memOp))
-        {
-            // TODO(saurabh): register different function based on whether we want to use cache or not (run-time configuration flag)
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_THREAD_ID,
-                IARG_END);
-        }
-        // Note that in some architectures a single memory operand can be
-        // both read and written (for instance incl (%eax) on IA-32)
-        // In that case we instrument it once for read and once for write.
-        if (INS_MemoryOperandIsWritten(ins, memOp))
-        {
-            // TODO(saurabh): register different function based on whether we want to use cache or not (run-time configuration flag)
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_THREAD_ID,
-                IARG_END);
-        }
+    UINT64 records = 0, bytes = 0;
+    for (size_t i = 0; i < capture_files.size(); i++) {
+      records += capture_files[i]->writer.records();
+      bytes += capture_files[i]->writer.bytes();
+      if (!capture_files[i]->writer.close()) {
+        std::cerr << "Error: could not write the capture of thread " << i << std::endl;
+      }
     }
+    std::cout << "Captured " << records << " accesses of " << capture_files.size() << " threads to " << KnobCapture.Value()
+              << ".*.atrace: " << bytes << " bytes, " << capture_stalls << " stalls on a full queue" << std::endl;
 }
 
-thread_data aggregate_thread_data()
+VOID Fini(INT32 code, VOID *v)
 {
-  thread_data result;
+    std::cout << "Fini()" << std::endl;
 
-  for (size_t i = 0; i < all_thread_data.size(); i++) {
-    thread_data *td = all_thread_data[i];
+    if (stream != NULL) {
+      FinishStream();
+      return;
+    }
+    if (capturing) {
+      FinishCapture();
+      return;
+    }
 
-    for (std::map<uint64_t, uint64_t>::iterator it = td->page_count_read_with_cache.begin(); it != td->page_count_read_with_cache.end(); ++it) {
-      result.page_count_read_with_cache[it->first] += it->second;
+    const char *filename = std::getenv("PINATRACE_OUTPUT_FILENAME");
+    std::cout << "Writing to " << filename << std::endl;
+
+    // everything below reads the counts from the page tables
+    if (sketch_counting && !all_thread_data.empty()) {
+      HeavyHitters(&all_thread_data[0]->pages, true);
     }
 
-    for (std::map<uint64_t, uint64_t>::iterator it = td->page_count_read_without_cache.begin(); it != td->page_count_read_without_cache.end(); ++it) {
-      result.page_count_read_without_cache[it->first] += it->second;
+    if (sampling_mode != SAMPLING_OFF) {
+      ReportSamplingError();
     }
 
-    for (std::map<uint64_t, uint64_t>::iterator it = td->page_count_write_with_cache.begin(); it != td->page_count_write_with_cache.end(); ++it) {
-      result.page_count_write_with_cache[it->first] += it->second;
+    if (ip_attribution) {
+      WriteIpReport(KnobIpReport.Value().c_str());
     }
 
-    for (std::map<uint64_t, uint64_t>::iterator it = td->page_count_write_without_cache.begin(); it != td->page_count_write_without_cache.end(); ++it) {
-      result.page_count_write_without_cache[it->first] += it->second;
+    if (alloc_attribution) {
+      WriteAllocReport(KnobAllocReport.Value().c_str());
+    }
+
+    if (object_heat) {
+      WriteObjectReport(KnobObjectReport.Value().c_str());
+    }
+
+    if (reuse_tracking) {
+      for (size_t i = 0; i < all_thread_data.size(); i++) {
+        FlushReuse(all_thread_data[i]->reuse_staged);
+        if (page_stream_engine != NULL) {
+          FlushPageReuse(all_thread_data[i]->page_reuse_staged);
+        }
+      }
+    }
+
+    if (!KnobReuseReport.Value().empty()) {
+      WriteReuseReport(KnobReuseReport.Value().c_str());
+    }
+
+    if (KnobCounts.Value() != "no_cache") {
+      FlushCaches();
+    }
+
+    if (!cores.empty()) {
+      ReportCoherence();
     }
-  }
 
-  return result;
+    if (tiers != NULL) {
+      WriteTierReport(KnobTierReport.Value().c_str());
+    }
+
+    if (region_tracking) {
+      WriteRegions(KnobRegions.Value().c_str());
+    }
+
+    if (KnobFormat.Value() == "json") {
+      if (page_stream_engine != NULL) {
+        WriteMissRatioCurves(KnobMrc.Value().c_str(), NULL);
+      }
+      WriteJsonTrace(filename);
+    } else {
+      WriteBinaryTrace();
+    }
 }
 
-Json::Value convert_uint64_map_to_json_value(std::map<uint64_t, uint64_t> m)
+// With -core_map affinity: a thread pinned to a set of CPUs moves to simulated core (first CPU of
+// the set) % -cores at its next access
+VOID SetAffinity(THREADID threadid, CONTEXT *ctxt, SYSCALL_STANDARD std)
 {
-    Json::Value result(Json::objectValue);
+    OS_THREAD_ID pid = PIN_GetSyscallArgument(ctxt, std, 0);
+    UINT64 mask[16];
+    size_t size = std::min((size_t)PIN_GetSyscallArgument(ctxt, std, 1), sizeof(mask));
+    size_t copied = PIN_SafeCopy(mask, (VOID *)PIN_GetSyscallArgument(ctxt, std, 2), size);
 
-    for (std::map<uint64_t, uint64_t>::iterator it = m.begin(); it != m.end(); ++it) {
-      // convert uint64_t to string
-      std::ostringstream o, o2;
-      o << it->first;
-      o2 << it->second;
+    UINT32 cpu = 0;
+    while (cpu < copied * 8 && (mask[cpu / 64] & (1ULL << (cpu % 64))) == 0) {
+      cpu++;
+    }
+    if (cpu == copied * 8) {
+      return;
+    }
 
-      result[o.str()] = o2.str();
+    PIN_GetLock(&lock, 0);
+    for (size_t i = 0; i < all_thread_data.size(); i++) {
+      if (pid == 0 ? all_thread_data[i] == get_tls(threadid) : all_thread_data[i]->os_tid == pid) {
+        all_thread_data[i]->next_core = cpu % cores.size();
+      }
+    }
+    PIN_ReleaseLock(&lock);
+}
+
+VOID SyscallEntry(THREADID threadid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v)
+{
+    ADDRINT number = PIN_GetSyscallNumber(ctxt, std);
+    if (number == SYS_sched_setaffinity && !cores.empty() && KnobCoreMap.Value() == "affinity") {
+      SetAffinity(threadid, ctxt, std);
     }
 
-    return result;
+    if (region_tracking) {
+      thread_data *td = get_tls(threadid);
+      td->syscall_number = number;
+      if (number == SYS_mmap || number == SYS_mremap) {
+        for (UINT32 i = 0; i < 6; i++) {
+          td->syscall_args[i] = PIN_GetSyscallArgument(ctxt, std, i);
+        }
+      }
+    }
 }
 
-VOID Fini(INT32 code, VOID *v)
+// Path of the file open as fd, or "" if it has none
+std::string FileOfDescriptor(int fd)
 {
-    std::cout << "Fini()" << std::endl;
-    Json::Value cache_data(Json::arrayValue);
-    Json::Value no_cache_data(Json::arrayValue);
+    char link[64];
+    char path[4096];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t length = readlink(link, path, sizeof(path) - 1);
+    if (length <= 0) {
+      return "";
+    }
+    return std::string(path, length);
+}
 
-    for (size_t i = 0; i < all_thread_data.size(); i++) {
-      Json::Value threadData_Cache(Json::objectValue);
-      threadData_Cache["reads"] = convert_uint64_map_to_json_value(all_thread_data[i]->page_count_read_with_cache);
-      threadData_Cache["writes"] = convert_uint64_map_to_json_value(all_thread_data[i]->page_count_write_with_cache);
-      cache_data.append(threadData_Cache);
+VOID SyscallExit(THREADID threadid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v)
+{
+    thread_data *td = get_tls(threadid);
+    ADDRINT number = td->syscall_number;
+    ADDRINT result = PIN_GetSyscallReturn(ctxt, std);
+    td->syscall_number = ~(ADDRINT)0;
 
-      Json::Value threadData_noCache(Json::objectValue);
-      threadData_noCache["reads"] = convert_uint64_map_to_json_value(all_thread_data[i]->page_count_read_without_cache);
-      threadData_noCache["writes"] = convert_uint64_map_to_json_value(all_thread_data[i]->page_count_write_without_cache);
-      no_cache_data.append(threadData_noCache);
+    // failed calls return -errno
+    if ((number != SYS_mmap && number != SYS_mremap && number != SYS_brk) || result >= (ADDRINT)-4096) {
+      return;
     }
 
-    Json::Value root(Json::objectValue);
-    root["cache"] = cache_data;
-    root["no_cache"] = no_cache_data;
+    const ADDRINT *args = td->syscall_args;
+    UINT32 kind = REGION_ANON;
+    std::string name;
+    if (number == SYS_mmap) {
+      if (args[3] & (MAP_STACK | MAP_GROWSDOWN)) {
+        kind = REGION_STACK;
+      } else if ((args[3] & MAP_ANONYMOUS) == 0) {
+        kind = REGION_FILE;
+        name = FileOfDescriptor((int)args[4]);
+      }
+    }
 
-    std::cout << "Writing to " << std::getenv("PINATRACE_OUTPUT_FILENAME") << std::endl;
+    PIN_GetLock(&region_lock, 0);
+    if (number == SYS_mmap) {
+      regions.add(result, args[1], kind, name);
+    } else if (number == SYS_mremap) {
+      regions.move(args[0], result, args[2]);
+    } else {
+      regions.set_break(result);
+    }
+    PIN_ReleaseLock(&region_lock);
+}
 
-    ofstream ofs(std::getenv("PINATRACE_OUTPUT_FILENAME"), ofstream::out);
-    ofs << root << endl;
-    ofs.close();
+VOID RegionImageLoad(IMG img, VOID *v)
+{
+    PIN_GetLock(&region_lock, 0);
+    regions.add(IMG_LowAddress(img), IMG_HighAddress(img) - IMG_LowAddress(img) + 1, REGION_IMAGE, IMG_Name(img));
+    PIN_ReleaseLock(&region_lock);
+}
+
+// The main thread's stack is mapped before the application starts
+VOID AddInitialStack()
+{
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+      unsigned long long start, end;
+      if (line.find("[stack]") != std::string::npos && sscanf(line.c_str(), "%llx-%llx", &start, &end) == 2) {
+        regions.add(start, end - start, REGION_STACK, "");
+      }
+    }
 }
 
 VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
     PIN_GetLock(&lock, 0);
 
-    thread_data *td = new thread_data;
+    thread_data *td = new thread_data(all_thread_data.size());
+    td->os_tid = PIN_GetTid();
 
     PIN_SetThreadData(tls_key, td, threadid);
 
     all_thread_data.push_back(td);
 
     PIN_ReleaseLock(&lock);
+
+    if (capturing) {
+      td->capture = StartCapture(td->index);
+    }
+
+    if (td->producer != NULL && !td->producer->claim(td->index)) {
+      std::cerr << "Error: no free ring in " << KnobStream.Value() << " for thread " << td->index << ", its accesses are dropped" << std::endl;
+    }
+
+    if (sampling_mode == SAMPLING_PERIODIC) {
+      get_sample_state(threadid).countdown = KnobSamplePeriod;
+    } else if (sampling_mode == SAMPLING_BURSTS) {
+      get_sample_state(threadid).countdown = KnobSampleGap;
+    }
 }
 
 VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 flags, VOID *v)
 {
     // TODO(saurabh): (debug) log that thread finished
+
+    // anything the thread's buffer still pushes after this counts as dropped
+    thread_data *td = get_tls(threadid);
+    if (td->producer != NULL) {
+      td->producer->release();
+    }
+    if (td->capture != NULL && td->capture->count != 0) {
+      SubmitCaptureChunk(td->capture);
+    }
 }
 
 INT32 Usage()
@@ -242,21 +3524,327 @@ int main(int argc, char *argv[])
     if (PIN_Init(argc, argv)) return Usage();
 
     PIN_InitLock(&lock);
+    PIN_InitLock(&collect_lock);
+
+    tracing_enabled = KnobStartTracing;
 
     tls_key = PIN_CreateThreadDataKey(0);
 
-    dl1cache = new L1Cache("L1 Data Cache", 64 * KILO, 64, 1);
-    dl3cache = new L3Cache("L3 Unified Cache", /* size = */ 8192 * KILO, /* block size = */ 64, /* associativity = */ 16);
+    if (KnobFormat.Value() != "binary" && KnobFormat.Value() != "json") {
+      return Usage();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if (KnobEpochMs.Value() != 0 && KnobEpochAccesses.Value() != 0) {
+      return Usage();
+    } else if (KnobEpochMs.Value() != 0) {
+      epoch_mode = EPOCHS_BY_TIME;
+    } else if (KnobEpochAccesses.Value() != 0) {
+      epoch_mode = EPOCHS_BY_ACCESSES;
+    }
+
+    // epochs are streamed into the binary trace while the application runs
+    if (epoch_mode != EPOCHS_OFF && KnobFormat.Value() != "binary") {
+      return Usage();
+    }
+
+    if (KnobFormat.Value() == "binary" && KnobStream.Value().empty() && KnobCapture.Value().empty() && !binary_writer.open(std::getenv("PINATRACE_OUTPUT_FILENAME"))) {
+      std::cerr << "Error: could not open " << std::getenv("PINATRACE_OUTPUT_FILENAME") << std::endl;
+      return 1;
+    }
+
+    if (KnobCounts.Value() == "both") {
+      SelectAnalysisRoutines<true, true>();
+    } else if (KnobCounts.Value() == "cache") {
+      SelectAnalysisRoutines<true, false>();
+    } else if (KnobCounts.Value() == "no_cache") {
+      SelectAnalysisRoutines<false, true>();
+    } else {
+      return Usage();
+    }
+
+    if (KnobSamplePeriod.Value() > 1) {
+      // cache simulation needs every access, and sampled accesses cannot be grouped or buffered
+      if (KnobCounts.Value() != "no_cache" || KnobInstrument.Value() != "ins" || KnobBuffer || KnobSampleBurst.Value() != 0) {
+        return Usage();
+      }
+      sampling_mode = SAMPLING_PERIODIC;
+      sample_scale = KnobSamplePeriod.Value();
+    } else if (KnobSampleBurst.Value() != 0) {
+      if (KnobSampleGap.Value() == 0) {
+        return Usage();
+      }
+      sampling_mode = SAMPLING_BURSTS;
+      sample_scale = (double)(KnobSampleBurst.Value() + KnobSampleGap.Value()) / KnobSampleBurst.Value();
+      sample_version_reg = PIN_ClaimToolRegister();
+      if (!REG_valid(sample_version_reg)) {
+        std::cerr << "Error: no tool register left for bursty sampling" << std::endl;
+        return 1;
+      }
+    }
+
+    if (KnobAccesses.Value() == "reads") {
+      instrument_writes = false;
+    } else if (KnobAccesses.Value() == "writes") {
+      instrument_reads = false;
+    } else if (KnobAccesses.Value() != "all") {
+      return Usage();
+    }
+
+    std::string cache_error;
+    if (KnobCacheConfig.Value() == "default") {
+      caches = cache_config::default_config();
+    } else if (KnobCacheConfig.Value() == "sysfs") {
+      if (!caches.read_sysfs(cache_error)) {
+        std::cerr << "Error: could not read the cache topology from sysfs: " << cache_error << std::endl;
+        return 1;
+      }
+    } else if (!caches.read_file(KnobCacheConfig.Value().c_str(), cache_error)) {
+      std::cerr << "Error: bad cache config " << KnobCacheConfig.Value() << ": " << cache_error << std::endl;
+      return 1;
+    }
+
+    cache_line_size = caches.line_size();
+    cache_line_shift = 0;
+    while ((1U << cache_line_shift) < cache_line_size) {
+      cache_line_shift++;
+    }
+
+    shared_caches.configure(caches);
+
+    if (KnobCores.Value() != 0) {
+      if (KnobCores.Value() > 64 || caches.levels.size() == shared_caches.num_levels() || KnobCounts.Value() == "no_cache" ||
+          (KnobCoreMap.Value() != "round_robin" && KnobCoreMap.Value() != "affinity")) {
+        return Usage();
+      }
+      for (UINT32 i = 0; i < KnobCores.Value(); i++) {
+        simulated_core *core = new simulated_core;
+        PIN_InitLock(&core->lock);
+        PIN_InitLock(&core->inbox_lock);
+        core->inbox_size = 0;
+        for (size_t j = 0; j < caches.levels.size(); j++) {
+          if (!caches.levels[j].shared) {
+            core->caches.add_level(caches.levels[j]);
+          }
+        }
+        core->caches.set_inclusive(caches.inclusive);
+        cores.push_back(core);
+      }
+      directories = new coherence_directory[shared_caches.num_stripes()];
+    }
+
+    // regions are tracked even while tracing is stopped, like allocations
+    region_tracking = !KnobRegions.Value().empty();
+    if (region_tracking) {
+      PIN_InitLock(&region_lock);
+      AddInitialStack();
+      IMG_AddInstrumentFunction(RegionImageLoad, 0);
+      PIN_AddSyscallExitFunction(SyscallExit, 0);
+    }
+    if (region_tracking || (!cores.empty() && KnobCoreMap.Value() == "affinity")) {
+      PIN_AddSyscallEntryFunction(SyscallEntry, 0);
+    }
+
+    if (!KnobTierReport.Value().empty()) {
+      dram_bytes = cache_config::parse_size(KnobDramSize.Value().c_str());
+      std::string tier_error;
+      if (!tier_config.parse(KnobTierParams.Value(), tier_error)) {
+        std::cerr << "Error: bad -tier_params: " << tier_error << std::endl;
+        return 1;
+      }
+      // parse_size() returns 0 for a malformed size, which would silently simulate a memory without
+      // DRAM; so would a size below one page
+      if (KnobCounts.Value() == "no_cache" || sampling_mode != SAMPLING_OFF || KnobTierEpoch.Value() == 0 || cache_line_shift > TRACE_PAGE_SHIFT ||
+          (dram_bytes >> TRACE_PAGE_SHIFT) == 0) {
+        return Usage();
+      }
+      PIN_InitLock(&tier_lock);
+      tiers = new tier_simulator(tier_config, dram_bytes >> TRACE_PAGE_SHIFT, KnobTierEpoch.Value(), 1U << (TRACE_PAGE_SHIFT - cache_line_shift));
+    }
+
+    // distances are only meaningful over the complete access stream
+    reuse_tracking = !KnobReuseReport.Value().empty() || !KnobMrc.Value().empty();
+    if (reuse_tracking) {
+      if (sampling_mode != SAMPLING_OFF || KnobReuseSample.Value() == 0 || KnobReuseLines.Value() == 0 || KnobReusePages.Value() == 0 ||
+          cache_line_shift > TRACE_PAGE_SHIFT) {
+        return Usage();
+      }
+      PIN_InitLock(&reuse_lock);
+      reuse_engine = new reuse_distance_engine(1.0 / KnobReuseSample.Value(), KnobReuseLines.Value());
+      page_reuses = new page_reuse_table(KnobReusePages.Value());
+    }
+
+    if (!KnobMrc.Value().empty()) {
+      UINT64 min_size = cache_config::parse_size(KnobMrcMin.Value().c_str());
+      UINT64 max_size = cache_config::parse_size(KnobMrcMax.Value().c_str());
+      if (min_size == 0 || max_size < min_size || KnobMrcSteps.Value() == 0) {
+        return Usage();
+      }
+      // sizes are rounded to whole lines, duplicates dropped
+      for (UINT32 i = 0;; i++) {
+        double size = min_size * pow(2.0, (double)i / KnobMrcSteps.Value());
+        if (size > max_size * 1.000001) {
+          break;
+        }
+        UINT64 rounded = ((UINT64)(size + 0.5) + cache_line_size - 1) & ~(UINT64)(cache_line_size - 1);
+        if (mrc_sizes.empty() || rounded != mrc_sizes.back()) {
+          mrc_sizes.push_back(rounded);
+        }
+      }
+
+      PIN_InitLock(&page_stream_lock);
+      page_stream_engine = new reuse_distance_engine(1.0 / KnobReuseSample.Value(), KnobReuseLines.Value());
+    }
+
+    granularity_shifts.push_back(TRACE_PAGE_SHIFT);
+    std::istringstream granularities(KnobGranularities.Value());
+    std::string granularity;
+    while (std::getline(granularities, granularity, ',')) {
+      UINT64 size = granularity == "line" ? cache_line_size : cache_config::parse_size(granularity.c_str());
+      // a coalesced group of accesses spans up to a cache line and is counted in a single page
+      if (size < cache_line_size || (size & (size - 1)) != 0) {
+        return Usage();
+      }
+      UINT32 shift = 0;
+      while ((1ULL << shift) < size) {
+        shift++;
+      }
+      granularity_shifts.push_back(shift);
+    }
+    std::sort(granularity_shifts.begin(), granularity_shifts.end());
+    granularity_shifts.erase(std::unique(granularity_shifts.begin(), granularity_shifts.end()), granularity_shifts.end());
+    count_shift = granularity_shifts[0];
+
+    // the JSON format only knows 4 KB pages
+    if (granularity_shifts.size() > 1 && KnobFormat.Value() != "binary") {
+      return Usage();
+    }
+
+    // sketches only count 4 KB pages over the whole run, and need every access
+    if (KnobCounters.Value() == "sketch") {
+      UINT32 width = KnobSketchWidth.Value();
+      if (granularity_shifts.size() > 1 || epoch_mode != EPOCHS_OFF || sampling_mode != SAMPLING_OFF ||
+          width == 0 || (width & (width - 1)) != 0 || KnobSketchDepth.Value() == 0 || KnobSketchTopK.Value() == 0) {
+        return Usage();
+      }
+      sketch_counting = true;
+    } else if (KnobCounters.Value() != "exact") {
+      return Usage();
+    }
 
     std::srand(std::time(0));
 
+    ip_attribution = !KnobIpReport.Value().empty();
+    alloc_attribution = !KnobAllocReport.Value().empty();
+
+    if (ip_attribution || alloc_attribution) {
+      PIN_InitSymbols();
+    }
+
+    for (UINT32 i = 0; i < KnobAllocHook.NumberOfValues(); i++) {
+      alloc_hook hook;
+      if (!KnobAllocHook.Value(i).empty()) {
+        if (!alloc_attribution || !ParseAllocHook(KnobAllocHook.Value(i), &hook)) {
+          return Usage();
+        }
+        alloc_hooks.push_back(hook);
+      }
+    }
+
+    object_heat = !KnobObjectReport.Value().empty();
+    if (object_heat) {
+      if (!alloc_attribution) {
+        return Usage();
+      }
+      objects = new object_table(KnobObjectTopK.Value());
+    }
+
+    // allocations are tracked even while tracing is stopped, so that the index is complete once it starts
+    if (alloc_attribution) {
+      PIN_RWMutexInit(&alloc_index_lock);
+      PIN_InitLock(&alloc_sites_lock);
+      IMG_AddInstrumentFunction(ImageLoad, 0);
+    }
+
+    // streaming and capture hand the accesses on as they are, so everything that needs more than
+    // that stays in-process; the tool writes no trace then, and stream_consumer only a binary one
+    capturing = !KnobCapture.Value().empty();
+    if (!KnobStream.Value().empty() || capturing) {
+      if (KnobFormat.Value() != "binary" || sampling_mode != SAMPLING_OFF || epoch_mode != EPOCHS_OFF || !cores.empty() || tiers != NULL || reuse_tracking ||
+          granularity_shifts.size() > 1 || sketch_counting || region_tracking || ip_attribution || alloc_attribution ||
+          (!KnobStream.Value().empty() && capturing)) {
+        return Usage();
+      }
+    }
+
+    if (!KnobStream.Value().empty()) {
+      UINT32 capacity = KnobStreamCapacity.Value();
+      if (KnobStreamRings.Value() == 0 || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+          (KnobStreamFull.Value() != "block" && KnobStreamFull.Value() != "drop")) {
+        return Usage();
+      }
+      stream = new access_stream;
+      if (!stream->create(KnobStream.Value().c_str(), KnobStreamRings.Value(), capacity)) {
+        std::cerr << "Error: could not create " << KnobStream.Value() << std::endl;
+        return 1;
+      }
+      stream_blocking = KnobStreamFull.Value() == "block";
+      SelectStreamRoutines();
+    }
+
+    // a capture keeps the size of every operand, which coalesced groups do not have
+    if (capturing) {
+      UINT32 chunk = KnobCaptureChunk.Value();
+      if (KnobInstrument.Value() != "ins" || chunk == 0 || chunk % CAPTURE_TIMESTAMP_PERIOD != 0 ||
+          KnobCaptureThreads.Value() == 0 || KnobCaptureQueue.Value() == 0) {
+        return Usage();
+      }
+      capture_chunk_records = chunk;
+      PIN_InitLock(&capture_lock);
+      buffer_full_routine = CaptureBufferFull;
+    }
+
+    if (KnobBuffer) {
+      buffer_id = PIN_DefineTraceBuffer(sizeof(mem_ref), NUM_BUFFER_PAGES, buffer_full_routine, 0);
+      if (buffer_id == BUFFER_ID_INVALID) {
+        std::cerr << "Error: could not allocate the trace buffer" << std::endl;
+        return 1;
+      }
+    }
+
     PIN_AddThreadStartFunction(ThreadStart, 0);
     PIN_AddThreadFiniFunction(ThreadFini, 0);
 
-    INS_AddInstrumentFunction(Instruction, 0);
+    if (KnobInstrument.Value() != "ins" && KnobInstrument.Value() != "bbl") {
+      return Usage();
+    }
+
+    // trace versioning needs trace-level instrumentation
+    if (KnobInstrument.Value() == "ins" && sampling_mode != SAMPLING_BURSTS) {
+      INS_AddInstrumentFunction(Instruction, 0);
+    } else {
+      TRACE_AddInstrumentFunction(Trace, 0);
+    }
 
     PIN_AddFiniFunction(Fini, 0);
 
+    if (epoch_mode != EPOCHS_OFF) {
+      SpawnInternalThread(EpochThread, NULL);
+    }
+
+    if (std::getenv("PINATRACE_PIPE") != NULL) {
+      SpawnInternalThread(ControlThread, std::getenv("PINATRACE_PIPE"));
+    }
+
+    for (UINT32 i = 0; capturing && i < KnobCaptureThreads.Value(); i++) {
+      size_t spawned = internal_threads.size();
+      SpawnInternalThread(CaptureThread, NULL);
+      capture_threads_running += internal_threads.size() - spawned;
+    }
+
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+
     // Never returns
     PIN_StartProgram();
 
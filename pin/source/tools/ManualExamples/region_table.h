@@ -0,0 +1,169 @@
+#ifndef REGION_TABLE_H
+#define REGION_TABLE_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Memory regions of the application (images, the brk heap, mmap'ed memory), so that pages can be
+// named by (region, offset in region) instead of by address. Addresses change from run to run with
+// ASLR and with the timing of mmap calls; a region's kind, name and ordinal (how many regions of the
+// same kind and name were created before it) usually do not, so they line runs up.
+
+enum region_kind
+{
+  REGION_NONE,
+  REGION_IMAGE,  // an executable or shared library, from its lowest to its highest address
+  REGION_HEAP,   // the brk heap
+  REGION_ANON,   // anonymous mmap
+  REGION_FILE,   // file-backed mmap (other than images)
+  REGION_STACK,  // the main thread's stack, or an mmap with MAP_STACK or MAP_GROWSDOWN
+  NUM_REGION_KINDS
+};
+
+inline const char *region_kind_name(uint32_t kind)
+{
+  static const char *names[] = { "none", "image", "heap", "anon", "file", "stack" };
+  return kind < NUM_REGION_KINDS ? names[kind] : "?";
+}
+
+struct region
+{
+  uint32_t kind;
+  uint32_t ordinal;
+  std::string name;  // image or file path; empty for anonymous memory
+  uint64_t start;    // where the region was first mapped
+  uint64_t size;     // largest size it had
+};
+
+// Maps addresses to the region mapped there last. Unmapping does not remove anything: a page that
+// was accessed and then unmapped is still attributed to its region at exit, and only a later mapping
+// at the same address takes it over. mremap keeps the region (and the offsets) of the moved memory.
+//
+// Not thread-safe; pinatrace.cpp serializes the syscalls that update it.
+class region_table
+{
+public:
+  static const uint32_t NO_REGION = ~(uint32_t)0;
+
+  region_table() : heap(NO_REGION), heap_start(0), heap_end(0) {}
+
+  // A new region of size bytes at start, mapped over whatever was there
+  uint32_t add(uint64_t start, uint64_t size, uint32_t kind, const std::string &name) {
+    region r;
+    r.kind = kind;
+    r.ordinal = ordinals[std::make_pair(kind, name)]++;
+    r.name = name;
+    r.start = start;
+    r.size = size;
+    regions.push_back(r);
+    assign(start, start + size, regions.size() - 1, 0);
+    return regions.size() - 1;
+  }
+
+  // mremap: the memory of the region at old_start now lives at new_start, with new_size bytes
+  void move(uint64_t old_start, uint64_t new_start, uint64_t new_size) {
+    uint32_t id;
+    uint64_t offset;
+    if (!find(old_start, &id, &offset)) {
+      add(new_start, new_size, REGION_ANON, "");
+      return;
+    }
+    assign(new_start, new_start + new_size, id, offset);
+    if (offset + new_size > regions[id].size) {
+      regions[id].size = offset + new_size;
+    }
+  }
+
+  // brk: the program break is now at end; the first call fixes the start of the heap
+  void set_break(uint64_t end) {
+    if (heap == NO_REGION) {
+      heap = add(end, 0, REGION_HEAP, "");
+      heap_start = heap_end = end;
+    }
+    if (end > heap_end) {
+      assign(heap_end, end, heap, heap_end - heap_start);
+      heap_end = end;
+      regions[heap].size = heap_end - heap_start;
+    }
+  }
+
+  // Looks up addr; sets *id to its region and *offset to its offset in bytes from the region's start
+  bool find(uint64_t addr, uint32_t *id, uint64_t *offset) const {
+    std::map<uint64_t, piece>::const_iterator it = pieces.upper_bound(addr);
+    if (it == pieces.begin()) {
+      return false;
+    }
+    --it;
+    if (addr >= it->second.end) {
+      return false;
+    }
+    *id = it->second.id;
+    *offset = it->second.offset + (addr - it->first);
+    return true;
+  }
+
+  size_t size() const { return regions.size(); }
+  const region &at(uint32_t id) const { return regions[id]; }
+
+private:
+  // A range of addresses that belongs to region id, starting offset bytes into it
+  struct piece
+  {
+    uint64_t end;
+    uint32_t id;
+    uint64_t offset;
+  };
+
+  std::map<uint64_t, piece> pieces;  // non-overlapping, by start address
+  std::vector<region> regions;
+  std::map<std::pair<uint32_t, std::string>, uint32_t> ordinals;
+
+  uint32_t heap;
+  uint64_t heap_start;
+  uint64_t heap_end;
+
+  // Maps [start, end) to region id, trimming or splitting the pieces it overlaps
+  void assign(uint64_t start, uint64_t end, uint32_t id, uint64_t offset) {
+    if (start >= end) {
+      return;
+    }
+
+    std::map<uint64_t, piece>::iterator it = pieces.lower_bound(start);
+    if (it != pieces.begin()) {
+      std::map<uint64_t, piece>::iterator prev = it;
+      --prev;
+      if (prev->second.end > start) {
+        // prev starts before start: keep its head, and its tail if it reaches past end
+        if (prev->second.end > end) {
+          piece tail = prev->second;
+          tail.offset += end - prev->first;
+          pieces[end] = tail;
+        }
+        prev->second.end = start;
+      }
+    }
+
+    it = pieces.lower_bound(start);
+    while (it != pieces.end() && it->first < end) {
+      if (it->second.end > end) {
+        piece tail = it->second;
+        tail.offset += end - it->first;
+        pieces.erase(it);
+        pieces[end] = tail;
+        break;
+      }
+      pieces.erase(it++);
+    }
+
+    piece p;
+    p.end = end;
+    p.id = id;
+    p.offset = offset;
+    pieces[start] = p;
+  }
+};
+
+#endif
@@ -0,0 +1,398 @@
+#ifndef REUSE_DISTANCE_H
+#define REUSE_DISTANCE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <set>
+#include <utility>
+#include <vector>
+
+// Reuse (stack) distance of an access: the number of distinct other lines accessed since the
+// previous access to the same line. A fully associative LRU cache of c lines hits exactly the
+// accesses whose distance is below c, so a histogram of distances predicts the miss ratio of every
+// cache (or DRAM tier) size at once.
+
+// Weighted histogram of reuse distances on a log scale with steps_per_octave buckets per power of
+// two: bucket 0 holds distances below 1, bucket b >= 1 distances in [2^((b-1)/steps), 2^(b/steps)).
+// First accesses (infinite distance) are counted separately as cold.
+class reuse_histogram
+{
+public:
+  explicit reuse_histogram(uint32_t steps_per_octave = 8)
+      : steps(steps_per_octave), weights(1 + 64 * steps_per_octave, 0.0), cold_weight(0) {}
+
+  void add(double distance, double weight) {
+    weights[bucket(distance)] += weight;
+  }
+
+  void add_cold(double weight) { cold_weight += weight; }
+
+  size_t bucket(double distance) const {
+    if (distance < 1) {
+      return 0;
+    }
+    size_t b = 1 + (size_t)floor(log2(distance) * steps);
+    return std::min(b, weights.size() - 1);
+  }
+
+  // Bounds of the distances in bucket b
+  double lower(size_t b) const { return b == 0 ? 0 : pow(2.0, (double)(b - 1) / steps); }
+  double upper(size_t b) const { return pow(2.0, (double)b / steps); }
+
+  size_t size() const { return weights.size(); }
+  double at(size_t b) const { return weights[b]; }
+  double cold() const { return cold_weight; }
+
+  // Weight of the accesses at distances of at least distance, cold ones included, interpolating
+  // log-linearly within the bucket that distance falls in. For a fully associative LRU cache of
+  // distance lines this is the number of misses.
+  double at_least(double distance) const {
+    size_t b = bucket(distance);
+    double sum = cold_weight;
+    for (size_t i = b + 1; i < weights.size(); i++) {
+      sum += weights[i];
+    }
+    if (b == 0 || distance <= lower(b)) {
+      return sum + weights[b];
+    }
+    return sum + weights[b] * (log2(upper(b)) - log2(distance)) / (log2(upper(b)) - log2(lower(b)));
+  }
+
+  double total() const {
+    double sum = cold_weight;
+    for (size_t b = 0; b < weights.size(); b++) {
+      sum += weights[b];
+    }
+    return sum;
+  }
+
+private:
+  uint32_t steps;
+  std::vector<double> weights;
+  double cold_weight;
+};
+
+// Per-page reuse distances in whole octaves, small enough to keep for every sampled page: bucket 0
+// holds first accesses, 1 distances below 1, and b >= 2 distances in [2^(b-2), 2^(b-1)).
+struct page_reuse
+{
+  static const int BUCKETS = 48;
+
+  float weights[BUCKETS];
+
+  static int bucket(double distance) {
+    if (distance < 0) {
+      return 0;
+    }
+    if (distance < 1) {
+      return 1;
+    }
+    int b = 2 + (int)floor(log2(distance));
+    return b < BUCKETS ? b : BUCKETS - 1;
+  }
+};
+
+// Sampled reuse-distance engine (SHARDS, Waldspurger et al., FAST '15, in its fixed-size variant).
+//
+// A line is sampled if a hash of its address is below a threshold, i.e. with probability rate().
+// The engine computes exact reuse distances within the sampled lines (Olken's algorithm: a Fenwick
+// tree over access times marks the most recent access of every sampled line, so the distance is the
+// number of marks since the line's previous access) and scales them by 1 / rate(). Each sampled
+// access stands for 1 / rate() accesses.
+//
+// At most max_lines lines are tracked: when more are sampled, the threshold drops to exclude the
+// lines with the highest hashes, which are forgotten. Memory is therefore bounded whatever the
+// footprint of the application, and an access costs one hash and compare if it is not sampled, and
+// O(log max_lines) if it is. Time stamps are renumbered once every max_lines sampled accesses.
+//
+// sampled() may be called concurrently with everything else; access() must be serialized.
+class reuse_distance_engine
+{
+public:
+  static const uint32_t HASH_BITS = 24;
+  static const int64_t NOT_SAMPLED = -2;
+
+  reuse_distance_engine(double rate, size_t max_lines)
+      : threshold((uint32_t)std::min(rate * (1 << HASH_BITS), (double)(1 << HASH_BITS))), max_lines(max_lines),
+        time_capacity(2 * max_lines), now(0), num_lines(0), tree(2 * max_lines + 1, 0), lines_by_time(2 * max_lines, (uint64_t)EMPTY) {
+    size_t capacity = 1;
+    while (capacity < 4 * max_lines) {
+      capacity *= 2;
+    }
+    keys.assign(capacity, (uint64_t)EMPTY);
+    times.assign(capacity, 0);
+    mask = capacity - 1;
+  }
+
+  static uint64_t mix(uint64_t line) {
+    uint64_t h = line;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+  }
+
+  static uint32_t hash(uint64_t line) { return (uint32_t)(mix(line) >> (64 - HASH_BITS)); }
+
+  bool sampled(uint64_t line) const { return hash(line) < threshold; }
+
+  double rate() const { return (double)threshold / (1 << HASH_BITS); }
+  size_t lines() const { return num_lines; }
+
+  // Records an access to line. Returns its estimated reuse distance in lines, -1 if it is the first
+  // access to line (as far as the engine remembers), or NOT_SAMPLED if line is not sampled (any more).
+  double access(uint64_t line) {
+    uint32_t h = hash(line);
+    if (h >= threshold) {
+      return NOT_SAMPLED;
+    }
+
+    double distance = -1;
+    size_t slot = find(line);
+    if (keys[slot] == line) {
+      uint32_t previous = times[slot];
+      distance = (prefix(now) - prefix(previous + 1)) / rate();
+      add(previous, -1);
+      lines_by_time[previous] = EMPTY;
+    } else {
+      keys[slot] = line;
+      num_lines++;
+      by_hash.insert(std::make_pair(h, line));
+    }
+
+    if (now == time_capacity) {
+      renumber();
+      slot = find(line);
+    }
+    times[slot] = now;
+    lines_by_time[now] = line;
+    add(now, 1);
+    now++;
+
+    while (num_lines > max_lines) {
+      evict();
+    }
+    return distance;
+  }
+
+private:
+  static const uint64_t EMPTY = ~(uint64_t)0;
+
+  volatile uint32_t threshold;
+  size_t max_lines;
+
+  // Fenwick tree over time stamps [0, time_capacity); lines_by_time is its inverse
+  size_t time_capacity;
+  uint32_t now;
+  size_t num_lines;
+  std::vector<int32_t> tree;
+  std::vector<uint64_t> lines_by_time;
+
+  // line -> time stamp of its last access (open addressing, linear probing)
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> times;
+  size_t mask;
+
+  // Tracked lines by hash, to find the ones to drop when the threshold is lowered
+  std::set<std::pair<uint32_t, uint64_t> > by_hash;
+
+  // Number of marks at time stamps below end
+  int64_t prefix(size_t end) const {
+    int64_t sum = 0;
+    for (size_t i = end; i > 0; i -= i & -i) {
+      sum += tree[i];
+    }
+    return sum;
+  }
+
+  void add(size_t time, int32_t delta) {
+    for (size_t i = time + 1; i < tree.size(); i += i & -i) {
+      tree[i] += delta;
+    }
+  }
+
+  // Slot of line, or the empty slot where it would go
+  size_t find(uint64_t line) const {
+    size_t i = (size_t)mix(line) & mask;
+    while (keys[i] != EMPTY && keys[i] != line) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  // Backward-shift deletion, which keeps every probe sequence unbroken without tombstones
+  void erase_slot(size_t i) {
+    size_t j = i;
+    while (true) {
+      j = (j + 1) & mask;
+      if (keys[j] == EMPTY) {
+        break;
+      }
+      size_t home = (size_t)mix(keys[j]) & mask;
+      // keys[j] may move to i if i lies cyclically between its home slot and j
+      if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+        keys[i] = keys[j];
+        times[i] = times[j];
+        i = j;
+      }
+    }
+    keys[i] = EMPTY;
+  }
+
+  // Lowers the threshold below the highest tracked hash and forgets the lines at or above it
+  void evict() {
+    uint32_t highest = by_hash.rbegin()->first;
+    threshold = highest;
+    while (!by_hash.empty() && by_hash.rbegin()->first >= highest) {
+      uint64_t line = by_hash.rbegin()->second;
+      by_hash.erase(--by_hash.end());
+
+      size_t slot = find(line);
+      add(times[slot], -1);
+      lines_by_time[times[slot]] = EMPTY;
+      erase_slot(slot);
+      num_lines--;
+    }
+  }
+
+  // Renumbers the time stamps of the tracked lines to 0..num_lines-1, keeping their order
+  void renumber() {
+    uint32_t next = 0;
+    for (uint32_t t = 0; t < now; t++) {
+      uint64_t line = lines_by_time[t];
+      if (line == EMPTY) {
+        continue;
+      }
+      lines_by_time[t] = EMPTY;
+      lines_by_time[next] = line;
+      times[find(line)] = next;
+      next++;
+    }
+    now = next;
+
+    // Fenwick tree of next ones followed by zeros, built in linear time
+    std::fill(tree.begin(), tree.end(), 0);
+    for (size_t i = 1; i < tree.size(); i++) {
+      tree[i] += i <= next;
+      size_t parent = i + (i & -i);
+      if (parent < tree.size()) {
+        tree[parent] += tree[i];
+      }
+    }
+  }
+};
+
+// Per-page reuse histograms of at most max_pages pages, in a table allocated once. Pages are
+// sampled like the lines of reuse_distance_engine: a page is kept if a hash of its number is below a
+// threshold, and when a new page finds the table full the threshold drops to keep only the half of
+// the pages with the lowest hashes. A page still in the table at the end was therefore kept from
+// its first access, and the pages kept are a uniform sample of the pages accessed.
+//
+// Not thread-safe.
+class page_reuse_table
+{
+public:
+  explicit page_reuse_table(size_t max_pages) : max_pages(max_pages), num_pages(0) {
+    size_t capacity = 1;
+    while (capacity < 2 * max_pages) {
+      capacity *= 2;
+    }
+    keys.resize(capacity);
+    pages.resize(capacity);
+    mask = capacity - 1;
+    clear();
+  }
+
+  // Returns the histogram of pageno, zeroed on first use, or NULL if pageno is not sampled
+  page_reuse *lookup(uint64_t pageno) {
+    uint32_t h = hash(pageno);
+    if (h >= threshold) {
+      return NULL;
+    }
+    size_t i = find(pageno);
+    if (keys[i] == pageno) {
+      return &pages[i];
+    }
+    if (num_pages == max_pages) {
+      halve();
+      if (h >= threshold) {
+        return NULL;
+      }
+      i = find(pageno);
+    }
+    keys[i] = pageno;
+    memset(&pages[i], 0, sizeof(page_reuse));
+    num_pages++;
+    return &pages[i];
+  }
+
+  void clear() {
+    std::fill(keys.begin(), keys.end(), (uint64_t)EMPTY);
+    num_pages = 0;
+    threshold = 1U << reuse_distance_engine::HASH_BITS;
+  }
+
+  // Fraction of the pages that are sampled
+  double rate() const { return (double)threshold / (1 << reuse_distance_engine::HASH_BITS); }
+  size_t size() const { return num_pages; }
+
+  // Slot-level iteration, as in page_table_of
+  size_t capacity() const { return mask + 1; }
+  bool used(size_t i) const { return keys[i] != EMPTY; }
+  uint64_t pageno_at(size_t i) const { return keys[i]; }
+  const page_reuse &at(size_t i) const { return pages[i]; }
+
+private:
+  static const uint64_t EMPTY = ~(uint64_t)0;
+
+  size_t max_pages;
+  size_t num_pages;
+  uint32_t threshold;
+  std::vector<uint64_t> keys;
+  std::vector<page_reuse> pages;
+  size_t mask;
+
+  // Independent of the line hash, so that the pages kept do not depend on which of their lines are
+  static uint32_t hash(uint64_t pageno) { return reuse_distance_engine::hash(pageno ^ 0x5851F42D4C957F2DULL); }
+
+  size_t find(uint64_t pageno) const {
+    size_t i = (size_t)reuse_distance_engine::mix(pageno) & mask;
+    while (keys[i] != EMPTY && keys[i] != pageno) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  // Lowers the threshold to the median hash of the pages and rebuilds the table with the pages below
+  // it; amortized over the max_pages / 2 insertions that refill the table
+  void halve() {
+    std::vector<uint32_t> hashes;
+    hashes.reserve(num_pages);
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i] != EMPTY) {
+        hashes.push_back(hash(keys[i]));
+      }
+    }
+    std::nth_element(hashes.begin(), hashes.begin() + hashes.size() / 2, hashes.end());
+    threshold = hashes[hashes.size() / 2];
+
+    std::vector<std::pair<uint64_t, page_reuse> > kept;
+    kept.reserve(hashes.size() / 2 + 1);
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i] != EMPTY && hash(keys[i]) < threshold) {
+        kept.push_back(std::make_pair(keys[i], pages[i]));
+      }
+    }
+    std::fill(keys.begin(), keys.end(), (uint64_t)EMPTY);
+    for (size_t k = 0; k < kept.size(); k++) {
+      size_t i = find(kept[k].first);
+      keys[i] = kept[k].first;
+      pages[i] = kept[k].second;
+    }
+    num_pages = kept.size();
+  }
+};
+
+#endif
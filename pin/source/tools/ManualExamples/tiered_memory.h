@@ -0,0 +1,345 @@
+#ifndef TIERED_MEMORY_H
+#define TIERED_MEMORY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "page_table.h"
+
+// Hybrid DRAM/NVM memory simulator.
+//
+// It is fed the memory traffic that gets past the simulated caches (line fills and write-backs),
+// page by page, and places the pages of the application in a DRAM tier of limited capacity or an NVM
+// tier under several policies at once:
+//
+//   first_touch      a page goes to DRAM on its first access while DRAM has room, and never moves
+//   epoch_migration  first-touch, then at the end of every epoch (a number of memory accesses) the
+//                    pages that were hottest during the epoch are promoted to DRAM, demoting the
+//                    coldest residents, as long as the time a move would save over an epoch like the
+//                    last one exceeds the time the copy takes
+//   static_top_k     the pages with the most to gain from DRAM over the whole run sit in DRAM from
+//                    the start; an oracle, decided at exit, like the offline percentile placement
+//   all_dram         unlimited DRAM, for reference
+//   all_nvm          no DRAM, for reference
+//
+// Every policy is charged the latency and energy of each access in the tier its page is in, and of
+// every line of each page it moves (a read from one tier and a write to the other). Memory time
+// assumes no overlap between accesses, so it is an upper bound on the stall time that is mainly
+// useful to compare policies. Not thread-safe.
+
+// Latencies (ns) and energies (pJ) of one cache-line access to each tier. The defaults are
+// PCM-like (Lee et al., ISCA '09) and should be set to the device being modelled.
+struct tier_params
+{
+  double dram_read_ns;
+  double dram_write_ns;
+  double nvm_read_ns;
+  double nvm_write_ns;
+  double dram_read_pj;
+  double dram_write_pj;
+  double nvm_read_pj;
+  double nvm_write_pj;
+
+  tier_params()
+      : dram_read_ns(80), dram_write_ns(80), nvm_read_ns(300), nvm_write_ns(1000),
+        dram_read_pj(640), dram_write_pj(640), nvm_read_pj(1265), nvm_write_pj(8612) {}
+
+  // Parses "name=value,name=value..." over the defaults, e.g. "nvm_read_ns=350,nvm_write_pj=5000"
+  bool parse(const std::string &spec, std::string &error) {
+    const char *names[] = { "dram_read_ns", "dram_write_ns", "nvm_read_ns", "nvm_write_ns",
+                            "dram_read_pj", "dram_write_pj", "nvm_read_pj", "nvm_write_pj" };
+    double *values[] = { &dram_read_ns, &dram_write_ns, &nvm_read_ns, &nvm_write_ns,
+                         &dram_read_pj, &dram_write_pj, &nvm_read_pj, &nvm_write_pj };
+
+    size_t start = 0;
+    while (start < spec.size()) {
+      size_t end = spec.find(',', start);
+      if (end == std::string::npos) {
+        end = spec.size();
+      }
+      std::string item = spec.substr(start, end - start);
+      start = end + 1;
+
+      size_t eq = item.find('=');
+      size_t i = 0;
+      while (i < 8 && (eq == std::string::npos || item.substr(0, eq) != names[i])) {
+        i++;
+      }
+      char *rest;
+      double value = i < 8 ? strtod(item.c_str() + eq + 1, &rest) : 0;
+      if (i == 8 || *rest != '\0' || value < 0) {
+        error = "bad parameter '" + item + "'";
+        return false;
+      }
+      *values[i] = value;
+    }
+    return true;
+  }
+
+  // Time saved by serving reads and writes from DRAM instead of NVM
+  double dram_benefit_ns(uint64_t reads, uint64_t writes) const {
+    return reads * (nvm_read_ns - dram_read_ns) + writes * (nvm_write_ns - dram_write_ns);
+  }
+};
+
+// What one policy cost
+struct tier_costs
+{
+  uint64_t reads[2];  // by tier: 0 DRAM, 1 NVM
+  uint64_t writes[2];
+  uint64_t promotions;  // pages moved to DRAM
+  uint64_t demotions;   // pages moved to NVM
+  double memory_ns;     // accesses
+  double migration_ns;  // page copies
+  double energy_pj;     // both
+};
+
+class tier_simulator
+{
+public:
+  enum policy
+  {
+    FIRST_TOUCH,
+    EPOCH_MIGRATION,
+    STATIC_TOP_K,
+    ALL_DRAM,
+    ALL_NVM,
+    NUM_POLICIES
+  };
+
+  static const char *policy_name(int policy) {
+    static const char *names[] = { "first_touch", "epoch_migration", "static_top_k", "all_dram", "all_nvm" };
+    return names[policy];
+  }
+
+  tier_simulator(const tier_params &params, uint64_t dram_pages, uint64_t epoch_accesses, uint32_t lines_per_page)
+      : params(params), dram_pages(dram_pages), epoch_accesses(epoch_accesses), lines_per_page(lines_per_page),
+        first_touch_used(0), accesses_left_in_epoch(epoch_accesses), num_epochs(0) {
+    memset(costs, 0, sizeof(costs));
+  }
+
+  // One cache-line access to pageno that reached memory
+  void access(uint64_t pageno, bool is_write) {
+    tier_page *page = pages.lookup(pageno);
+    if ((page->flags & SEEN) == 0) {
+      page->flags |= SEEN;
+      if (first_touch_used < dram_pages) {
+        page->flags |= FIRST_TOUCH_DRAM;
+        first_touch_used++;
+      }
+      if (residents.size() < dram_pages) {
+        make_resident(pageno, page);
+      }
+    }
+
+    if (is_write) {
+      page->writes++;
+    } else {
+      page->reads++;
+    }
+    charge(costs[FIRST_TOUCH], (page->flags & FIRST_TOUCH_DRAM) != 0, is_write);
+    charge(costs[EPOCH_MIGRATION], (page->flags & MIGRATION_DRAM) != 0, is_write);
+
+    if ((page->flags & IN_EPOCH) == 0) {
+      page->flags |= IN_EPOCH;
+      epoch_pagenos.push_back(pageno);
+    }
+    if (is_write) {
+      page->epoch_writes++;
+    } else {
+      page->epoch_reads++;
+    }
+    if (--accesses_left_in_epoch == 0) {
+      end_epoch();
+      accesses_left_in_epoch = epoch_accesses;
+    }
+  }
+
+  // Evaluates the policies that are decided over the whole run; call once, at exit
+  void finish() {
+    std::vector<std::pair<double, size_t> > benefits;
+    for (size_t i = 0; i < pages.capacity(); i++) {
+      if (pages.used(i)) {
+        const tier_page &page = pages.counts_at(i);
+        benefits.push_back(std::make_pair(-params.dram_benefit_ns(page.reads, page.writes), i));
+      }
+    }
+    size_t k = std::min((size_t)dram_pages, benefits.size());
+    std::nth_element(benefits.begin(), benefits.begin() + k, benefits.end());
+
+    for (size_t j = 0; j < benefits.size(); j++) {
+      const tier_page &page = pages.counts_at(benefits[j].second);
+      charge(costs[STATIC_TOP_K], j < k, false, page.reads);
+      charge(costs[STATIC_TOP_K], j < k, true, page.writes);
+      charge(costs[ALL_DRAM], true, false, page.reads);
+      charge(costs[ALL_DRAM], true, true, page.writes);
+      charge(costs[ALL_NVM], false, false, page.reads);
+      charge(costs[ALL_NVM], false, true, page.writes);
+    }
+  }
+
+  // Forgets the costs so far, keeping the placements
+  void reset() {
+    memset(costs, 0, sizeof(costs));
+    for (size_t i = 0; i < pages.capacity(); i++) {
+      if (pages.used(i)) {
+        tier_page *page = pages.lookup(pages.pageno_at(i));
+        page->reads = 0;
+        page->writes = 0;
+      }
+    }
+  }
+
+  const tier_costs &costs_of(int policy) const { return costs[policy]; }
+  uint64_t pages_seen() const { return pages.size(); }
+  uint64_t epochs() const { return num_epochs; }
+
+private:
+  static const uint32_t SEEN = 1;
+  static const uint32_t FIRST_TOUCH_DRAM = 2;
+  static const uint32_t MIGRATION_DRAM = 4;  // resident_index is valid
+  static const uint32_t IN_EPOCH = 8;        // in epoch_pagenos
+
+  struct tier_page
+  {
+    uint64_t reads;
+    uint64_t writes;
+    uint32_t epoch_reads;
+    uint32_t epoch_writes;
+    uint32_t resident_index;
+    uint32_t flags;
+  };
+
+  tier_params params;
+  uint64_t dram_pages;
+  uint64_t epoch_accesses;
+  uint32_t lines_per_page;
+
+  page_table_of<tier_page> pages;
+  uint64_t first_touch_used;
+
+  // epoch_migration: the pages in DRAM, and the pages accessed during the current epoch
+  std::vector<uint64_t> residents;
+  std::vector<uint64_t> epoch_pagenos;
+  uint64_t accesses_left_in_epoch;
+  uint64_t num_epochs;
+
+  tier_costs costs[NUM_POLICIES];
+
+  void charge(tier_costs &c, bool dram, bool is_write, uint64_t count = 1) {
+    if (is_write) {
+      c.writes[!dram] += count;
+      c.memory_ns += count * (dram ? params.dram_write_ns : params.nvm_write_ns);
+      c.energy_pj += count * (dram ? params.dram_write_pj : params.nvm_write_pj);
+    } else {
+      c.reads[!dram] += count;
+      c.memory_ns += count * (dram ? params.dram_read_ns : params.nvm_read_ns);
+      c.energy_pj += count * (dram ? params.dram_read_pj : params.nvm_read_pj);
+    }
+  }
+
+  double promotion_ns() const { return lines_per_page * (params.nvm_read_ns + params.dram_write_ns); }
+  double demotion_ns() const { return lines_per_page * (params.dram_read_ns + params.nvm_write_ns); }
+
+  void make_resident(uint64_t pageno, tier_page *page) {
+    page->flags |= MIGRATION_DRAM;
+    page->resident_index = residents.size();
+    residents.push_back(pageno);
+  }
+
+  void move(uint64_t pageno, tier_page *page, bool to_dram) {
+    tier_costs &c = costs[EPOCH_MIGRATION];
+    if (to_dram) {
+      make_resident(pageno, page);
+      c.promotions++;
+      c.migration_ns += promotion_ns();
+      c.energy_pj += lines_per_page * (params.nvm_read_pj + params.dram_write_pj);
+    } else {
+      // swap-remove from residents
+      uint64_t last = residents.back();
+      residents[page->resident_index] = last;
+      pages.lookup(last)->resident_index = page->resident_index;
+      residents.pop_back();
+      page->flags &= ~MIGRATION_DRAM;
+      c.demotions++;
+      c.migration_ns += demotion_ns();
+      c.energy_pj += lines_per_page * (params.dram_read_pj + params.nvm_write_pj);
+    }
+  }
+
+  double epoch_benefit(const tier_page &page) const {
+    return params.dram_benefit_ns(page.epoch_reads, page.epoch_writes);
+  }
+
+  void end_epoch() {
+    num_epochs++;
+
+    // promotion candidates, hottest first
+    std::vector<std::pair<double, uint64_t> > candidates;
+    for (size_t i = 0; i < epoch_pagenos.size(); i++) {
+      const tier_page &page = *pages.lookup(epoch_pagenos[i]);
+      if ((page.flags & MIGRATION_DRAM) == 0) {
+        candidates.push_back(std::make_pair(-epoch_benefit(page), epoch_pagenos[i]));
+      }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    // demotion victims, coldest first: residents that were not accessed in this epoch (in any
+    // order), then the accessed ones by benefit
+    std::vector<uint64_t> cold;
+    std::vector<std::pair<double, uint64_t> > warm;
+    if (residents.size() == dram_pages && !candidates.empty()) {
+      for (size_t i = 0; i < residents.size(); i++) {
+        const tier_page &page = *pages.lookup(residents[i]);
+        if ((page.flags & IN_EPOCH) == 0) {
+          cold.push_back(residents[i]);
+        } else {
+          warm.push_back(std::make_pair(epoch_benefit(page), residents[i]));
+        }
+      }
+      std::sort(warm.begin(), warm.end());
+    }
+
+    size_t next_cold = 0, next_warm = 0;
+    for (size_t i = 0; i < candidates.size(); i++) {
+      double benefit = -candidates[i].first;
+      if (residents.size() < dram_pages) {
+        if (benefit <= promotion_ns()) {
+          break;
+        }
+      } else {
+        uint64_t victim;
+        double victim_benefit;
+        if (next_cold < cold.size()) {
+          victim = cold[next_cold++];
+          victim_benefit = 0;
+        } else if (next_warm < warm.size()) {
+          victim = warm[next_warm].second;
+          victim_benefit = warm[next_warm++].first;
+        } else {
+          break;
+        }
+        if (benefit - victim_benefit <= promotion_ns() + demotion_ns()) {
+          break;
+        }
+        move(victim, pages.lookup(victim), false);
+      }
+      move(candidates[i].second, pages.lookup(candidates[i].second), true);
+    }
+
+    for (size_t i = 0; i < epoch_pagenos.size(); i++) {
+      tier_page *page = pages.lookup(epoch_pagenos[i]);
+      page->epoch_reads = 0;
+      page->epoch_writes = 0;
+      page->flags &= ~IN_EPOCH;
+    }
+    epoch_pagenos.clear();
+  }
+};
+
+#endif
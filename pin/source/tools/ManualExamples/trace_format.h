@@ -0,0 +1,264 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+// Binary page-count trace format
+// ===============================
+//
+// All integers are little-endian and every array is 8-byte aligned, so a reader can mmap the file
+// and use the arrays in place (util.py does the same with numpy.memmap).
+//
+//   trace_header                      at offset 0
+//   page number / count arrays        one pair per section, anywhere after the header
+//   trace_section[num_sections]       at section_table_offset (written last)
+//
+// Each section holds one counter kind of one thread as two parallel uint64 arrays of length count:
+// page numbers in ascending order, and the matching counts. Pages whose count is zero are left out.
+//
+// Sections whose kind has SECTION_EPOCH set are per-epoch deltas (see -epoch_ms in pinatrace.cpp):
+// they hold only the accesses made during epoch `epoch`, and timestamp_ms is when the epoch was
+// collected, in milliseconds since the tool started. The plain kinds always hold run totals, so
+// readers that ignore epochs are unaffected.
+//
+// Page numbers are address >> shift, where shift is recorded per section (0 in files written before
+// the field existed, meaning TRACE_PAGE_SHIFT). The plain kinds always hold 4 KB pages; sections at any
+// other granularity (cache lines, huge pages, see -granularities in pinatrace.cpp) additionally have
+// SECTION_GRANULARITY set, so readers that only know 4 KB pages skip them.
+//
+// Sections with SECTION_ALLOC_CLASS set hold only the accesses to objects of custom allocation class
+// `group` (see -alloc_hook in pinatrace.cpp; the class names are listed in the -alloc_report file).
+//
+// SECTION_WRITE_BACK sections count the dirty cache lines written back to memory from each page by
+// the simulated caches, including the lines still dirty at exit. They are run totals and are
+// attributed to the thread whose access caused the eviction (thread 0 for the final flush of the
+// shared levels).
+//
+// With -cores, SECTION_INVALIDATION sections count the copies of each page's lines in other cores'
+// private caches that a thread's stores invalidated, and SECTION_COHERENCE_MISS sections the
+// private-cache misses of a thread on lines it had lost to such an invalidation.
+//
+// SECTION_REUSE sections (see -reuse_report) hold estimated access counts by reuse distance of the
+// pages of all threads (thread 0): group 0 counts first accesses, group 1 accesses at distance 0,
+// and group g >= 2 accesses at distances in [2^(g-2), 2^(g-1)) cache lines.
+//
+// SECTION_MRC sections (see -mrc) are miss-ratio curves rather than page counts: their page numbers
+// are cache sizes in bytes and their counts the estimated misses of a fully associative LRU cache of
+// that size, of cache lines (group 0) or of 4 KB pages (group 1). Size 0 holds the number of accesses.
+//
+// SECTION_REGION sections (see -regions) map pages to memory regions (see region_table.h), for all
+// threads (thread 0): group 0 gives the region id of every page with a known region, group 1 its
+// offset in 4 KB pages from the start of the region, and groups 2 and 3 are indexed by region id
+// rather than page number and give each region's kind (region_kind) and ordinal. Region names are
+// only in the -regions file.
+//
+// With -counters sketch, the plain sections only hold the hottest pages, all under thread 0, and
+// their counts are estimates that may exceed the true counts (see heavy_hitters.h).
+//
+// In sampled runs, counts are already scaled up to estimated totals, and every section is followed by
+// one with SECTION_ERROR set that holds the standard error of each page's estimate in place of counts.
+//
+// section_size is the size of one trace_section as written; readers step through the section table
+// by section_size so that newer writers can append fields to trace_section without breaking them,
+// and read the fields past section_size of an older file as 0 (trace_file::section() copies only
+// section_size bytes). TRACE_VERSION only changes when the layout changes incompatibly.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+static const char TRACE_MAGIC[8] = { 'P', 'G', 'T', 'R', 'A', 'C', 'E', '\0' };
+static const uint32_t TRACE_VERSION = 1;
+static const uint32_t TRACE_PAGE_SHIFT = 12;
+
+enum trace_section_kind
+{
+  SECTION_READ_WITH_CACHE = 0,
+  SECTION_READ_WITHOUT_CACHE = 1,
+  SECTION_WRITE_WITH_CACHE = 2,
+  SECTION_WRITE_WITHOUT_CACHE = 3,
+  SECTION_WRITE_BACK = 4,
+  SECTION_INVALIDATION = 5,
+  SECTION_COHERENCE_MISS = 6,
+
+  SECTION_EPOCH = 0x100,
+  SECTION_ERROR = 0x200,
+  SECTION_GRANULARITY = 0x400,
+  SECTION_ALLOC_CLASS = 0x800,
+  SECTION_REUSE = 0x1000,
+  SECTION_MRC = 0x2000,
+  SECTION_REGION = 0x4000
+};
+
+struct trace_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t section_size;
+  uint64_t num_sections;
+  uint64_t section_table_offset;
+};
+
+struct trace_section
+{
+  uint32_t kind;
+  uint32_t thread;
+  uint64_t count;
+  uint64_t pagenos_offset;
+  uint64_t counts_offset;
+  uint32_t epoch;
+  uint32_t shift;
+  uint64_t timestamp_ms;
+  uint32_t group;
+  uint32_t reserved;
+};
+
+// Appends sections to a trace file. The header is rewritten and the section table appended by close().
+class trace_writer
+{
+public:
+  trace_writer() : file(NULL), offset(0) {}
+
+  ~trace_writer() {
+    if (file != NULL) {
+      close();
+    }
+  }
+
+  bool open(const char *filename) {
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+      return false;
+    }
+    sections.clear();
+    offset = 0;
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    write(&header, sizeof(header));
+    return true;
+  }
+
+  // pagenos must be sorted in ascending order
+  void add_section(uint32_t kind, uint32_t thread, const uint64_t *pagenos, const uint64_t *counts, uint64_t count,
+                   uint32_t epoch = 0, uint64_t timestamp_ms = 0, uint32_t shift = TRACE_PAGE_SHIFT, uint32_t group = 0) {
+    trace_section section;
+    memset(&section, 0, sizeof(section));
+    section.kind = kind;
+    section.thread = thread;
+    section.epoch = epoch;
+    section.shift = shift;
+    section.group = group;
+    section.timestamp_ms = timestamp_ms;
+    section.count = count;
+    section.pagenos_offset = offset;
+    write(pagenos, count * sizeof(uint64_t));
+    section.counts_offset = offset;
+    write(counts, count * sizeof(uint64_t));
+    sections.push_back(section);
+  }
+
+  bool close() {
+    trace_header header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.section_size = sizeof(trace_section);
+    header.num_sections = sections.size();
+    header.section_table_offset = offset;
+
+    if (!sections.empty()) {
+      write(&sections[0], sections.size() * sizeof(trace_section));
+    }
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    return ok;
+  }
+
+private:
+  FILE *file;
+  uint64_t offset;
+  std::vector<trace_section> sections;
+
+  void write(const void *data, uint64_t size) {
+    fwrite(data, 1, size, file);
+    offset += size;
+  }
+};
+
+// Read-only, zero-copy view of a trace file
+class trace_file
+{
+public:
+  trace_file() : data(NULL), size(0) {}
+
+  ~trace_file() {
+    if (data != NULL) {
+      munmap(data, size);
+    }
+  }
+
+  // Returns false if the file cannot be mapped or is not a trace file of a supported version
+  bool open(const char *filename) {
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(trace_header)) {
+      ::close(fd);
+      return false;
+    }
+    size = st.st_size;
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    data = (char *)p;
+
+    const trace_header *h = header();
+    return memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) == 0
+        && h->version <= TRACE_VERSION
+        && h->section_size >= offsetof(trace_section, epoch)
+        && h->section_table_offset + h->num_sections * h->section_size <= size;
+  }
+
+  const trace_header *header() const { return (const trace_header *)data; }
+
+  uint64_t num_sections() const { return header()->num_sections; }
+
+  // Copy of section i; fields beyond the file's section_size are 0
+  trace_section section(uint64_t i) const {
+    uint32_t section_size = header()->section_size;
+    trace_section s;
+    memset(&s, 0, sizeof(s));
+    memcpy(&s, data + header()->section_table_offset + i * section_size, section_size < sizeof(s) ? section_size : sizeof(s));
+    return s;
+  }
+
+  const uint64_t *pagenos(const trace_section &s) const { return (const uint64_t *)(data + s.pagenos_offset); }
+  const uint64_t *counts(const trace_section &s) const { return (const uint64_t *)(data + s.counts_offset); }
+
+  // Page shift of s, a section of this file: TRACE_PAGE_SHIFT if the file's sections predate the
+  // field, or it is 0
+  uint32_t shift(const trace_section &s) const {
+    bool has_shift = header()->section_size >= offsetof(trace_section, shift) + sizeof(s.shift);
+    return has_shift && s.shift != 0 ? s.shift : TRACE_PAGE_SHIFT;
+  }
+
+private:
+  char *data;
+  size_t size;
+
+  trace_file(const trace_file &);
+  trace_file &operator=(const trace_file &);
+};
+
+#endif
@@ -30,8 +30,8 @@ echo
 echo "Starting memcached under pin"
 export PINATRACE_PIPE
 export PINATRACE_OUTPUT_FILENAME
-echo "PINATRACE_PIPE=${PINATRACE_PIPE} PINATRACE_OUTPUT_FILENAME=${PINATRACE_OUTPUT_FILENAME} ${PIN_BINARY_PATH} -injection child -t ${PIN_TOOL_PATH} -- ${MEMCACHED_COMMAND} &"
-PINATRACE_PIPE=${PINATRACE_PIPE} PINATRACE_OUTPUT_FILENAME=${PINATRACE_OUTPUT_FILENAME} ${PIN_BINARY_PATH} -injection child -t ${PIN_TOOL_PATH} -- ${MEMCACHED_COMMAND} &
+echo "PINATRACE_PIPE=${PINATRACE_PIPE} PINATRACE_OUTPUT_FILENAME=${PINATRACE_OUTPUT_FILENAME} ${PIN_BINARY_PATH} -injection child -t ${PIN_TOOL_PATH} -start_tracing 0 -- ${MEMCACHED_COMMAND} &"
+PINATRACE_PIPE=${PINATRACE_PIPE} PINATRACE_OUTPUT_FILENAME=${PINATRACE_OUTPUT_FILENAME} ${PIN_BINARY_PATH} -injection child -t ${PIN_TOOL_PATH} -start_tracing 0 -- ${MEMCACHED_COMMAND} &
 PIN_PORT=$!
 echo
 
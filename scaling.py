@@ -0,0 +1,40 @@
+#!/usr/bin/env python
+
+# Runs scaling_test under pin with 1-16 threads and prints instrumented accesses/sec.
+#
+# Usage: ./scaling.py [pin_tool_path]
+#
+# Pass the path of an older pinatrace.so to get the "before" numbers for comparison.
+
+import os
+import subprocess
+import sys
+import util
+
+SCALING_TEST_PATH = os.path.join(util.RESEARCH_DIR, "scaling_test")
+
+THREAD_COUNTS = [1, 2, 4, 8, 16]
+
+def main(pin_tool_path):
+  if not os.path.exists(SCALING_TEST_PATH):
+    subprocess.check_call(["gcc", "-O1", "-pthread", "-o", SCALING_TEST_PATH, "scaling_test.c"])
+
+  with util.create_tmp_file() as pin_output_filename:
+    print "%8s %16s" % ("threads", "accesses/sec")
+
+    for num_threads in THREAD_COUNTS:
+      command = "%s %d" % (SCALING_TEST_PATH, num_threads)
+      pin_process = util.run_under_pin(command_to_run=command, pin_output_filename=pin_output_filename, pin_tool_path=pin_tool_path, stdout=subprocess.PIPE)
+      output = pin_process.communicate()[0]
+
+      # the pin tool prints to the same stdout, so pick out the line scaling_test wrote
+      result_line = [line for line in output.split("\n") if line.startswith("threads=")][0]
+      result = dict(field.split("=") for field in result_line.split(" "))
+      print "%8d %16.0f" % (num_threads, float(result["accesses_per_sec"]))
+
+if __name__ == "__main__":
+  if len(sys.argv) > 2:
+    print "Usage: ./scaling.py [pin_tool_path]"
+    sys.exit(1)
+
+  main(sys.argv[1] if len(sys.argv) == 2 else None)
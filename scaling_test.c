@@ -0,0 +1,65 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define PAGE_SIZE (4096)
+
+// Every thread walks its own 8 MB buffer and a buffer shared by all threads
+#define PRIVATE_PAGES (2048)
+#define SHARED_PAGES (2048)
+#define PASSES (20)
+
+char *shared;
+
+double now_sec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void *worker(void *arg)
+{
+  char *p = malloc(PRIVATE_PAGES * PAGE_SIZE);
+  long i, pass;
+  volatile char c = 0;
+
+  for (pass = 0; pass < PASSES; pass++) {
+    for (i = 0; i < PRIVATE_PAGES * PAGE_SIZE; i += 64)
+      p[i] = c;
+    for (i = 0; i < SHARED_PAGES * PAGE_SIZE; i += 64)
+      c = shared[i];
+  }
+
+  free(p);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int num_threads = argc > 1 ? atoi(argv[1]) : 1;
+  pthread_t threads[64];
+  int i;
+
+  if (num_threads < 1 || num_threads > 64) {
+    fprintf(stderr, "usage: %s [num_threads (1-64)]\n", argv[0]);
+    return 1;
+  }
+
+  shared = calloc(SHARED_PAGES, PAGE_SIZE);
+
+  double start = now_sec();
+  for (i = 0; i < num_threads; i++)
+    pthread_create(&threads[i], NULL, worker, NULL);
+  for (i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = now_sec() - start;
+
+  // one store per private line and one load per shared line on every pass
+  double accesses = (double)num_threads * PASSES * (PRIVATE_PAGES + SHARED_PAGES) * (PAGE_SIZE / 64);
+
+  printf("threads=%d accesses=%.0f seconds=%.3f accesses_per_sec=%.0f\n", num_threads, accesses, elapsed, accesses / elapsed);
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Compares the -counters sketch backend (heavy_hitters.h) against exact page_table counts on a
+// synthetic Zipf-distributed stream split over several threads, the way pinatrace uses it: one
+// Count-Min sketch and Space-Saving table per thread, merged at the end, the top k pages by merged
+// estimate reported. Prints the memory and time of both, how many of the true top k pages were
+// found, and the overestimates of their counts against the documented bounds.
+//
+// g++ -O2 -o sketch_bench sketch_bench.cpp && ./sketch_bench [num_pages] [num_accesses] [zipf_s] [width] [depth] [topk] [threads]
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "pin/source/tools/ManualExamples/heavy_hitters.h"
+
+static double now_sec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+  *state += 0x9E3779B97F4A7C15ULL;
+  return count_min_sketch::mix(*state);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t num_pages = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+  size_t num_accesses = argc > 2 ? strtoull(argv[2], NULL, 10) : 50000000;
+  double zipf_s = argc > 3 ? atof(argv[3]) : 0.9;
+  uint32_t width = argc > 4 ? strtoul(argv[4], NULL, 10) : 65536;
+  uint32_t depth = argc > 5 ? strtoul(argv[5], NULL, 10) : 4;
+  size_t topk = argc > 6 ? strtoull(argv[6], NULL, 10) : 4096;
+  size_t num_threads = argc > 7 ? strtoull(argv[7], NULL, 10) : 4;
+
+  // Zipf ranks by inverse CDF, scattered over a heap-like range of page numbers; bit 0 of the flags
+  // is write, bit 1 cache hit
+  std::vector<double> cdf(num_pages);
+  double sum = 0;
+  for (size_t i = 0; i < num_pages; i++) {
+    sum += 1.0 / pow(i + 1.0, zipf_s);
+    cdf[i] = sum;
+  }
+  std::vector<uint64_t> pagenos(num_accesses);
+  std::vector<uint8_t> flags(num_accesses);
+  uint64_t state = 42;
+  for (size_t i = 0; i < num_accesses; i++) {
+    double u = (next_random(&state) >> 11) * (1.0 / 9007199254740992.0) * sum;
+    size_t rank = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    pagenos[i] = 0x7f0000000ULL + count_min_sketch::mix(rank) % (num_pages * 4);
+    flags[i] = next_random(&state) & 3;
+  }
+
+  // each thread takes an interleaved share of the stream
+  double start = now_sec();
+  page_table exact;
+  for (size_t i = 0; i < num_accesses; i++) {
+    page_counts *counts = exact.lookup(pagenos[i]);
+    bool write = flags[i] & 1, hit = flags[i] & 2;
+    if (write) {
+      counts->write_without_cache++;
+      if (!hit) counts->write_with_cache++;
+    } else {
+      counts->read_without_cache++;
+      if (!hit) counts->read_with_cache++;
+    }
+  }
+  double exact_sec = now_sec() - start;
+
+  start = now_sec();
+  std::vector<count_min_sketch *> sketches;
+  std::vector<space_saving *> tables;
+  for (size_t t = 0; t < num_threads; t++) {
+    sketches.push_back(new count_min_sketch(width, depth));
+    tables.push_back(new space_saving(topk));
+  }
+  for (size_t i = 0; i < num_accesses; i++) {
+    size_t t = i % num_threads;
+    bool write = flags[i] & 1, hit = flags[i] & 2;
+    page_counts delta = { 0, 0, 0, 0 };
+    if (write) {
+      delta.write_without_cache = 1;
+      delta.write_with_cache = !hit;
+    } else {
+      delta.read_without_cache = 1;
+      delta.read_with_cache = !hit;
+    }
+    sketches[t]->add(pagenos[i], delta);
+    page_counts estimate = sketches[t]->estimate(pagenos[i]);
+    tables[t]->add(pagenos[i], 1, estimate.read_without_cache + estimate.write_without_cache);
+  }
+  double sketch_sec = now_sec() - start;
+
+  // merge as pinatrace does at exit
+  start = now_sec();
+  count_min_sketch merged(width, depth);
+  std::vector<uint64_t> candidates;
+  for (size_t t = 0; t < num_threads; t++) {
+    merged.merge(*sketches[t]);
+    for (size_t i = 0; i < tables[t]->size(); i++) {
+      candidates.push_back(tables[t]->at(i).pageno);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+  std::vector<std::pair<uint64_t, uint64_t> > estimated;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    page_counts c = merged.estimate(candidates[i]);
+    estimated.push_back(std::make_pair(c.read_without_cache + c.write_without_cache, candidates[i]));
+  }
+  std::sort(estimated.rbegin(), estimated.rend());
+  estimated.resize(std::min(estimated.size(), topk));
+  double merge_sec = now_sec() - start;
+
+  std::vector<std::pair<uint64_t, uint64_t> > truth;
+  for (size_t i = 0; i < exact.capacity(); i++) {
+    if (exact.used(i)) {
+      const page_counts &c = exact.counts_at(i);
+      truth.push_back(std::make_pair(c.read_without_cache + c.write_without_cache, exact.pageno_at(i)));
+    }
+  }
+  std::sort(truth.rbegin(), truth.rend());
+
+  // recall of the true top k, and the overestimates of every reported page's four counters
+  std::vector<uint64_t> reported;
+  for (size_t i = 0; i < estimated.size(); i++) {
+    reported.push_back(estimated[i].second);
+  }
+  std::sort(reported.begin(), reported.end());
+  size_t found = 0;
+  for (size_t i = 0; i < std::min(topk, truth.size()); i++) {
+    found += std::binary_search(reported.begin(), reported.end(), truth[i].second);
+  }
+
+  double bound = merged.error_bound(merged.total().read_without_cache);
+  uint64_t max_error = 0, over_bound = 0, under = 0;
+  double error_sum = 0;
+  for (size_t i = 0; i < reported.size(); i++) {
+    page_counts e = merged.estimate(reported[i]);
+    const page_counts *c = exact.find(reported[i]);
+    uint64_t actual = c != NULL ? c->read_without_cache : 0;
+    under += e.read_without_cache < actual;
+    uint64_t error = e.read_without_cache - actual;
+    max_error = std::max(max_error, error);
+    error_sum += error;
+    over_bound += error > bound;
+  }
+
+  // every page above the sum of the tables' smallest weights must have been a candidate
+  uint64_t missed_guaranteed = 0;
+  uint64_t threshold = 0;
+  for (size_t t = 0; t < num_threads; t++) {
+    threshold += tables[t]->min_weight();
+  }
+  for (size_t i = 0; i < truth.size() && truth[i].first > threshold; i++) {
+    missed_guaranteed += !std::binary_search(candidates.begin(), candidates.end(), truth[i].second);
+  }
+
+  size_t sketch_bytes = num_threads * (merged.bytes() + tables[0]->bytes());
+  size_t exact_bytes = exact.capacity() * (sizeof(uint64_t) + sizeof(page_counts));
+  printf("%zu accesses over %zu distinct pages (zipf s=%.2f), %zu threads\n", num_accesses, exact.size(), zipf_s, num_threads);
+  printf("exact:  %8.2f MB, %6.2f ns/access\n", exact_bytes / 1048576.0, exact_sec * 1e9 / num_accesses);
+  printf("sketch: %8.2f MB, %6.2f ns/access, merge %.3f s (width %u, depth %u, top %zu)\n", sketch_bytes / 1048576.0,
+         sketch_sec * 1e9 / num_accesses, merge_sec, width, depth, topk);
+  printf("top %zu: %zu found (%.1f%%), %zu candidates\n", topk, found, 100.0 * found / std::min(topk, truth.size()), candidates.size());
+  printf("reads of reported pages: overestimate max %llu, mean %.1f; per-page bound %.1f (p = %.3f), %llu above it (expected up to %.0f), "
+         "%llu below the true count\n",
+         (unsigned long long)max_error, reported.empty() ? 0.0 : error_sum / reported.size(), bound, merged.failure_probability(),
+         (unsigned long long)over_bound, merged.failure_probability() * reported.size(), (unsigned long long)under);
+  printf("pages above the tables' smallest weights (%llu accesses; bound total / k + sketch error = %.0f) not among the candidates: %llu\n",
+         (unsigned long long)threshold, (double)num_accesses / topk + merged.error_bound(num_accesses), (unsigned long long)missed_guaranteed);
+
+  if (under != 0 || missed_guaranteed != 0) {
+    fprintf(stderr, "mismatch: the sketch broke a guarantee\n");
+    return 1;
+  }
+  return 0;
+}
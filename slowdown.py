@@ -0,0 +1,48 @@
+#!/usr/bin/env python
+
+# Reports the slowdown of every analysis variant of the pin tool on large_test.c.
+#
+# Usage: ./slowdown.py [extra_pin_tool_args]
+
+import datetime
+import os
+import subprocess
+import sys
+import util
+
+LARGE_TEST_PATH = os.path.join(util.RESEARCH_DIR, "large_test")
+
+VARIANTS = [
+  "-counts both -accesses all",
+  "-counts cache -accesses all",
+  "-counts no_cache -accesses all",
+  "-counts both -accesses reads",
+  "-counts both -accesses writes",
+  "-counts no_cache -accesses reads",
+  "-counts no_cache -accesses writes",
+]
+
+def time_process(process):
+  start_time = datetime.datetime.now()
+  process.communicate()
+  return (datetime.datetime.now() - start_time).total_seconds()
+
+def main(extra_pin_tool_args):
+  if not os.path.exists(LARGE_TEST_PATH):
+    subprocess.check_call(["gcc", "-O1", "-o", LARGE_TEST_PATH, "large_test.c"])
+
+  with open(os.devnull, "w") as devnull:
+    native_sec = time_process(subprocess.Popen([LARGE_TEST_PATH], stdout=devnull))
+
+    print "%-40s %10s %10s" % ("variant", "seconds", "slowdown")
+    print "%-40s %10.2f %10s" % ("native", native_sec, "1.0x")
+
+    with util.create_tmp_file() as pin_output_filename:
+      for variant in VARIANTS:
+        pin_tool_args = "%s %s" % (variant, extra_pin_tool_args)
+        pin_process = util.run_under_pin(command_to_run=LARGE_TEST_PATH, pin_output_filename=pin_output_filename, stdout=devnull, pin_tool_args=pin_tool_args)
+        pin_sec = time_process(pin_process)
+        print "%-40s %10.2f %9.1fx" % (variant, pin_sec, pin_sec / native_sec)
+
+if __name__ == "__main__":
+  main(" ".join(sys.argv[1:]))
@@ -0,0 +1,284 @@
+// Consumer of pinatrace -stream: attaches to the shared-memory segment (access_ring.h), drains the
+// rings of the application's threads and does what pinatrace would otherwise do in those threads,
+// counting pages with and without the simulated caches and the lines written back to memory, then
+// writes the binary trace (trace_format.h). Start it before or after the tool, on the same segment
+// path and with the same cache line size; it waits for the segment to appear and exits once the
+// tool has finished and every ring is empty.
+//
+// Rings are split over -workers threads (ring r goes to worker r % workers). Every application
+// thread has its own private levels here too, and the simulation is pinatrace's own
+// (cache_simulation.h) on pthread locks, so the counts match those of an in-process run up to the
+// interleaving of the threads at the shared levels. The dropped records and the producers' stalls
+// are reported. So are the records of a ring that precede its first THREAD_START marker, which are
+// skipped.
+//
+// g++ -O2 -pthread -o stream_consumer stream_consumer.cpp && ./stream_consumer [-counts both|cache|no_cache] [-cache_config default|FILE] [-workers N] segment trace
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "pin/source/tools/ManualExamples/access_ring.h"
+#include "pin/source/tools/ManualExamples/cache_model.h"
+#include "pin/source/tools/ManualExamples/cache_simulation.h"
+#include "pin/source/tools/ManualExamples/page_table.h"
+#include "pin/source/tools/ManualExamples/trace_format.h"
+
+static double now_sec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool with_cache = true;
+static bool without_cache = true;
+static uint32_t cache_line_shift = 6;
+static cache_config caches;
+
+struct pthread_locks
+{
+  typedef pthread_mutex_t lock_type;
+  static void init(pthread_mutex_t *lock) { pthread_mutex_init(lock, NULL); }
+  static void acquire(pthread_mutex_t *lock) { pthread_mutex_lock(lock); }
+  static void release(pthread_mutex_t *lock) { pthread_mutex_unlock(lock); }
+};
+
+static striped_shared_caches<pthread_locks> shared_caches;
+
+// One application thread, as seen through its ring
+struct consumer_thread
+{
+  uint32_t index;
+  cache_hierarchy private_caches;
+  page_table pages;
+  page_table_of<line_event_counts> line_events;
+  std::vector<uint64_t> private_write_backs;
+  std::vector<uint64_t> memory_write_backs;
+
+  explicit consumer_thread(uint32_t index) : index(index) {
+    for (size_t i = 0; i < caches.levels.size(); i++) {
+      if (!caches.levels[i].shared) {
+        private_caches.add_level(caches.levels[i]);
+      }
+    }
+    private_caches.set_inclusive(caches.inclusive);
+  }
+
+  bool access_cache(uint64_t addr, bool is_write) {
+    bool hit = access_private_and_shared(private_caches, shared_caches, addr >> cache_line_shift, is_write, &private_write_backs, &memory_write_backs);
+    if (!memory_write_backs.empty()) {
+      add_write_backs(line_events, memory_write_backs, cache_line_shift, TRACE_PAGE_SHIFT);
+    }
+    return hit;
+  }
+
+  // A run of count accesses to one line: only the first one can miss
+  void record(const access_record &r) {
+    bool cache_hit = with_cache && access_cache(r.addr, r.is_write());
+    if (!without_cache && cache_hit) {
+      return;
+    }
+    page_counts *counts = pages.lookup(r.addr >> TRACE_PAGE_SHIFT);
+    if (r.is_write()) {
+      counts->write_without_cache += without_cache ? r.count() : 0;
+      counts->write_with_cache += with_cache && !cache_hit;
+    } else {
+      counts->read_without_cache += without_cache ? r.count() : 0;
+      counts->read_with_cache += with_cache && !cache_hit;
+    }
+  }
+};
+
+static access_stream stream;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<consumer_thread *> threads;
+
+struct worker
+{
+  pthread_t thread;
+  uint32_t first_ring;
+  uint32_t ring_step;
+  uint64_t records;
+  uint64_t accesses;
+  uint64_t unattributed;  // records that came before their ring's first THREAD_START
+};
+
+static void *run_worker(void *arg)
+{
+  worker *w = (worker *)arg;
+  const size_t BATCH = 4096;
+  std::vector<access_record> batch(BATCH);
+  std::vector<consumer_thread *> current(stream.num_rings(), (consumer_thread *)NULL);
+
+  while (true) {
+    // once done is seen, one more pass that finds every ring empty means there is nothing left
+    bool done = __atomic_load_n(&stream.header()->done, __ATOMIC_ACQUIRE);
+    bool drained_any = false;
+    for (uint32_t r = w->first_ring; r < stream.num_rings(); r += w->ring_step) {
+      size_t n;
+      while ((n = stream.drain(r, &batch[0], BATCH)) != 0) {
+        drained_any = true;
+        for (size_t i = 0; i < n; i++) {
+          const access_record &rec = batch[i];
+          if (rec.info == access_record::THREAD_START) {
+            current[r] = new consumer_thread((uint32_t)rec.addr);
+            pthread_mutex_lock(&threads_lock);
+            threads.push_back(current[r]);
+            pthread_mutex_unlock(&threads_lock);
+          } else if (current[r] == NULL) {
+            // left over from a producer whose marker was dropped, e.g. while a previous consumer
+            // had died without detaching, so there is no thread to count them for
+            w->unattributed++;
+          } else {
+            current[r]->record(rec);
+            w->records++;
+            w->accesses += rec.count();
+          }
+        }
+      }
+    }
+    if (!drained_any) {
+      if (done) {
+        return NULL;
+      }
+      usleep(100);
+    }
+  }
+}
+
+static bool by_index(const consumer_thread *a, const consumer_thread *b)
+{
+  return a->index < b->index;
+}
+
+// A thread's sections, as pinatrace writes them at 4 KB without sampling
+static void write_sections(trace_writer &writer, const consumer_thread &t)
+{
+  write_page_counts_sections(writer, t.index, t.pages, TRACE_PAGE_SHIFT, 0, 0, 0, 0, NULL, NULL);
+  if (with_cache) {
+    write_line_events_sections(writer, t.index, t.line_events, TRACE_PAGE_SHIFT, false, NULL, NULL);
+  }
+}
+
+static int usage()
+{
+  fprintf(stderr, "usage: stream_consumer [-counts both|cache|no_cache] [-cache_config default|FILE] [-workers N] segment trace\n");
+  return 2;
+}
+
+int main(int argc, char *argv[])
+{
+  std::string counts = "both", cache_config_name = "default";
+  uint32_t num_workers = 1;
+  int arg = 1;
+  for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+    if (strcmp(argv[arg], "-counts") == 0) {
+      counts = argv[arg + 1];
+    } else if (strcmp(argv[arg], "-cache_config") == 0) {
+      cache_config_name = argv[arg + 1];
+    } else if (strcmp(argv[arg], "-workers") == 0) {
+      num_workers = strtoul(argv[arg + 1], NULL, 10);
+    } else {
+      return usage();
+    }
+  }
+  if (argc - arg != 2 || num_workers == 0 || (counts != "both" && counts != "cache" && counts != "no_cache")) {
+    return usage();
+  }
+  const char *segment = argv[arg];
+  const char *output = argv[arg + 1];
+  with_cache = counts != "no_cache";
+  without_cache = counts != "cache";
+
+  std::string error;
+  if (cache_config_name == "default") {
+    caches = cache_config::default_config();
+  } else if (!caches.read_file(cache_config_name.c_str(), error)) {
+    fprintf(stderr, "Error: bad cache config %s: %s\n", cache_config_name.c_str(), error.c_str());
+    return 1;
+  }
+  cache_line_shift = 0;
+  while ((1U << cache_line_shift) < caches.line_size()) {
+    cache_line_shift++;
+  }
+  shared_caches.configure(caches);
+
+  // a segment whose consumer already detached is left over from an earlier run
+  bool waiting = false;
+  while (!stream.attach(segment) || stream.header()->consumer_pid < 0) {
+    stream.unmap();
+    if (!waiting) {
+      fprintf(stderr, "waiting for %s\n", segment);
+      waiting = true;
+    }
+    usleep(10000);
+  }
+  if (!stream.attach_consumer()) {
+    fprintf(stderr, "Error: %s already has a consumer\n", segment);
+    return 1;
+  }
+
+  double start = now_sec();
+  num_workers = std::min(num_workers, stream.num_rings());
+  std::vector<worker> workers(num_workers);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    workers[i].first_ring = i;
+    workers[i].ring_step = num_workers;
+    workers[i].records = 0;
+    workers[i].accesses = 0;
+    workers[i].unattributed = 0;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  uint64_t records = 0, accesses = 0, unattributed = 0;
+  for (uint32_t i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    records += workers[i].records;
+    accesses += workers[i].accesses;
+    unattributed += workers[i].unattributed;
+  }
+  double seconds = now_sec() - start;
+
+  uint64_t dropped = stream.header()->unassigned_dropped + unattributed, stalls = 0;
+  for (uint32_t r = 0; r < stream.num_rings(); r++) {
+    dropped += stream.control(r)->dropped;
+    stalls += stream.control(r)->stalls;
+  }
+  stream.detach_consumer();
+
+  // dirty lines left at exit, as pinatrace's FlushCaches(); the shared levels' go to thread 0
+  std::sort(threads.begin(), threads.end(), by_index);
+  if (with_cache && !threads.empty()) {
+    for (size_t i = 0; i < threads.size(); i++) {
+      flush_private_caches(threads[i]->private_caches, shared_caches, &threads[i]->memory_write_backs);
+      add_write_backs(threads[i]->line_events, threads[i]->memory_write_backs, cache_line_shift, TRACE_PAGE_SHIFT);
+    }
+    std::vector<uint64_t> lines;
+    shared_caches.levels().flush(&lines);
+    add_write_backs(threads[0]->line_events, lines, cache_line_shift, TRACE_PAGE_SHIFT);
+  }
+
+  trace_writer writer;
+  if (!writer.open(output)) {
+    fprintf(stderr, "Error: could not open %s\n", output);
+    return 1;
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    write_sections(writer, *threads[i]);
+  }
+  if (!writer.close()) {
+    fprintf(stderr, "Error: could not write %s\n", output);
+    return 1;
+  }
+
+  printf("%zu threads, %llu records (%llu accesses) in %.2f s, %.1f M records/s with %u workers\n", threads.size(),
+         (unsigned long long)records, (unsigned long long)accesses, seconds, records / seconds / 1e6, num_workers);
+  printf("%llu records dropped (%llu without a thread start), %llu producer stalls on a full ring\n", (unsigned long long)dropped,
+         (unsigned long long)unattributed, (unsigned long long)stalls);
+  return 0;
+}
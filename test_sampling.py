@@ -0,0 +1,81 @@
+#!/usr/bin/env python
+
+# Validates sampled page counts against an exact run of large_test.
+#
+# For every sampling configuration this prints the slowdown relative to the exact run, the mean
+# relative error of pages with at least MIN_EXACT_COUNT accesses, the fraction of those pages whose
+# exact count lies within two reported standard errors, and the overlap of the sampled and exact
+# top-k hot sets.
+
+import datetime
+import os
+import subprocess
+import util
+
+LARGE_TEST_PATH = os.path.join(util.RESEARCH_DIR, "large_test")
+PIN_OUT_DIR = os.path.join(util.AFS_DIRECTORY, "pinatrace_out", "sampling")
+
+EXACT_ARGS = "-counts no_cache"
+
+SAMPLED_ARGS = [
+  "-counts no_cache -sample_period 10",
+  "-counts no_cache -sample_period 100",
+  "-counts no_cache -sample_period 1000",
+  "-counts no_cache -sample_burst 100 -sample_gap 900",
+  "-counts no_cache -sample_burst 1000 -sample_gap 9000",
+]
+
+MIN_EXACT_COUNT = 1000
+TOP_K = 100
+
+KINDS = [util.SECTION_READ_WITHOUT_CACHE, util.SECTION_WRITE_WITHOUT_CACHE]
+
+def run(pin_tool_args, pin_output_filename):
+  with open(os.devnull, "w") as devnull:
+    start_time = datetime.datetime.now()
+    util.run_under_pin(command_to_run=LARGE_TEST_PATH, pin_output_filename=pin_output_filename, stdout=devnull, pin_tool_args=pin_tool_args).wait()
+    return (datetime.datetime.now() - start_time).total_seconds()
+
+def top_k(pagenos, counts, k):
+  return set(pagenos[counts.argsort()[::-1][:k]].tolist())
+
+def main():
+  if not os.path.exists(LARGE_TEST_PATH):
+    subprocess.check_call(["gcc", "-O1", "-o", LARGE_TEST_PATH, "large_test.c"])
+  if not os.path.exists(PIN_OUT_DIR):
+    os.makedirs(PIN_OUT_DIR)
+
+  exact_filename = os.path.join(PIN_OUT_DIR, "exact.out")
+  exact_sec = run(EXACT_ARGS, exact_filename)
+  exact_pagenos, exact_counts = util.BinaryTrace(exact_filename).aggregate(KINDS)
+  exact = dict(zip(exact_pagenos.tolist(), exact_counts.tolist()))
+  exact_top_k = top_k(exact_pagenos, exact_counts, TOP_K)
+
+  print "%-55s %9s %10s %12s %10s" % ("configuration", "speedup", "rel. error", "within 2 SE", "top-%d" % TOP_K)
+
+  for i, pin_tool_args in enumerate(SAMPLED_ARGS):
+    sampled_filename = os.path.join(PIN_OUT_DIR, "sampled_%d.out" % i)
+    sampled_sec = run(pin_tool_args, sampled_filename)
+
+    trace = util.BinaryTrace(sampled_filename)
+    pagenos, counts = trace.aggregate(KINDS)
+    _, errors = trace.aggregate_errors(KINDS)
+    sampled = dict(zip(pagenos.tolist(), zip(counts.tolist(), errors.tolist())))
+
+    relative_errors = []
+    within = 0
+    for pageno in exact:
+      if exact[pageno] < MIN_EXACT_COUNT:
+        continue
+      estimate, error = sampled.get(pageno, (0, 0))
+      relative_errors.append(abs(estimate - exact[pageno]) / float(exact[pageno]))
+      if abs(estimate - exact[pageno]) <= 2 * error:
+        within += 1
+
+    overlap = len(exact_top_k & top_k(pagenos, counts, TOP_K)) / float(len(exact_top_k))
+
+    print "%-55s %8.1fx %10.4f %11.1f%% %9.1f%%" % (pin_tool_args, exact_sec / sampled_sec,
+      sum(relative_errors) / max(len(relative_errors), 1), 100.0 * within / max(len(relative_errors), 1), 100.0 * overlap)
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,438 @@
+// Compares and averages the page counts of several runs of the same workload (binary traces of
+// pinatrace). Pages are lined up by page number, or, if every trace was recorded with -regions, by
+// (region kind, name, ordinal, offset in region) so that runs line up despite ASLR and mmap
+// placement. The region names of trace T are read from T.regions if it exists (the -regions file of
+// the run); without it, regions are told apart by kind and ordinal only.
+//
+// Every trace is reduced to one sorted array of (page, count) by merging its sections pairwise, and
+// the runs are lined up on the union of their pages, merged the same way; everything after that is
+// a linear pass over each run. The summary goes to stdout: for every run its pages, accesses and the pages no other
+// run has, and how far it is from the first run and from the mean of all runs (cosine similarity of
+// the aligned page counts, as util.cosine_similarity, and the Kolmogorov-Smirnov and earth mover's
+// distances between the distributions of per-page counts). With -pages, the mean, variance, minimum
+// and maximum of every page over all runs (0 where a run does not have the page) go to FILE.
+//
+// g++ -O2 -o trace_compare trace_compare.cpp && ./trace_compare [-no_cache] [-raw] [-pages FILE] trace...
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "pin/source/tools/ManualExamples/trace_format.h"
+#include "pin/source/tools/ManualExamples/region_table.h"
+
+static double now_sec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Keys of region-relative pages: (region key + 1) << REGION_KEY_SHIFT | offset in pages. Raw page
+// numbers of 64-bit addresses stay below 1 << REGION_KEY_SHIFT, so both kinds of key can be mixed.
+static const uint32_t REGION_KEY_SHIFT = 40;
+
+static std::map<std::string, uint32_t> region_key_ids;
+static std::vector<std::string> region_key_names;
+
+static uint32_t region_key(const std::string &name)
+{
+  std::map<std::string, uint32_t>::iterator it = region_key_ids.find(name);
+  if (it != region_key_ids.end()) {
+    return it->second;
+  }
+  region_key_ids[name] = region_key_names.size();
+  region_key_names.push_back(name);
+  return region_key_names.size() - 1;
+}
+
+static std::string key_name(uint64_t key)
+{
+  char buf[64];
+  if (key >> REGION_KEY_SHIFT == 0) {
+    snprintf(buf, sizeof(buf), "page 0x%llx", (unsigned long long)key);
+    return buf;
+  }
+  snprintf(buf, sizeof(buf), "+0x%llx ", (unsigned long long)(key & ((1ULL << REGION_KEY_SHIFT) - 1)));
+  return buf + region_key_names[(key >> REGION_KEY_SHIFT) - 1];
+}
+
+// Sorted arrays of (key, count), each key at most once
+struct page_counts
+{
+  std::vector<uint64_t> keys;
+  std::vector<uint64_t> counts;
+};
+
+// out = a + b, adding up the counts of keys in both
+static void merge_counts(const uint64_t *a_keys, const uint64_t *a_counts, size_t a_n,
+                         const uint64_t *b_keys, const uint64_t *b_counts, size_t b_n, page_counts *out)
+{
+  out->keys.resize(a_n + b_n);
+  out->counts.resize(a_n + b_n);
+  size_t i = 0, j = 0, n = 0;
+  while (i < a_n && j < b_n) {
+    if (a_keys[i] < b_keys[j]) {
+      out->keys[n] = a_keys[i];
+      out->counts[n++] = a_counts[i++];
+    } else if (b_keys[j] < a_keys[i]) {
+      out->keys[n] = b_keys[j];
+      out->counts[n++] = b_counts[j++];
+    } else {
+      out->keys[n] = a_keys[i];
+      out->counts[n++] = a_counts[i++] + b_counts[j++];
+    }
+  }
+  for (; i < a_n; i++, n++) {
+    out->keys[n] = a_keys[i];
+    out->counts[n] = a_counts[i];
+  }
+  for (; j < b_n; j++, n++) {
+    out->keys[n] = b_keys[j];
+    out->counts[n] = b_counts[j];
+  }
+  out->keys.resize(n);
+  out->counts.resize(n);
+}
+
+// Adds up parts pairwise, so that every key is copied O(log parts) times; returns the result in parts[0]
+static void merge_all(std::vector<page_counts> &parts)
+{
+  if (parts.empty()) {
+    parts.resize(1);
+  }
+  while (parts.size() > 1) {
+    std::vector<page_counts> merged((parts.size() + 1) / 2);
+    for (size_t i = 0; i + 1 < parts.size(); i += 2) {
+      const page_counts &a = parts[i], &b = parts[i + 1];
+      merge_counts(a.keys.empty() ? NULL : &a.keys[0], a.counts.empty() ? NULL : &a.counts[0], a.keys.size(),
+                   b.keys.empty() ? NULL : &b.keys[0], b.counts.empty() ? NULL : &b.counts[0], b.keys.size(), &merged[i / 2]);
+    }
+    if (parts.size() % 2 != 0) {
+      merged.back().keys.swap(parts.back().keys);
+      merged.back().counts.swap(parts.back().counts);
+    }
+    parts.swap(merged);
+  }
+}
+
+static bool is_page_section(const trace_file &trace, const trace_section &s, bool with_cache)
+{
+  if (trace.shift(s) != TRACE_PAGE_SHIFT) {
+    return false;
+  }
+  return with_cache ? s.kind == SECTION_READ_WITH_CACHE || s.kind == SECTION_WRITE_WITH_CACHE
+                    : s.kind == SECTION_READ_WITHOUT_CACHE || s.kind == SECTION_WRITE_WITHOUT_CACHE;
+}
+
+static bool has_regions(const trace_file &trace)
+{
+  for (uint64_t i = 0; i < trace.num_sections(); i++) {
+    if (trace.section(i).kind == SECTION_REGION) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Region names by id from the -regions file of a run, if there is one
+static std::map<uint64_t, std::string> read_region_names(const std::string &filename)
+{
+  std::map<uint64_t, std::string> names;
+  std::ifstream in(filename.c_str());
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string tag, kind, start, size, name;
+    uint64_t id, ordinal;
+    if (fields >> tag >> id >> kind >> ordinal >> start >> size && tag == "region") {
+      std::getline(fields >> std::ws, name);
+      names[id] = name;
+    }
+  }
+  return names;
+}
+
+// Sums the page sections of all threads of filename into run; keys are region-relative if by_region
+static bool load_run(const std::string &filename, bool with_cache, bool by_region, page_counts *run)
+{
+  trace_file trace;
+  if (!trace.open(filename.c_str())) {
+    fprintf(stderr, "Error: %s is not a binary trace\n", filename.c_str());
+    return false;
+  }
+
+  std::vector<trace_section> sections;
+  std::map<uint32_t, trace_section> region_groups;
+  for (uint64_t i = 0; i < trace.num_sections(); i++) {
+    trace_section s = trace.section(i);
+    if (is_page_section(trace, s, with_cache)) {
+      sections.push_back(s);
+    } else if (s.kind == SECTION_REGION) {
+      region_groups[s.group] = s;
+    }
+  }
+
+  // the first round merges straight out of the mapped file
+  std::vector<page_counts> parts((sections.size() + 1) / 2);
+  for (size_t i = 0; i < sections.size(); i += 2) {
+    const trace_section &a = sections[i];
+    if (i + 1 < sections.size()) {
+      const trace_section &b = sections[i + 1];
+      merge_counts(trace.pagenos(a), trace.counts(a), a.count, trace.pagenos(b), trace.counts(b), b.count, &parts[i / 2]);
+    } else {
+      parts[i / 2].keys.assign(trace.pagenos(a), trace.pagenos(a) + a.count);
+      parts[i / 2].counts.assign(trace.counts(a), trace.counts(a) + a.count);
+    }
+  }
+  merge_all(parts);
+  run->keys.swap(parts[0].keys);
+  run->counts.swap(parts[0].counts);
+
+  if (!by_region) {
+    return true;
+  }
+  if (region_groups.count(0) == 0 || region_groups.count(1) == 0 || region_groups.count(2) == 0 || region_groups.count(3) == 0) {
+    fprintf(stderr, "Error: %s has no regions\n", filename.c_str());
+    return false;
+  }
+
+  // region id -> key id, named "kind ordinal name"
+  std::map<uint64_t, std::string> names = read_region_names(filename + ".regions");
+  const trace_section &kinds = region_groups[2], &ordinals = region_groups[3];
+  std::map<uint64_t, uint32_t> keys_of_regions;
+  for (uint64_t i = 0; i < kinds.count; i++) {
+    uint64_t id = trace.pagenos(kinds)[i];
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s %llu", region_kind_name(trace.counts(kinds)[i]), (unsigned long long)trace.counts(ordinals)[i]);
+    keys_of_regions[id] = region_key(names[id].empty() ? buf : buf + (" " + names[id]));
+  }
+
+  // page -> (region id, offset), both sorted by page like run->keys
+  const trace_section &ids = region_groups[0], &offsets = region_groups[1];
+  const uint64_t *region_pagenos = trace.pagenos(ids);
+  std::vector<std::pair<uint64_t, uint64_t> > mapped(run->keys.size());
+  size_t j = 0;
+  for (size_t i = 0; i < run->keys.size(); i++) {
+    while (j < ids.count && region_pagenos[j] < run->keys[i]) {
+      j++;
+    }
+    uint64_t mapped_key = run->keys[i];
+    if (j < ids.count && region_pagenos[j] == run->keys[i] && keys_of_regions.count(trace.counts(ids)[j]) != 0) {
+      mapped_key = (uint64_t)(keys_of_regions[trace.counts(ids)[j]] + 1) << REGION_KEY_SHIFT | trace.counts(offsets)[j];
+    }
+    mapped[i] = std::make_pair(mapped_key, run->counts[i]);
+  }
+
+  std::sort(mapped.begin(), mapped.end());
+  run->keys.clear();
+  run->counts.clear();
+  for (size_t i = 0; i < mapped.size(); i++) {
+    if (!run->keys.empty() && run->keys.back() == mapped[i].first) {
+      run->counts.back() += mapped[i].second;
+    } else {
+      run->keys.push_back(mapped[i].first);
+      run->counts.push_back(mapped[i].second);
+    }
+  }
+  return true;
+}
+
+// Kolmogorov-Smirnov distance (largest difference of the empirical CDFs) and earth mover's distance
+// (area between the CDFs, in accesses per page) of two sorted samples
+template <class A, class B>
+static void distribution_distances(const std::vector<A> &a, const std::vector<B> &b, double *ks, double *emd)
+{
+  *ks = 0;
+  *emd = 0;
+  if (a.empty() || b.empty()) {
+    return;
+  }
+  size_t i = 0, j = 0;
+  double x = std::min<double>(a[0], b[0]);
+  while (i < a.size() || j < b.size()) {
+    double next = std::min(i < a.size() ? (double)a[i] : HUGE_VAL, j < b.size() ? (double)b[j] : HUGE_VAL);
+    *emd += fabs((double)i / a.size() - (double)j / b.size()) * (next - x);
+    x = next;
+    while (i < a.size() && (double)a[i] == x) {
+      i++;
+    }
+    while (j < b.size() && (double)b[j] == x) {
+      j++;
+    }
+    *ks = std::max(*ks, fabs((double)i / a.size() - (double)j / b.size()));
+  }
+}
+
+static double cosine(double xy, double xx, double yy)
+{
+  return xx == 0 || yy == 0 ? 0 : xy / sqrt(xx * yy);
+}
+
+static int usage()
+{
+  fprintf(stderr, "usage: trace_compare [-no_cache] [-raw] [-pages FILE] trace...\n"
+                  "  -no_cache    compare the accesses before the cache filter instead of after it\n"
+                  "  -raw         line pages up by page number even if the traces have regions\n"
+                  "  -pages FILE  write the mean, variance, min and max count of every page to FILE\n");
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  bool with_cache = true, raw = false;
+  const char *pages_filename = NULL;
+  std::vector<std::string> filenames;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-no_cache") == 0) {
+      with_cache = false;
+    } else if (strcmp(argv[i], "-raw") == 0) {
+      raw = true;
+    } else if (strcmp(argv[i], "-pages") == 0 && i + 1 < argc) {
+      pages_filename = argv[++i];
+    } else if (argv[i][0] == '-') {
+      return usage();
+    } else {
+      filenames.push_back(argv[i]);
+    }
+  }
+  if (filenames.empty()) {
+    return usage();
+  }
+
+  double start = now_sec();
+
+  bool by_region = !raw;
+  for (size_t r = 0; r < filenames.size() && by_region; r++) {
+    trace_file trace;
+    by_region = trace.open(filenames[r].c_str()) && has_regions(trace);
+  }
+
+  size_t num_runs = filenames.size();
+  std::vector<page_counts> runs(num_runs);
+  for (size_t r = 0; r < num_runs; r++) {
+    if (!load_run(filenames[r], with_cache, by_region, &runs[r])) {
+      return 1;
+    }
+  }
+
+  // The union of all pages, and where each run's pages are in it
+  std::vector<page_counts> parts(num_runs);
+  for (size_t r = 0; r < num_runs; r++) {
+    parts[r].keys = runs[r].keys;
+    parts[r].counts.assign(runs[r].keys.size(), 1);
+  }
+  merge_all(parts);
+  const std::vector<uint64_t> &keys = parts[0].keys;
+  const std::vector<uint64_t> &present = parts[0].counts;
+  size_t num_pages = keys.size();
+
+  std::vector<std::vector<uint32_t> > positions(num_runs);
+  for (size_t r = 0; r < num_runs; r++) {
+    positions[r].resize(runs[r].keys.size());
+    size_t pos = 0;
+    for (size_t i = 0; i < runs[r].keys.size(); i++) {
+      while (keys[pos] != runs[r].keys[i]) {
+        pos++;
+      }
+      positions[r][i] = pos;
+    }
+  }
+
+  // Per-page statistics, one run at a time; min starts as the minimum over the runs that have the page
+  std::vector<double> sums(num_pages, 0.0), sum_squares(num_pages, 0.0), first(num_pages, 0.0);
+  std::vector<uint64_t> mins(num_pages, ~(uint64_t)0), maxs(num_pages, 0);
+  std::vector<int32_t> only(num_pages, -1);
+  for (size_t r = 0; r < num_runs; r++) {
+    for (size_t i = 0; i < runs[r].keys.size(); i++) {
+      uint32_t pos = positions[r][i];
+      uint64_t count = runs[r].counts[i];
+      sums[pos] += count;
+      sum_squares[pos] += (double)count * count;
+      mins[pos] = std::min(mins[pos], count);
+      maxs[pos] = std::max(maxs[pos], count);
+      if (present[pos] == 1) {
+        only[pos] = r;
+      }
+      if (r == 0) {
+        first[pos] = count;
+      }
+    }
+  }
+
+  std::vector<double> means(num_pages);
+  double mean_norm = 0;
+  uint64_t common_pages = 0;
+  for (size_t pos = 0; pos < num_pages; pos++) {
+    means[pos] = sums[pos] / num_runs;
+    mean_norm += means[pos] * means[pos];
+    common_pages += present[pos] == num_runs;
+  }
+
+  // cosine similarity of run r to the first run: dot_first[r] / sqrt(norms[r] * norms[0]); to the mean likewise
+  std::vector<double> dot_first(num_runs, 0.0), dot_mean(num_runs, 0.0), norms(num_runs, 0.0);
+  std::vector<uint64_t> accesses(num_runs, 0), unique_pages(num_runs, 0), unique_accesses(num_runs, 0);
+  for (size_t r = 0; r < num_runs; r++) {
+    for (size_t i = 0; i < runs[r].keys.size(); i++) {
+      uint32_t pos = positions[r][i];
+      double count = runs[r].counts[i];
+      dot_first[r] += count * first[pos];
+      dot_mean[r] += count * means[pos];
+      norms[r] += count * count;
+      accesses[r] += runs[r].counts[i];
+      if (present[pos] == 1) {
+        unique_pages[r]++;
+        unique_accesses[r] += runs[r].counts[i];
+      }
+    }
+  }
+
+  if (pages_filename != NULL) {
+    FILE *out = fopen(pages_filename, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Error: could not open %s\n", pages_filename);
+      return 1;
+    }
+    fprintf(out, "# %zu runs; only: the one run that has the page, or -1\n", num_runs);
+    fprintf(out, "# present only            mean          variance         min         max  page\n");
+    for (size_t pos = 0; pos < num_pages; pos++) {
+      double variance = std::max(0.0, sum_squares[pos] / num_runs - means[pos] * means[pos]);
+      fprintf(out, "%9llu %4d %15.3f %17.3f %11llu %11llu  %s\n", (unsigned long long)present[pos], only[pos], means[pos], variance,
+              present[pos] < num_runs ? 0ULL : (unsigned long long)mins[pos], (unsigned long long)maxs[pos], key_name(keys[pos]).c_str());
+    }
+    fclose(out);
+  }
+
+  std::sort(means.begin(), means.end());
+  std::vector<std::vector<uint64_t> > distributions(num_runs);
+  for (size_t r = 0; r < num_runs; r++) {
+    distributions[r] = runs[r].counts;
+    std::sort(distributions[r].begin(), distributions[r].end());
+  }
+
+  printf("# %zu runs, %zu distinct pages, %llu in every run, lined up by %s; %.2f s\n", num_runs, num_pages,
+         (unsigned long long)common_pages, by_region ? "region" : "page number", now_sec() - start);
+  printf("# first/mean: distance to the first run / to the mean of all runs (cosine similarity of the page counts,"
+         " KS and EMD of their distributions)\n");
+  printf("#    run      pages       accesses unique_pages unique_accesses cos_first  ks_first     emd_first  cos_mean   ks_mean      emd_mean  trace\n");
+  for (size_t r = 0; r < num_runs; r++) {
+    double ks_first, emd_first, ks_mean, emd_mean;
+    distribution_distances(distributions[r], distributions[0], &ks_first, &emd_first);
+    distribution_distances(distributions[r], means, &ks_mean, &emd_mean);
+    printf("run %4zu %10zu %14llu %12llu %15llu %9.6f %9.6f %13.3f %9.6f %9.6f %13.3f  %s\n", r, runs[r].keys.size(),
+           (unsigned long long)accesses[r], (unsigned long long)unique_pages[r], (unsigned long long)unique_accesses[r],
+           cosine(dot_first[r], norms[r], norms[0]), ks_first, emd_first, cosine(dot_mean[r], norms[r], mean_norm), ks_mean, emd_mean,
+           filenames[r].c_str());
+  }
+
+  return 0;
+}
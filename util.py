@@ -1,6 +1,7 @@
 from collections import Counter
 import json
 import math
+import numpy
 import os
 import shlex
 import subprocess
@@ -10,8 +11,208 @@ RESEARCH_DIR = "/afs/ir/users/s/a/saurabh1/research"
 # 50 GB space
 AFS_DIRECTORY = "/afs/ir/data/saurabh1/"
 
+# Binary trace format, see pin/source/tools/ManualExamples/trace_format.h
+TRACE_MAGIC = "PGTRACE\0"
+SECTION_READ_WITH_CACHE = 0
+SECTION_READ_WITHOUT_CACHE = 1
+SECTION_WRITE_WITH_CACHE = 2
+SECTION_WRITE_WITHOUT_CACHE = 3
+SECTION_WRITE_BACK = 4
+SECTION_INVALIDATION = 5
+SECTION_COHERENCE_MISS = 6
+SECTION_EPOCH = 0x100
+SECTION_ERROR = 0x200
+SECTION_GRANULARITY = 0x400
+SECTION_ALLOC_CLASS = 0x800
+SECTION_REUSE = 0x1000
+SECTION_MRC = 0x2000
+SECTION_REGION = 0x4000
+REUSE_BUCKETS = 48
+PAGE_SHIFT = 12
+
+TRACE_HEADER_DTYPE = numpy.dtype([("magic", "S8"), ("version", "<u4"), ("section_size", "<u4"), ("num_sections", "<u8"), ("section_table_offset", "<u8")])
+# (name, format, offset); files written before epochs existed stop after counts_offset
+TRACE_SECTION_FIELDS = [("kind", "<u4", 0), ("thread", "<u4", 4), ("count", "<u8", 8), ("pagenos_offset", "<u8", 16), ("counts_offset", "<u8", 24),
+                        ("epoch", "<u4", 32), ("shift", "<u4", 36), ("timestamp_ms", "<u8", 40),
+                        ("group", "<u4", 48)]
+
+def is_binary_trace(trace_filename):
+  with open(trace_filename, "rb") as f:
+    return f.read(len(TRACE_MAGIC)) == TRACE_MAGIC
+
+class BinaryTrace:
+  """Zero-copy reader for binary traces: every page number / count array is a view into an mmap."""
+
+  def __init__(self, trace_filename):
+    self.data = numpy.memmap(trace_filename, dtype=numpy.uint8, mode="r")
+
+    header = self.data[:TRACE_HEADER_DTYPE.itemsize].view(TRACE_HEADER_DTYPE)[0]
+    assert header["magic"] == TRACE_MAGIC.rstrip("\0")
+
+    # step through the section table by the section size the writer used
+    section_size = int(header["section_size"])
+    fields = [field for field in TRACE_SECTION_FIELDS if field[2] + numpy.dtype(field[1]).itemsize <= section_size]
+    section_dtype = numpy.dtype({
+      "names": [name for (name, _, _) in fields],
+      "formats": [fmt for (_, fmt, _) in fields],
+      "offsets": [offset for (_, _, offset) in fields],
+      "itemsize": section_size,
+    })
+    start = int(header["section_table_offset"])
+    end = start + int(header["num_sections"]) * section_dtype.itemsize
+    self.sections = self.data[start:end].view(section_dtype)
+
+  def _array(self, offset, count):
+    return self.data[offset:offset + 8 * count].view("<u8")
+
+  def _shifts(self):
+    if "shift" not in self.sections.dtype.names:
+      return numpy.full(len(self.sections), PAGE_SHIFT)
+    shifts = self.sections["shift"]
+    # 0 in files written before the field existed
+    return numpy.where(shifts == 0, PAGE_SHIFT, shifts)
+
+  def _select(self, kind, shift, group=None):
+    if shift != PAGE_SHIFT:
+      kind |= SECTION_GRANULARITY
+    selected = (self.sections["kind"] == kind) & (self._shifts() == shift)
+    if group is not None:
+      selected &= self.sections["group"] == group
+    return self.sections[selected]
+
+  def alloc_classes(self):
+    """Returns the sorted ids of the allocation classes the trace has sections for (see
+    parse_alloc_classes for their names)."""
+    selected = (self.sections["kind"] & SECTION_ALLOC_CLASS) != 0
+    return sorted(set(self.sections["group"][selected].tolist())) if "group" in self.sections.dtype.names else []
+
+  def page_reuse(self):
+    """Returns the per-page reuse-distance histograms as (pagenos, counts), where counts[i, g] is the
+    estimated number of accesses to page pagenos[i] in bucket g: 0 for first accesses, 1 for distance 0,
+    g >= 2 for distances in [2^(g-2), 2^(g-1)) cache lines."""
+    sections = [(int(section["group"]), self._array(int(section["pagenos_offset"]), int(section["count"])),
+                 self._array(int(section["counts_offset"]), int(section["count"])))
+                for section in self.sections[self.sections["kind"] == SECTION_REUSE]] if "group" in self.sections.dtype.names else []
+    if not sections:
+      return numpy.zeros(0, dtype=numpy.uint64), numpy.zeros((0, REUSE_BUCKETS), dtype=numpy.uint64)
+
+    pagenos = numpy.unique(numpy.concatenate([section_pagenos for (_, section_pagenos, _) in sections]))
+    counts = numpy.zeros((len(pagenos), REUSE_BUCKETS), dtype=numpy.uint64)
+    for (group, section_pagenos, section_counts) in sections:
+      counts[numpy.searchsorted(pagenos, section_pagenos), group] = section_counts
+    return pagenos, counts
+
+  def miss_ratio_curves(self):
+    """Returns the miss-ratio curves of the trace (see -mrc) as {"line": (sizes, miss_ratios),
+    "page": (sizes, miss_ratios)}, sizes in bytes, for fully associative LRU caches of cache lines and
+    tiers of 4 KB pages."""
+    result = {}
+    if "group" not in self.sections.dtype.names:
+      return result
+    for section in self.sections[self.sections["kind"] == SECTION_MRC]:
+      count = int(section["count"])
+      sizes = self._array(int(section["pagenos_offset"]), count)
+      misses = self._array(int(section["counts_offset"]), count)
+      # size 0 holds the number of accesses
+      result[["line", "page"][int(section["group"])]] = (sizes[1:], misses[1:] / float(max(misses[0], 1)))
+    return result
+
+  def page_regions(self):
+    """Returns {pageno: (region_id, offset)} for the pages whose region is known (see -regions), the
+    offset in 4 KB pages from the start of the region."""
+    if "group" not in self.sections.dtype.names:
+      return {}
+    by_group = {}
+    for section in self.sections[self.sections["kind"] == SECTION_REGION]:
+      count = int(section["count"])
+      by_group[int(section["group"])] = (self._array(int(section["pagenos_offset"]), count).tolist(),
+                                         self._array(int(section["counts_offset"]), count).tolist())
+    if 0 not in by_group or 1 not in by_group:
+      return {}
+    return dict(zip(by_group[0][0], zip(by_group[0][1], by_group[1][1])))
+
+  def granularities(self):
+    """Returns the sorted page shifts (log2 of the page size) the trace has sections for."""
+    return sorted(set(self._shifts().tolist()))
+
+  def sections_of_kind(self, kind, shift=PAGE_SHIFT, group=None):
+    """Returns a list of (thread, pagenos, counts) for every section of the given kind whose page
+    numbers are address >> shift; for SECTION_ALLOC_CLASS kinds, group selects the allocation class."""
+    result = []
+    for section in self._select(kind, shift, group):
+      count = int(section["count"])
+      result.append((int(section["thread"]), self._array(int(section["pagenos_offset"]), count), self._array(int(section["counts_offset"]), count)))
+    return result
+
+  def epochs(self, kind, shift=PAGE_SHIFT):
+    """Returns a list of (epoch, timestamp_ms, thread, pagenos, counts) for every per-epoch delta of
+    the given kind (one of the plain SECTION_* kinds), ordered by epoch."""
+    result = []
+    for section in self._select(kind | SECTION_EPOCH, shift):
+      count = int(section["count"])
+      result.append((int(section["epoch"]), int(section["timestamp_ms"]), int(section["thread"]),
+                     self._array(int(section["pagenos_offset"]), count), self._array(int(section["counts_offset"]), count)))
+    return sorted(result, key=lambda epoch: (epoch[0], epoch[2]))
+
+  def aggregate(self, kinds, shift=PAGE_SHIFT, group=None):
+    """Sums the counts of all threads over the given section kinds; returns sorted (pagenos, counts) arrays."""
+    pagenos = []
+    counts = []
+    for kind in kinds:
+      for (_, section_pagenos, section_counts) in self.sections_of_kind(kind, shift, group):
+        pagenos.append(section_pagenos)
+        counts.append(section_counts)
+
+    if not pagenos:
+      return numpy.zeros(0, dtype=numpy.uint64), numpy.zeros(0, dtype=numpy.uint64)
+
+    pagenos = numpy.concatenate(pagenos)
+    counts = numpy.concatenate(counts)
+    order = numpy.argsort(pagenos, kind="mergesort")
+    pagenos = pagenos[order]
+    counts = counts[order]
+
+    starts = numpy.concatenate([[0], numpy.flatnonzero(pagenos[1:] != pagenos[:-1]) + 1])
+    return pagenos[starts], numpy.add.reduceat(counts, starts)
+
+  def aggregate_errors(self, kinds, shift=PAGE_SHIFT):
+    """For sampled traces: standard errors of aggregate(kinds), assuming independent per-thread
+    estimates; returns sorted (pagenos, errors) arrays."""
+    pagenos = []
+    variances = []
+    for kind in kinds:
+      for (_, section_pagenos, section_errors) in self.sections_of_kind(kind | SECTION_ERROR, shift):
+        pagenos.append(section_pagenos)
+        variances.append(section_errors.astype(numpy.float64) ** 2)
+
+    if not pagenos:
+      return numpy.zeros(0, dtype=numpy.uint64), numpy.zeros(0)
+
+    pagenos = numpy.concatenate(pagenos)
+    variances = numpy.concatenate(variances)
+    order = numpy.argsort(pagenos, kind="mergesort")
+    pagenos = pagenos[order]
+    variances = variances[order]
+
+    starts = numpy.concatenate([[0], numpy.flatnonzero(pagenos[1:] != pagenos[:-1]) + 1])
+    return pagenos[starts], numpy.sqrt(numpy.add.reduceat(variances, starts))
+
+  def aggregate_dict(self, kinds, shift=PAGE_SHIFT, group=None):
+    pagenos, counts = self.aggregate(kinds, shift, group)
+    return dict(zip(pagenos.tolist(), counts.tolist()))
+
 class Trace:
   def __init__(self, trace_filename):
+    self.binary_trace = None
+
+    if is_binary_trace(trace_filename):
+      self.binary_trace = BinaryTrace(trace_filename)
+      # binary traces keep their header next to them, see write_header_to_json_data_file
+      if os.path.exists(trace_filename + ".header"):
+        with open(trace_filename + ".header") as f:
+          self.header = json.load(f)
+      return
+
     # read entire trace once in constructor
     with open(trace_filename) as f:
       self.trace_data = json.load(f)
@@ -34,6 +235,9 @@ class Trace:
     return result
 
   def aggregate_writes(self, with_cache=True):
+    if self.binary_trace is not None:
+      return self.binary_trace.aggregate_dict([SECTION_WRITE_WITH_CACHE if with_cache else SECTION_WRITE_WITHOUT_CACHE])
+
     if "cache" in self.trace_data and "no_cache" in self.trace_data:
       if with_cache:
         data_to_aggregate = self.trace_data["cache"]
@@ -49,6 +253,9 @@ class Trace:
         return self._combine_dicts([self.trace_data["write_without_cache"]])
 
   def aggregate_reads(self, with_cache=True):
+    if self.binary_trace is not None:
+      return self.binary_trace.aggregate_dict([SECTION_READ_WITH_CACHE if with_cache else SECTION_READ_WITHOUT_CACHE])
+
     if "cache" in self.trace_data and "no_cache" in self.trace_data:
       if with_cache:
         data_to_aggregate = self.trace_data["cache"]
@@ -64,6 +271,12 @@ class Trace:
         return self._combine_dicts([self.trace_data["read_without_cache"]])
 
   def aggregate_reads_writes(self, with_cache=True):
+    if self.binary_trace is not None:
+      if with_cache:
+        return self.binary_trace.aggregate_dict([SECTION_READ_WITH_CACHE, SECTION_WRITE_WITH_CACHE])
+      else:
+        return self.binary_trace.aggregate_dict([SECTION_READ_WITHOUT_CACHE, SECTION_WRITE_WITHOUT_CACHE])
+
     if "cache" in self.trace_data and "no_cache" in self.trace_data:
       if with_cache:
         data_to_aggregate = self.trace_data["cache"]
@@ -78,6 +291,33 @@ class Trace:
       else:
         return self._combine_dicts([self.trace_data["read_without_cache"], self.trace_data["write_without_cache"]])
 
+  def _aggregate_line_events(self, kind, key):
+    if self.binary_trace is not None:
+      return self.binary_trace.aggregate_dict([kind])
+
+    if "cache" in self.trace_data and all(key in td for td in self.trace_data["cache"]):
+      return self._combine_dicts([td[key] for td in self.trace_data["cache"]])
+    return None
+
+  def aggregate_write_backs(self):
+    """Dirty cache lines written back to memory per page, or None if the trace has none."""
+    return self._aggregate_line_events(SECTION_WRITE_BACK, "writebacks")
+
+  def aggregate_invalidations(self):
+    """Copies of each page's lines in other cores' private caches invalidated by stores (-cores)."""
+    return self._aggregate_line_events(SECTION_INVALIDATION, "invalidations")
+
+  def aggregate_coherence_misses(self):
+    """Private-cache misses per page on lines lost to another core's store (-cores)."""
+    return self._aggregate_line_events(SECTION_COHERENCE_MISS, "coherence_misses")
+
+  def page_regions(self):
+    """Returns {pageno: (region_id, offset)} for the pages whose region is known (see -regions), or
+    {} if the trace has no regions."""
+    if self.binary_trace is not None:
+      return self.binary_trace.page_regions()
+    return dict((int(k), (int(v[0]), int(v[1]))) for (k, v) in self.trace_data.get("regions", {}).items())
+
 class untar_file:
   def __init__(self, tar_filename):
     self.tar_filename = tar_filename
@@ -100,9 +340,10 @@ class create_tmp_file:
     # TODO(saurabh): delete parsec.out
     pass
 
-def run_under_pin(command_to_run, pin_output_filename, child_injection=False, memcached_alloc_filename=""):
+def run_under_pin(command_to_run, pin_output_filename, child_injection=False, memcached_alloc_filename="", pin_tool_path=None, stdout=None, pin_tool_args=""):
   pin_path = os.path.join(RESEARCH_DIR, "pin/pin")
-  pin_tool_path = os.path.join(RESEARCH_DIR, "pin/source/tools/ManualExamples/obj-intel64/pinatrace.so")
+  if pin_tool_path is None:
+    pin_tool_path = os.path.join(RESEARCH_DIR, "pin/source/tools/ManualExamples/obj-intel64/pinatrace.so")
   env_vars = dict(os.environ)
   env_vars["PINATRACE_OUTPUT_FILENAME"] = pin_output_filename
   env_vars["MEMCACHED_ALLOC_FILENAME"] = memcached_alloc_filename
@@ -111,7 +352,7 @@ def run_under_pin(command_to_run, pin_output_filename, child_injection=False, me
   else:
     injection_method = "dynamic"
   disable_aslr_command = "setarch x86_64 -R"
-  pin_process = subprocess.Popen(shlex.split(disable_aslr_command) + [pin_path, "-injection", injection_method, "-t", pin_tool_path, "--"] + shlex.split(command_to_run), env=env_vars)
+  pin_process = subprocess.Popen(shlex.split(disable_aslr_command) + [pin_path, "-injection", injection_method, "-t", pin_tool_path] + shlex.split(pin_tool_args) + ["--"] + shlex.split(command_to_run), env=env_vars, stdout=stdout)
   return pin_process
 
 # Uses https://en.wikipedia.org/wiki/Percentile#The_Nearest_Rank_method
@@ -122,6 +363,12 @@ def percentile_slice(elems, percentile):
   return elems[:n]
 
 def write_header_to_json_data_file(header, filename):
+  # binary traces are not rewritten; the header goes into a file next to the trace
+  if is_binary_trace(filename):
+    with open(filename + ".header", 'w+') as f:
+      f.write(json.dumps(header))
+    return
+
   with open(filename, 'r') as f:
     data = json.load(f)
 
@@ -163,6 +410,33 @@ def cosine_similarity(v1,v2):
     sumxy += x*y
   return sumxy/math.sqrt(sumxx*sumyy)
 
+def compare_page_counts_distributions(page_counts_a, page_counts_b, bucket_size = 5):
+  """Compares two runs by the distribution of their per-page counts, which does not depend on where
+  the pages were: the cosine similarity of the page_counts_distributions histograms, and the
+  Kolmogorov-Smirnov and earth mover's distances (in accesses per page) of the counts themselves.
+  trace_compare does the same, and more, for many binary traces at once."""
+  buckets_a = page_counts_distributions(page_counts_a, bucket_size)
+  buckets_b = page_counts_distributions(page_counts_b, bucket_size)
+  keys = sorted(set(buckets_a) | set(buckets_b))
+  result = {"cosine": cosine_similarity([buckets_a[k] for k in keys], [buckets_b[k] for k in keys]) if keys else 0.0, "ks": 0.0, "emd": 0.0}
+
+  a = sorted(page_counts_a)
+  b = sorted(page_counts_b)
+  if not a or not b:
+    return result
+  i, j = 0, 0
+  x = min(a[0], b[0])
+  while i < len(a) or j < len(b):
+    next_x = min(a[i] if i < len(a) else float("inf"), b[j] if j < len(b) else float("inf"))
+    result["emd"] += abs(float(i) / len(a) - float(j) / len(b)) * (next_x - x)
+    x = next_x
+    while i < len(a) and a[i] == x:
+      i += 1
+    while j < len(b) and b[j] == x:
+      j += 1
+    result["ks"] = max(result["ks"], abs(float(i) / len(a) - float(j) / len(b)))
+  return result
+
 def find_alloc_files(memcached_log_filename, fb_dist=False):
   result = []
 
@@ -253,3 +527,144 @@ def parse_memcached_allocs(memcached_alloc_filename):
     result.append((address, size, c_filename, function_name, line_number))
 
   return result
+
+def parse_alloc_report(alloc_report_filename):
+  """Parses the -alloc_report output of pinatrace into a list of (site, reads, writes, misses,
+  allocations, bytes, stack) tuples, hottest first. misses is None if cache counts were not collected;
+  stack is the list of "function [file:line]" frames, innermost first."""
+  result = []
+
+  with open(alloc_report_filename) as f:
+    for line in f:
+      if line.startswith("#") or line.startswith("class ") or not line.strip():
+        continue
+
+      comps = line.split(None, 6)
+      misses = None if comps[3] == "-" else int(comps[3])
+      stack = [frame.strip() for frame in comps[6].split(" < ")] if len(comps) > 6 else []
+      result.append((int(comps[0]), int(comps[1]), int(comps[2]), misses, int(comps[4]), int(comps[5]), stack))
+
+  return result
+
+def parse_alloc_classes(alloc_report_filename):
+  """Parses the custom allocation classes (-alloc_hook) of an -alloc_report into a list of (class,
+  reads, writes, misses, allocations, bytes, name) tuples, by class id. Their page counts are the
+  SECTION_ALLOC_CLASS sections of the trace, see BinaryTrace.alloc_classes()."""
+  result = []
+
+  with open(alloc_report_filename) as f:
+    for line in f:
+      if not line.startswith("class "):
+        continue
+
+      comps = line.split(None, 7)
+      misses = None if comps[4] == "-" else int(comps[4])
+      result.append((int(comps[1]), int(comps[2]), int(comps[3]), misses, int(comps[5]), int(comps[6]), comps[7].strip()))
+
+  return result
+
+def parse_object_report(object_report_filename):
+  """Parses the -object_report output of pinatrace into a dict of lists of tuples:
+  "coverage": (share, object_bytes, objects, page_bytes, pages)
+  "sizes": (size_min, size_max, objects, bytes, untouched, accesses, misses, accesses_per_byte)
+  "cells": (size_min, size_max, accesses_min, accesses_max, objects, bytes, accesses, misses)
+  "objects": (size, reads, writes, misses, first_ms, last_ms, site), hottest first
+  misses is None if cache counts were not collected; site is the allocation site id, or the string
+  "class=ID NAME" for objects of a custom allocation class."""
+  result = {"coverage": [], "sizes": [], "cells": [], "objects": []}
+
+  def number(field):
+    return None if field == "-" else float(field) if "." in field else int(field)
+
+  with open(object_report_filename) as f:
+    for line in f:
+      comps = line.split()
+      if not comps or comps[0].startswith("#"):
+        continue
+
+      if comps[0] == "coverage":
+        result["coverage"].append(tuple(number(field) for field in comps[1:]))
+      elif comps[0] == "size":
+        result["sizes"].append(tuple(number(field) for field in comps[1:]))
+      elif comps[0] == "cell":
+        result["cells"].append(tuple(number(field) for field in comps[1:]))
+      elif comps[0] == "object":
+        site = line.split(None, 7)[7].strip()
+        site = int(site[len("site="):]) if site.startswith("site=") else site
+        result["objects"].append(tuple(number(field) for field in comps[1:7]) + (site,))
+
+  return result
+
+def parse_reuse_report(reuse_report_filename):
+  """Parses the -reuse_report output of pinatrace into (buckets, cold), where buckets is a list of
+  (distance_min, distance_max, accesses, share_at_least_min) tuples in increasing distance, in cache
+  lines, and cold the estimated number of first accesses."""
+  buckets = []
+  cold = 0
+
+  with open(reuse_report_filename) as f:
+    for line in f:
+      comps = line.split()
+      if not comps or comps[0].startswith("#"):
+        continue
+      if comps[0] == "reuse":
+        buckets.append((float(comps[1]), float(comps[2]), float(comps[3]), float(comps[4])))
+      elif comps[0] == "cold":
+        cold = float(comps[1])
+
+  return buckets, cold
+
+TIER_REPORT_FIELDS = ["dram_reads", "nvm_reads", "dram_writes", "nvm_writes", "promotions", "demotions", "migration_bytes",
+                      "memory_ms", "migration_ms", "total_ms", "energy_mj"]
+
+def parse_tier_report(tier_report_filename):
+  """Parses the -tier_report output of pinatrace into {policy: {field: value}}, with the fields of
+  TIER_REPORT_FIELDS."""
+  result = {}
+
+  with open(tier_report_filename) as f:
+    for line in f:
+      comps = line.split()
+      if comps and comps[0] == "policy":
+        result[comps[1]] = dict(zip(TIER_REPORT_FIELDS, [float(c) if "." in c else int(c) for c in comps[2:]]))
+
+  return result
+
+def parse_regions(regions_filename):
+  """Parses the -regions output of pinatrace into {region_id: (kind, name, ordinal)}."""
+  result = {}
+
+  with open(regions_filename) as f:
+    for line in f:
+      comps = line.split(None, 6)
+      if comps and comps[0] == "region":
+        result[int(comps[1])] = (comps[2], comps[6].rstrip("\n") if len(comps) > 6 else "", int(comps[3]))
+
+  return result
+
+def normalize_page_counts(page_counts, page_regions, regions):
+  """Re-keys {pageno: count} by (kind, name, ordinal, offset) of each page's region (see parse_regions
+  and Trace.page_regions), which stays the same across runs whatever the addresses. Pages without a
+  known region keep their page number, as ("none", "", 0, pageno)."""
+  result = {}
+  for (pageno, count) in page_counts.items():
+    if pageno in page_regions and page_regions[pageno][0] in regions:
+      (region_id, offset) = page_regions[pageno]
+      (kind, name, ordinal) = regions[region_id]
+      key = (kind, name, ordinal, offset)
+    else:
+      key = ("none", "", 0, pageno)
+    result[key] = count + result.get(key, 0)
+  return result
+
+def parse_mrc(mrc_filename):
+  """Parses the -mrc output of pinatrace into {"line": [(size_bytes, misses, miss_ratio)...], "page": [...]}."""
+  result = {"line": [], "page": []}
+
+  with open(mrc_filename) as f:
+    for line in f:
+      comps = line.split()
+      if comps and comps[0] in result:
+        result[comps[0]].append((int(comps[1]), float(comps[2]), float(comps[3])))
+
+  return result